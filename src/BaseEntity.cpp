@@ -1,4 +1,5 @@
 #include "BaseEntity.h"
+#include "uniform_blocks.h"
 
 
 PrefabEntity::PrefabEntity(GTR::Prefab * p, bool v)
@@ -39,15 +40,17 @@ Light::Light(Vector3 c, light_type type, bool v, float rad, Vector3 pos,float ma
 
 }
 
-void Light::setUniforms(Shader * shader)
+void Light::fillUniformBlock(sLightBlock& block)
 {
-	shader->setUniform("u_light_type", this->l_type);
-	shader->setUniform("u_light_vector", this->getLocalVector(Vector3(0, 0, -1)));
-	shader->setUniform("u_light_position", this->position);
-	shader->setUniform("u_light_color", this->color);
-	shader->setUniform("u_spotCutOff", this->spotCutOff);
-	shader->setUniform("u_exponent", this->exponent_factor);
-	shader->setUniform("u_light_maxdist", this->maxDist);
-	shader->setUniform("u_light_intensity", this->intensity);
-	shader->setUniform("u_shadows", this->has_shadow);
+	block.light_type = this->l_type;
+	block.light_vector = this->getLocalVector(Vector3(0, 0, -1));
+	block.light_position = this->position;
+	block.light_color = this->color;
+	block.spot_cutoff = this->spotCutOff;
+	block.exponent = this->exponent_factor;
+	block.max_dist = this->maxDist;
+	block.intensity = this->intensity;
+	block.shadows = this->has_shadow;
+	block.shadow_viewproj = this->light_camera->viewprojection_matrix;
+	block.shadow_bias = this->shadow_bias;
 }
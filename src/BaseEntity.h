@@ -8,6 +8,7 @@
 #include "fbo.h"
 #include "camera.h"
 
+struct sLightBlock;
 
 enum eType { BASE_NODE, PREFAB, LIGHT };
 enum light_type { DIRECTIONAL, SPOT, POINT_L };
@@ -55,7 +56,7 @@ class Light :public BaseEntity {
 
 		Light(Vector3 c, light_type type, bool v, float rad, Vector3 pos, float max);
 
-		void setUniforms(Shader *shader);
+		void fillUniformBlock(sLightBlock& block); //see UniformBlocks::setLights
 		
 		
 };
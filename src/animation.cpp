@@ -6,6 +6,7 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
+#include "uniform_blocks.h"
 
 #include <sys/stat.h>
 
@@ -111,6 +112,7 @@ void Skeleton::renderSkeleton(Camera* camera, Matrix44 model, Vector4 color, boo
 	}
 
 	Shader* shader = Shader::getDefaultShader("flat");
+	UniformBlocks::setCamera(camera); //the flat of the atlas reads it from the camera block
 	shader->enable();
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 	shader->setUniform("u_model", model);
@@ -2,6 +2,14 @@
 #include "utils.h"
 #include "mesh.h"
 #include "texture.h"
+#include "texture_streaming.h"
+#include "virtual_texture.h"
+#include "texture_array.h"
+#include "readback.h"
+#include "texture_upload.h"
+#include "uniform_blocks.h"
+#include "shader_permutations.h"
+#include "gl_state.h"
 
 #include "fbo.h"
 #include "shader.h"
@@ -48,9 +56,11 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	instance = this;
 	must_exit = false;
 	render_debug = true;
+	upload_budget_ms = 4.0f;
 	render_gui = true;
 
 	render_wireframe = false;
+	take_screenshot = false;
 
 	fps = 0;
 	frame = 0;
@@ -64,6 +74,8 @@ Application::Application(int window_width, int window_height, SDL_Window* window
     //change to "data/shader_atlas_osx.txt" if you are in XCODE
 	if(!Shader::LoadAtlas("data/shader_atlas.txt"))
         exit(1);
+	//the permutations the scene used last time, saved from the menu
+	ShaderPermutations::load(SHADER_PERMUTATIONS_FILENAME);
     checkGLErrors();
 
 	fbo = new FBO();
@@ -199,6 +211,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 
 	renderer->planar_reflection_fbo = new FBO();
 	renderer->planar_reflection_fbo->create(1024, 1024);
+	renderer->streaming_camera = camera;
 
 	//hide the cursor
 	SDL_ShowCursor(!mouse_locked); //hide or show the mouse
@@ -209,6 +222,9 @@ void Application::render(void)
 {
 	//be sure no errors present in opengl before start
 	checkGLErrors();
+	UniformBlocks::beginFrame();
+	GLState::beginFrame();
+	Shader::update(); //the atlas shaders compiled since the last frame
 
 	//set the clear color (the background color)
 	glClearColor(Scene::scene->bg_color.x, Scene::scene->bg_color.y, Scene::scene->bg_color.z, 1.0);
@@ -221,10 +237,10 @@ void Application::render(void)
     checkGLErrors();
 
 	//set default flags
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
     
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 	if(render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	else
@@ -264,14 +280,42 @@ void Application::render(void)
 	else
 		renderer->renderScene(camera, false);
 
-	glDisable(GL_CULL_FACE);
-	glDisable(GL_DEPTH_TEST);
+	//mips requested by this frame
+	TextureStreaming::update();
+	TextureArray::update();
+	TextureUpload::update();
+
+	if (take_screenshot)
+	{
+		//the pixels arrive some frames later and a worker writes the file
+		take_screenshot = false;
+		std::string filename = "screenshot_" + std::to_string(getTime()) + ".tga";
+		GPUReadback::readFramebuffer(0, 0, window_width, window_height, GL_RGBA, GL_UNSIGNED_BYTE, [filename](const void* data, int width, int height) {
+			Image* image = new Image();
+			image->resize(width, height, 4);
+			memcpy(image->data, data, width * height * 4);
+			runAsync([image, filename]() {
+				if (image->saveTGA(filename.c_str()))
+					std::cout << " + Screenshot saved: " << filename << std::endl;
+				else
+					std::cout << "[ERROR] Cannot save the screenshot " << filename << std::endl;
+				delete image;
+			});
+		});
+	}
+	GPUReadback::update();
+
+	GLState::disable(GL_CULL_FACE);
+	GLState::disable(GL_DEPTH_TEST);
 }
 
 void Application::update(double seconds_elapsed)
 {
 	float speed = seconds_elapsed * cam_speed; //the speed is defined by the seconds_elapsed so it goes constant
 	float orbit_speed = seconds_elapsed * 0.5;
+
+	//GL uploads of the assets loaded by the workers
+	processMainThreadTasks(upload_budget_ms);
 	
 	//async input to move the camera around
 	if (Input::isKeyPressed(SDL_SCANCODE_LSHIFT)) speed *= 10; //move faster with left shift
@@ -398,6 +442,12 @@ void Application::renderDebugGUI(void)
 	ImGui::Text(getGPUStats().c_str());					   // Display some text (you can use a format strings too)
 
 	//ImGui::Checkbox("Wireframe", &render_wireframe);
+	ImGui::Checkbox("Cull meshlets", &Mesh::cull_meshlets);
+	ImGui::Checkbox("GPU instancing", &renderer->use_instancing);
+	ImGui::DragFloat("LOD threshold", &Mesh::lod_threshold, 0.01f, 0.0f, 10.0f);
+	ImGui::DragFloat("Shadow LOD bias", &renderer->shadow_lod_bias, 0.1f, 0.0f, 8.0f);
+	ImGui::DragFloat("Probe LOD bias", &renderer->probe_lod_bias, 0.1f, 0.0f, 8.0f);
+	ImGui::DragFloat("Upload budget (ms)", &upload_budget_ms, 0.1f, 0.1f, 33.0f);
 	
 	ImGui::Combo("Render", (int*)&Scene::scene->render_type, "DEFERRED\0FORWARD", 2);
 	if (Scene::scene->render_type == Scene::DEFERRED) {
@@ -475,6 +525,55 @@ void Application::renderDebugGUI(void)
 
 	}
 
+	if (ImGui::TreeNode("Texture streaming")) {
+		TextureStreaming::renderInMenu();
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Transfers")) {
+		if (ImGui::Button("Screenshot (F2)"))
+			take_screenshot = true;
+		GPUReadback::renderInMenu();
+		TextureUpload::renderInMenu();
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Uniform blocks")) {
+		UniformBlocks::renderInMenu();
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Shader permutations")) {
+		ShaderPermutations::renderInMenu();
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("GL state")) {
+		GLState::renderInMenu();
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Texture arrays")) {
+		ImGui::Checkbox("Use in the G-buffer", &renderer->use_texture_arrays);
+		TextureArray::renderInMenu();
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Virtual texturing")) {
+		ImGui::Checkbox("Enabled", &renderer->use_virtual_texturing);
+		VirtualTexture::renderInMenu();
+		ImGui::TreePop();
+	}
+
+	//loaders benchmarks, the results go to the console
+	if (ImGui::TreeNode("Benchmarks")) {
+		if (ImGui::Button("ASE parser (box.ASE x20000)"))
+			Mesh::benchmarkASE("data/meshes/box.ASE", 20000);
+		if (ImGui::Button("PNG decoder (data)"))
+			Image::benchmarkPNG("data");
+		ImGui::TreePop();
+	}
+
 	if (ImGui::TreeNode(directional, "Lights")) {
 
 		ImGui::DragFloat3("Ambient", &(Scene::scene->ambient.x), 0.05f, 0.0f, 1.0f);
@@ -539,6 +638,7 @@ void Application::onKeyDown( SDL_KeyboardEvent event )
 	{
 		case SDLK_ESCAPE: must_exit = true; break; //ESC key, kill the app
 		case SDLK_F1: render_debug = !render_debug; break;
+		case SDLK_F2: take_screenshot = true; break;
 		case SDLK_f: camera->center.set(0, 0, 0); camera->updateViewMatrix(); break;
 		case SDLK_F5: Shader::ReloadAll(); break;
 	}
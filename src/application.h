@@ -31,6 +31,8 @@ public:
 	//some vars
 	bool mouse_locked; //tells if the mouse is locked (blocked in the center and not visible)
 	bool render_wireframe; //in case we want to render everything in wireframe mode
+	float upload_budget_ms; //time per frame spent uploading the assets loaded in the background
+	bool take_screenshot; //the next frame is saved to a TGA (F2)
 
 	Application( int window_width, int window_height, SDL_Window* window );
 
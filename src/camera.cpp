@@ -8,6 +8,7 @@ Camera* Camera::current = NULL;
 
 Camera::Camera()
 {
+	lod_bias = 0;
 	lookAt( Vector3(0, 0, 0), Vector3(0, 0, -1), Vector3(0, 1, 0) );
 	setOrthographic(-100,100,-100, 100,-100,100);
 }
@@ -318,6 +319,8 @@ Vector3 Camera::getRayDirection( int mouse_x, int mouse_y, float window_width, f
 }
 
 float Camera::getProjectedScale(Vector3 pos3D, float radius) {
+	if (type == ORTHOGRAPHIC) //same as a perspective of 90 degrees at the distance where it covers the same width
+		return radius / fabs(right - left) * 400.0f;
 	float dist = eye.distance(pos3D);
 	return ((float)sin(fov*DEG2RAD) / dist) * radius * 200.0f; //100 is to compensate width in pixels
 }
@@ -32,6 +32,8 @@ public:
 	//for orthogonal projection
 	float left,right,top,bottom;
 
+	float lod_bias; //every unit doubles the error allowed when choosing a mesh LOD (shadows and probes do not need much detail)
+
 	//planes
 	float frustum[6][4];
 
@@ -1,6 +1,7 @@
 #include "fbo.h"
 #include <cassert>
 #include "utils.h"
+#include "gl_state.h"
 
 FBO::FBO()
 {
@@ -64,7 +65,7 @@ bool FBO::create(int width, int height, int num_textures, int format, int type,
 	for (int i = 0; i < num_textures; ++i)
 	{
 		Texture* colortex = textures[i] = new Texture(width, height, format, type, false); //,NULL, format == GL_RGBA ? GL_RGBA8 : GL_RGB8 
-		glBindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
+		GLState::bindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	//set the min filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   //set the mag filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
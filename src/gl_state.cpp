@@ -0,0 +1,250 @@
+#include "gl_state.h"
+
+#include <cstring>
+
+bool GLState::enabled = true;
+
+int GLState::num_issued[NUM_GLCALLS];
+int GLState::num_filtered[NUM_GLCALLS];
+
+#define GLSTATE_MAX_UNITS 32
+#define GLSTATE_MAX_BUFFER_INDICES 16
+#define GLSTATE_UNKNOWN 0xFFFFFFFF //never a valid value, the next call is issued
+
+//the targets and caps that are cached
+static const GLenum texture_targets[] = { GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_3D };
+static const GLenum caps[] = { GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST };
+static const GLenum buffer_targets[] = { GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_PIXEL_PACK_BUFFER, GL_PIXEL_UNPACK_BUFFER };
+#define NUM_TEXTURE_TARGETS (int)(sizeof(texture_targets) / sizeof(GLenum))
+#define NUM_CAPS (int)(sizeof(caps) / sizeof(GLenum))
+#define NUM_BUFFER_TARGETS (int)(sizeof(buffer_targets) / sizeof(GLenum))
+
+struct sBufferRange {
+	GLuint buffer;
+	GLintptr offset;
+	GLsizeiptr size; //-1 for glBindBufferBase
+};
+
+static GLuint program = GLSTATE_UNKNOWN;
+static GLuint active_unit = GLSTATE_UNKNOWN;
+static GLuint textures[GLSTATE_MAX_UNITS][NUM_TEXTURE_TARGETS];
+static GLuint cap_values[NUM_CAPS];
+static GLuint blend_src = GLSTATE_UNKNOWN;
+static GLuint blend_dst = GLSTATE_UNKNOWN;
+static GLuint depth_func = GLSTATE_UNKNOWN;
+static GLuint depth_mask = GLSTATE_UNKNOWN;
+static GLuint front_face = GLSTATE_UNKNOWN;
+static GLuint buffers[NUM_BUFFER_TARGETS];
+static sBufferRange uniform_ranges[GLSTATE_MAX_BUFFER_INDICES];
+
+//nothing is known until the first calls, the context could have any state
+static struct sInitCache { sInitCache() { GLState::invalidate(); } } init_cache;
+
+static int getIndex(const GLenum* values, int num, GLenum value)
+{
+	for (int i = 0; i < num; ++i)
+		if (values[i] == value)
+			return i;
+	return -1;
+}
+
+//true if the call can be dropped, the value is stored otherwise
+static bool filter(GLuint& cached, GLuint value, eGLStateCall type)
+{
+	if (GLState::enabled && cached == value)
+	{
+		GLState::num_filtered[type]++;
+		return true;
+	}
+	cached = value;
+	GLState::num_issued[type]++;
+	return false;
+}
+
+void GLState::useProgram(GLuint value)
+{
+	if (!filter(program, value, GLCALL_PROGRAM))
+		glUseProgram(value);
+}
+
+void GLState::activeTexture(int unit)
+{
+	if (!filter(active_unit, unit, GLCALL_TEXTURE))
+		glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void GLState::bindTexture(GLenum target, GLuint texture)
+{
+	int index = getIndex(texture_targets, NUM_TEXTURE_TARGETS, target);
+	if (index == -1 || active_unit >= GLSTATE_MAX_UNITS)
+	{
+		num_issued[GLCALL_TEXTURE]++;
+		glBindTexture(target, texture);
+		if (index != -1) //the unit is unknown, it could be any of them
+			for (int i = 0; i < GLSTATE_MAX_UNITS; ++i)
+				textures[i][index] = GLSTATE_UNKNOWN;
+		return;
+	}
+	if (!filter(textures[active_unit][index], texture, GLCALL_TEXTURE))
+		glBindTexture(target, texture);
+}
+
+void GLState::bindTexture(int unit, GLenum target, GLuint texture)
+{
+	int index = getIndex(texture_targets, NUM_TEXTURE_TARGETS, target);
+	if (enabled && index != -1 && unit < GLSTATE_MAX_UNITS && textures[unit][index] == texture)
+	{
+		num_filtered[GLCALL_TEXTURE]++;
+		return;
+	}
+	activeTexture(unit);
+	bindTexture(target, texture);
+}
+
+void GLState::setEnabled(GLenum cap, bool value)
+{
+	int index = getIndex(caps, NUM_CAPS, cap);
+	if (index != -1 && filter(cap_values[index], value, GLCALL_STATE))
+		return;
+	if (index == -1)
+		num_issued[GLCALL_STATE]++;
+	if (value)
+		glEnable(cap);
+	else
+		glDisable(cap);
+}
+
+void GLState::blendFunc(GLenum sfactor, GLenum dfactor)
+{
+	if (enabled && blend_src == sfactor && blend_dst == dfactor)
+	{
+		num_filtered[GLCALL_STATE]++;
+		return;
+	}
+	blend_src = sfactor;
+	blend_dst = dfactor;
+	num_issued[GLCALL_STATE]++;
+	glBlendFunc(sfactor, dfactor);
+}
+
+void GLState::depthFunc(GLenum func)
+{
+	if (!filter(depth_func, func, GLCALL_STATE))
+		glDepthFunc(func);
+}
+
+void GLState::depthMask(bool write)
+{
+	if (!filter(depth_mask, write, GLCALL_STATE))
+		glDepthMask(write);
+}
+
+void GLState::frontFace(GLenum mode)
+{
+	if (!filter(front_face, mode, GLCALL_STATE))
+		glFrontFace(mode);
+}
+
+void GLState::bindBuffer(GLenum target, GLuint buffer)
+{
+	int index = getIndex(buffer_targets, NUM_BUFFER_TARGETS, target);
+	if (index != -1 && filter(buffers[index], buffer, GLCALL_BUFFER))
+		return;
+	if (index == -1)
+		num_issued[GLCALL_BUFFER]++;
+	glBindBuffer(target, buffer);
+}
+
+void GLState::bindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+	bindBufferRange(target, index, buffer, 0, -1);
+}
+
+void GLState::bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+	bool cached = target == GL_UNIFORM_BUFFER && index < GLSTATE_MAX_BUFFER_INDICES;
+	if (cached && enabled)
+	{
+		sBufferRange& range = uniform_ranges[index];
+		if (range.buffer == buffer && range.offset == offset && range.size == size)
+		{
+			num_filtered[GLCALL_BUFFER]++;
+			return;
+		}
+	}
+	if (cached)
+	{
+		uniform_ranges[index].buffer = buffer;
+		uniform_ranges[index].offset = offset;
+		uniform_ranges[index].size = size;
+	}
+
+	num_issued[GLCALL_BUFFER]++;
+	if (size == -1)
+		glBindBufferBase(target, index, buffer);
+	else
+		glBindBufferRange(target, index, buffer, offset, size);
+
+	//it also binds the buffer to the generic target
+	int generic = getIndex(buffer_targets, NUM_BUFFER_TARGETS, target);
+	if (generic != -1)
+		buffers[generic] = buffer;
+}
+
+void GLState::deleteTexture(GLuint texture)
+{
+	for (int i = 0; i < GLSTATE_MAX_UNITS; ++i)
+		for (int j = 0; j < NUM_TEXTURE_TARGETS; ++j)
+			if (textures[i][j] == texture)
+				textures[i][j] = 0;
+}
+
+void GLState::deleteBuffer(GLuint buffer)
+{
+	for (int i = 0; i < NUM_BUFFER_TARGETS; ++i)
+		if (buffers[i] == buffer)
+			buffers[i] = 0;
+	for (int i = 0; i < GLSTATE_MAX_BUFFER_INDICES; ++i)
+		if (uniform_ranges[i].buffer == buffer)
+			uniform_ranges[i].buffer = 0;
+}
+
+void GLState::invalidate()
+{
+	program = GLSTATE_UNKNOWN;
+	active_unit = GLSTATE_UNKNOWN;
+	memset(textures, 0xFF, sizeof(textures));
+	memset(cap_values, 0xFF, sizeof(cap_values));
+	blend_src = blend_dst = GLSTATE_UNKNOWN;
+	depth_func = depth_mask = front_face = GLSTATE_UNKNOWN;
+	memset(buffers, 0xFF, sizeof(buffers));
+	for (int i = 0; i < GLSTATE_MAX_BUFFER_INDICES; ++i)
+	{
+		uniform_ranges[i].buffer = GLSTATE_UNKNOWN;
+		uniform_ranges[i].offset = 0;
+		uniform_ranges[i].size = 0;
+	}
+}
+
+void GLState::beginFrame()
+{
+	memset(num_issued, 0, sizeof(num_issued));
+	memset(num_filtered, 0, sizeof(num_filtered));
+	invalidate();
+}
+
+void GLState::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	static const char* names[NUM_GLCALLS] = { "Program", "Textures", "Blend, cull, depth", "Buffers" };
+	ImGui::Checkbox("Filter redundant calls", &enabled);
+	int total_issued = 0, total_filtered = 0;
+	for (int i = 0; i < NUM_GLCALLS; ++i)
+	{
+		ImGui::Text("%s: %d issued, %d filtered", names[i], num_issued[i], num_filtered[i]);
+		total_issued += num_issued[i];
+		total_filtered += num_filtered[i];
+	}
+	ImGui::Text("Total: %d issued, %d filtered", total_issued, total_filtered);
+#endif
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "includes.h"
+
+//the kinds of calls GLState counts
+enum eGLStateCall { GLCALL_PROGRAM, GLCALL_TEXTURE, GLCALL_STATE, GLCALL_BUFFER, NUM_GLCALLS };
+
+//a cache of the GL state the renderer sets on every draw: the program, the textures of each unit, blend, cull and depth state and the
+//bound buffers, the calls that set what is already set are dropped. The code that changes this state must do it through here or the
+//cache goes stale, invalidate() forgets it all (beginFrame does it, in case something else changed it between frames).
+class GLState
+{
+public:
+	static bool enabled; //false issues every call, to compare
+
+	//stats of the current frame
+	static int num_issued[NUM_GLCALLS];
+	static int num_filtered[NUM_GLCALLS];
+
+	static void useProgram(GLuint program);
+	static void activeTexture(int unit);
+	static void bindTexture(GLenum target, GLuint texture); //in the active unit
+	static void bindTexture(int unit, GLenum target, GLuint texture); //activates the unit only if the binding changes
+
+	static void enable(GLenum cap) { setEnabled(cap, true); }
+	static void disable(GLenum cap) { setEnabled(cap, false); }
+	static void setEnabled(GLenum cap, bool value); //GL_BLEND, GL_CULL_FACE and GL_DEPTH_TEST are cached, the rest are issued
+	static void blendFunc(GLenum sfactor, GLenum dfactor);
+	static void depthFunc(GLenum func);
+	static void depthMask(bool write);
+	static void frontFace(GLenum mode);
+
+	static void bindBuffer(GLenum target, GLuint buffer);
+	static void bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+	static void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+	//before glDeleteTextures/glDeleteBuffers, the driver unbinds them and their names can be reused
+	static void deleteTexture(GLuint texture);
+	static void deleteBuffer(GLuint buffer);
+
+	static void invalidate(); //after GL calls that bypass the cache
+	static void beginFrame(); //main thread, resets the stats
+	static void renderInMenu();
+};
@@ -4,14 +4,18 @@
 #include "extra/cgltf.h"
 
 #include "mesh.h"
+#include "mesh_optimizer.h"
 #include "texture.h"
 #include "material.h"
 #include "prefab.h"
+#include "utils.h"
 
 #include <iostream>
+#include <mutex>
+#include <map>
+#include <algorithm>
 
 //** PARSING GLTF IS UGLY
-std::string base_folder;
 
 #ifdef _DEBUG
 	bool load_textures = false; //must textures be loadead?
@@ -19,139 +23,181 @@ std::string base_folder;
 	bool load_textures = true; //must textures be loadead?
 #endif
 
-void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+//one component of an accessor element, normalized integers go to [0,1] or [-1,1] (see the accessor section of the glTF spec)
+static inline float readGLTFComponent(const unsigned char* pos, cgltf_component_type type, bool normalized)
 {
-	int i = 0;
-
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
-	if (acc->normalized)
+	switch (type)
 	{
-		//denormalize
-		assert(!"TO DO");
+	case cgltf_component_type_r_32f: return *(const float*)pos;
+	case cgltf_component_type_r_8: return normalized ? std::max(*(const signed char*)pos / 127.0f, -1.0f) : (float)*(const signed char*)pos;
+	case cgltf_component_type_r_8u: return normalized ? *pos / 255.0f : (float)*pos;
+	case cgltf_component_type_r_16: return normalized ? std::max(*(const short*)pos / 32767.0f, -1.0f) : (float)*(const short*)pos;
+	case cgltf_component_type_r_16u: return normalized ? *(const unsigned short*)pos / 65535.0f : (float)*(const unsigned short*)pos;
+	case cgltf_component_type_r_32u: return (float)*(const unsigned int*)pos;
+	default: return 0;
 	}
-	int num_elements = acc->count;
-	std::vector<Vector3> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec3);
-	if (acc->stride == sizeof(Vector3))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector3));
-	else
-	{
-		for (int i = 0; i < num_elements; ++i)
-		{
-			memcpy(&unindexed[i], data, sizeof(Vector3));
-			data += acc->stride;
-		}
-	}
-
-	if (!indices_acc)
-	{
-		container = unindexed;
-		return;
-	}
-
-	container.resize(indices_acc->count);
+}
 
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (int i = 0; i < indices_acc->count; ++i)
+static inline unsigned int readGLTFIndex(const unsigned char* pos, cgltf_component_type type)
+{
+	switch (type)
 	{
-		int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
-		{
-		case cgltf_component_type_r_8u: index = (int)*pos; break;
-		case cgltf_component_type_r_16u: index = (int)*(unsigned short*)pos; break;
-		case cgltf_component_type_r_32u: index = (int)*(unsigned int*)pos; break;
-		}
-		if (index < unindexed.size()) //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
+	case cgltf_component_type_r_8u: return *pos;
+	case cgltf_component_type_r_16u: return *(const unsigned short*)pos;
+	case cgltf_component_type_r_32u: return *(const unsigned int*)pos;
+	default: return 0;
 	}
 }
 
-void parseGLTFBufferVector2(std::vector<Vector2>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+//reads the accessor straight into dst (num_components floats per element, the missing ones are 0)
+//it supports floats, normalized and plain integers (KHR_mesh_quantization) and sparse accessors
+bool readGLTFAccessor(float* dst, int num_components, cgltf_accessor* acc)
 {
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->offset + acc->buffer_view->offset;
-	if (acc->normalized)
-	{
-		//denormalize
-		assert(!"TO DO");
-	}
-	int num_elements = acc->count;
-	std::vector<Vector2> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec2);
-	if (acc->stride == sizeof(Vector2))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector2));
+	int acc_components = (int)cgltf_num_components(acc->type);
+	int components = std::min(num_components, acc_components);
+	size_t component_size = cgltf_component_size(acc->component_type);
+	size_t count = acc->count;
+
+	if (!acc->buffer_view) //only the sparse values, the rest is zero
+		memset(dst, 0, count * num_components * sizeof(float));
 	else
 	{
-		for (int i = 0; i < num_elements; ++i)
+		if (!acc->buffer_view->buffer->data)
+			return false;
+		const unsigned char* data = (const unsigned char*)acc->buffer_view->buffer->data + acc->buffer_view->offset + acc->offset;
+		size_t stride = acc->stride ? acc->stride : acc_components * component_size;
+
+		if (acc->component_type == cgltf_component_type_r_32f && acc_components == num_components && stride == num_components * sizeof(float))
+			memcpy(dst, data, count * stride); //same layout
+		else
 		{
-			memcpy(&unindexed[i], data, sizeof(Vector2));
-			data += acc->stride;
+			for (size_t i = 0; i < count; ++i, data += stride)
+			{
+				float* out = dst + i * num_components;
+				int j = 0;
+				for (; j < components; ++j)
+					out[j] = readGLTFComponent(data + j * component_size, acc->component_type, acc->normalized != 0);
+				for (; j < num_components; ++j)
+					out[j] = 0;
+			}
 		}
 	}
 
-	if (!indices_acc)
+	if (acc->is_sparse)
 	{
-		container = unindexed;
-		return;
-	}
-
-	container.resize(indices_acc->count);
-
-	assert(indices_acc->sparse.count == 0); //sparse not supported yet
-
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (int i = 0; i < indices_acc->count; ++i)
-	{
-		unsigned int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
+		const cgltf_accessor_sparse& sparse = acc->sparse;
+		if (!sparse.indices_buffer_view->buffer->data || !sparse.values_buffer_view->buffer->data)
+			return false;
+		const unsigned char* indices = (const unsigned char*)sparse.indices_buffer_view->buffer->data + sparse.indices_buffer_view->offset + sparse.indices_byte_offset;
+		const unsigned char* values = (const unsigned char*)sparse.values_buffer_view->buffer->data + sparse.values_buffer_view->offset + sparse.values_byte_offset;
+		size_t index_size = cgltf_component_size(sparse.indices_component_type);
+		size_t value_size = acc_components * component_size; //the values are tightly packed
+		for (size_t i = 0; i < sparse.count; ++i, values += value_size)
 		{
-		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
-		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
-		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
+			unsigned int index = readGLTFIndex(indices + i * index_size, sparse.indices_component_type);
+			if (index >= count)
+				continue;
+			float* out = dst + index * num_components;
+			for (int j = 0; j < components; ++j)
+				out[j] = readGLTFComponent(values + j * component_size, acc->component_type, acc->normalized != 0);
 		}
-		if (index < unindexed.size())  //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
 	}
 
+	return true;
 }
 
-void parseGLTFBufferIndices(std::vector<Vector3u>& container, cgltf_accessor* acc)
+void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc)
 {
 	container.resize(acc->count);
+	if (acc->count && !readGLTFAccessor(container[0].v, 3, acc))
+		container.clear();
+}
+
+void parseGLTFBufferVector2(std::vector<Vector2>& container, cgltf_accessor* acc)
+{
+	container.resize(acc->count);
+	if (acc->count && !readGLTFAccessor(container[0].value, 2, acc))
+		container.clear();
+}
+
+//the index buffer is kept as it is in the file (no unindexing), out of bounds indices point to the first vertex
+void parseGLTFBufferIndices(std::vector<Vector3u>& container, cgltf_accessor* acc, size_t num_vertices)
+{
+	container.resize(acc->count / 3); //Vector3u holds a whole triangle
+	if (container.empty())
+		return;
 	unsigned int *final_indices = (unsigned int*)&container[0];
+	size_t num_indices = container.size() * 3;
 
-	assert(acc->sparse.count == 0); //sparse not supported yet
+	if (acc->buffer_view && acc->buffer_view->buffer->data)
+	{
+		const unsigned char* indices = (const unsigned char*)acc->buffer_view->buffer->data + acc->buffer_view->offset + acc->offset;
+		size_t stride = acc->stride ? acc->stride : cgltf_component_size(acc->component_type);
+		if (acc->component_type == cgltf_component_type_r_32u && stride == sizeof(unsigned int))
+			memcpy(final_indices, indices, num_indices * sizeof(unsigned int));
+		else
+			for (size_t i = 0; i < num_indices; ++i)
+				final_indices[i] = readGLTFIndex(indices + i * stride, acc->component_type);
+	}
+	else
+		memset(final_indices, 0, num_indices * sizeof(unsigned int));
 
-	unsigned char* indices = (unsigned char*)acc->buffer_view->buffer->data + acc->buffer_view->offset + acc->offset;
-	int stride = acc->stride;
-	for (int i = 0; i < acc->count; ++i)
+	if (acc->is_sparse)
 	{
-		unsigned int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (acc->component_type)
+		const cgltf_accessor_sparse& sparse = acc->sparse;
+		const unsigned char* indices = (const unsigned char*)sparse.indices_buffer_view->buffer->data + sparse.indices_buffer_view->offset + sparse.indices_byte_offset;
+		const unsigned char* values = (const unsigned char*)sparse.values_buffer_view->buffer->data + sparse.values_buffer_view->offset + sparse.values_byte_offset;
+		size_t index_size = cgltf_component_size(sparse.indices_component_type);
+		size_t value_size = cgltf_component_size(acc->component_type);
+		for (size_t i = 0; i < sparse.count; ++i)
 		{
-		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
-		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
-		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
+			unsigned int index = readGLTFIndex(indices + i * index_size, sparse.indices_component_type);
+			if (index < num_indices)
+				final_indices[index] = readGLTFIndex(values + i * value_size, acc->component_type);
 		}
-		final_indices[i] = index;
 	}
+
+	//sometimes indices are out of bounds
+	size_t out_of_bounds = 0;
+	for (size_t i = 0; i < num_indices; ++i)
+		if (final_indices[i] >= num_vertices)
+		{
+			final_indices[i] = 0;
+			out_of_bounds++;
+		}
+	if (out_of_bounds)
+		std::cout << "[WARN] indices out of bounds: " << out_of_bounds << std::endl;
 }
 
-std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
+//the import is done in phases so the slow parts use all the cores:
+//parse the file, find the unique meshes, materials and images, decode the images and convert the geometry in parallel, then build the tree
+struct sGLTFMeshJob {
+	cgltf_primitive* primitive;
+	Mesh* mesh;
+	std::string bin_filename; //empty if it is not stored
+	bool optimized;
+	sVertexCacheStats before, after;
+};
+
+struct sGLTFImport {
+	std::string base_folder;
+	std::map<cgltf_mesh*, std::vector<Mesh*> > meshes; //one per primitive
+	std::map<cgltf_material*, GTR::Material*> materials;
+	std::vector<sGLTFMeshJob> mesh_jobs; //the meshes that were not loaded yet
+	std::vector<Texture*> image_jobs; //the images that were not loaded yet
+	std::map<cgltf_node*, std::vector<Matrix44> > instances; //EXT_mesh_gpu_instancing, read before the buffers are released
+};
+
+//the material and prefab registries are only used while finding and building, the rest of the import can overlap with other files
+std::mutex gltf_registry_mutex;
+
+//PHASE 2: unique meshes, materials and images
+
+void collectGLTFMesh(sGLTFImport& import, cgltf_mesh* meshdata)
 {
-	std::vector<Mesh*> result;
+	if (import.meshes.find(meshdata) != import.meshes.end())
+		return;
+	std::vector<Mesh*>& result = import.meshes[meshdata];
 
 	if(meshdata->name)
 		std::cout << "MESH: " << meshdata->name << std::endl;
@@ -159,7 +205,6 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 	//submeshes
 	for (int i = 0; i < meshdata->primitives_count; ++i)
 	{
-		cgltf_primitive* primitive = &meshdata->primitives[i];
 		Mesh* mesh = NULL;
 
 		std::string submesh_name;
@@ -174,55 +219,59 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 			}
 		}
 
+		//empty until it is converted and uploaded, registered now so other prefabs share it
 		mesh = new Mesh();
-		
-		//streams
-		for (int j = 0; j < primitive->attributes_count; ++j)
-		{
-			cgltf_attribute* attr = &primitive->attributes[j];
-			//std::string attrname = attr->name;
-			if (attr->type == cgltf_attribute_type_position)
-			{
-				parseGLTFBufferVector3(mesh->vertices, attr->data);
-				if (attr->data->has_min && attr->data->has_max)
-				{
-					mesh->aabb_min = attr->data->min;
-					mesh->aabb_max = attr->data->max;
-					mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
-					mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
-				}
-				else
-					mesh->updateBoundingBox();
-			}
-			else if (attr->type == cgltf_attribute_type_normal)
-				parseGLTFBufferVector3(mesh->normals, attr->data);
-			else if (attr->type == cgltf_attribute_type_texcoord)
-			{
-				if ( strcmp( attr->name,"TEXCOORD_1") == 0 ) //secondary UV set
-					parseGLTFBufferVector2(mesh->uvs1, attr->data);
-				else
-					parseGLTFBufferVector2(mesh->uvs, attr->data);
-			}
-
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->indices, primitive->indices);
-		}
-
-		mesh->uploadToVRAM();
+		mesh->vertex_format = Mesh::default_vertex_format;
+		mesh->load_state = ASSET_LOADING;
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
+
+		sGLTFMeshJob job;
+		job.primitive = &meshdata->primitives[i];
+		job.mesh = mesh;
+		job.optimized = false;
+		import.mesh_jobs.push_back(job);
 		result.push_back(mesh);
 	}
+}
+
+//usage (eTextureUsage) picks the compression, an image used in several slots keeps all its channels
+Texture* collectGLTFTexture(sGLTFImport& import, cgltf_texture* texture, int usage)
+{
+	if (!texture || !load_textures)
+		return NULL;
+	if (!texture->image || !texture->image->uri)
+	{
+		std::cout << "[WARN] images inside the buffers are not supported" << std::endl;
+		return NULL;
+	}
 
+	bool created = false;
+	Texture* result = Texture::Register(std::string(import.base_folder + "/" + texture->image->uri).c_str(), created);
+	if (created)
+	{
+		result->usage = usage;
+		import.image_jobs.push_back(result);
+	}
+	else if (result->usage != usage && std::find(import.image_jobs.begin(), import.image_jobs.end(), result) != import.image_jobs.end())
+		result->usage = TEXTURE_COLOR; //not decoded yet, like the ORM textures used for occlusion and metal/roughness
 	return result;
 }
 
-GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
+GTR::Material* collectGLTFMaterial(sGLTFImport& import, cgltf_material* matdata)
 {
+	auto it = import.materials.find(matdata);
+	if (it != import.materials.end())
+		return it->second;
+
 	GTR::Material* material = matdata->name ? GTR::Material::Get(matdata->name) : NULL;
 	if (material)
+	{
+		import.materials[matdata] = material;
 		return material;
+	}
 	material = new GTR::Material();
+	import.materials[matdata] = material;
 	if(matdata->name)
 		material->registerMaterial(matdata->name);
 	material->alpha_mode = (GTR::AlphaMode)matdata->alpha_mode;
@@ -231,31 +280,18 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 
 	//normalmap
 	if (matdata->normal_texture.texture)
-	{
-		const char* filename = matdata->normal_texture.texture->image->uri;
-		if (load_textures)
-			material->normal_texture = Texture::Get(std::string(base_folder + "/" + filename).c_str());
-	}
+		material->normal_texture = collectGLTFTexture(import, matdata->normal_texture.texture, TEXTURE_NORMAL);
 
 	//emissive
 	material->emissive_factor = matdata->emissive_factor;
 	if (matdata->emissive_texture.texture)
-	{
-		const char* filename = matdata->emissive_texture.texture->image->uri;
-		if (load_textures)
-			material->emissive_texture = Texture::Get(std::string(base_folder + "/" + filename).c_str());
-	}
+		material->emissive_texture = collectGLTFTexture(import, matdata->emissive_texture.texture, TEXTURE_COLOR);
 
 	//pbr
 	if (matdata->has_pbr_specular_glossiness)
 	{
 		if (matdata->pbr_specular_glossiness.diffuse_texture.texture)
-		{
-			const char* filename = matdata->pbr_specular_glossiness.diffuse_texture.texture->image->uri;
-			//std::cout << base_folder + "/" + filename << std::endl;
-			if (load_textures)
-				material->color_texture = Texture::Get(std::string(base_folder + "/" + filename).c_str());
-		}
+			material->color_texture = collectGLTFTexture(import, matdata->pbr_specular_glossiness.diffuse_texture.texture, TEXTURE_COLOR);
 	}
 	if (matdata->has_pbr_metallic_roughness)
 	{
@@ -264,52 +300,263 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 		material->roughness_factor = matdata->pbr_metallic_roughness.roughness_factor;
 
 		if (matdata->pbr_metallic_roughness.base_color_texture.texture)
-		{
-			const char* filename = matdata->pbr_metallic_roughness.base_color_texture.texture->image->uri;
-			if (load_textures)
-				material->color_texture = Texture::Get(std::string(base_folder + "/" + filename).c_str());
-		}
+			material->color_texture = collectGLTFTexture(import, matdata->pbr_metallic_roughness.base_color_texture.texture, TEXTURE_COLOR);
 		if (matdata->pbr_metallic_roughness.metallic_roughness_texture.texture)
+			material->metallic_roughness_texture = collectGLTFTexture(import, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture, TEXTURE_METAL_ROUGHNESS);
+	}
+
+	if (matdata->occlusion_texture.texture)
+		material->occlusion_texture = collectGLTFTexture(import, matdata->occlusion_texture.texture, TEXTURE_MASK);
+
+	return material;
+}
+
+void collectGLTFNode(sGLTFImport& import, cgltf_node* node)
+{
+	if (node->mesh)
+	{
+		//single primitive meshes can be registered with the name of the mesh
+		if (node->mesh->primitives_count > 1 || !node->mesh->name || !Mesh::Get(node->mesh->name, true))
+			collectGLTFMesh(import, node->mesh);
+		for (int i = 0; i < node->mesh->primitives_count; ++i)
+			if (node->mesh->primitives[i].material)
+				collectGLTFMaterial(import, node->mesh->primitives[i].material);
+	}
+
+	for (int i = 0; i < node->children_count; ++i)
+		collectGLTFNode(import, node->children[i]);
+}
+
+//translation, rotation (quaternion) and scale, the ones that are NULL are skipped
+void composeGLTFTransform(const float* translation, const float* rotation, const float* scale, Matrix44 &model)
+{
+	if (translation)
+		model.translate(translation[0], translation[1], translation[2]);
+	if (rotation)
+	{
+		Quaternion q(rotation[0], rotation[1], rotation[2], rotation[3]);
+		Matrix44 R;
+		q.toMatrix(R);
+		R.transpose();
+		model = R * model; //like Matrix44::rotate, so the translation is not rotated
+	}
+	if (scale)
+		model.scale(scale[0], scale[1], scale[2]);
+}
+
+//EXT_mesh_gpu_instancing: this cgltf does not parse node extensions, so they are read from the json
+
+//returns the token with the value of key in the object at token i, or -1
+static int findGLTFJsonKey(const jsmntok_t* tokens, int i, const uint8_t* json, const char* key)
+{
+	if (tokens[i].type != JSMN_OBJECT)
+		return -1;
+	int size = tokens[i].size;
+	++i;
+	for (int j = 0; j < size && i >= 0; ++j)
+	{
+		if (cgltf_json_strcmp(&tokens[i], json, key) == 0)
+			return i + 1;
+		i = cgltf_skip_json(tokens, i + 1);
+	}
+	return -1;
+}
+
+static cgltf_accessor* getGLTFInstanceAccessor(cgltf_data* data, const jsmntok_t* tokens, int attributes, const uint8_t* json, const char* name, cgltf_type type)
+{
+	int i = findGLTFJsonKey(tokens, attributes, json, name);
+	if (i < 0)
+		return NULL;
+	int index = cgltf_json_to_int(&tokens[i], json);
+	if (index < 0 || index >= (int)data->accessors_count || data->accessors[index].type != type)
+	{
+		std::cout << "[WARN] wrong EXT_mesh_gpu_instancing accessor for " << name << std::endl;
+		return NULL;
+	}
+	return &data->accessors[index];
+}
+
+void collectGLTFInstances(sGLTFImport& import, cgltf_data* data, cgltf_node* node, const jsmntok_t* tokens, int attributes)
+{
+	const uint8_t* json = (const uint8_t*)data->json;
+	cgltf_accessor* accessors[3] = {
+		getGLTFInstanceAccessor(data, tokens, attributes, json, "TRANSLATION", cgltf_type_vec3),
+		getGLTFInstanceAccessor(data, tokens, attributes, json, "ROTATION", cgltf_type_vec4),
+		getGLTFInstanceAccessor(data, tokens, attributes, json, "SCALE", cgltf_type_vec3) };
+
+	//all the attributes have the same count
+	size_t count = 0;
+	for (int i = 0; i < 3; ++i)
+		if (accessors[i])
+			count = count ? std::min(count, (size_t)accessors[i]->count) : accessors[i]->count;
+	if (!count)
+		return;
+
+	std::vector<float> values[3];
+	const float* rows[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		int num_components = i == 1 ? 4 : 3;
+		if (accessors[i])
 		{
-			const char* filename = matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image->uri;
-			if (load_textures)
-				material->metallic_roughness_texture = Texture::Get(std::string(base_folder + "/" + filename).c_str());
+			values[i].resize(accessors[i]->count * num_components);
+			if (!readGLTFAccessor(&values[i][0], num_components, accessors[i]))
+				return;
 		}
 	}
 
-	if (matdata->occlusion_texture.texture)
+	std::vector<Matrix44>& instances = import.instances[node];
+	instances.resize(count);
+	for (size_t j = 0; j < count; ++j)
 	{
-		const char* filename = matdata->occlusion_texture.texture->image->uri;
-		if (load_textures)
-			material->occlusion_texture = Texture::Get(std::string(base_folder + "/" + filename).c_str());
+		for (int i = 0; i < 3; ++i)
+			rows[i] = accessors[i] ? &values[i][j * (i == 1 ? 4 : 3)] : NULL;
+		composeGLTFTransform(rows[0], rows[1], rows[2], instances[j]);
 	}
+}
 
-	return material;
+void collectGLTFInstances(sGLTFImport& import, cgltf_data* data)
+{
+	bool used = false;
+	for (cgltf_size i = 0; i < data->extensions_used_count; ++i)
+		used = used || strcmp(data->extensions_used[i], "EXT_mesh_gpu_instancing") == 0;
+	if (!used || !data->json)
+		return;
+
+	jsmn_parser parser;
+	jsmn_init(&parser);
+	int num_tokens = jsmn_parse(&parser, data->json, data->json_size, NULL, 0);
+	if (num_tokens <= 0)
+		return;
+	std::vector<jsmntok_t> tokens(num_tokens + 1);
+	jsmn_init(&parser);
+	if (jsmn_parse(&parser, data->json, data->json_size, &tokens[0], num_tokens) <= 0)
+		return;
+	tokens[num_tokens].type = JSMN_UNDEFINED;
+
+	const uint8_t* json = (const uint8_t*)data->json;
+	int nodes = findGLTFJsonKey(&tokens[0], 0, json, "nodes");
+	if (nodes < 0 || tokens[nodes].type != JSMN_ARRAY)
+		return;
+
+	//the nodes of cgltf are in the same order as in the json
+	int i = nodes + 1;
+	for (int n = 0; n < tokens[nodes].size && n < (int)data->nodes_count && i >= 0; ++n)
+	{
+		int extensions = findGLTFJsonKey(&tokens[0], i, json, "extensions");
+		int instancing = extensions < 0 ? -1 : findGLTFJsonKey(&tokens[0], extensions, json, "EXT_mesh_gpu_instancing");
+		int attributes = instancing < 0 ? -1 : findGLTFJsonKey(&tokens[0], instancing, json, "attributes");
+		if (attributes >= 0 && data->nodes[n].mesh)
+			collectGLTFInstances(import, data, &data->nodes[n], &tokens[0], attributes);
+		i = cgltf_skip_json(&tokens[0], i);
+	}
+}
+
+//PHASE 3: runs in parallel with the other meshes and the images, the upload is queued for the main thread
+
+void convertGLTFPrimitive(sGLTFMeshJob& job)
+{
+	cgltf_primitive* primitive = job.primitive;
+	Mesh* mesh = job.mesh;
+
+	//streams
+	for (int j = 0; j < primitive->attributes_count; ++j)
+	{
+		cgltf_attribute* attr = &primitive->attributes[j];
+		//std::string attrname = attr->name;
+		if (attr->type == cgltf_attribute_type_position)
+		{
+			parseGLTFBufferVector3(mesh->vertices, attr->data);
+			//min and max are in the units of the components, only valid as they are for floats without sparse changes
+			if (attr->data->has_min && attr->data->has_max && attr->data->component_type == cgltf_component_type_r_32f && !attr->data->is_sparse)
+			{
+				mesh->aabb_min = attr->data->min;
+				mesh->aabb_max = attr->data->max;
+				mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+				mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
+			}
+			else
+				mesh->updateBoundingBox();
+		}
+		else if (attr->type == cgltf_attribute_type_normal)
+			parseGLTFBufferVector3(mesh->normals, attr->data);
+		else if (attr->type == cgltf_attribute_type_texcoord)
+		{
+			if ( strcmp( attr->name,"TEXCOORD_1") == 0 ) //secondary UV set
+				parseGLTFBufferVector2(mesh->uvs1, attr->data);
+			else
+				parseGLTFBufferVector2(mesh->uvs, attr->data);
+		}
+	}
+
+	if (primitive->indices && primitive->indices->count)
+		parseGLTFBufferIndices(mesh->indices, primitive->indices, mesh->vertices.size());
+
+	job.optimized = Mesh::optimize_meshes && mesh->optimize(&job.before, &job.after);
+	if (Mesh::lod_levels > 0)
+		mesh->buildLODs(Mesh::lod_levels);
+
+	//for the prefab cache, the geometry is only read from here on
+	if (job.bin_filename.size() && mesh->vertices.size() && mesh->writeBin(job.bin_filename.c_str()))
+		mesh->bin_filename = job.bin_filename + ".mbin";
+
+	//the mesh renders nothing until the main thread uploads it
+	runInMainThread([mesh]() {
+		mesh->uploadToVRAM();
+		mesh->load_state = ASSET_READY;
+	});
+}
+
+void decodeGLTFImage(Texture* texture)
+{
+	long time = getTime();
+	bool found = texture->loadImage(texture->filename.c_str());
+	texture->queueUpload(found, true, true, time);
 }
 
 void parseGLTFTransform(cgltf_node* node, Matrix44 &model)
 {
 	if (node->has_matrix)
 		memcpy(model.m, node->matrix, sizeof(node->matrix)); //transform
-	else {
-		if (node->has_translation)
-			model.translate(node->translation[0], node->translation[1], node->translation[2]);
-		if (node->has_rotation)
+	else
+		composeGLTFTransform(node->has_translation ? node->translation : NULL, node->has_rotation ? node->rotation : NULL, node->has_scale ? node->scale : NULL, model);
+	//model.transpose(); //dont know why
+}
+
+//PHASE 4: GLTF PARSING
+void parseGLTFNodeMesh(sGLTFImport& import, cgltf_mesh* meshdata, GTR::Node* scenenode)
+{
+	if (meshdata->primitives_count > 1 && 1)
+	{
+		std::vector<Mesh*>& meshes = import.meshes[meshdata];
+
+		for (int i = 0; i < meshdata->primitives_count; ++i)
 		{
-			Quaternion q(node->rotation[0], node->rotation[1], node->rotation[2], node->rotation[3]);
-			Matrix44 R;
-			q.toMatrix(R);
-			R.transpose();
-			model = model * R;
+			GTR::Node* subnode = new GTR::Node();
+			subnode->mesh = meshes[i];
+			if (meshdata->primitives[i].material)
+				subnode->material = import.materials[meshdata->primitives[i].material];
+			scenenode->addChild(subnode);
 		}
-		if (node->has_scale)
-			model.scale(node->scale[0], node->scale[1], node->scale[2]);
 	}
-	//model.transpose(); //dont know why
+	else //single primitive
+	{
+		auto it = import.meshes.find(meshdata);
+		if (it != import.meshes.end())
+		{
+			if (it->second.size())
+				scenenode->mesh = it->second[0];
+		}
+		else if (meshdata->name)
+			scenenode->mesh = Mesh::Get(meshdata->name,true);
+
+		if (meshdata->primitives->material)
+			scenenode->material = import.materials[meshdata->primitives->material];
+	}
 }
 
-//GLTF PARSING: you can pass the node or it will create it
-GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
+//you can pass the node or it will create it
+GTR::Node* parseGLTFNode(sGLTFImport& import, cgltf_node* node, GTR::Node* scenenode = NULL)
 {
 	if (scenenode == NULL)
 		scenenode = new GTR::Node();
@@ -322,54 +569,41 @@ GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
 
 	if (node->mesh)
 	{
-		/*
-		if (node->mesh->name)
-		{
-			//meshname = node->mesh->name;
-			scenenode->mesh = Mesh::Get(node->mesh->name);
-		}
-		*/
-
-		if (node->mesh->primitives_count > 1 && 1)
-		{
-			std::vector<Mesh*> meshes;
-			meshes = parseGLTFMesh(node->mesh);
-
-			for (int i = 0; i < node->mesh->primitives_count; ++i)
-			{
-				GTR::Node* subnode = new GTR::Node();
-				subnode->mesh = meshes[i];
-				if (node->mesh->primitives[i].material)
-					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material);
-				scenenode->addChild(subnode);
-			}
-		}
-		else //single primitive
-		{
-			if (node->mesh->name)
-				scenenode->mesh = Mesh::Get(node->mesh->name,true);
-
-			if (!scenenode->mesh)
+		auto instances = import.instances.find(node);
+		if (instances == import.instances.end())
+			parseGLTFNodeMesh(import, node->mesh, scenenode);
+		else //one child per instance, the renderer draws them instanced again
+			for (size_t i = 0; i < instances->second.size(); ++i)
 			{
-				std::vector<Mesh*> meshes;
-				meshes = parseGLTFMesh(node->mesh);
-				if(meshes.size())
-					scenenode->mesh = meshes[0];
+				GTR::Node* instancenode = new GTR::Node();
+				instancenode->model = instances->second[i];
+				parseGLTFNodeMesh(import, node->mesh, instancenode);
+				scenenode->addChild(instancenode);
 			}
-
-			if (node->mesh->primitives->material)
-				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material);
-		}
 	}
 
 	for (int i = 0; i < node->children_count; ++i)
-		scenenode->addChild(parseGLTFNode(node->children[i]));
+		scenenode->addChild(parseGLTFNode(import, node->children[i]));
 
 	return scenenode;
 }
 
 GTR::Prefab* loadGLTF(const char* filename)
 {
+	GTR::Prefab* prefab = new GTR::Prefab();
+	if (!loadGLTF(filename, prefab))
+	{
+		delete prefab;
+		return NULL;
+	}
+	return prefab;
+}
+
+bool loadGLTF(const char* filename, GTR::Prefab* prefab, std::vector<std::string>* sources)
+{
+	long time = getTime();
+
+	//PHASE 1: parse the json and read the buffers
 	std::cout << "loading gltf... " << filename << std::endl;
 	cgltf_options options;
 	memset(&options, 0, sizeof(cgltf_options));
@@ -378,26 +612,29 @@ GTR::Prefab* loadGLTF(const char* filename)
 	if (result != cgltf_result_success)
 	{
 		std::cout << "[NOT FOUND]" << std::endl;
-		return NULL;
+		return false;
 	}
 
 	if (data->scenes_count > 1)
 		std::cout << "[WARN] more than one scene, skipping the rest" << std::endl;
+	for (cgltf_size i = 0; i < data->extensions_required_count; ++i)
+		if (strcmp(data->extensions_required[i], "KHR_mesh_quantization") != 0 && strcmp(data->extensions_required[i], "EXT_mesh_gpu_instancing") != 0) //quantized accessors are decoded in readGLTFAccessor
+			std::cout << "[WARN] required extension not supported: " << data->extensions_required[i] << std::endl;
 
 	//get nodes
 	cgltf_scene* scene = &data->scenes[0];
 
-	char folder[1024];
-	strcpy(folder, filename);
-	char* name_start = strrchr(folder, '/');
-	*name_start = '\0';
-	base_folder = folder; //global
+	sGLTFImport import;
+	std::string folder = filename;
+	size_t slash = folder.find_last_of('/');
+	import.base_folder = slash != std::string::npos ? folder.substr(0, slash) : ".";
 
 	result = cgltf_load_buffers(&options, data, filename);
 	if (result != cgltf_result_success)
 	{
 		std::cout << "[BIN NOT FOUND]:" << filename << std::endl;
-		return NULL;
+		cgltf_free(data);
+		return false;
 	}
 
 	if (scene->nodes_count > 1)
@@ -417,16 +654,82 @@ GTR::Prefab* loadGLTF(const char* filename)
 			node = node->children[0];
 		}
 	}
+	long parse_time = getTime();
 
-	GTR::Prefab* prefab = new GTR::Prefab();
+	//PHASE 2: what is not loaded yet
+	{
+		std::lock_guard<std::mutex> lock(gltf_registry_mutex);
+		collectGLTFNode(import, node);
+	}
+	collectGLTFInstances(import, data);
+	if (sources)
+	{
+		for (size_t i = 0; i < import.mesh_jobs.size(); ++i)
+			import.mesh_jobs[i].bin_filename = std::string(filename) + "." + std::to_string(i);
+		for (cgltf_size i = 0; i < data->buffers_count; ++i)
+			if (data->buffers[i].uri && strncmp(data->buffers[i].uri, "data:", 5) != 0)
+				sources->push_back(import.base_folder + "/" + data->buffers[i].uri);
+	}
+	long collect_time = getTime();
 
-	parseGLTFNode(node, &prefab->root);
+	//PHASE 3: images first, they are the slowest jobs
+	int num_images = (int)import.image_jobs.size();
+	parallelFor(num_images + (int)import.mesh_jobs.size(), [&](int i) {
+		if (i < num_images)
+			decodeGLTFImage(import.image_jobs[i]);
+		else
+			convertGLTFPrimitive(import.mesh_jobs[i - num_images]);
+	});
+
+	//the geometry is converted, the buffers are not needed to build the tree
+	for (cgltf_size i = 0; i < data->buffers_count; ++i)
+		if (data->buffers[i].data != data->bin)
+		{
+			cgltf_default_file_release(&data->memory, &data->file, data->buffers[i].data);
+			data->buffers[i].data = NULL;
+		}
+	long convert_time = getTime();
+
+	//vertex cache stats of the optimized meshes (weighted by triangles and vertices)
+	double optimized_acmr[2] = { 0, 0 };
+	double optimized_atvr[2] = { 0, 0 };
+	size_t optimized_triangles = 0;
+	size_t optimized_vertices = 0;
+	for (size_t i = 0; i < import.mesh_jobs.size(); ++i)
+	{
+		sGLTFMeshJob& job = import.mesh_jobs[i];
+		if (!job.optimized)
+			continue;
+		size_t num_triangles = job.mesh->indices.size();
+		size_t num_vertices = job.mesh->vertices.size();
+		optimized_acmr[0] += job.before.acmr * num_triangles;
+		optimized_acmr[1] += job.after.acmr * num_triangles;
+		optimized_atvr[0] += job.before.atvr * num_vertices;
+		optimized_atvr[1] += job.after.atvr * num_vertices;
+		optimized_triangles += num_triangles;
+		optimized_vertices += num_vertices;
+	}
+
+	if (optimized_triangles)
+		std::cout << " + Optimized meshes: " << optimized_triangles << " tris, ACMR " << optimized_acmr[0] / optimized_triangles << " -> " << optimized_acmr[1] / optimized_triangles
+			<< ", ATVR " << optimized_atvr[0] / optimized_vertices << " -> " << optimized_atvr[1] / optimized_vertices << std::endl;
+
+	//PHASE 4: the tree, with the meshes and materials found before
+	{
+		std::lock_guard<std::mutex> lock(gltf_registry_mutex);
+		parseGLTFNode(import, node, &prefab->root);
+	}
 	prefab->root.model = model;
 	prefab->updateNodesByName();
 	prefab->updateBounding();
 
-	//frees all data, including bin
+	//frees all data
 	cgltf_free(data);
 
-	return prefab;
-}
\ No newline at end of file
+	long end_time = getTime();
+	std::cout << " + glTF phases: parse " << parse_time - time << "ms, collect " << collect_time - parse_time << "ms (" << import.mesh_jobs.size() << " meshes, "
+		<< import.materials.size() << " materials, " << num_images << " images), decode/convert " << convert_time - collect_time << "ms in "
+		<< std::min(getNumCores(), std::max(1, num_images + (int)import.mesh_jobs.size())) << " threads, tree " << end_time - convert_time << "ms" << std::endl;
+
+	return true;
+}
@@ -1,5 +1,12 @@
 #pragma once
 
 #include "prefab.h"
+#include <mutex>
 
 GTR::Prefab* loadGLTF(const char* filename);
+//fills an empty prefab, it can be called from any thread: the meshes are uploaded and the textures loaded later (see processMainThreadTasks)
+//with sources it also writes every mesh to a .mbin and lists the other files read (buffers), used to cache the prefab (see Prefab::writeBin)
+bool loadGLTF(const char* filename, GTR::Prefab* prefab, std::vector<std::string>* sources = NULL);
+
+extern bool load_textures; //must textures be loadead?
+extern std::mutex gltf_registry_mutex; //held while the shared materials and prefabs are found or built, also by Prefab::readBin
@@ -15,6 +15,7 @@
 #include "utils.h"
 #include "input.h"
 #include "application.h"
+#include "texture.h"
 
 #include <iostream> //to output
 
@@ -74,6 +75,7 @@ SDL_Window* createWindow(const char* caption, int width, int height, bool fullsc
 	#ifdef USE_GLEW
 		glewInit();
 	#endif
+	Texture::detectCompressedFormats();
 
 	int window_width, window_height;
 	SDL_GetWindowSize(sdl_window, &window_width, &window_height);
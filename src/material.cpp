@@ -4,13 +4,17 @@
 #include "includes.h"
 #include "texture.h"
 
+#include <mutex>
+
 using namespace GTR;
 
 std::map<std::string, Material*> Material::sMaterials;
+static std::mutex materials_mutex; //materials are registered from the loading threads
 
 Material* Material::Get(const char* name)
 {
 	assert(name);
+	std::lock_guard<std::mutex> lock(materials_mutex);
 	std::map<std::string, Material*>::iterator it = sMaterials.find(name);
 	if (it != sMaterials.end())
 		return it->second;
@@ -19,6 +23,7 @@ Material* Material::Get(const char* name)
 
 void Material::registerMaterial(const char* name)
 {
+	std::lock_guard<std::mutex> lock(materials_mutex);
 	this->name = name;
 	sMaterials[name] = this;
 }
@@ -48,9 +53,10 @@ Material::~Material()
 {
 	if (name.size())
 	{
+		std::lock_guard<std::mutex> lock(materials_mutex);
 		auto it = sMaterials.find(name);
-		if (it != sMaterials.end());
-		sMaterials.erase(it);
+		if (it != sMaterials.end() && it->second == this)
+			sMaterials.erase(it);
 	}
 }
 
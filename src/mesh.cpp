@@ -1,5 +1,5 @@
 #include "mesh.h"
-#include "extra/textparser.h"
+#include "mesh_optimizer.h"
 #include "utils.h"
 #include "shader.h"
 #include "includes.h"
@@ -9,19 +9,38 @@
 #include <iostream>
 #include <limits>
 #include <sys/stat.h>
+#include <sstream>
+#include <mutex>
 
 #include "camera.h"
 #include "texture.h"
 #include "animation.h"
+#include "uniform_blocks.h"
+#include "gl_state.h"
 #include "extra/coldet/coldet.h"
 
 bool Mesh::use_binary = true;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::optimize_meshes = true;		//reorders indices and vertices for the GPU caches before uploading or writing the .mbin
+bool Mesh::keep_cpu_copy = false;		//meshes read from .mbin are uploaded from the mapped file and not kept in RAM
+int Mesh::default_vertex_format = VF_COMPACT; //format used in VRAM and in the .mbin by the meshes loaded with Get (see eVertexFormat)
+bool Mesh::build_meshlets = true;		//optimized meshes are split in meshlets so renderCulled can skip the hidden parts
+bool Mesh::cull_meshlets = true;
+int Mesh::lod_levels = 3;				//LODs built when a mesh is optimized (they are stored in the .mbin)
+float Mesh::lod_threshold = 0.5f;
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
+static std::mutex meshes_mutex; //sMeshesLoaded is used from the loading threads
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+long Mesh::num_meshlets_rendered = 0;
+long Mesh::num_meshlets_culled = 0;
+
+//set on every draw by enableBuffers
+static UniformHandle u_vertex_offset("u_vertex_offset");
+static UniformHandle u_vertex_scale("u_vertex_scale");
+static UniformHandle u_oct_normals("u_oct_normals");
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -31,8 +50,13 @@ long Mesh::num_triangles_rendered = 0;
 Mesh::Mesh()
 {
 	radius = 0;
-	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	uv_density = 0;
+	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = lod_indices_vbo_id = 0;
+	num_vertices_vram = num_indices_vram = 0;
+	vertex_format = VF_FLOAT;
+	vertex_scale.set(1, 1, 1);
 	collision_model = NULL;
+	load_state = ASSET_READY;
 	clear();
 }
 
@@ -42,30 +66,41 @@ Mesh::~Mesh()
 }
 
 
+//the state cache forgets it, its name can be reused
+static void deleteBuffer(GLuint& id)
+{
+	GLState::deleteBuffer(id);
+	glDeleteBuffersARB(1, &id);
+}
+
 void Mesh::clear()
 {
 	//Free VBOs
 	if (vertices_vbo_id) 
-		glDeleteBuffersARB(1,&vertices_vbo_id);
+		deleteBuffer(vertices_vbo_id);
 	if (uvs_vbo_id)
-		glDeleteBuffersARB(1,&uvs_vbo_id);
+		deleteBuffer(uvs_vbo_id);
 	if (normals_vbo_id) 
-		glDeleteBuffersARB(1,&normals_vbo_id);
+		deleteBuffer(normals_vbo_id);
 	if (colors_vbo_id) 
-		glDeleteBuffersARB(1,&colors_vbo_id);
+		deleteBuffer(colors_vbo_id);
 	if (interleaved_vbo_id)
-		glDeleteBuffersARB(1, &interleaved_vbo_id);
+		deleteBuffer(interleaved_vbo_id);
 	if (indices_vbo_id)
-		glDeleteBuffersARB(1, &indices_vbo_id);
+		deleteBuffer(indices_vbo_id);
 	if (bones_vbo_id)
-		glDeleteBuffersARB(1, &bones_vbo_id);
+		deleteBuffer(bones_vbo_id);
 	if (weights_vbo_id)
-		glDeleteBuffersARB(1, &weights_vbo_id);
+		deleteBuffer(weights_vbo_id);
 	if (uvs1_vbo_id)
-		glDeleteBuffersARB(1, &uvs1_vbo_id);
+		deleteBuffer(uvs1_vbo_id);
+	if (lod_indices_vbo_id)
+		deleteBuffer(lod_indices_vbo_id);
 
 	//VBOs ids
-	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = lod_indices_vbo_id = 0;
+	num_vertices_vram = num_indices_vram = 0;
+	vram_bytes = 0;
 
 	//buffers
 	vertices.clear();
@@ -77,9 +112,296 @@ void Mesh::clear()
 	bones.clear();
 	weights.clear();
 	uvs1.clear();
+	meshlets.clear();
+	lods.clear();
+	lod_indices.clear();
 
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
+	collision_model = NULL;
+}
+
+//compact vertex formats ***********************************
+
+struct sVertexLayout
+{
+	int position_bytes;
+	int normal_bytes;
+	int uv_bytes;
+	int stride; //when interleaved
+};
+
+static sVertexLayout getVertexLayout(int format)
+{
+	sVertexLayout layout;
+	layout.position_bytes = (format & VF_POSITION_16) ? 8 : 12; //4 x unorm16, the last one keeps the alignment
+	layout.normal_bytes = (format & VF_NORMAL_OCT) ? 4 : 12;
+	layout.uv_bytes = (format & VF_UV_16) ? 4 : 8;
+	layout.stride = layout.position_bytes + layout.normal_bytes + layout.uv_bytes;
+	return layout;
+}
+
+//flags that change the content of a stream (streams are named like in the .mbin)
+static int getStreamFormatFlags(const char* id)
+{
+	if (memcmp(id, "INTR", 4) == 0) return VF_POSITION_16 | VF_NORMAL_OCT | VF_UV_16;
+	if (memcmp(id, "VERT", 4) == 0) return VF_POSITION_16;
+	if (memcmp(id, "NORM", 4) == 0) return VF_NORMAL_OCT;
+	if (memcmp(id, "UVS0", 4) == 0 || memcmp(id, "UVS1", 4) == 0) return VF_UV_16;
+	if (memcmp(id, "WGHT", 4) == 0) return VF_WEIGHTS_8;
+	if (memcmp(id, "INDX", 4) == 0 || memcmp(id, "LODI", 4) == 0) return VF_INDICES_16;
+	return 0;
+}
+
+static void getQuantization(const BoundingBox& box, Vector3& offset, Vector3& scale)
+{
+	offset = box.center - box.halfsize;
+	scale = box.halfsize * 2.0f;
+	for (int i = 0; i < 3; ++i)
+		if (scale.v[i] <= 0.0f)
+			scale.v[i] = 1.0f;
+}
+
+static unsigned short floatToHalf(float f)
+{
+	unsigned int x;
+	memcpy(&x, &f, sizeof(float));
+	unsigned short sign = (unsigned short)((x >> 16) & 0x8000);
+	int exponent = (int)((x >> 23) & 0xFF) - 127 + 15;
+	unsigned int mantissa = x & 0x7FFFFF;
+	if (exponent <= 0) //denormal or zero
+	{
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return sign | (unsigned short)half;
+	}
+	if (exponent >= 31) //too big
+		return sign | 0x7C00;
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) //round (may carry into the exponent, which is right)
+		half++;
+	return (unsigned short)half;
+}
+
+static float halfToFloat(unsigned short h)
+{
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	unsigned int exponent = (h >> 10) & 0x1F;
+	unsigned int mantissa = h & 0x3FF;
+	float f;
+	if (exponent == 0)
+		f = mantissa / 16777216.0f; //2^-24
+	else
+	{
+		unsigned int x = exponent == 31 ? (0x7F800000 | (mantissa << 13)) : (((exponent - 15 + 127) << 23) | (mantissa << 13));
+		memcpy(&f, &x, sizeof(float));
+	}
+	return sign ? -f : f;
+}
+
+static void packPosition(unsigned char* dst, const Vector3& v, int format, const Vector3& offset, const Vector3& scale)
+{
+	if (!(format & VF_POSITION_16))
+	{
+		memcpy(dst, v.v, sizeof(Vector3));
+		return;
+	}
+	unsigned short* p = (unsigned short*)dst;
+	for (int i = 0; i < 3; ++i)
+		p[i] = (unsigned short)(clamp((v.v[i] - offset.v[i]) / scale.v[i], 0.0f, 1.0f) * 65535.0f + 0.5f);
+	p[3] = 0;
+}
+
+static Vector3 unpackPosition(const unsigned char* src, int format, const Vector3& offset, const Vector3& scale)
+{
+	Vector3 v;
+	if (!(format & VF_POSITION_16))
+		memcpy(v.v, src, sizeof(Vector3));
+	else
+		for (int i = 0; i < 3; ++i)
+			v.v[i] = ((const unsigned short*)src)[i] / 65535.0f * scale.v[i] + offset.v[i];
+	return v;
+}
+
+//octahedral encoding: the normal is projected on the octahedron and the lower half is folded over the upper one
+static void packNormal(unsigned char* dst, const Vector3& n, int format)
+{
+	if (!(format & VF_NORMAL_OCT))
+	{
+		memcpy(dst, n.v, sizeof(Vector3));
+		return;
+	}
+	float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	if (l1 == 0.0f)
+		l1 = 1.0f;
+	float x = n.x / l1;
+	float y = n.y / l1;
+	if (n.z < 0.0f)
+	{
+		float folded_x = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = folded_x;
+	}
+	short* p = (short*)dst;
+	p[0] = (short)floor(clamp(x, -1.0f, 1.0f) * 32767.0f + 0.5f);
+	p[1] = (short)floor(clamp(y, -1.0f, 1.0f) * 32767.0f + 0.5f);
+}
+
+static Vector3 unpackNormal(const unsigned char* src, int format)
+{
+	Vector3 n;
+	if (!(format & VF_NORMAL_OCT))
+	{
+		memcpy(n.v, src, sizeof(Vector3));
+		return n;
+	}
+	const short* p = (const short*)src;
+	n.set(p[0] / 32767.0f, p[1] / 32767.0f, 0.0f);
+	n.z = 1.0f - fabs(n.x) - fabs(n.y);
+	if (n.z < 0.0f)
+	{
+		float x = (1.0f - fabs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+		n.y = (1.0f - fabs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+		n.x = x;
+	}
+	n.normalize();
+	return n;
+}
+
+static void packUV(unsigned char* dst, const Vector2& uv, int format)
+{
+	if (!(format & VF_UV_16))
+	{
+		memcpy(dst, uv.value, sizeof(Vector2));
+		return;
+	}
+	unsigned short* p = (unsigned short*)dst;
+	p[0] = floatToHalf(uv.x);
+	p[1] = floatToHalf(uv.y);
+}
+
+static Vector2 unpackUV(const unsigned char* src, int format)
+{
+	Vector2 uv;
+	if (!(format & VF_UV_16))
+		memcpy(uv.value, src, sizeof(Vector2));
+	else
+		uv.set(halfToFloat(((const unsigned short*)src)[0]), halfToFloat(((const unsigned short*)src)[1]));
+	return uv;
+}
+
+//converts a CPU stream to the format used in VRAM and in the .mbin
+static void packStream(Mesh& mesh, const char* id, int format, const Vector3& offset, const Vector3& scale, std::vector<unsigned char>& out)
+{
+	sVertexLayout layout = getVertexLayout(format);
+	if (memcmp(id, "INTR", 4) == 0)
+	{
+		out.resize(mesh.interleaved.size() * layout.stride);
+		for (size_t i = 0; i < mesh.interleaved.size(); ++i)
+		{
+			unsigned char* dst = &out[i * layout.stride];
+			packPosition(dst, mesh.interleaved[i].vertex, format, offset, scale);
+			packNormal(dst + layout.position_bytes, mesh.interleaved[i].normal, format);
+			packUV(dst + layout.position_bytes + layout.normal_bytes, mesh.interleaved[i].uv, format);
+		}
+	}
+	else if (memcmp(id, "VERT", 4) == 0)
+	{
+		out.resize(mesh.vertices.size() * layout.position_bytes);
+		for (size_t i = 0; i < mesh.vertices.size(); ++i)
+			packPosition(&out[i * layout.position_bytes], mesh.vertices[i], format, offset, scale);
+	}
+	else if (memcmp(id, "NORM", 4) == 0)
+	{
+		out.resize(mesh.normals.size() * layout.normal_bytes);
+		for (size_t i = 0; i < mesh.normals.size(); ++i)
+			packNormal(&out[i * layout.normal_bytes], mesh.normals[i], format);
+	}
+	else if (memcmp(id, "UVS0", 4) == 0 || memcmp(id, "UVS1", 4) == 0)
+	{
+		std::vector<Vector2>& uvs = id[3] == '0' ? mesh.uvs : mesh.uvs1;
+		out.resize(uvs.size() * layout.uv_bytes);
+		for (size_t i = 0; i < uvs.size(); ++i)
+			packUV(&out[i * layout.uv_bytes], uvs[i], format);
+	}
+	else if (memcmp(id, "WGHT", 4) == 0)
+	{
+		out.resize(mesh.weights.size() * 4);
+		for (size_t i = 0; i < mesh.weights.size(); ++i)
+			for (int j = 0; j < 4; ++j)
+				out[i * 4 + j] = (unsigned char)(clamp(mesh.weights[i].v[j], 0.0f, 1.0f) * 255.0f + 0.5f);
+	}
+	else if (memcmp(id, "INDX", 4) == 0 || memcmp(id, "LODI", 4) == 0)
+	{
+		std::vector<Vector3u>& triangles = id[0] == 'I' ? mesh.indices : mesh.lod_indices;
+		out.resize(triangles.size() * 3 * sizeof(unsigned short));
+		unsigned short* dst = (unsigned short*)&out[0];
+		const unsigned int* src = (const unsigned int*)&triangles[0];
+		for (size_t i = 0; i < triangles.size() * 3; ++i)
+			dst[i] = (unsigned short)src[i];
+	}
+}
+
+//the opposite of packStream, count is the number of elements
+static void unpackStream(Mesh& mesh, const char* id, const unsigned char* data, unsigned int count, int format, const Vector3& offset, const Vector3& scale)
+{
+	sVertexLayout layout = getVertexLayout(format);
+	if (memcmp(id, "INTR", 4) == 0)
+	{
+		mesh.interleaved.resize(count);
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			const unsigned char* src = data + i * layout.stride;
+			mesh.interleaved[i].vertex = unpackPosition(src, format, offset, scale);
+			mesh.interleaved[i].normal = unpackNormal(src + layout.position_bytes, format);
+			mesh.interleaved[i].uv = unpackUV(src + layout.position_bytes + layout.normal_bytes, format);
+		}
+	}
+	else if (memcmp(id, "VERT", 4) == 0)
+	{
+		mesh.vertices.resize(count);
+		for (unsigned int i = 0; i < count; ++i)
+			mesh.vertices[i] = unpackPosition(data + i * layout.position_bytes, format, offset, scale);
+	}
+	else if (memcmp(id, "NORM", 4) == 0)
+	{
+		mesh.normals.resize(count);
+		for (unsigned int i = 0; i < count; ++i)
+			mesh.normals[i] = unpackNormal(data + i * layout.normal_bytes, format);
+	}
+	else if (memcmp(id, "UVS0", 4) == 0 || memcmp(id, "UVS1", 4) == 0)
+	{
+		std::vector<Vector2>& uvs = id[3] == '0' ? mesh.uvs : mesh.uvs1;
+		uvs.resize(count);
+		for (unsigned int i = 0; i < count; ++i)
+			uvs[i] = unpackUV(data + i * layout.uv_bytes, format);
+	}
+	else if (memcmp(id, "WGHT", 4) == 0)
+	{
+		mesh.weights.resize(count);
+		for (unsigned int i = 0; i < count; ++i)
+			mesh.weights[i].set(data[i * 4] / 255.0f, data[i * 4 + 1] / 255.0f, data[i * 4 + 2] / 255.0f, data[i * 4 + 3] / 255.0f);
+	}
+	else if (memcmp(id, "INDX", 4) == 0 || memcmp(id, "LODI", 4) == 0)
+	{
+		std::vector<Vector3u>& triangles = id[0] == 'I' ? mesh.indices : mesh.lod_indices;
+		triangles.resize(count);
+		const unsigned short* src = (const unsigned short*)data;
+		for (unsigned int i = 0; i < count; ++i)
+			triangles[i].set(src[i * 3], src[i * 3 + 1], src[i * 3 + 2]);
+	}
+}
+
+int Mesh::getSupportedVertexFormat(int format)
+{
+	if (getNumVertices() > 65536 || !getNumIndices())
+		format &= ~VF_INDICES_16;
+	return format;
 }
 
 int vertex_location = -1;
@@ -98,29 +420,43 @@ void Mesh::enableBuffers(Shader* sh)
 	if (vertex_location == -1)
 		return;
 
+	//streams in RAM are always floats, the ones in VRAM use the vertex_format
+	int format = (vertices_vbo_id || interleaved_vbo_id) ? vertex_format : VF_FLOAT;
+	sVertexLayout layout = getVertexLayout(format);
+
 	int spacing = 0;
 	int offset_normal = 0;
 	int offset_uv = 0;
 
-	if (interleaved.size())
+	if (interleaved.size() || interleaved_vbo_id)
 	{
-		spacing = sizeof(tInterleaved);
-		offset_normal = sizeof(Vector3);
-		offset_uv = sizeof(Vector3) + sizeof(Vector3);
+		spacing = interleaved_vbo_id ? layout.stride : sizeof(tInterleaved);
+		offset_normal = interleaved_vbo_id ? layout.position_bytes : sizeof(Vector3);
+		offset_uv = interleaved_vbo_id ? layout.position_bytes + layout.normal_bytes : sizeof(Vector3) + sizeof(Vector3);
 	}
 
+	//dequantization, shaders without these uniforms only work with VF_FLOAT meshes
+	Vector3 quantization_offset = (format & VF_POSITION_16) ? vertex_offset : Vector3(0, 0, 0);
+	Vector3 quantization_scale = (format & VF_POSITION_16) ? vertex_scale : Vector3(1, 1, 1);
+	sh->setUniform(u_vertex_offset, quantization_offset);
+	sh->setUniform(u_vertex_scale, quantization_scale);
+	sh->setUniform(u_oct_normals, (format & VF_NORMAL_OCT) != 0);
+
 	glEnableVertexAttribArray(vertex_location);
 
 	if (vertices_vbo_id || interleaved_vbo_id)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : vertices_vbo_id);
-		glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, 0);
+		GLState::bindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : vertices_vbo_id);
+		if (format & VF_POSITION_16)
+			glVertexAttribPointer(vertex_location, 3, GL_UNSIGNED_SHORT, GL_TRUE, spacing ? spacing : layout.position_bytes, 0);
+		else
+			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, 0);
 	}
 	else
 		glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].vertex : &vertices[0]);
 
 	normal_location = -1;
-	if (normals.size() || spacing)
+	if (normals.size() || normals_vbo_id || spacing)
 	{
 		normal_location = sh->getAttribLocation("a_normal");
 		if (normal_location != -1)
@@ -128,8 +464,11 @@ void Mesh::enableBuffers(Shader* sh)
 			glEnableVertexAttribArray(normal_location);
 			if (normals_vbo_id || interleaved_vbo_id)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
-				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
+				GLState::bindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
+				if (format & VF_NORMAL_OCT)
+					glVertexAttribPointer(normal_location, 2, GL_SHORT, GL_TRUE, spacing ? spacing : layout.normal_bytes, (void*)offset_normal);
+				else
+					glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
 			}
 			else
 				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].normal : &normals[0]);
@@ -137,7 +476,7 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	uv_location = -1;
-	if (uvs.size() || spacing)
+	if (uvs.size() || uvs_vbo_id || spacing)
 	{
 		uv_location = sh->getAttribLocation("a_uv");
 		if (uv_location != -1)
@@ -145,8 +484,11 @@ void Mesh::enableBuffers(Shader* sh)
 			glEnableVertexAttribArray(uv_location);
 			if (uvs_vbo_id || interleaved_vbo_id)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
-				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
+				GLState::bindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
+				if (format & VF_UV_16)
+					glVertexAttribPointer(uv_location, 2, GL_HALF_FLOAT, GL_FALSE, spacing ? spacing : layout.uv_bytes, (void*)offset_uv);
+				else
+					glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
 			}
 			else
 				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].uv : &uvs[0]);
@@ -154,24 +496,24 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	uv1_location = -1;
-	if (uvs1.size() || spacing)
+	if (uvs1.size() || uvs1_vbo_id)
 	{
 		uv1_location = sh->getAttribLocation("a_uv1");
 		if (uv1_location != -1)
 		{
 			glEnableVertexAttribArray(uv1_location);
-			if (uvs1_vbo_id)
+			if (uvs1_vbo_id) //uvs1 are never interleaved
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, uvs1_vbo_id);
-				glVertexAttribPointer(uv1_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)0);
+				GLState::bindBuffer(GL_ARRAY_BUFFER, uvs1_vbo_id);
+				glVertexAttribPointer(uv1_location, 2, (format & VF_UV_16) ? GL_HALF_FLOAT : GL_FLOAT, GL_FALSE, 0, (void*)0);
 			}
 			else
-				glVertexAttribPointer(uv1_location, 2, GL_FLOAT, GL_FALSE, spacing, &uvs1[0]);
+				glVertexAttribPointer(uv1_location, 2, GL_FLOAT, GL_FALSE, 0, &uvs1[0]);
 		}
 	}
 
 	color_location = -1;
-	if (colors.size())
+	if (colors.size() || colors_vbo_id)
 	{
 		color_location = sh->getAttribLocation("a_color");
 		if (color_location != -1)
@@ -179,7 +521,7 @@ void Mesh::enableBuffers(Shader* sh)
 			glEnableVertexAttribArray(color_location);
 			if (colors_vbo_id)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, colors_vbo_id);
+				GLState::bindBuffer(GL_ARRAY_BUFFER, colors_vbo_id);
 				glVertexAttribPointer(color_location, 4, GL_FLOAT, GL_FALSE, 0, NULL);
 			}
 			else
@@ -188,7 +530,7 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	bones_location = -1;
-	if (bones.size())
+	if (bones.size() || bones_vbo_id)
 	{
 		bones_location = sh->getAttribLocation("a_bones");
 		if (bones_location != -1)
@@ -196,7 +538,7 @@ void Mesh::enableBuffers(Shader* sh)
 			glEnableVertexAttribArray(bones_location);
 			if (bones_vbo_id)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, bones_vbo_id);
+				GLState::bindBuffer(GL_ARRAY_BUFFER, bones_vbo_id);
 				glVertexAttribPointer(bones_location, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, NULL);
 			}
 			else
@@ -204,7 +546,7 @@ void Mesh::enableBuffers(Shader* sh)
 		}
 	}
 	weights_location = -1;
-	if (weights.size())
+	if (weights.size() || weights_vbo_id)
 	{
 		weights_location = sh->getAttribLocation("a_weights");
 		if (weights_location != -1)
@@ -212,8 +554,11 @@ void Mesh::enableBuffers(Shader* sh)
 			glEnableVertexAttribArray(weights_location);
 			if (weights_vbo_id)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, weights_vbo_id);
-				glVertexAttribPointer(weights_location, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+				GLState::bindBuffer(GL_ARRAY_BUFFER, weights_vbo_id);
+				if (format & VF_WEIGHTS_8)
+					glVertexAttribPointer(weights_location, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, NULL);
+				else
+					glVertexAttribPointer(weights_location, 4, GL_FLOAT, GL_FALSE, 0, NULL);
 			}
 			else
 				glVertexAttribPointer(weights_location, 4, GL_FLOAT, GL_FALSE, 0, &weights[0]);
@@ -222,63 +567,81 @@ void Mesh::enableBuffers(Shader* sh)
 
 }
 
-void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
+void Mesh::render(unsigned int primitive, int submesh_id, int num_instances, int lod)
 {
+	if (load_state != ASSET_READY) //still loading, it is empty until then
+		return;
+
 	Shader* shader = Shader::current;
 	if (!shader || !shader->compiled)
 	{
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	assert(getNumVertices() && "No vertices in this mesh");
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 
 	//draw call
-	drawCall(primitive, submesh_id, num_instances);
+	drawCall(primitive, submesh_id, num_instances, lod);
 
 	//unbind them
 	disableBuffers(shader);
 }
 
-void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
+void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances, int lod)
 {
 	int start = 0; //in primitives
-	int size = (int)vertices.size();
-	if (indices.size())
-		size = (int)indices.size();
-	else if (interleaved.size())
-		size = (int)interleaved.size();
+	bool indexed = indices.size() || indices_vbo_id;
+	int size = indexed ? (int)getNumIndices() : (int)getNumVertices();
 
 	if (submesh_id > -1)
 	{
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
+	}
+
+	//simplified triangles, they are in their own index buffer
+	unsigned int index_vbo_id = indices_vbo_id;
+	const Vector3u* index_data = indices.size() ? &indices[0] : NULL;
+	const sMeshLOD* lod_info = (indexed && lod > 0) ? findLOD(lod, submesh_id) : NULL;
+	if (lod_info)
+	{
+		start = lod_info->start;
+		size = lod_info->length;
+		index_vbo_id = lod_indices_vbo_id;
+		index_data = lod_indices.size() ? &lod_indices[0] : NULL;
 	}
 
 	//DRAW
-	if (indices.size())
+	if (indexed)
 	{
 		if (num_instances > 0)
 		{
-			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3)), num_instances);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			assert(index_vbo_id && "indices must be uploaded to the GPU");
+			GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_vbo_id);
+			if (vertex_format & VF_INDICES_16)
+				glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_SHORT, (void*)(start * sizeof(unsigned short) * 3), num_instances);
+			else
+				glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)), num_instances);
+			GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
 		{
-			if (indices_vbo_id)
+			if (index_vbo_id)
 			{
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)));
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+				GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_vbo_id);
+				if (vertex_format & VF_INDICES_16)
+					glDrawElements(primitive, size * 3, GL_UNSIGNED_SHORT, (void*)(start * sizeof(unsigned short) * 3));
+				else
+					glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)));
+				GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 			}
 			else
-				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(&indices[0] + start)); //no multiply, its a vector3u pointer)
+				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(index_data + start)); //no multiply, its a vector3u pointer)
 		}
 	}
 	else
@@ -289,7 +652,102 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 			glDrawArrays(primitive, start, size);
 	}
 
-	num_triangles_rendered += (size / 3) * (num_instances ? num_instances : 1);
+	num_triangles_rendered += (indexed ? size : size / 3) * (num_instances ? num_instances : 1);
+	num_meshes_rendered++;
+}
+
+void Mesh::renderCulled(unsigned int primitive, const Matrix44& model, Camera* camera, bool cull_backfaces, int submesh_id, int lod)
+{
+	if (load_state != ASSET_READY)
+		return;
+
+	//without meshlets or index buffer there is nothing to skip, LODs are used far away where the meshlets would be tiny
+	if (!cull_meshlets || !meshlets.size() || !indices_vbo_id || !camera || (lod > 0 && findLOD(lod, submesh_id)))
+	{
+		render(primitive, submesh_id, 0, lod);
+		return;
+	}
+
+	Shader* shader = Shader::current;
+	if (!shader || !shader->compiled)
+	{
+		assert(0 && "no shader or shader not compiled or enabled");
+		return;
+	}
+
+	unsigned int first = 0;
+	unsigned int last = getNumIndices(); //in triangles
+	if (submesh_id > -1)
+	{
+		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
+		first = submeshes[submesh_id].start;
+		last = first + submeshes[submesh_id].length;
+	}
+
+	//the culling is done in world space, the radius grows with the biggest scale of the model
+	float scale = (float)std::max(Vector3(model.m[0], model.m[1], model.m[2]).length(), std::max(Vector3(model.m[4], model.m[5], model.m[6]).length(), Vector3(model.m[8], model.m[9], model.m[10]).length()));
+	Vector3 camera_front = (camera->center - camera->eye).normalize();
+	bool orthographic = camera->type == Camera::ORTHOGRAPHIC;
+
+	//visible ranges, contiguous meshlets go in the same range
+	static std::vector<GLsizei> counts;
+	static std::vector<const void*> offsets;
+	counts.clear();
+	offsets.clear();
+	int index_size = (vertex_format & VF_INDICES_16) ? sizeof(unsigned short) : sizeof(unsigned int);
+	unsigned int range_end = 0xFFFFFFFF;
+	unsigned int num_triangles = 0;
+	for (size_t i = 0; i < meshlets.size(); ++i)
+	{
+		const sMeshlet& meshlet = meshlets[i];
+		if (meshlet.start < first || meshlet.start >= last)
+			continue;
+
+		Vector3 center = model * Vector3(meshlet.center[0], meshlet.center[1], meshlet.center[2]);
+		float radius = meshlet.radius * scale;
+		bool visible = camera->testSphereInFrustum(center, radius) != CLIP_OUTSIDE;
+
+		//all the triangles face away from the camera
+		if (visible && cull_backfaces && meshlet.cone_cutoff < 1.0f)
+		{
+			Vector3 axis = model.rotateVector(Vector3(meshlet.cone_axis[0], meshlet.cone_axis[1], meshlet.cone_axis[2])).normalize();
+			if (orthographic)
+				visible = camera_front.dot(axis) < meshlet.cone_cutoff;
+			else
+			{
+				Vector3 to_center = center - camera->eye;
+				visible = to_center.dot(axis) < meshlet.cone_cutoff * to_center.length() + radius;
+			}
+		}
+
+		if (!visible)
+		{
+			num_meshlets_culled++;
+			continue;
+		}
+		num_meshlets_rendered++;
+		num_triangles += meshlet.length;
+
+		if (meshlet.start == range_end)
+			counts.back() += meshlet.length * 3;
+		else
+		{
+			counts.push_back(meshlet.length * 3);
+			offsets.push_back((const void*)((size_t)meshlet.start * 3 * index_size));
+		}
+		range_end = meshlet.start + meshlet.length;
+	}
+
+	if (!counts.size())
+		return;
+
+	enableBuffers(shader);
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+	glMultiDrawElements(primitive, &counts[0], index_size == sizeof(unsigned short) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, (const void**)&offsets[0], (GLsizei)counts.size());
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	disableBuffers(shader);
+
+	num_triangles_rendered += num_triangles;
 	num_meshes_rendered++;
 }
 
@@ -302,15 +760,16 @@ void Mesh::disableBuffers(Shader* shader)
 	if (color_location != -1) glDisableVertexAttribArray(color_location);
 	if (bones_location != -1) glDisableVertexAttribArray(bones_location);
 	if (weights_location != -1) glDisableVertexAttribArray(weights_location);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
+	GLState::bindBuffer(GL_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
 }
 
 GLuint instances_buffer_id = 0;
+GLuint instance_materials_buffer_id = 0;
 
 //should be faster but in some system it is slower
-void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
+void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances, int submesh_id, int lod, const float* instanced_material_ids)
 {
-	if (!num_instances)
+	if (!num_instances || load_state != ASSET_READY)
 		return;
 
 	Shader* shader = Shader::current;
@@ -318,7 +777,7 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 
 	if (instances_buffer_id == 0)
 		glGenBuffersARB(1, &instances_buffer_id);
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
+	GLState::bindBuffer(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
 	glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
 
 	int attribLocation = shader->getAttribLocation("u_model");
@@ -336,8 +795,23 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 		glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
 	}
 
+	//row + 1 of the material of every instance in TextureArray::material_table, the current value is undefined after using an array
+	int materialLocation = shader->getAttribLocation("a_material_id");
+	if (materialLocation != -1 && instanced_material_ids)
+	{
+		if (instance_materials_buffer_id == 0)
+			glGenBuffersARB(1, &instance_materials_buffer_id);
+		GLState::bindBuffer(GL_ARRAY_BUFFER_ARB, instance_materials_buffer_id);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(float), instanced_material_ids, GL_STREAM_DRAW_ARB);
+		glEnableVertexAttribArray(materialLocation);
+		glVertexAttribPointer(materialLocation, 1, GL_FLOAT, false, sizeof(float), 0);
+		glVertexAttribDivisor(materialLocation, 1);
+	}
+	else if (materialLocation != -1)
+		glVertexAttrib1f(materialLocation, 0.0f);
+
 	//regular render
-	render(primitive, 0, num_instances);
+	render(primitive, submesh_id, num_instances, lod);
 
 	//disable instanced attribs
 	for (int k = 0; k < 4; ++k)
@@ -345,6 +819,11 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 		glDisableVertexAttribArray(attribLocation + k);
 		glVertexAttribDivisor(attribLocation + k, 0);
 	}
+	if (materialLocation != -1 && instanced_material_ids)
+	{
+		glDisableVertexAttribArray(materialLocation);
+		glVertexAttribDivisor(materialLocation, 0);
+	}
 }
 
 //super obsolete rendering method, do not use
@@ -360,7 +839,7 @@ void Mesh::renderFixedPipeline(int primitive)
 
 	if (vertices_vbo_id || interleaved_vbo_id)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, interleave_offset ? interleaved_vbo_id : vertices_vbo_id);
+		GLState::bindBuffer(GL_ARRAY_BUFFER, interleave_offset ? interleaved_vbo_id : vertices_vbo_id);
 		glVertexPointer(3, GL_FLOAT, interleave_offset, 0);
 	}
 	else
@@ -371,7 +850,7 @@ void Mesh::renderFixedPipeline(int primitive)
 		glEnableClientState(GL_NORMAL_ARRAY);
 		if (normals_vbo_id || interleaved_vbo_id)
 		{
-			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
+			GLState::bindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
 			glNormalPointer(GL_FLOAT, interleave_offset, (void*)offset_normal);
 		}
 		else
@@ -383,7 +862,7 @@ void Mesh::renderFixedPipeline(int primitive)
 		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 		if (uvs_vbo_id || interleaved_vbo_id)
 		{
-			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
+			GLState::bindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
 			glTexCoordPointer(2, GL_FLOAT, interleave_offset, (void*)offset_uv);
 		}
 		else
@@ -395,7 +874,7 @@ void Mesh::renderFixedPipeline(int primitive)
 		glEnableClientState(GL_COLOR_ARRAY);
 		if (colors_vbo_id)
 		{
-			glBindBuffer(GL_ARRAY_BUFFER, colors_vbo_id);
+			GLState::bindBuffer(GL_ARRAY_BUFFER, colors_vbo_id);
 			glColorPointer(4, GL_FLOAT, 0, NULL);
 		}
 		else
@@ -414,7 +893,7 @@ void Mesh::renderFixedPipeline(int primitive)
 		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 	if (colors.size())
 		glDisableClientState(GL_COLOR_ARRAY);
-	glBindBuffer(GL_ARRAY_BUFFER, 0); //if it crashes, comment this line
+	GLState::bindBuffer(GL_ARRAY_BUFFER, 0); //if it crashes, comment this line
 }
 
 /*
@@ -434,6 +913,28 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 }
 */
 
+static void uploadBuffer(unsigned int& vbo_id, unsigned int target, const void* data, size_t bytes)
+{
+	if (vbo_id == 0)
+		glGenBuffersARB(1, &vbo_id);
+	GLState::bindBuffer(target, vbo_id);
+	glBufferDataARB(target, bytes, data, GL_STATIC_DRAW_ARB);
+}
+
+//uploads a stream converting it to the vertex format if it affects it, returns the bytes used in VRAM
+static size_t uploadStream(Mesh& mesh, const char* id, unsigned int& vbo_id, unsigned int target, const void* data, size_t bytes)
+{
+	if (!(mesh.vertex_format & getStreamFormatFlags(id)))
+	{
+		uploadBuffer(vbo_id, target, data, bytes);
+		return bytes;
+	}
+	std::vector<unsigned char> packed;
+	packStream(mesh, id, mesh.vertex_format, mesh.vertex_offset, mesh.vertex_scale, packed);
+	uploadBuffer(vbo_id, target, &packed[0], packed.size());
+	return packed.size();
+}
+
 void Mesh::uploadToVRAM()
 {
 	assert(vertices.size() || interleaved.size());
@@ -444,87 +945,56 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
+	vertex_format = getSupportedVertexFormat(vertex_format);
+	if (vertex_format & VF_POSITION_16)
+		getQuantization(box, vertex_offset, vertex_scale);
+	vram_bytes = 0;
+	if (!uv_density)
+		updateUVDensity();
+
 	if (interleaved.size())
 	{
 		// Vertex,Normal,UV
-		if (interleaved_vbo_id == 0)
-			glGenBuffersARB(1, &interleaved_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
+		vram_bytes += uploadStream(*this, "INTR", interleaved_vbo_id, GL_ARRAY_BUFFER_ARB, &interleaved[0], interleaved.size() * sizeof(tInterleaved));
 	}
 	else
 	{
 		// Vertices
-		if (vertices_vbo_id == 0)
-			glGenBuffersARB(1, &vertices_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(Vector3), &vertices[0], GL_STATIC_DRAW_ARB);
+		vram_bytes += uploadStream(*this, "VERT", vertices_vbo_id, GL_ARRAY_BUFFER_ARB, &vertices[0], vertices.size() * sizeof(Vector3));
 
 		// UVs
 		if (uvs.size())
-		{
-			if (uvs_vbo_id == 0)
-				glGenBuffersARB(1, &uvs_vbo_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2), &uvs[0], GL_STATIC_DRAW_ARB);
-		}
+			vram_bytes += uploadStream(*this, "UVS0", uvs_vbo_id, GL_ARRAY_BUFFER_ARB, &uvs[0], uvs.size() * sizeof(Vector2));
 
 		// Normals
 		if (normals.size())
-		{
-			if (normals_vbo_id == 0)
-				glGenBuffersARB(1, &normals_vbo_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3), &normals[0], GL_STATIC_DRAW_ARB);
-		}
+			vram_bytes += uploadStream(*this, "NORM", normals_vbo_id, GL_ARRAY_BUFFER_ARB, &normals[0], normals.size() * sizeof(Vector3));
 	}
 
 	// UVs
 	if (uvs1.size())
-	{
-		if (uvs1_vbo_id == 0)
-			glGenBuffersARB(1, &uvs1_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs1_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs1.size() * sizeof(Vector2), &uvs1[0], GL_STATIC_DRAW_ARB);
-	}
+		vram_bytes += uploadStream(*this, "UVS1", uvs1_vbo_id, GL_ARRAY_BUFFER_ARB, &uvs1[0], uvs1.size() * sizeof(Vector2));
 
 	// Colors
 	if (colors.size())
-	{
-		if (colors_vbo_id == 0)
-			glGenBuffersARB(1, &colors_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, colors_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(Vector4), &colors[0], GL_STATIC_DRAW_ARB);
-	}
+		vram_bytes += uploadStream(*this, "COLR", colors_vbo_id, GL_ARRAY_BUFFER_ARB, &colors[0], colors.size() * sizeof(Vector4));
 
 	if (bones.size())
-	{
-		if (bones_vbo_id == 0)
-			glGenBuffersARB(1, &bones_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(Vector4ub), &bones[0], GL_STATIC_DRAW_ARB);
-	}
+		vram_bytes += uploadStream(*this, "BONE", bones_vbo_id, GL_ARRAY_BUFFER_ARB, &bones[0], bones.size() * sizeof(Vector4ub));
 	if (weights.size())
-	{
-		if (weights_vbo_id == 0)
-			glGenBuffersARB(1, &weights_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, weights_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, weights.size() * sizeof(Vector4), &weights[0], GL_STATIC_DRAW_ARB);
-	}
+		vram_bytes += uploadStream(*this, "WGHT", weights_vbo_id, GL_ARRAY_BUFFER_ARB, &weights[0], weights.size() * sizeof(Vector4));
 
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+	GLState::bindBuffer(GL_ARRAY_BUFFER_ARB, 0);
 
 	// Indices
 	if (indices.size())
-	{
-		if (indices_vbo_id == 0)
-			glGenBuffersARB(1, &indices_vbo_id);
-		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(Vector3u), &indices[0], GL_STATIC_DRAW_ARB);
-	}
-	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
-
+		vram_bytes += uploadStream(*this, "INDX", indices_vbo_id, GL_ELEMENT_ARRAY_BUFFER, &indices[0], indices.size() * sizeof(Vector3u));
+	if (lod_indices.size())
+		vram_bytes += uploadStream(*this, "LODI", lod_indices_vbo_id, GL_ELEMENT_ARRAY_BUFFER, &lod_indices[0], lod_indices.size() * sizeof(Vector3u));
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+	num_vertices_vram = getNumVertices();
+	num_indices_vram = (unsigned int)indices.size();
 
 	checkGLErrors();
 
@@ -536,6 +1006,17 @@ bool Mesh::createCollisionModel(bool is_static)
 	if (collision_model)
 		return true;
 
+	//the geometry only lives in VRAM, reload it from the binary just to build the collision model
+	if (!hasCPUData() && bin_filename.size())
+	{
+		Mesh temp;
+		if (!temp.readBin(bin_filename.c_str()) || !temp.createCollisionModel(is_static))
+			return false;
+		this->collision_model = temp.collision_model;
+		temp.collision_model = NULL;
+		return true;
+	}
+
 	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
 
 	if (indices.size()) //indexed
@@ -673,6 +1154,186 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
+template<typename T>
+static void remapStream(std::vector<T>& container, const std::vector<unsigned int>& remap)
+{
+	if (container.size() != remap.size())
+		return;
+	std::vector<T> old_container(container);
+	for (size_t i = 0; i < remap.size(); ++i)
+		container[remap[i]] = old_container[i];
+}
+
+static bool hasValidSubmeshRanges(const std::vector<sSubmeshInfo>& submeshes, size_t num_triangles)
+{
+	if (!submeshes.size())
+		return false;
+	for (size_t i = 0; i < submeshes.size(); ++i)
+		if (submeshes[i].start < 0 || submeshes[i].length < 0 || submeshes[i].start + submeshes[i].length > (int)num_triangles)
+			return false;
+	return true;
+}
+
+bool Mesh::optimize(sVertexCacheStats* before, sVertexCacheStats* after)
+{
+	size_t num_vertices = interleaved.size() ? interleaved.size() : vertices.size();
+	if (!indices.size() || !num_vertices)
+		return false;
+
+	unsigned int* index_data = (unsigned int*)&indices[0];
+	size_t num_indices = indices.size() * 3;
+	const float* positions = interleaved.size() ? interleaved[0].vertex.v : vertices[0].v;
+	size_t positions_stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3);
+
+	if (before)
+		*before = computeVertexCacheStats(index_data, num_indices, num_vertices);
+
+	//every submesh on its own so the triangles do not leave its range
+	bool ranges_valid = hasValidSubmeshRanges(submeshes, indices.size());
+	if (ranges_valid)
+		for (size_t i = 0; i < submeshes.size(); ++i)
+		{
+			unsigned int* submesh_indices = index_data + submeshes[i].start * 3;
+			optimizeVertexCache(submesh_indices, submeshes[i].length * 3, num_vertices);
+			optimizeOverdraw(submesh_indices, submeshes[i].length * 3, positions, positions_stride, num_vertices);
+		}
+	else
+	{
+		optimizeVertexCache(index_data, num_indices, num_vertices);
+		optimizeOverdraw(index_data, num_indices, positions, positions_stride, num_vertices);
+	}
+
+	//the meshlets keep the order of the cache optimization inside every cluster
+	if (build_meshlets)
+		buildMeshlets();
+
+	std::vector<unsigned int> remap;
+	optimizeVertexFetch(index_data, num_indices, num_vertices, remap);
+	remapStream(interleaved, remap);
+	remapStream(vertices, remap);
+	remapStream(normals, remap);
+	remapStream(uvs, remap);
+	remapStream(uvs1, remap);
+	remapStream(colors, remap);
+	remapStream(bones, remap);
+	remapStream(weights, remap);
+
+	if (after)
+		*after = computeVertexCacheStats(index_data, num_indices, num_vertices);
+	return true;
+}
+
+bool Mesh::buildMeshlets()
+{
+	size_t num_vertices = interleaved.size() ? interleaved.size() : vertices.size();
+	if (!indices.size() || !num_vertices)
+		return false;
+
+	unsigned int* index_data = (unsigned int*)&indices[0];
+	const float* positions = interleaved.size() ? interleaved[0].vertex.v : vertices[0].v;
+	size_t positions_stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3);
+
+	meshlets.clear();
+	if (hasValidSubmeshRanges(submeshes, indices.size()))
+		for (size_t i = 0; i < submeshes.size(); ++i)
+		{
+			size_t first = meshlets.size();
+			::buildMeshlets(index_data + submeshes[i].start * 3, submeshes[i].length * 3, positions, positions_stride, num_vertices, meshlets);
+			for (size_t j = first; j < meshlets.size(); ++j)
+				meshlets[j].start += submeshes[i].start;
+		}
+	else
+		::buildMeshlets(index_data, indices.size() * 3, positions, positions_stride, num_vertices, meshlets);
+	return true;
+}
+
+bool Mesh::buildLODs(int levels)
+{
+	size_t num_vertices = interleaved.size() ? interleaved.size() : vertices.size();
+	if (!indices.size() || !num_vertices)
+		return false;
+
+	const float* positions = interleaved.size() ? interleaved[0].vertex.v : vertices[0].v;
+	size_t positions_stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3);
+
+	lods.clear();
+	lod_indices.clear();
+
+	//every submesh on its own, the whole mesh LOD is the range that contains all of them
+	bool per_submesh = hasValidSubmeshRanges(submeshes, indices.size());
+	int num_ranges = per_submesh ? (int)submeshes.size() : 1;
+	std::vector<sMeshLOD> previous(num_ranges); //every level simplifies the previous one (in lod_indices, or indices for the first one)
+	for (int i = 0; i < num_ranges; ++i)
+	{
+		previous[i].start = per_submesh ? submeshes[i].start : 0;
+		previous[i].length = per_submesh ? submeshes[i].length : (int)indices.size();
+		previous[i].error = 0;
+	}
+	std::vector<unsigned int> simplified;
+	int previous_length = (int)indices.size();
+	for (int level = 1; level <= levels; ++level)
+	{
+		size_t level_lods = lods.size();
+		sMeshLOD whole = { level, -1, (int)lod_indices.size(), 0, 0.0f };
+		for (int i = 0; i < num_ranges; ++i)
+		{
+			const unsigned int* source = (const unsigned int*)(level == 1 ? &indices[0] : &lod_indices[0]) + previous[i].start * 3;
+			int length = previous[i].length;
+			simplified.resize(length * 3);
+			float error = 0; //relative to the submesh radius, so never smaller than relative to the mesh one
+			size_t count = length ? simplifyMesh(&simplified[0], source, length * 3, positions, positions_stride, num_vertices, (size_t)(length / 2) * 3, &error) : 0;
+			sMeshLOD lod = { level, i, (int)lod_indices.size(), (int)(count / 3), std::max(error, previous[i].error) };
+			lod_indices.resize(lod_indices.size() + lod.length);
+			for (int t = 0; t < lod.length; ++t)
+				lod_indices[lod.start + t] = Vector3u(simplified[t * 3], simplified[t * 3 + 1], simplified[t * 3 + 2]);
+			if (per_submesh)
+				lods.push_back(lod);
+			previous[i] = lod;
+			whole.error = std::max(whole.error, lod.error);
+		}
+		whole.length = (int)lod_indices.size() - whole.start;
+
+		//borders and seams cannot be removed, stop when a level is not much smaller than the previous one
+		if (whole.length > previous_length * 0.8f)
+		{
+			lods.resize(level_lods);
+			lod_indices.resize(whole.start);
+			break;
+		}
+		lods.push_back(whole);
+		previous_length = whole.length;
+	}
+	return lods.size() > 0;
+}
+
+const sMeshLOD* Mesh::findLOD(int level, int submesh_id)
+{
+	for (size_t i = 0; i < lods.size(); ++i)
+		if (lods[i].level == level && lods[i].submesh == submesh_id)
+			return &lods[i];
+	return NULL;
+}
+
+int Mesh::getNumLODs()
+{
+	int num = 1;
+	for (size_t i = 0; i < lods.size(); ++i)
+		num = std::max(num, lods[i].level + 1);
+	return num;
+}
+
+int Mesh::getLOD(float projected_radius, float bias)
+{
+	//the error of a LOD on screen is its relative error times the projected radius, the bias doubles the threshold every unit
+	float threshold = lod_threshold * powf(2.0f, bias);
+	int lod = 0;
+	for (size_t i = 0; i < lods.size(); ++i)
+		if (lods[i].submesh == -1 && lods[i].level > lod && lods[i].error * projected_radius <= threshold)
+			lod = lods[i].level;
+	return lod;
+}
+
+//MBIN v11, kept to read old files (they get upgraded when loaded)
 typedef struct 
 {
 	int version;
@@ -689,43 +1350,238 @@ typedef struct
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
 	char extra[32]; //unused
-} sMeshInfo;
+} sMeshInfoV11;
 
-bool Mesh::readBin(const char* filename)
-{
-	FILE *f;
-	assert(filename);
+#define MESH_BIN_MAX_STREAMS 16
+#define MESH_BIN_ALIGNMENT 16 //every stream starts at a multiple of this (from the beginning of the file)
 
-	struct stat stbuffer;
+struct sMeshBinStream
+{
+	char id[4];	//INTR,VERT,NORM,UVS0,UVS1,COLR,INDX,BONE,WGHT,BINF,SUBM,MSHL,LODI,LODS
+	unsigned int offset; //from the beginning of the file
+	unsigned int bytes;
+	unsigned int count; //num elements
+};
 
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
-		return false;
+typedef struct 
+{
+	int version;
+	int header_bytes;
+	int size;
+	int num_indices;
+	Vector3 aabb_min;
+	Vector3	aabb_max;
+	Vector3	center;
+	Vector3	halfsize;
+	float radius;
+	int num_bones;
+	int num_submeshes;
+	Matrix44 bind_matrix;
+	int num_streams;
+	int vertex_format; //eVertexFormat of the streams, positions are relative to center - halfsize
+	sMeshBinStream streams[MESH_BIN_MAX_STREAMS];
+} sMeshInfo;
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
+static bool isStream(const sMeshBinStream& stream, const char* id)
+{
+	return memcmp(stream.id, id, 4) == 0;
+}
+
+template<typename T>
+static void loadStream(std::vector<T>& container, unsigned int* vbo_id, unsigned int target, const char* data, const sMeshBinStream& stream, bool only_vram)
+{
+	if (only_vram && vbo_id)
+	{
+		uploadBuffer(*vbo_id, target, data + stream.offset, stream.bytes);
+		return;
+	}
+	container.resize(stream.bytes / sizeof(T));
+	if (container.size())
+		memcpy((void*)&container[0], data + stream.offset, container.size() * sizeof(T));
+}
+
+bool Mesh::readBin(const char* filename)
+{
+	assert(filename);
+
+	MappedFile file;
+	if (!file.open(filename))
+		return false;
 
 	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+	if (file.size < 8 || memcmp(file.data, "MBIN", 4) != 0)
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
 		return false;
 	}
 
-	char* pos = data + 4;
-	sMeshInfo info;
-	memcpy(&info,pos,sizeof(sMeshInfo));
-	pos += sizeof(sMeshInfo);
+	int version = 0;
+	memcpy(&version, file.data + 4, sizeof(int));
+
+	//old format: it goes through the same steps as an imported mesh (see loadFile) and is written again in the current one
+	if (version == 11)
+	{
+		bool loaded = readBinLegacy(file.data, file.size);
+		file.close();
+		if (!loaded)
+		{
+			std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+			return false;
+		}
+		if (optimize_meshes && indices.size())
+			optimize();
+		if (lod_levels > 0)
+			buildLODs(lod_levels);
+		if (interleave_meshes && interleaved.size() == 0)
+			interleaveBuffers();
+		std::string base_filename = filename;
+		if (base_filename.size() > 5 && base_filename.substr(base_filename.size() - 5) == ".mbin")
+		{
+			std::cout << "[UPGRADE BIN] ";
+			writeBin(base_filename.substr(0, base_filename.size() - 5).c_str());
+		}
+		bin_filename = filename;
+		return true;
+	}
+
+	return readBin(file, filename, false);
+}
 
-	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
+//the header of a file in the current version, false if it is not one
+static bool readBinInfo(const MappedFile& file, const char* filename, sMeshInfo& info)
+{
+	if (file.size < 4 + sizeof(sMeshInfo))
+	{
+		std::cout << "[ERROR] loading BIN: file too small: " << filename << std::endl;
+		return false;
+	}
+	memcpy(&info, file.data + 4, sizeof(sMeshInfo));
+
+	if (info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) || info.num_streams > MESH_BIN_MAX_STREAMS)
 	{
 		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
 		return false;
 	}
 
+	for (int i = 0; i < info.num_streams; ++i)
+		if ((size_t)info.streams[i].offset + info.streams[i].bytes > file.size)
+		{
+			std::cout << "[ERROR] loading BIN: stream out of bounds: " << filename << std::endl;
+			return false;
+		}
+	return true;
+}
+
+bool Mesh::readBin(const MappedFile& file, const char* filename, bool only_vram)
+{
+	sMeshInfo info;
+	if (!readBinInfo(file, filename, info))
+		return false;
+
+	Vector3 quantization_offset, quantization_scale;
+	BoundingBox info_box;
+	info_box.center = info.center;
+	info_box.halfsize = info.halfsize;
+	getQuantization(info_box, quantization_offset, quantization_scale);
+
+	for (int i = 0; i < info.num_streams; ++i)
+	{
+		const sMeshBinStream& stream = info.streams[i];
+		if (info.vertex_format & getStreamFormatFlags(stream.id)) //compact stream
+		{
+			if (!only_vram)
+				unpackStream(*this, stream.id, (const unsigned char*)file.data + stream.offset, stream.count, info.vertex_format, quantization_offset, quantization_scale);
+			else if (isStream(stream, "INTR"))
+				uploadBuffer(interleaved_vbo_id, GL_ARRAY_BUFFER_ARB, file.data + stream.offset, stream.bytes);
+			else if (isStream(stream, "VERT"))
+				uploadBuffer(vertices_vbo_id, GL_ARRAY_BUFFER_ARB, file.data + stream.offset, stream.bytes);
+			else if (isStream(stream, "NORM"))
+				uploadBuffer(normals_vbo_id, GL_ARRAY_BUFFER_ARB, file.data + stream.offset, stream.bytes);
+			else if (isStream(stream, "UVS0"))
+				uploadBuffer(uvs_vbo_id, GL_ARRAY_BUFFER_ARB, file.data + stream.offset, stream.bytes);
+			else if (isStream(stream, "UVS1"))
+				uploadBuffer(uvs1_vbo_id, GL_ARRAY_BUFFER_ARB, file.data + stream.offset, stream.bytes);
+			else if (isStream(stream, "WGHT"))
+				uploadBuffer(weights_vbo_id, GL_ARRAY_BUFFER_ARB, file.data + stream.offset, stream.bytes);
+			else if (isStream(stream, "INDX"))
+				uploadBuffer(indices_vbo_id, GL_ELEMENT_ARRAY_BUFFER, file.data + stream.offset, stream.bytes);
+			else if (isStream(stream, "LODI"))
+				uploadBuffer(lod_indices_vbo_id, GL_ELEMENT_ARRAY_BUFFER, file.data + stream.offset, stream.bytes);
+		}
+		else if (isStream(stream, "INTR"))
+			loadStream(interleaved, &interleaved_vbo_id, GL_ARRAY_BUFFER_ARB, file.data, stream, only_vram);
+		else if (isStream(stream, "VERT"))
+			loadStream(vertices, &vertices_vbo_id, GL_ARRAY_BUFFER_ARB, file.data, stream, only_vram);
+		else if (isStream(stream, "NORM"))
+			loadStream(normals, &normals_vbo_id, GL_ARRAY_BUFFER_ARB, file.data, stream, only_vram);
+		else if (isStream(stream, "UVS0"))
+			loadStream(uvs, &uvs_vbo_id, GL_ARRAY_BUFFER_ARB, file.data, stream, only_vram);
+		else if (isStream(stream, "UVS1"))
+			loadStream(uvs1, &uvs1_vbo_id, GL_ARRAY_BUFFER_ARB, file.data, stream, only_vram);
+		else if (isStream(stream, "COLR"))
+			loadStream(colors, &colors_vbo_id, GL_ARRAY_BUFFER_ARB, file.data, stream, only_vram);
+		else if (isStream(stream, "BONE"))
+			loadStream(bones, &bones_vbo_id, GL_ARRAY_BUFFER_ARB, file.data, stream, only_vram);
+		else if (isStream(stream, "WGHT"))
+			loadStream(weights, &weights_vbo_id, GL_ARRAY_BUFFER_ARB, file.data, stream, only_vram);
+		else if (isStream(stream, "INDX"))
+			loadStream(indices, &indices_vbo_id, GL_ELEMENT_ARRAY_BUFFER, file.data, stream, only_vram);
+		else if (isStream(stream, "BINF")) //small, always in RAM
+			loadStream(bones_info, NULL, 0, file.data, stream, false);
+		else if (isStream(stream, "SUBM"))
+			loadStream(submeshes, NULL, 0, file.data, stream, false);
+		else if (isStream(stream, "MSHL"))
+			loadStream(meshlets, NULL, 0, file.data, stream, false);
+		else if (isStream(stream, "LODI"))
+			loadStream(lod_indices, &lod_indices_vbo_id, GL_ELEMENT_ARRAY_BUFFER, file.data, stream, only_vram);
+		else if (isStream(stream, "LODS"))
+			loadStream(lods, NULL, 0, file.data, stream, false);
+		else if (isStream(stream, "UVDN") && stream.bytes == sizeof(float))
+			memcpy(&uv_density, file.data + stream.offset, sizeof(float));
+	}
+
+	if (only_vram)
+	{
+		GLState::bindBuffer(GL_ARRAY_BUFFER_ARB, 0);
+		GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		num_vertices_vram = info.size;
+		num_indices_vram = info.num_indices;
+		vram_bytes = 0;
+		for (int i = 0; i < info.num_streams; ++i)
+			if (!isStream(info.streams[i], "BINF") && !isStream(info.streams[i], "SUBM") && !isStream(info.streams[i], "MSHL") && !isStream(info.streams[i], "LODS") && !isStream(info.streams[i], "UVDN"))
+				vram_bytes += info.streams[i].bytes;
+		checkGLErrors();
+	}
+
+	//the streams in VRAM keep the format of the file, the ones in RAM are floats again and will be packed when uploaded
+	vertex_format = info.vertex_format;
+	vertex_offset = quantization_offset;
+	vertex_scale = quantization_scale;
+
+	aabb_max = info.aabb_max;
+	aabb_min = info.aabb_min;
+	box.center = info.center;
+	box.halfsize = info.halfsize;
+	radius = info.radius;
+	bind_matrix = info.bind_matrix;
+	bin_filename = filename;
+
+	//collision model is created on demand (see createCollisionModel)
+	return true;
+}
+
+bool Mesh::readBinLegacy(const char* data, size_t size)
+{
+	const char* pos = data + 4;
+	sMeshInfoV11 info;
+	if (size < 4 + sizeof(sMeshInfoV11))
+		return false;
+	memcpy(&info,pos,sizeof(sMeshInfoV11));
+	pos += sizeof(sMeshInfoV11);
+
+	if(info.version != 11 || info.header_bytes != sizeof(sMeshInfoV11) )
+		return false;
+
 	if (info.streams[0] == 'I')
 	{
 		interleaved.resize(info.size);
@@ -781,13 +1637,7 @@ bool Mesh::readBin(const char* filename)
 		pos += sizeof(Vector4) * info.size;
 	}
 
-	if (info.streams[7] == 'u')
-	{
-		uvs1.resize(info.size);
-		memcpy((void*)&uvs1[0], pos, sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
-	}
-
+	//v11 writer stored bones_info before uvs1
 	if (info.num_bones)
 	{
 		bones_info.resize(info.num_bones);
@@ -795,6 +1645,13 @@ bool Mesh::readBin(const char* filename)
 		pos += sizeof(BoneInfo) * info.num_bones;
 	}
 
+	if (info.streams[7] == 'u')
+	{
+		uvs1.resize(info.size);
+		memcpy((void*)&uvs1[0], pos, sizeof(Vector2) * info.size);
+		pos += sizeof(Vector2) * info.size;
+	}
+
 	aabb_max = info.aabb_max;
 	aabb_min = info.aabb_min;
 	box.center = info.center;
@@ -803,11 +1660,11 @@ bool Mesh::readBin(const char* filename)
 	bind_matrix = info.bind_matrix;
 
 	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+	if (info.num_submeshes)
+		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
-	return true;
+	return (size_t)(pos - data) <= size;
 }
 
 bool Mesh::writeBin(const char* filename)
@@ -823,9 +1680,6 @@ bool Mesh::writeBin(const char* filename)
 		return false;
 	}
 
-	//watermark
-	fwrite("MBIN",sizeof(char),4,f);
-
 	sMeshInfo info;
 	memset(&info, 0, sizeof(info));
 	info.version = MESH_BIN_VERSION;
@@ -840,331 +1694,761 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	if (!uv_density)
+		updateUVDensity();
+	std::vector<float> uv_density_stream;
+	if (uv_density)
+		uv_density_stream.push_back(uv_density);
+
+	//build stream table
+	const void* streams_data[MESH_BIN_MAX_STREAMS];
+	#define ADD_STREAM(ID, CONTAINER) if (CONTAINER.size()) { \
+		sMeshBinStream& stream = info.streams[info.num_streams]; \
+		memcpy(stream.id, ID, 4); \
+		stream.count = (unsigned int)CONTAINER.size(); \
+		stream.bytes = (unsigned int)(CONTAINER.size() * sizeof(CONTAINER[0])); \
+		streams_data[info.num_streams++] = &CONTAINER[0]; }
+
+	ADD_STREAM("INTR", interleaved);
+	ADD_STREAM("VERT", vertices);
+	ADD_STREAM("NORM", normals);
+	ADD_STREAM("UVS0", uvs);
+	ADD_STREAM("UVS1", uvs1);
+	ADD_STREAM("COLR", colors);
+	ADD_STREAM("INDX", indices);
+	ADD_STREAM("BONE", bones);
+	ADD_STREAM("WGHT", weights);
+	ADD_STREAM("BINF", bones_info);
+	ADD_STREAM("SUBM", submeshes);
+	ADD_STREAM("MSHL", meshlets);
+	ADD_STREAM("LODI", lod_indices);
+	ADD_STREAM("LODS", lods);
+	ADD_STREAM("UVDN", uv_density_stream); //only the meshes with uvs have it
+	#undef ADD_STREAM
+
+	//compact streams, stored the same way they go to VRAM so they can be uploaded straight from the file
+	info.vertex_format = getSupportedVertexFormat(vertex_format);
+	Vector3 quantization_offset, quantization_scale;
+	getQuantization(box, quantization_offset, quantization_scale);
+	std::vector<unsigned char> packed[MESH_BIN_MAX_STREAMS];
+	for (int i = 0; i < info.num_streams; ++i)
+	{
+		if (!(info.vertex_format & getStreamFormatFlags(info.streams[i].id)))
+			continue;
+		packStream(*this, info.streams[i].id, info.vertex_format, quantization_offset, quantization_scale, packed[i]);
+		info.streams[i].bytes = (unsigned int)packed[i].size();
+		streams_data[i] = &packed[i][0];
+	}
+
+	unsigned int offset = 4 + sizeof(sMeshInfo);
+	for (int i = 0; i < info.num_streams; ++i)
+	{
+		offset = (offset + MESH_BIN_ALIGNMENT - 1) & ~(MESH_BIN_ALIGNMENT - 1);
+		info.streams[i].offset = offset;
+		offset += info.streams[i].bytes;
+	}
 
-	info.streams[0] = interleaved.size() ? 'I' : 'V';
-	info.streams[1] = normals.size() ? 'N' : ' ';
-	info.streams[2] = uvs.size() ? 'U' : ' ';
-	info.streams[3] = colors.size() ? 'C' : ' ';
-	info.streams[4] = indices.size() ? 'I' : ' ';
-	info.streams[5] = bones.size() ? 'B' : ' ';
-	info.streams[6] = weights.size() ? 'W' : ' ';
-	info.streams[7] = uvs1.size() ? 'u' : ' '; //uv second set
-
+	//watermark
+	fwrite("MBIN",sizeof(char),4,f);
 
 	//write info
 	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
 
 	//write streams
-	if (interleaved.size())
-		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
-	else
+	static const char padding[MESH_BIN_ALIGNMENT] = { 0 };
+	unsigned int pos = 4 + sizeof(sMeshInfo);
+	for (int i = 0; i < info.num_streams; ++i)
 	{
-		fwrite((void*)&vertices[0], vertices.size() * sizeof(Vector3), 1, f);
-		if (normals.size())
-			fwrite((void*)&normals[0], normals.size() * sizeof(Vector3), 1, f);
-		if (uvs.size())
-			fwrite((void*)&uvs[0], uvs.size() * sizeof(Vector2), 1, f);
+		fwrite(padding, info.streams[i].offset - pos, 1, f);
+		fwrite(streams_data[i], info.streams[i].bytes, 1, f);
+		pos = info.streams[i].offset + info.streams[i].bytes;
 	}
 
-	if (colors.size())
-		fwrite((void*)&colors[0], colors.size() * sizeof(Vector4), 1, f);
-
-	if (indices.size())
-		fwrite((void*)&indices[0], indices.size() * sizeof(Vector3u), 1, f);
-
-	if (bones.size())
-		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
-	if (weights.size())
-		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
-	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
-	if (uvs1.size())
-		fwrite((void*)&uvs1[0], uvs1.size() * sizeof(Vector2), 1, f);
-
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
-
 	fclose(f);
 	return true;
 }
 
+//hash table to find repeated vertices, the key is N ints (attribute indices or raw bits)
+template<int N>
+struct sVertexMap
+{
+	std::vector<int> keys;
+	std::vector<unsigned int> values;
+	unsigned int mask;
+	unsigned int count;
+
+	sVertexMap(size_t expected_elements)
+	{
+		size_t size = 1024;
+		while (size < expected_elements * 2)
+			size *= 2;
+		resize(size);
+	}
+
+	void resize(size_t size)
+	{
+		std::vector<int> old_keys;
+		std::vector<unsigned int> old_values;
+		old_keys.swap(keys);
+		old_values.swap(values);
+		keys.resize(size * N);
+		values.assign(size, 0xFFFFFFFF);
+		mask = (unsigned int)size - 1;
+		count = 0;
+		for (size_t i = 0; i < old_values.size(); ++i)
+			if (old_values[i] != 0xFFFFFFFF)
+				findOrAdd(&old_keys[i * N], old_values[i]);
+	}
+
+	//returns the index stored for the key, or stores new_index if it is not found
+	unsigned int findOrAdd(const int* key, unsigned int new_index)
+	{
+		if (count * 4 >= values.size() * 3)
+			resize(values.size() * 2);
+		unsigned int h = 2166136261u;
+		for (int j = 0; j < N; ++j)
+			h = (h ^ (unsigned int)key[j]) * 16777619u;
+		h ^= h >> 15;
+		for (unsigned int i = h & mask;; i = (i + 1) & mask)
+		{
+			if (values[i] == 0xFFFFFFFF)
+			{
+				memcpy(&keys[i * N], key, sizeof(int) * N);
+				values[i] = new_index;
+				count++;
+				return new_index;
+			}
+			if (memcmp(&keys[i * N], key, sizeof(int) * N) == 0)
+				return values[i];
+		}
+	}
+};
+
 bool Mesh::loadASE(const char* filename)
 {
-	int nVtx,nFcs;
-	int count;
-	int vId,aId,bId,cId;
-	float vtxX,vtxY,vtxZ;
-	float nX,nY,nZ;
-	TextParser t;
-	if (t.create(filename) == false)
+	std::string content;
+	if (!readFile(filename, content))
 		return false;
+	return parseASE(content.c_str(), content.size());
+}
 
-	t.seek("*MESH_NUMVERTEX");
-	nVtx = t.getint();
-	t.seek("*MESH_NUMFACES");
-	nFcs = t.getint();
-
-	normals.resize(nFcs*3);
-	vertices.resize(nFcs*3);
-	uvs.resize(nFcs*3);
+static inline bool isASEKeyword(const char* word, size_t len, const char* keyword, size_t keyword_len)
+{
+	return len == keyword_len && memcmp(word, keyword, len) == 0;
+}
+#define ASE_KEYWORD(K) isASEKeyword(word, len, K, sizeof(K) - 1)
 
+//streams the file once, it only reads the first GEOMOBJECT (as the previous parser did)
+bool Mesh::parseASE(const char* data, size_t size)
+{
 	std::vector<Vector3> unique_vertices;
-	unique_vertices.resize(nVtx);
+	std::vector<Vector2> unique_uvs;
+	std::vector<Vector3u> faces;
+	std::vector<Vector3u> tfaces;
+	std::vector<int> face_materials;
+	std::vector<Vector3> corner_normals;
+	int num_geomobjects = 0;
+	int normal_face = 0;
+	int normal_corner = 0;
+
+	const char* end = data + size;
+	const char* pos = data;
+	while (pos < end)
+	{
+		pos = (const char*)memchr(pos, '*', end - pos);
+		if (!pos)
+			break;
+		const char* word = ++pos;
+		while (pos < end && *pos > ' ')
+			pos++;
+		size_t len = pos - word;
+		if (len < 5)
+			continue;
+		pos = skipSpaces(pos);
+
+		if (ASE_KEYWORD("MESH_VERTEX"))
+		{
+			int id;
+			Vector3 v;
+			pos = parseInt(pos, id);
+			pos = parseFloat(skipSpaces(pos), v.x);
+			pos = parseFloat(skipSpaces(pos), v.y);
+			pos = parseFloat(skipSpaces(pos), v.z);
+			if (id >= 0 && id < (int)unique_vertices.size())
+				unique_vertices[id].set(-v.x, v.z, v.y);
+		}
+		else if (ASE_KEYWORD("MESH_FACE"))
+		{
+			int id, abc[3];
+			pos = parseInt(pos, id);
+			if (*pos == ':')
+				pos++;
+			for (int i = 0; i < 3; ++i) //A: B: C:
+			{
+				while (pos < end && *pos != ':') pos++;
+				pos = parseInt(skipSpaces(pos + 1), abc[i]);
+			}
+			if (id >= 0 && id < (int)faces.size())
+				faces[id] = Vector3u(abc[0], abc[1], abc[2]);
+			normal_face = id;
+		}
+		else if (ASE_KEYWORD("MESH_MTLID"))
+		{
+			int mat;
+			pos = parseInt(pos, mat);
+			if (normal_face >= 0 && normal_face < (int)face_materials.size())
+				face_materials[normal_face] = mat;
+		}
+		else if (ASE_KEYWORD("MESH_TVERT"))
+		{
+			int id;
+			Vector2 uv;
+			pos = parseInt(pos, id);
+			pos = parseFloat(skipSpaces(pos), uv.x);
+			pos = parseFloat(skipSpaces(pos), uv.y);
+			if (id >= 0 && id < (int)unique_uvs.size())
+				unique_uvs[id] = uv;
+		}
+		else if (ASE_KEYWORD("MESH_TFACE"))
+		{
+			int id, abc[3];
+			pos = parseInt(pos, id);
+			for (int i = 0; i < 3; ++i)
+				pos = parseInt(skipSpaces(pos), abc[i]);
+			if (id >= 0 && id < (int)tfaces.size())
+				tfaces[id] = Vector3u(abc[0], abc[1], abc[2]);
+		}
+		else if (ASE_KEYWORD("MESH_FACENORMAL"))
+		{
+			pos = parseInt(pos, normal_face);
+			normal_corner = 0;
+		}
+		else if (ASE_KEYWORD("MESH_VERTEXNORMAL"))
+		{
+			int id;
+			Vector3 n;
+			pos = parseInt(pos, id);
+			pos = parseFloat(skipSpaces(pos), n.x);
+			pos = parseFloat(skipSpaces(pos), n.y);
+			pos = parseFloat(skipSpaces(pos), n.z);
+			int corner = normal_face * 3 + normal_corner++;
+			if (normal_corner <= 3 && corner >= 0 && corner < (int)corner_normals.size())
+				corner_normals[corner].set(-n.x, n.z, n.y);
+		}
+		else if (ASE_KEYWORD("MESH_NUMVERTEX"))
+		{
+			int num;
+			pos = parseInt(pos, num);
+			unique_vertices.resize(num);
+		}
+		else if (ASE_KEYWORD("MESH_NUMFACES"))
+		{
+			int num;
+			pos = parseInt(pos, num);
+			faces.resize(num);
+			face_materials.resize(num);
+			corner_normals.resize(num * 3);
+		}
+		else if (ASE_KEYWORD("MESH_NUMTVERTEX"))
+		{
+			int num;
+			pos = parseInt(pos, num);
+			unique_uvs.resize(num);
+		}
+		else if (ASE_KEYWORD("MESH_NUMTVFACES"))
+		{
+			int num;
+			pos = parseInt(pos, num);
+			tfaces.resize(num);
+		}
+		else if (ASE_KEYWORD("GEOMOBJECT"))
+		{
+			if (++num_geomobjects > 1)
+				break;
+		}
+	}
+
+	if (faces.empty() || unique_vertices.empty())
+	{
+		std::cout << "[ERROR] ASE without faces" << std::endl;
+		return false;
+	}
 
 	const float max_float = 10000000;
 	const float min_float = -10000000;
 	aabb_min.set(max_float,max_float,max_float);
 	aabb_max.set(min_float,min_float,min_float);
-
-	//load unique vertices
-	for(count=0;count<nVtx;count++)
+	for (size_t i = 0; i < unique_vertices.size(); ++i)
 	{
-		t.seek("*MESH_VERTEX");
-		vId = t.getint();
-		vtxX=(float)t.getfloat();
-		vtxY= (float)t.getfloat();
-		vtxZ= (float)t.getfloat();
-		Vector3 v(-vtxX,vtxZ,vtxY);
-		unique_vertices[count] = v;
-		aabb_min.setMin( v );
-		aabb_max.setMax( v );
+		aabb_min.setMin(unique_vertices[i]);
+		aabb_max.setMax(unique_vertices[i]);
 	}
 	box.center = (aabb_max + aabb_min) * 0.5;
 	box.halfsize = (aabb_max - box.center);
 	radius = (float)fmax( aabb_max.length(), aabb_min.length() );
-	
-	int prev_mat = 0;
 
+	//every corner is a vertex+tvert+normal, repeated ones are shared
+	sVertexMap<5> vertex_map(unique_vertices.size() * 2);
+	indices.resize(faces.size());
+	vertices.reserve(unique_vertices.size() * 2);
+	uvs.reserve(unique_vertices.size() * 2);
+	normals.reserve(unique_vertices.size() * 2);
+	unsigned int* triangle_indices = (unsigned int*)&indices[0];
+	for (size_t i = 0; i < faces.size(); ++i)
+		for (int k = 0; k < 3; ++k)
+		{
+			int key[5];
+			key[0] = (int)faces[i].v[k];
+			if (key[0] >= (int)unique_vertices.size())
+				key[0] = 0;
+			key[1] = i < tfaces.size() && tfaces[i].v[k] < unique_uvs.size() ? (int)tfaces[i].v[k] : -1;
+			memcpy(key + 2, corner_normals[i * 3 + k].v, sizeof(float) * 3);
+			unsigned int index = vertex_map.findOrAdd(key, (unsigned int)vertices.size());
+			if (index == vertices.size())
+			{
+				vertices.push_back(unique_vertices[key[0]]);
+				uvs.push_back(key[1] != -1 ? unique_uvs[key[1]] : Vector2());
+				normals.push_back(corner_normals[i * 3 + k]);
+			}
+			triangle_indices[i * 3 + k] = index;
+		}
+
+	//a new submesh (in triangles) every time the material id changes
 	sSubmeshInfo submesh;
 	memset(&submesh, 0, sizeof(submesh));
-
-	//load faces
-	for(count=0;count<nFcs;count++)
-	{
-		t.seek("*MESH_FACE");
-		t.seek("A:");
-		aId = t.getint();
-		t.seek("B:");
-		bId = t.getint();
-		t.seek("C:");
-		cId = t.getint();
-		vertices[count*3 + 0] = unique_vertices[aId];
-		vertices[count*3 + 1] = unique_vertices[bId];
-		vertices[count*3 + 2] = unique_vertices[cId];
-
-		t.seek("*MESH_MTLID");
-		int current_mat = t.getint();
-		if (current_mat != prev_mat)
-		{
-			submesh.length = count * 3 - submesh.start;
-			submeshes.push_back( submesh );
+	int prev_mat = 0;
+	for (size_t i = 0; i < faces.size(); ++i)
+		if (face_materials[i] != prev_mat)
+		{
+			submesh.length = (int)i - submesh.start;
+			submeshes.push_back(submesh);
 			memset(&submesh, 0, sizeof(submesh));
-			submesh.start = count * 3;
-			prev_mat = current_mat;
+			submesh.start = (int)i;
+			prev_mat = face_materials[i];
 		}
-	}
-
-	submesh.length = count * 3 - submesh.start;
+	submesh.length = (int)faces.size() - submesh.start;
 	submeshes.push_back(submesh);
 
-	t.seek("*MESH_NUMTVERTEX");
-	nVtx = t.getint();
-	std::vector<Vector2> unique_uvs;
-	unique_uvs.resize(nVtx);
-
-	for(count=0;count<nVtx;count++)
-	{
-		t.seek("*MESH_TVERT");
-		vId = t.getint();
-		vtxX= (float)t.getfloat();
-		vtxY= (float)t.getfloat();
-		unique_uvs[count]=Vector2(vtxX,vtxY);
-	}
-
-	t.seek("*MESH_NUMTVFACES");
-	nFcs = t.getint();
-	for(count=0;count<nFcs;count++)
-	{
-		t.seek("*MESH_TFACE");
-		t.getint(); //num face
-		uvs[count*3] = unique_uvs[ t.getint() ];
-		uvs[count*3+1] = unique_uvs[ t.getint() ];
-		uvs[count*3+2] = unique_uvs[ t.getint() ];
-	}
-
-	//normals
-	for(count=0;count<nFcs;count++)
-	{
-		t.seek("*MESH_VERTEXNORMAL");
-		aId = t.getint();
-		nX = (float)t.getfloat();
-		nY = (float)t.getfloat();
-		nZ = (float)t.getfloat();
-		normals[count*3]=Vector3(-nX,nZ,nY);
-		t.seek("*MESH_VERTEXNORMAL");
-		aId = t.getint();
-		nX = (float)t.getfloat();
-		nY = (float)t.getfloat();
-		nZ = (float)t.getfloat();
-		normals[count*3+1]=Vector3(-nX,nZ,nY);
-		t.seek("*MESH_VERTEXNORMAL");
-		aId = t.getint();
-		nX = (float)t.getfloat();
-		nY = (float)t.getfloat();
-		nZ = (float)t.getfloat();
-		normals[count*3+2]=Vector3(-nX,nZ,nY);
-	}
-
 	return true;
 }
+#undef ASE_KEYWORD
 
-bool Mesh::loadOBJ(const char* filename)
+//builds a big ASE by repeating the mesh of an ASE file (in a row) and measures the parser
+void Mesh::benchmarkASE(const char* filename, int copies)
 {
-	struct stat stbuffer;
+	std::string source;
+	if (!readFile(filename, source))
+		return;
 
-	FILE* f = fopen(filename,"rb");
-	if (f == NULL)
-	{
-		std::cerr << "File not found: " << filename << std::endl;
-		return false;
-	}
+	//split the lines we have to replicate
+	std::vector<std::string> vertex_lines, face_lines, tvert_lines, tface_lines, normal_lines;
+	std::stringstream stream(source);
+	std::string line;
+	while (std::getline(stream, line))
+	{
+		size_t start = line.find('*');
+		if (start == std::string::npos)
+			continue;
+		line = line.substr(start);
+		if (line.compare(0, 13, "*MESH_VERTEX ") == 0) vertex_lines.push_back(line);
+		else if (line.compare(0, 11, "*MESH_FACE ") == 0) face_lines.push_back(line);
+		else if (line.compare(0, 12, "*MESH_TVERT ") == 0) tvert_lines.push_back(line);
+		else if (line.compare(0, 12, "*MESH_TFACE ") == 0) tface_lines.push_back(line);
+		else if (line.compare(0, 16, "*MESH_FACENORMAL") == 0 || line.compare(0, 18, "*MESH_VERTEXNORMAL") == 0) normal_lines.push_back(line);
+	}
+
+	int nv = (int)vertex_lines.size();
+	int nf = (int)face_lines.size();
+	int ntv = (int)tvert_lines.size();
+	char buffer[512];
+	std::string text = "*3DSMAX_ASCIIEXPORT	200\n*GEOMOBJECT {\n\t*MESH {\n";
+	text += "\t\t*MESH_NUMVERTEX " + std::to_string(nv * copies) + "\n\t\t*MESH_NUMFACES " + std::to_string(nf * copies) + "\n\t\t*MESH_VERTEX_LIST {\n";
+	for (int c = 0; c < copies; ++c)
+		for (int i = 0; i < nv; ++i)
+		{
+			int id; float x, y, z;
+			sscanf(vertex_lines[i].c_str(), "*MESH_VERTEX %d %f %f %f", &id, &x, &y, &z);
+			sprintf(buffer, "\t\t\t*MESH_VERTEX %d\t%.4f\t%.4f\t%.4f\n", id + c * nv, x + c * 150.0f, y, z);
+			text += buffer;
+		}
+	text += "\t\t}\n\t\t*MESH_FACE_LIST {\n";
+	for (int c = 0; c < copies; ++c)
+		for (int i = 0; i < nf; ++i)
+		{
+			int id, a, b, cc, mat = 0;
+			sscanf(face_lines[i].c_str(), "*MESH_FACE %d: A: %d B: %d C: %d", &id, &a, &b, &cc);
+			size_t mtl = face_lines[i].find("*MESH_MTLID");
+			if (mtl != std::string::npos)
+				mat = atoi(face_lines[i].c_str() + mtl + 11);
+			sprintf(buffer, "\t\t\t*MESH_FACE %d:    A: %d B: %d C: %d AB:    1 BC:    1 CA:    0\t *MESH_SMOOTHING 1 \t*MESH_MTLID %d\n", id + c * nf, a + c * nv, b + c * nv, cc + c * nv, mat);
+			text += buffer;
+		}
+	text += "\t\t}\n\t\t*MESH_NUMTVERTEX " + std::to_string(ntv * copies) + "\n\t\t*MESH_TVERTLIST {\n";
+	for (int c = 0; c < copies; ++c)
+		for (int i = 0; i < ntv; ++i)
+		{
+			int id; float u, v, w;
+			sscanf(tvert_lines[i].c_str(), "*MESH_TVERT %d %f %f %f", &id, &u, &v, &w);
+			sprintf(buffer, "\t\t\t*MESH_TVERT %d\t%.4f\t%.4f\t%.4f\n", id + c * ntv, u, v, w);
+			text += buffer;
+		}
+	text += "\t\t}\n\t\t*MESH_NUMTVFACES " + std::to_string((int)tface_lines.size() * copies) + "\n\t\t*MESH_TFACELIST {\n";
+	for (int c = 0; c < copies; ++c)
+		for (size_t i = 0; i < tface_lines.size(); ++i)
+		{
+			int id, a, b, cc;
+			sscanf(tface_lines[i].c_str(), "*MESH_TFACE %d %d %d %d", &id, &a, &b, &cc);
+			sprintf(buffer, "\t\t\t*MESH_TFACE %d\t%d\t%d\t%d\n", id + c * nf, a + c * ntv, b + c * ntv, cc + c * ntv);
+			text += buffer;
+		}
+	text += "\t\t}\n\t\t*MESH_NORMALS {\n";
+	for (int c = 0; c < copies; ++c)
+		for (size_t i = 0; i < normal_lines.size(); ++i)
+		{
+			int id; float x, y, z;
+			bool is_face = normal_lines[i][6] == 'F';
+			sscanf(normal_lines[i].c_str() + (is_face ? 16 : 18), "%d %f %f %f", &id, &x, &y, &z);
+			sprintf(buffer, "\t\t\t*MESH_%s %d\t%.4f\t%.4f\t%.4f\n", is_face ? "FACENORMAL" : "VERTEXNORMAL", id + c * (is_face ? nf : nv), x, y, z);
+			text += buffer;
+		}
+	text += "\t\t}\n\t}\n}\n";
 
-	stat(filename,&stbuffer);
+	long time = getTime();
+	Mesh mesh;
+	bool parsed = mesh.parseASE(text.c_str(), text.size());
+	long elapsed = getTime() - time;
+	if (elapsed < 1)
+		elapsed = 1;
+	std::cout << " + ASE benchmark: " << filename << " x" << copies << " (" << text.size() / (1024 * 1024) << "MB) " << (parsed ? "" : "[ERROR] ")
+		<< "Faces: " << mesh.indices.size() << " Vertices: " << mesh.vertices.size()
+		<< " Time: " << elapsed * 0.001 << "sec (" << (text.size() / 1024.0 / 1024.0) / (elapsed * 0.001) << " MB/s)" << std::endl;
+}
 
-	unsigned int size = stbuffer.st_size;
-	char* data = new char[size+1];
-	fread(data,size,1,f);
-	fclose(f);
-	data[size] = 0;
+//OBJ parsing, the file is split in chunks (at line breaks) that are parsed in parallel
+struct sOBJCorner
+{
+	int v, t, n; //0-based, -1 if not present
+};
 
-	char* pos = data;
-	char line[255];
+struct sOBJGroupEvent
+{
+	int triangle; //first triangle after the event (local to the chunk)
+	bool is_material; //usemtl or g
+	char name[64];
+};
+
+struct sOBJChunk
+{
+	const char* start;
+	const char* end;
+	std::vector<Vector3> positions;
+	std::vector<Vector2> uvs;
+	std::vector<Vector3> normals;
+	std::vector<sOBJCorner> corners; //three per triangle
+	std::vector<unsigned char> relative; //per corner, bit set if the v/t/n is relative to the chunk (negative in the file)
+	std::vector<sOBJGroupEvent> events;
+	Vector3 aabb_min;
+	Vector3 aabb_max;
+};
+
+static const char* parseOBJName(const char* pos, char* name)
+{
+	pos = skipSpaces(pos);
 	int i = 0;
+	while (*pos && *pos != '\n' && *pos != '\r' && i < 63)
+		name[i++] = *pos++;
+	while (i > 0 && (name[i - 1] == ' ' || name[i - 1] == '\t'))
+		i--;
+	name[i] = 0;
+	return pos;
+}
 
-	std::vector<Vector3> indexed_positions;
-	std::vector<Vector3> indexed_normals;
-	std::vector<Vector2> indexed_uvs;
+//resolves an index from the file (1-based or negative) to 0-based, relative ones are local to the chunk and fixed later
+static inline int resolveOBJIndex(int index, int num_local, unsigned char& relative, unsigned char bit)
+{
+	if (index > 0)
+		return index - 1;
+	if (index < 0)
+	{
+		relative |= bit;
+		return num_local + index;
+	}
+	return -1;
+}
 
+static void parseOBJChunk(sOBJChunk& chunk)
+{
 	const float max_float = 10000000;
 	const float min_float = -10000000;
-	aabb_min.set(max_float,max_float,max_float);
-	aabb_max.set(min_float,min_float,min_float);
-
-	unsigned int vertex_i = 0;
+	chunk.aabb_min.set(max_float, max_float, max_float);
+	chunk.aabb_max.set(min_float, min_float, min_float);
 
-	sSubmeshInfo submesh_info;
-	int last_submesh_vertex = 0;
-	memset(&submesh_info, 0, sizeof(submesh_info));
-
-	//parse file
-	while(*pos != 0)
+	sOBJCorner face[3];
+	unsigned char face_relative[3];
+	const char* pos = chunk.start;
+	while (pos < chunk.end)
 	{
-		if (*pos == '\n') pos++;
-		if (*pos == '\r') pos++;
-
-		//read one line
-		i = 0;
-		while(i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
-		memcpy(line,pos,i);
-		line[i] = 0;
-		pos = pos + i;
-
-		//std::cout << "Line: \"" << line << "\"" << std::endl;
-		if (*line == '#' || *line == 0) continue; //comment
-
-		//tokenize line
-		std::vector<std::string> tokens = tokenize(line," ");
-
-		if (tokens.empty()) continue;
-
-		if (tokens[0] == "v" && tokens.size() == 4)
+		pos = skipSpaces(pos);
+		char c = pos[0];
+		if (c == 'v' && (pos[1] == ' ' || pos[1] == '\t'))
+		{
+			Vector3 v;
+			pos = parseFloat(skipSpaces(pos + 2), v.x);
+			pos = parseFloat(skipSpaces(pos), v.y);
+			pos = parseFloat(skipSpaces(pos), v.z);
+			chunk.positions.push_back(v);
+			chunk.aabb_min.setMin(v);
+			chunk.aabb_max.setMax(v);
+		}
+		else if (c == 'v' && pos[1] == 't')
+		{
+			Vector2 v;
+			pos = parseFloat(skipSpaces(pos + 2), v.x);
+			pos = parseFloat(skipSpaces(pos), v.y);
+			chunk.uvs.push_back(v);
+		}
+		else if (c == 'v' && pos[1] == 'n')
 		{
-			Vector3 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_positions.push_back(v);
+			Vector3 v;
+			pos = parseFloat(skipSpaces(pos + 2), v.x);
+			pos = parseFloat(skipSpaces(pos), v.y);
+			pos = parseFloat(skipSpaces(pos), v.z);
+			chunk.normals.push_back(v);
+		}
+		else if (c == 'f' && (pos[1] == ' ' || pos[1] == '\t'))
+		{
+			pos += 2;
+			int num = 0;
+			while (true)
+			{
+				pos = skipSpaces(pos);
+				if (*pos != '-' && (*pos < '0' || *pos > '9'))
+					break;
+				sOBJCorner corner;
+				unsigned char relative = 0;
+				int index = 0;
+				pos = parseInt(pos, index);
+				corner.v = resolveOBJIndex(index, (int)chunk.positions.size(), relative, 1);
+				corner.t = corner.n = -1;
+				if (*pos == '/')
+				{
+					pos++;
+					if (*pos != '/')
+					{
+						pos = parseInt(pos, index);
+						corner.t = resolveOBJIndex(index, (int)chunk.uvs.size(), relative, 2);
+					}
+					if (*pos == '/')
+					{
+						pos = parseInt(pos + 1, index);
+						corner.n = resolveOBJIndex(index, (int)chunk.normals.size(), relative, 4);
+					}
+				}
+				while (*pos && *pos != ' ' && *pos != '\t' && *pos != '\n' && *pos != '\r')
+					pos++;
 
-			aabb_min.setMin( v );
-			aabb_max.setMax( v );
+				//triangle fan
+				if (num < 2)
+				{
+					face[num] = corner;
+					face_relative[num] = relative;
+				}
+				else
+				{
+					face[2] = corner;
+					face_relative[2] = relative;
+					for (int i = 0; i < 3; ++i)
+					{
+						chunk.corners.push_back(face[i]);
+						chunk.relative.push_back(face_relative[i]);
+					}
+					face[1] = face[2];
+					face_relative[1] = face_relative[2];
+				}
+				num++;
+			}
 		}
-		else if (tokens[0] == "vt" && tokens.size() >= 3)
+		else if (c == 'g' && (pos[1] == ' ' || pos[1] == '\t'))
 		{
-			Vector2 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()) );
-			indexed_uvs.push_back(v);
+			sOBJGroupEvent e;
+			e.triangle = (int)chunk.corners.size() / 3;
+			e.is_material = false;
+			pos = parseOBJName(pos + 1, e.name);
+			chunk.events.push_back(e);
 		}
-		else if (tokens[0] == "vn" && tokens.size() == 4)
+		else if (strncmp(pos, "usemtl", 6) == 0)
 		{
-			Vector3 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_normals.push_back(v);
+			sOBJGroupEvent e;
+			e.triangle = (int)chunk.corners.size() / 3;
+			e.is_material = true;
+			pos = parseOBJName(pos + 6, e.name);
+			chunk.events.push_back(e);
 		}
-		else if (tokens[0] == "s") //surface? it appears one time before the faces
+
+		//next line
+		while (pos < chunk.end && *pos != '\n')
+			pos++;
+		pos++;
+	}
+}
+
+bool Mesh::loadOBJ(const char* filename)
+{
+	FILE* f = fopen(filename,"rb");
+	if (f == NULL)
+	{
+		std::cerr << "File not found: " << filename << std::endl;
+		return false;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size_t size = (size_t)ftell(f);
+	rewind(f);
+	std::vector<char> content(size + 1);
+	if (size)
+		size = fread(&content[0], 1, size, f);
+	fclose(f);
+	content[size] = 0;
+	const char* data = &content[0];
+
+	//split in chunks ending in a line break
+	const size_t min_chunk_size = 1 << 20;
+	int num_chunks = getNumCores() * 4;
+	if (size / num_chunks < min_chunk_size)
+		num_chunks = (int)(size / min_chunk_size) + 1;
+	std::vector<sOBJChunk> chunks(num_chunks);
+	const char* chunk_start = data;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		const char* chunk_end = (i == num_chunks - 1) ? data + size : data + (size * (i + 1)) / num_chunks;
+		if (chunk_end < chunk_start)
+			chunk_end = chunk_start;
+		while (chunk_end < data + size && *chunk_end != '\n')
+			chunk_end++;
+		chunks[i].start = chunk_start;
+		chunks[i].end = chunk_end;
+		chunk_start = chunk_end < data + size ? chunk_end + 1 : chunk_end;
+	}
+
+	parallelFor(num_chunks, [&](int i) { parseOBJChunk(chunks[i]); });
+
+	//join the attribute arrays, relative indices need the amount of elements in the previous chunks
+	std::vector<int> positions_offset(num_chunks), uvs_offset(num_chunks), normals_offset(num_chunks), triangles_offset(num_chunks);
+	size_t num_positions = 0, num_uvs = 0, num_normals = 0, num_triangles = 0;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		positions_offset[i] = (int)num_positions;
+		uvs_offset[i] = (int)num_uvs;
+		normals_offset[i] = (int)num_normals;
+		triangles_offset[i] = (int)num_triangles;
+		num_positions += chunks[i].positions.size();
+		num_uvs += chunks[i].uvs.size();
+		num_normals += chunks[i].normals.size();
+		num_triangles += chunks[i].corners.size() / 3;
+	}
+
+	std::vector<Vector3> indexed_positions(num_positions);
+	std::vector<Vector2> indexed_uvs(num_uvs);
+	std::vector<Vector3> indexed_normals(num_normals);
+	parallelFor(num_chunks, [&](int i) {
+		sOBJChunk& chunk = chunks[i];
+		if (chunk.positions.size())
+			memcpy(&indexed_positions[positions_offset[i]], &chunk.positions[0], chunk.positions.size() * sizeof(Vector3));
+		if (chunk.uvs.size())
+			memcpy(&indexed_uvs[uvs_offset[i]], &chunk.uvs[0], chunk.uvs.size() * sizeof(Vector2));
+		if (chunk.normals.size())
+			memcpy(&indexed_normals[normals_offset[i]], &chunk.normals[0], chunk.normals.size() * sizeof(Vector3));
+		for (size_t j = 0; j < chunk.corners.size(); ++j)
 		{
-			//process mesh: ????
-			//if (uvs.size() == 0 && indexed_uvs.size() )
-			//	uvs.resize(1);
+			sOBJCorner& corner = chunk.corners[j];
+			unsigned char relative = chunk.relative[j];
+			if (relative & 1) corner.v += positions_offset[i];
+			if (relative & 2) corner.t += uvs_offset[i];
+			if (relative & 4) corner.n += normals_offset[i];
+			if (corner.v < 0 || corner.v >= (int)num_positions) corner.v = 0;
+			if (corner.t >= (int)num_uvs) corner.t = -1;
+			if (corner.n >= (int)num_normals) corner.n = -1;
 		}
-		else if (tokens[0] == "usemtl") //surface? it appears one time before the faces
+		std::vector<Vector3>().swap(chunk.positions);
+		std::vector<Vector2>().swap(chunk.uvs);
+		std::vector<Vector3>().swap(chunk.normals);
+	});
+
+	if (!num_triangles || !num_positions)
+	{
+		std::cerr << "[ERROR] OBJ without faces: " << filename << std::endl;
+		return false;
+	}
+
+	//deduplicate the position/uv/normal triples into indices
+	sVertexMap<3> vertex_map(num_positions + num_positions / 2);
+	indices.resize(num_triangles);
+	vertices.reserve(num_positions);
+	if (num_uvs)
+		uvs.reserve(num_positions);
+	if (num_normals)
+		normals.reserve(num_positions);
+	unsigned int* triangle_indices = (unsigned int*)&indices[0];
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		const std::vector<sOBJCorner>& corners = chunks[i].corners;
+		unsigned int* out = triangle_indices + triangles_offset[i] * 3;
+		for (size_t j = 0; j < corners.size(); ++j)
 		{
-			if (last_submesh_vertex != vertices.size())
+			const sOBJCorner& corner = corners[j];
+			unsigned int index = vertex_map.findOrAdd(&corner.v, (unsigned int)vertices.size());
+			if (index == vertices.size())
 			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy(submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
+				vertices.push_back(indexed_positions[corner.v]);
+				if (num_uvs)
+					uvs.push_back(corner.t >= 0 ? indexed_uvs[corner.t] : Vector2());
+				if (num_normals)
+					normals.push_back(corner.n >= 0 ? indexed_normals[corner.n] : Vector3());
 			}
-			else
-				strcpy(submesh_info.material, tokens[1].c_str());
+			out[j] = index;
 		}
-		else if (tokens[0] == "g") //surface? it appears one time before the faces
+	}
+
+	//submeshes (in triangles): a new one starts with every g or usemtl that comes after some faces
+	sSubmeshInfo submesh_info;
+	memset(&submesh_info, 0, sizeof(submesh_info));
+	for (int i = 0; i < num_chunks; ++i)
+		for (size_t j = 0; j < chunks[i].events.size(); ++j)
 		{
-			if (last_submesh_vertex != vertices.size())
+			const sOBJGroupEvent& e = chunks[i].events[j];
+			int triangle = triangles_offset[i] + e.triangle;
+			if (triangle != submesh_info.start)
 			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
+				submesh_info.length = triangle - submesh_info.start;
 				submeshes.push_back(submesh_info);
 				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy( submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
+				submesh_info.start = triangle;
 			}
-		}
-		else if (tokens[0] == "f" && tokens.size() >= 4)
-		{
-			Vector3 v1,v2,v3;
-			v1.parseFromText( tokens[1].c_str(), '/' );
-
-			for (unsigned int iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
+			if (e.is_material)
 			{
-				v2.parseFromText( tokens[iPoly].c_str(), '/' );
-				v3.parseFromText( tokens[iPoly+1].c_str(), '/' );
-
-				vertices.push_back( indexed_positions[ (unsigned int)(v1.x) -1 ] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v2.x) -1] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v3.x) -1] );
-				//triangles.push_back( VECTOR_INDICES_TYPE(vertex_i, vertex_i+1, vertex_i+2) ); //not needed
-				vertex_i += 3;
-
-				if (indexed_uvs.size() > 0)
-				{
-					uvs.push_back( indexed_uvs[(unsigned int)(v1.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v2.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v3.y) -1] );
-				}
-
-				if (indexed_normals.size() > 0)
-				{
-					normals.push_back( indexed_normals[(unsigned int)(v1.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v2.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v3.z) -1] );
-				}
+				if (!submesh_info.name[0])
+					strcpy(submesh_info.name, e.name);
+				strcpy(submesh_info.material, e.name);
 			}
+			else
+				strcpy(submesh_info.name, e.name);
 		}
+	submesh_info.length = (int)num_triangles - submesh_info.start;
+	submeshes.push_back(submesh_info);
+
+	const float max_float = 10000000;
+	const float min_float = -10000000;
+	aabb_min.set(max_float, max_float, max_float);
+	aabb_max.set(min_float, min_float, min_float);
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		aabb_min.setMin(chunks[i].aabb_min);
+		aabb_max.setMax(chunks[i].aabb_max);
 	}
 
 	box.center = (aabb_max + aabb_min) * 0.5;
 	box.halfsize = (aabb_max - box.center);
 	radius = (float)fmax( aabb_max.length(), aabb_min.length() );
-
-	submesh_info.length = vertices.size() - last_submesh_vertex;
-	submeshes.push_back(submesh_info);
 	return true;
 }
 
@@ -1246,6 +2530,8 @@ bool Mesh::loadMESH(const char* filename)
 
 	delete[] data;
 
+	updateBoundingBox(); //needed to quantize the positions
+
 	return true;
 }
 
@@ -1446,7 +2732,7 @@ void Mesh::updateBoundingBox()
 	else if (interleaved.size())
 	{
 		aabb_max = aabb_min = interleaved[0].vertex;
-		for (int i = 1; i < vertices.size(); ++i)
+		for (int i = 1; i < interleaved.size(); ++i)
 		{
 			aabb_min.setMin(interleaved[i].vertex);
 			aabb_max.setMax(interleaved[i].vertex);
@@ -1456,6 +2742,39 @@ void Mesh::updateBoundingBox()
 	box.halfsize = aabb_max - box.center;
 }
 
+//how many UV units cover one unit of length of the surface, the square root of the total UV area divided by the total area
+void Mesh::updateUVDensity()
+{
+	uv_density = 0;
+	bool has_uvs = interleaved.size() || uvs.size() == vertices.size();
+	unsigned int num_vertices = (unsigned int)(interleaved.size() ? interleaved.size() : vertices.size());
+	if (!has_uvs || !num_vertices)
+		return;
+
+	double area = 0;
+	double uv_area = 0;
+	unsigned int num_triangles = indices.size() ? (unsigned int)indices.size() : num_vertices / 3;
+	for (unsigned int i = 0; i < num_triangles; ++i)
+	{
+		Vector3 p[3];
+		Vector2 uv[3];
+		for (int j = 0; j < 3; ++j)
+		{
+			unsigned int index = indices.size() ? indices[i].v[j] : i * 3 + j;
+			if (index >= num_vertices)
+				return;
+			p[j] = interleaved.size() ? interleaved[index].vertex : vertices[index];
+			uv[j] = interleaved.size() ? interleaved[index].uv : uvs[index];
+		}
+		area += (p[1] - p[0]).cross(p[2] - p[0]).length();
+		Vector2 e1 = uv[1] - uv[0];
+		Vector2 e2 = uv[2] - uv[0];
+		uv_area += fabs(e1.x * e2.y - e1.y * e2.x);
+	}
+	if (area > 0 && uv_area > 0)
+		uv_density = (float)sqrt(uv_area / area);
+}
+
 Mesh* wire_box = NULL;
 
 void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
@@ -1468,6 +2787,7 @@ void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
 	}
 
 	Shader* sh = Shader::getDefaultShader("flat");
+	UniformBlocks::setCamera(Camera::current); //the flat of the atlas reads it from the camera block
 	sh->enable();
 	sh->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
 
@@ -1507,108 +2827,223 @@ Mesh* Mesh::getQuad()
 	return quad;
 }
 
+static char getMeshFileFormat(const std::string& filename)
+{
+	std::string ext = filename.substr(filename.find_last_of(".") + 1);
+	if (ext == "ase" || ext == "ASE")
+		return FORMAT_ASE;
+	if (ext == "obj" || ext == "OBJ")
+		return FORMAT_OBJ;
+	if (ext == "mbin" || ext == "MBIN")
+		return FORMAT_MBIN;
+	if (ext == "mesh" || ext == "MESH")
+		return FORMAT_MESH;
+	return 0;
+}
+
 Mesh* Mesh::Get(const char* filename, bool skip_load)
 {
 	assert(filename);
-	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
-	if (it != sMeshesLoaded.end())
-		return it->second;
-
 	if (skip_load)
+	{
+		std::lock_guard<std::mutex> lock(meshes_mutex);
+		std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
+		return it != sMeshesLoaded.end() ? it->second : NULL;
+	}
+
+	//same path than the async version, but waiting for it
+	Mesh* m = GetAsync(filename);
+	if (!m)
 		return NULL;
+	waitUntil([m]() { return m->load_state != ASSET_LOADING; });
+	return m->isReady() ? m : NULL;
+}
 
-	Mesh* m = new Mesh();
+Mesh* Mesh::GetAsync(const char* filename)
+{
+	assert(filename);
 	std::string name = filename;
 
-	//detect format
-	char file_format = 0;
-	std::string ext = name.substr(name.find_last_of(".")+1);
-	if (ext == "ase" || ext == "ASE")
-		file_format = FORMAT_ASE;
-	else if (ext == "obj" || ext == "OBJ")
-		file_format = FORMAT_OBJ;
-	else if (ext == "mbin" || ext == "MBIN")
-		file_format = FORMAT_MBIN;
-	else if (ext == "mesh" || ext == "MESH")
-		file_format = FORMAT_MESH;
-	else
+	Mesh* m = NULL;
+	{
+		std::lock_guard<std::mutex> lock(meshes_mutex);
+		std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(name);
+		if (it != sMeshesLoaded.end())
+			return it->second;
+
+		if (!getMeshFileFormat(name))
+		{
+			std::cerr << "Unknown mesh format: " << filename << std::endl;
+			return NULL;
+		}
+
+		//registered now so the next calls get the same one while it loads
+		m = new Mesh();
+		m->vertex_format = default_vertex_format;
+		m->load_state = ASSET_LOADING;
+		m->name = name;
+		sMeshesLoaded[name] = m;
+	}
+
+	runAsync([m, name]() { m->loadFile(name); });
+	return m;
+}
+
+//the .mbin mapped and paged in, when it can go to VRAM as it is: the current version, in the vertex format the meshes use and already
+//interleaved if they are. NULL otherwise, it has to be loaded to RAM
+static MappedFile* openBinForUpload(const char* filename)
+{
+	if (glGenBuffersARB == 0)
+		return NULL;
+	MappedFile* file = new MappedFile();
+	sMeshInfo info;
+	//older versions and broken files are left to readBin, that upgrades or reports them
+	if (!file->open(filename) || file->size < 4 + sizeof(sMeshInfo) || memcmp(file->data, "MBIN", 4) != 0)
 	{
-		std::cerr << "Unknown mesh format: " << filename << std::endl;
+		delete file;
+		return NULL;
+	}
+	memcpy(&info, file->data + 4, sizeof(sMeshInfo));
+	if (info.version != MESH_BIN_VERSION || !readBinInfo(*file, filename, info))
+	{
+		delete file;
 		return NULL;
 	}
 
-	//stats
+	bool has_stream[4] = { false, false, false, false };
+	const char* ids[4] = { "INTR", "VERT", "NORM", "UVS0" };
+	for (int i = 0; i < info.num_streams; ++i)
+		for (int j = 0; j < 4; ++j)
+			has_stream[j] = has_stream[j] || isStream(info.streams[i], ids[j]);
+	bool interleavable = !has_stream[0] && has_stream[1] && has_stream[2] && has_stream[3]; //interleaveBuffers needs them in RAM
+
+	int format = Mesh::default_vertex_format;
+	if (info.size > 65536 || !info.num_indices) //see getSupportedVertexFormat
+		format &= ~VF_INDICES_16;
+	if (info.vertex_format != format || (Mesh::interleave_meshes && interleavable))
+	{
+		delete file;
+		return NULL;
+	}
+
+	//every page is read here so the upload in the main thread does not wait for the disk
+	volatile char sum = 0;
+	for (size_t i = 0; i < file->size; i += 4096)
+		sum += file->data[i];
+	return file;
+}
+
+void Mesh::loadFile(std::string filename)
+{
+	//stats, printed at once when it is done (other loads run at the same time)
 	long time = getTime();
-	std::cout << " + Mesh loading: " << filename << " ... ";
-	std::string binfilename = filename;
+	std::stringstream log;
+	log << " + Mesh loading: " << filename << " ... ";
 
+	char file_format = getMeshFileFormat(filename);
+	std::string binfilename = filename;
 	if (file_format != FORMAT_MBIN)
 		binfilename = binfilename + ".mbin";
 
-	//try loading the binary version
-	if ( use_binary && m->readBin(binfilename.c_str()) )
+	//try loading the binary version: if it is ready for VRAM the mapping is kept open until the main thread uploads from it,
+	//otherwise it is copied to RAM here
+	MappedFile* upload_file = NULL;
+	if (use_binary && auto_upload_to_vram && !keep_cpu_copy)
+		upload_file = openBinForUpload(binfilename.c_str());
+	bool from_binary = upload_file || (use_binary && readBin(binfilename.c_str()));
+	if (from_binary)
+	{
+		if (!upload_file) //the mapped one keeps the format of the file, it is already this one
+			vertex_format = default_vertex_format;
+	}
+	else
 	{
-		if(interleave_meshes && m->interleaved.size() == 0)
+		//load the ascii version
+		bool loaded = false;
+		if (file_format == FORMAT_OBJ)
+			loaded = loadOBJ(filename.c_str());
+		else if (file_format == FORMAT_ASE)
+			loaded = loadASE(filename.c_str());
+		else if (file_format == FORMAT_MESH)
+			loaded = loadMESH(filename.c_str());
+
+		if (!loaded)
 		{
-			std::cout << "[INTERL] ";
-			m->interleaveBuffers();
+			log << "[ERROR]: Mesh not found";
+			std::string text = log.str();
+			runInMainThread([this, text]() {
+				std::cout << text << std::endl;
+				load_state = ASSET_FAILED;
+			});
+			return;
 		}
 
-		if (auto_upload_to_vram)
+		//reorder for the GPU caches (before writing the .mbin so it is stored optimized)
+		if (optimize_meshes && indices.size())
 		{
-			std::cout << "[VRAM] ";
-			m->uploadToVRAM();
+			sVertexCacheStats before, after;
+			optimize(&before, &after);
+			log << "[OPT ACMR " << before.acmr << " -> " << after.acmr << " ATVR " << before.atvr << " -> " << after.atvr << "] ";
 		}
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-		sMeshesLoaded[filename] = m;
-		return m;
-	}
-
-	//load the ascii version
-	bool loaded = false;
-	if (file_format == FORMAT_OBJ)
-		loaded = m->loadOBJ(filename);
-	else if (file_format == FORMAT_ASE)
-		loaded = m->loadASE(filename);
-	else if (file_format == FORMAT_MESH)
-		loaded = m->loadMESH(filename);
-
-	if (!loaded)
-	{
-		delete m;
-		std::cout << "[ERROR]: Mesh not found" << std::endl;
-		return NULL;
+		//simplified versions, after optimize because it moves the vertices
+		if (lod_levels > 0 && buildLODs(lod_levels))
+			log << "[LODS " << getNumLODs() - 1 << "] ";
 	}
 
-	//to optimize, interleave the meshes
-	if (interleave_meshes)
+	//to optimize, interleave the meshes (before writing the .mbin so the next loads can upload it as it is)
+	if (interleave_meshes && interleaved.size() == 0 && !upload_file)
 	{
-		std::cout << "[INTERL] ";
-		m->interleaveBuffers();
+		log << "[INTERL] ";
+		interleaveBuffers();
 	}
 
-	//and upload them to VRAM
-	if (auto_upload_to_vram)
+	if (!from_binary && use_binary)
 	{
-		std::cout << "[VRAM] ";
-		m->uploadToVRAM();
+		log << "[WRITE BIN] ";
+		writeBin(filename.c_str());
 	}
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-	if (use_binary)
-	{
-		std::cout << "\t\t Writing .BIN ... ";
-		m->writeBin(filename);
-		std::cout << "[OK]" << std::endl;
-	}
+	//and upload them to VRAM, the only part that needs the GL context
+	std::string text = log.str();
+	runInMainThread([this, text, time, from_binary, upload_file, binfilename]() {
+		std::cout << text;
+		if (upload_file)
+		{
+			std::cout << "[VRAM MAPPED] ";
+			readBin(*upload_file, binfilename.c_str(), true);
+			delete upload_file;
+		}
+		else if (auto_upload_to_vram)
+		{
+			std::cout << "[VRAM] ";
+			uploadToVRAM();
+			if (from_binary && !keep_cpu_copy)
+				releaseCPUData();
+		}
+		std::cout << (from_binary ? "[OK BIN]  Faces: " : "[OK]  Faces: ") << (getNumIndices() ? getNumIndices() : getNumVertices() / 3) << " VRAM: " << vram_bytes / 1024 << "KB Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		load_state = ASSET_READY;
+	});
+}
 
-	m->registerMesh(name);
-	return m;
+void Mesh::releaseCPUData()
+{
+	//the counts stay in num_vertices_vram and num_indices_vram, the geometry can be read again from bin_filename
+	std::vector<Vector3>().swap(vertices);
+	std::vector<Vector3>().swap(normals);
+	std::vector<Vector2>().swap(uvs);
+	std::vector<Vector2>().swap(uvs1);
+	std::vector<Vector4>().swap(colors);
+	std::vector<tInterleaved>().swap(interleaved);
+	std::vector<Vector3u>().swap(indices);
+	std::vector<Vector4ub>().swap(bones);
+	std::vector<Vector4>().swap(weights);
+	std::vector<Vector3u>().swap(lod_indices);
 }
 
 void Mesh::registerMesh( std::string name )
 {
+	std::lock_guard<std::mutex> lock(meshes_mutex);
 	this->name = name;
 	sMeshesLoaded[name] = this;
 }
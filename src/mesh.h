@@ -3,6 +3,9 @@
 
 #include <vector>
 #include "framework.h"
+#include "mesh_optimizer.h" //sMeshlet
+#include "utils.h" //eAssetState
+#include <atomic>
 
 #include <map>
 #include <string>
@@ -10,9 +13,25 @@
 class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
-
-//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+class Camera; //for culling
+
+//version 12: stream table with aligned offsets so the file can be mapped and uploaded without copies
+//version 13: vertices and triangles in the order of optimize
+//version 14: MSHL meshlets
+//version 15: LODI/LODS levels of detail
+//version 16: UVDN texel density
+#define MESH_BIN_VERSION 16 //this is used to regenerate bins if the format changes
+
+//compact vertex formats, they only change how the geometry is stored in VRAM and in the .mbin (the CPU streams are always float)
+enum eVertexFormat {
+	VF_FLOAT = 0,
+	VF_POSITION_16 = 1,	//unorm16 relative to the bounding box (decoded in the vertex shader with u_vertex_offset and u_vertex_scale)
+	VF_NORMAL_OCT = 2,	//octahedral in two snorm16 (decoded in the vertex shader if u_oct_normals)
+	VF_UV_16 = 4,		//half floats
+	VF_WEIGHTS_8 = 8,	//unorm8
+	VF_INDICES_16 = 16,	//only used when there are 65536 vertices or less
+	VF_COMPACT = 31
+};
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -27,6 +46,16 @@ struct sSubmeshInfo
 	int length;//in primitive
 };
 
+//simplified version of the mesh (or of a submesh), it uses the same vertices
+struct sMeshLOD
+{
+	int level; //1 is the first simplification
+	int submesh; //-1 if it is the whole mesh
+	int start; //in triangles, inside lod_indices
+	int length;
+	float error; //distance error relative to the mesh radius
+};
+
 class Mesh
 {
 public:
@@ -34,12 +63,24 @@ public:
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool optimize_meshes; //loaded meshes get their indices and vertices reordered (see optimize)
+	static int default_vertex_format; //eVertexFormat flags used by loaded meshes
+	static bool keep_cpu_copy; //meshes loaded from a binary keep their geometry in RAM after the upload
+	static bool build_meshlets; //optimize also splits the meshes in meshlets
+	static bool cull_meshlets; //renderCulled skips the meshlets outside the frustum or facing away
+	static int lod_levels; //LODs built for the loaded meshes, every one with half the triangles of the previous one
+	static float lod_threshold; //max error of a LOD in projected units (see getLOD)
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static long num_meshlets_rendered;
+	static long num_meshlets_culled;
 
 	std::string name;
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
+	std::vector<sMeshlet> meshlets; //ranges of triangles with culling info, they never cross a submesh
+	std::vector<sMeshLOD> lods;
+	std::vector< Vector3u > lod_indices; //triangles of all the LODs
 
 	std::vector< Vector3 > vertices; //here we store the vertices
 	std::vector< Vector3 > normals;	 //here we store the normals
@@ -68,6 +109,7 @@ public:
 	BoundingBox box;
 
 	float radius;
+	float uv_density; //UV units per unit of length on the surface (from the areas of the triangles), 0 if unknown, used by the texture streaming
 
 	unsigned int vertices_vbo_id;
 	unsigned int uvs_vbo_id;
@@ -79,27 +121,48 @@ public:
 	unsigned int bones_vbo_id;
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
+	unsigned int lod_indices_vbo_id;
+
+	int vertex_format; //eVertexFormat flags, the one requested before uploading and the one in use after it
+	Vector3 vertex_offset; //to decode VF_POSITION_16, taken from the box when packing
+	Vector3 vertex_scale;
+
+	//when the geometry lives only in VRAM (uploaded straight from the .mbin) we still need the counts
+	unsigned int num_vertices_vram;
+	unsigned int num_indices_vram; //in triangles, like indices
+	unsigned int vram_bytes; //size of all the buffers uploaded
+	std::string bin_filename; //used to reload the geometry on demand (collisions)
+	std::atomic<int> load_state; //eAssetState, while it is loading in the background the mesh renders nothing
 
 	Mesh();
 	~Mesh();
 
 	void clear();
 
-	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0 );
-	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
+	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0, int lod = 0 );
+	void renderCulled(unsigned int primitive, const Matrix44& model, Camera* camera, bool cull_backfaces = true, int submesh_id = -1, int lod = 0); //only the visible meshlets (LOD 0)
+	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number, int submesh_id = -1, int lod = 0, const float* instanced_material_ids = NULL); //the shader needs the model as an attribute (see instanced.vs), the material ids go to a_material_id (0 without them)
 	void renderBounding( const Matrix44& model, bool world_bounding = true );
 	void renderFixedPipeline(int primitive); //sloooooooow
 	//void renderAnimated(unsigned int primitive, Skeleton *sk);
 
 	void enableBuffers(Shader* shader);
-	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
+	void drawCall(unsigned int primitive, int submesh_id, int num_instances, int lod = 0);
 	void disableBuffers(Shader* shader);
 
-	bool readBin(const char* filename);
+	bool readBin(const char* filename); //to RAM
+	bool readBin(const MappedFile& file, const char* filename, bool only_vram); //only_vram uploads the streams straight from the mapping (main thread)
 	bool writeBin(const char* filename);
 
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
-	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	unsigned int getNumVertices() { return interleaved.size() ? (unsigned int)interleaved.size() : (vertices.size() ? (unsigned int)vertices.size() : num_vertices_vram); }
+	unsigned int getNumIndices() { return indices.size() ? (unsigned int)indices.size() : num_indices_vram; } //in triangles
+	bool hasCPUData() { return interleaved.size() || vertices.size(); }
+	bool isReady() { return load_state == ASSET_READY; }
+	int getSupportedVertexFormat(int format); //removes the flags that cannot be used with this mesh
+	int getNumLODs(); //including the mesh itself
+	int getLOD(float projected_radius, float bias = 0); //coarsest LOD with an error smaller than lod_threshold, projected_radius from Camera::getProjectedScale
+	const sMeshLOD* findLOD(int level, int submesh_id);
 
 	//collision testing
 	void* collision_model;
@@ -109,7 +172,8 @@ public:
 	bool testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal);
 
 	//loader
-	static Mesh* Get(const char* filename, bool skip_load = false);
+	static Mesh* Get(const char* filename, bool skip_load = false); //waits until the mesh is loaded, NULL if it failed
+	static Mesh* GetAsync(const char* filename); //returns an empty mesh at once, filled when a worker parsed it and the main thread uploaded it (see processMainThreadTasks)
 	void registerMesh(std::string name);
 
 	//create help meshes
@@ -121,15 +185,24 @@ public:
 	void createGrid(float dist);
 	void displace(Image* heightmap, float altitude);
 	static Mesh* getQuad(); //get global quad
+	static void benchmarkASE(const char* filename, int copies); //parses a copy of the file scaled up, prints the time
 
 	void updateBoundingBox();
+	void updateUVDensity();
 
 	//optimize meshes
 	void uploadToVRAM();
 	bool interleaveBuffers();
+	bool optimize(sVertexCacheStats* before = NULL, sVertexCacheStats* after = NULL); //vertex cache, overdraw and vertex fetch order, only indexed meshes
+	bool buildMeshlets(); //reorders the triangles in clusters (see buildMeshlets in mesh_optimizer.h)
+	bool buildLODs(int levels); //simplified index buffers (see simplifyMesh in mesh_optimizer.h), call it after optimize
 
 private:
+	void loadFile(std::string filename); //parses in the calling thread, the upload is queued for the main thread
+	void releaseCPUData(); //after uploading, when keep_cpu_copy is off
+	bool readBinLegacy(const char* data, size_t size); //MBIN v11
 	bool loadASE(const char* filename);
+	bool parseASE(const char* data, size_t size);
 	bool loadOBJ(const char* filename);
 	bool loadMESH(const char* filename); //personal format used for animations
 };
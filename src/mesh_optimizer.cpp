@@ -0,0 +1,778 @@
+#include "mesh_optimizer.h"
+#include "framework.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+sVertexCacheStats computeVertexCacheStats(const unsigned int* indices, size_t num_indices, size_t num_vertices, int cache_size)
+{
+	sVertexCacheStats stats;
+	stats.acmr = stats.atvr = 0;
+	if (!num_indices || !num_vertices)
+		return stats;
+
+	//FIFO cache, a vertex is in the cache if it was pushed less than cache_size misses ago
+	std::vector<unsigned int> timestamps(num_vertices, 0);
+	std::vector<bool> used(num_vertices, false);
+	unsigned int time = cache_size + 1;
+	size_t misses = 0;
+	size_t num_used = 0;
+	for (size_t i = 0; i < num_indices; ++i)
+	{
+		unsigned int v = indices[i];
+		assert(v < num_vertices);
+		if (time - timestamps[v] > (unsigned int)cache_size)
+		{
+			timestamps[v] = time++;
+			misses++;
+		}
+		if (!used[v])
+		{
+			used[v] = true;
+			num_used++;
+		}
+	}
+
+	stats.acmr = (float)misses / (num_indices / 3);
+	stats.atvr = (float)misses / num_used;
+	return stats;
+}
+
+//Tom Forsyth, "Linear-Speed Vertex Cache Optimisation"
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_MAX_VALENCE 32
+
+static float forsyth_cache_scores[FORSYTH_CACHE_SIZE];
+static float forsyth_valence_scores[FORSYTH_MAX_VALENCE + 1];
+
+static void initForsythScores()
+{
+	static bool ready = false;
+	if (ready)
+		return;
+	for (int i = 0; i < FORSYTH_CACHE_SIZE; ++i)
+	{
+		if (i < 3)
+			forsyth_cache_scores[i] = 0.75f; //last triangle, no preference between its vertices
+		else
+			forsyth_cache_scores[i] = powf(1.0f - (i - 3) / float(FORSYTH_CACHE_SIZE - 3), 1.5f);
+	}
+	forsyth_valence_scores[0] = 0;
+	for (int i = 1; i <= FORSYTH_MAX_VALENCE; ++i)
+		forsyth_valence_scores[i] = 2.0f / sqrtf((float)i); //vertices with few triangles left go first
+	ready = true;
+}
+
+static inline float forsythVertexScore(int cache_position, unsigned int live_triangles)
+{
+	if (live_triangles == 0)
+		return -1.0f; //no triangles need this vertex
+	float score = cache_position < 0 ? 0.0f : forsyth_cache_scores[cache_position];
+	return score + forsyth_valence_scores[live_triangles < FORSYTH_MAX_VALENCE ? live_triangles : FORSYTH_MAX_VALENCE];
+}
+
+void optimizeVertexCache(unsigned int* indices, size_t num_indices, size_t num_vertices)
+{
+	size_t num_triangles = num_indices / 3;
+	if (num_triangles < 2)
+		return;
+	initForsythScores();
+
+	//triangles using every vertex
+	std::vector<unsigned int> live_triangles(num_vertices, 0);
+	for (size_t i = 0; i < num_indices; ++i)
+		live_triangles[indices[i]]++;
+	std::vector<unsigned int> adjacency_offset(num_vertices + 1, 0);
+	for (size_t i = 0; i < num_vertices; ++i)
+		adjacency_offset[i + 1] = adjacency_offset[i] + live_triangles[i];
+	std::vector<unsigned int> adjacency(num_indices);
+	std::vector<unsigned int> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+	for (size_t i = 0; i < num_indices; ++i)
+		adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+
+	std::vector<int> cache_position(num_vertices, -1);
+	std::vector<float> vertex_score(num_vertices);
+	for (size_t i = 0; i < num_vertices; ++i)
+		vertex_score[i] = forsythVertexScore(-1, live_triangles[i]);
+
+	std::vector<float> triangle_score(num_triangles);
+	for (size_t i = 0; i < num_triangles; ++i)
+		triangle_score[i] = vertex_score[indices[i * 3]] + vertex_score[indices[i * 3 + 1]] + vertex_score[indices[i * 3 + 2]];
+
+	std::vector<bool> emitted(num_triangles, false);
+	std::vector<unsigned int> result(num_indices);
+
+	unsigned int cache[FORSYTH_CACHE_SIZE + 3];
+	int cache_count = 0;
+
+	//first triangle: the best one
+	int best_triangle = (int)(std::max_element(triangle_score.begin(), triangle_score.end()) - triangle_score.begin());
+	size_t scan_position = 0; //to find a new start when nothing in the cache is useful
+
+	for (size_t output = 0; output < num_triangles; ++output)
+	{
+		if (best_triangle < 0)
+		{
+			while (emitted[scan_position])
+				scan_position++;
+			best_triangle = (int)scan_position;
+		}
+
+		const unsigned int* tri = indices + best_triangle * 3;
+		memcpy(&result[output * 3], tri, sizeof(unsigned int) * 3);
+		emitted[best_triangle] = true;
+
+		//remove it from the adjacency of its vertices
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = tri[k];
+			unsigned int* begin = &adjacency[adjacency_offset[v]];
+			unsigned int* end = begin + live_triangles[v];
+			unsigned int* it = std::find(begin, end, (unsigned int)best_triangle);
+			if (it != end)
+			{
+				*it = *(end - 1);
+				live_triangles[v]--;
+			}
+		}
+
+		//push the vertices to the front of the LRU cache
+		unsigned int new_cache[FORSYTH_CACHE_SIZE + 3];
+		int new_count = 0;
+		for (int k = 0; k < 3; ++k)
+			new_cache[new_count++] = tri[k];
+		for (int i = 0; i < cache_count; ++i)
+		{
+			unsigned int v = cache[i];
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				new_cache[new_count++] = v;
+		}
+
+		//update scores of the vertices in the cache (and the ones that fell off) and find the best triangle using them
+		best_triangle = -1;
+		float best_score = 0;
+		for (int i = 0; i < new_count; ++i)
+		{
+			unsigned int v = new_cache[i];
+			cache_position[v] = i < FORSYTH_CACHE_SIZE ? i : -1;
+			float score = forsythVertexScore(cache_position[v], live_triangles[v]);
+			float delta = score - vertex_score[v];
+			vertex_score[v] = score;
+			const unsigned int* adj = &adjacency[adjacency_offset[v]];
+			for (unsigned int j = 0; j < live_triangles[v]; ++j)
+			{
+				unsigned int t = adj[j];
+				triangle_score[t] += delta;
+				if (i < FORSYTH_CACHE_SIZE && triangle_score[t] > best_score)
+				{
+					best_score = triangle_score[t];
+					best_triangle = (int)t;
+				}
+			}
+		}
+
+		cache_count = new_count < FORSYTH_CACHE_SIZE ? new_count : FORSYTH_CACHE_SIZE;
+		memcpy(cache, new_cache, sizeof(unsigned int) * cache_count);
+	}
+
+	memcpy(indices, &result[0], sizeof(unsigned int) * num_indices);
+}
+
+struct sTriangleCluster {
+	unsigned int start; //in triangles
+	unsigned int length;
+	float sort_key;
+};
+
+void optimizeOverdraw(unsigned int* indices, size_t num_indices, const float* positions, size_t positions_stride, size_t num_vertices, float threshold)
+{
+	size_t num_triangles = num_indices / 3;
+	if (num_triangles < 2)
+		return;
+	size_t stride = positions_stride / sizeof(float);
+	#define POSITION(i) Vector3(positions[(i) * stride], positions[(i) * stride + 1], positions[(i) * stride + 2])
+
+	//split in clusters where the cache restarts (the three vertices of a triangle are misses)
+	std::vector<sTriangleCluster> clusters;
+	std::vector<unsigned int> timestamps(num_vertices, 0);
+	unsigned int time = VERTEX_CACHE_SIZE + 1;
+	for (size_t i = 0; i < num_triangles; ++i)
+	{
+		int misses = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = indices[i * 3 + k];
+			if (time - timestamps[v] > VERTEX_CACHE_SIZE)
+			{
+				timestamps[v] = time++;
+				misses++;
+			}
+		}
+		if (clusters.empty() || misses == 3)
+		{
+			sTriangleCluster cluster;
+			cluster.start = (unsigned int)i;
+			cluster.length = 0;
+			cluster.sort_key = 0;
+			clusters.push_back(cluster);
+		}
+		clusters.back().length++;
+	}
+	if (clusters.size() < 2)
+		return;
+
+	//mesh center
+	Vector3 mesh_center;
+	for (size_t i = 0; i < num_indices; ++i)
+		mesh_center = mesh_center + POSITION(indices[i]);
+	mesh_center = mesh_center * (1.0f / num_indices);
+
+	//clusters facing away from the center are more likely to occlude the rest, draw them first
+	for (size_t c = 0; c < clusters.size(); ++c)
+	{
+		sTriangleCluster& cluster = clusters[c];
+		Vector3 center, normal;
+		float area = 0;
+		for (unsigned int t = cluster.start; t < cluster.start + cluster.length; ++t)
+		{
+			Vector3 a = POSITION(indices[t * 3]);
+			Vector3 b = POSITION(indices[t * 3 + 1]);
+			Vector3 c = POSITION(indices[t * 3 + 2]);
+			Vector3 n = (b - a).cross(c - a); //length is twice the area
+			float triangle_area = n.length();
+			center = center + (a + b + c) * (triangle_area / 3.0f);
+			normal = normal + n;
+			area += triangle_area;
+		}
+		if (area > 0)
+			center = center * (1.0f / area);
+		float normal_length = normal.length();
+		if (normal_length > 0)
+			normal = normal * (1.0f / normal_length);
+		cluster.sort_key = (center - mesh_center).dot(normal);
+	}
+	#undef POSITION
+
+	std::vector<sTriangleCluster> sorted = clusters;
+	std::stable_sort(sorted.begin(), sorted.end(), [](const sTriangleCluster& a, const sTriangleCluster& b) { return a.sort_key > b.sort_key; });
+
+	std::vector<unsigned int> result(num_indices);
+	size_t output = 0;
+	for (size_t c = 0; c < sorted.size(); ++c)
+	{
+		memcpy(&result[output], indices + sorted[c].start * 3, sizeof(unsigned int) * sorted[c].length * 3);
+		output += sorted[c].length * 3;
+	}
+
+	//clusters start with a cold cache so the ACMR should barely change, but check it
+	float acmr_before = computeVertexCacheStats(indices, num_indices, num_vertices).acmr;
+	float acmr_after = computeVertexCacheStats(&result[0], num_indices, num_vertices).acmr;
+	if (acmr_after > acmr_before * threshold)
+		return;
+
+	memcpy(indices, &result[0], sizeof(unsigned int) * num_indices);
+}
+
+size_t optimizeVertexFetch(unsigned int* indices, size_t num_indices, size_t num_vertices, std::vector<unsigned int>& remap)
+{
+	remap.assign(num_vertices, 0xFFFFFFFF);
+	unsigned int next = 0;
+	for (size_t i = 0; i < num_indices; ++i)
+	{
+		unsigned int& index = indices[i];
+		if (remap[index] == 0xFFFFFFFF)
+			remap[index] = next++;
+		index = remap[index];
+	}
+	size_t num_used = next;
+	for (size_t i = 0; i < num_vertices; ++i)
+		if (remap[i] == 0xFFFFFFFF)
+			remap[i] = next++;
+	return num_used;
+}
+
+static void computeMeshletBounds(sMeshlet& meshlet, const unsigned int* indices, const float* positions, size_t stride)
+{
+	#define POSITION(i) Vector3(positions[(i) * stride], positions[(i) * stride + 1], positions[(i) * stride + 2])
+
+	//sphere around the box of the vertices
+	Vector3 min_pos = POSITION(indices[meshlet.start * 3]);
+	Vector3 max_pos = min_pos;
+	for (unsigned int i = meshlet.start * 3; i < (meshlet.start + meshlet.length) * 3; ++i)
+	{
+		min_pos.setMin(POSITION(indices[i]));
+		max_pos.setMax(POSITION(indices[i]));
+	}
+	Vector3 center = (min_pos + max_pos) * 0.5f;
+	float radius = 0;
+	for (unsigned int i = meshlet.start * 3; i < (meshlet.start + meshlet.length) * 3; ++i)
+		radius = std::max(radius, (float)(POSITION(indices[i]) - center).length());
+
+	//cone that contains all the normals
+	std::vector<Vector3> normals;
+	normals.reserve(meshlet.length);
+	Vector3 axis;
+	for (unsigned int t = meshlet.start; t < meshlet.start + meshlet.length; ++t)
+	{
+		Vector3 a = POSITION(indices[t * 3]);
+		Vector3 b = POSITION(indices[t * 3 + 1]);
+		Vector3 c = POSITION(indices[t * 3 + 2]);
+		Vector3 n = (b - a).cross(c - a);
+		float length = (float)n.length();
+		if (length == 0.0f) //degenerated, no orientation
+			continue;
+		n = n * (1.0f / length);
+		normals.push_back(n);
+		axis = axis + n;
+	}
+	#undef POSITION
+
+	float cutoff = 1.0f;
+	float axis_length = (float)axis.length();
+	if (axis_length > 0.0f && normals.size())
+	{
+		axis = axis * (1.0f / axis_length);
+		float min_dot = 1.0f;
+		for (size_t i = 0; i < normals.size(); ++i)
+			min_dot = std::min(min_dot, normals[i].dot(axis));
+		if (min_dot > 0.1f) //wider cones are almost never culled
+			cutoff = sqrtf(1.0f - min_dot * min_dot);
+	}
+
+	memcpy(meshlet.center, center.v, sizeof(float) * 3);
+	meshlet.radius = radius;
+	memcpy(meshlet.cone_axis, axis.v, sizeof(float) * 3);
+	meshlet.cone_cutoff = cutoff;
+}
+
+size_t buildMeshlets(unsigned int* indices, size_t num_indices, const float* positions, size_t positions_stride, size_t num_vertices, std::vector<sMeshlet>& meshlets, size_t max_vertices, size_t max_triangles)
+{
+	size_t num_triangles = num_indices / 3;
+	if (!num_triangles)
+		return 0;
+	assert(max_vertices >= 3 && max_triangles >= 1);
+	size_t stride = positions_stride / sizeof(float);
+
+	//triangles using every vertex (the emitted ones are removed as we go)
+	std::vector<unsigned int> live_triangles(num_vertices, 0);
+	for (size_t i = 0; i < num_indices; ++i)
+		live_triangles[indices[i]]++;
+	std::vector<unsigned int> adjacency_offset(num_vertices + 1, 0);
+	for (size_t i = 0; i < num_vertices; ++i)
+		adjacency_offset[i + 1] = adjacency_offset[i] + live_triangles[i];
+	std::vector<unsigned int> adjacency(num_indices);
+	std::vector<unsigned int> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+	for (size_t i = 0; i < num_indices; ++i)
+		adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+
+	std::vector<Vector3> triangle_centers(num_triangles);
+	for (size_t i = 0; i < num_triangles; ++i)
+	{
+		Vector3 center;
+		for (int k = 0; k < 3; ++k)
+		{
+			const float* p = positions + indices[i * 3 + k] * stride;
+			center = center + Vector3(p[0], p[1], p[2]);
+		}
+		triangle_centers[i] = center * (1.0f / 3.0f);
+	}
+
+	std::vector<bool> emitted(num_triangles, false);
+	std::vector<unsigned int> vertex_meshlet(num_vertices, 0xFFFFFFFF); //last meshlet that used every vertex
+	std::vector<unsigned int> vertex_local(num_vertices); //its position in meshlet_vertices
+	std::vector<unsigned int> local_indices;
+	std::vector<unsigned int> result;
+	result.reserve(num_indices);
+	std::vector<unsigned int> meshlet_vertices;
+	meshlet_vertices.reserve(max_vertices);
+
+	size_t first_meshlet = meshlets.size();
+	size_t scan_position = 0; //seed of the next meshlet, keeps the order of the input
+	while (result.size() < num_triangles * 3)
+	{
+		unsigned int meshlet_id = (unsigned int)meshlets.size();
+		sMeshlet meshlet;
+		meshlet.start = (unsigned int)(result.size() / 3);
+		meshlet.length = 0;
+		meshlet_vertices.clear();
+		Vector3 center_sum, box_min, box_max;
+
+		while (emitted[scan_position])
+			scan_position++;
+		int triangle = (int)scan_position;
+
+		while (triangle >= 0)
+		{
+			const unsigned int* tri = indices + triangle * 3;
+			result.insert(result.end(), tri, tri + 3);
+			emitted[triangle] = true;
+			meshlet.length++;
+			center_sum = center_sum + triangle_centers[triangle];
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = tri[k];
+				if (vertex_meshlet[v] != meshlet_id)
+				{
+					vertex_meshlet[v] = meshlet_id;
+					vertex_local[v] = (unsigned int)meshlet_vertices.size();
+					meshlet_vertices.push_back(v);
+					const float* p = positions + v * stride;
+					if (meshlet_vertices.size() == 1)
+						box_min = box_max = Vector3(p[0], p[1], p[2]);
+					box_min.setMin(Vector3(p[0], p[1], p[2]));
+					box_max.setMax(Vector3(p[0], p[1], p[2]));
+				}
+				unsigned int* begin = &adjacency[adjacency_offset[v]];
+				unsigned int* end = begin + live_triangles[v];
+				unsigned int* it = std::find(begin, end, (unsigned int)triangle);
+				if (it != end)
+				{
+					*it = *(end - 1);
+					live_triangles[v]--;
+				}
+			}
+			if (meshlet.length == max_triangles)
+				break;
+
+			//next one: the neighbour that adds less vertices, then the closest to the center
+			Vector3 center = center_sum * (1.0f / meshlet.length);
+			triangle = -1;
+			int best_new_vertices = 4;
+			float best_distance = 0;
+			for (size_t i = 0; i < meshlet_vertices.size(); ++i)
+			{
+				unsigned int v = meshlet_vertices[i];
+				const unsigned int* adj = &adjacency[adjacency_offset[v]];
+				for (unsigned int j = 0; j < live_triangles[v]; ++j)
+				{
+					unsigned int t = adj[j];
+					int new_vertices = (vertex_meshlet[indices[t * 3]] != meshlet_id) + (vertex_meshlet[indices[t * 3 + 1]] != meshlet_id) + (vertex_meshlet[indices[t * 3 + 2]] != meshlet_id);
+					if (meshlet_vertices.size() + new_vertices > max_vertices || new_vertices > best_new_vertices)
+						continue;
+					Vector3 delta = triangle_centers[t] - center;
+					float distance = delta.dot(delta);
+					if (new_vertices < best_new_vertices || distance < best_distance)
+					{
+						triangle = (int)t;
+						best_new_vertices = new_vertices;
+						best_distance = distance;
+					}
+				}
+			}
+
+			//no connected triangle left (hard edges split the vertices), try the next one in order if it is close enough
+			if (triangle == -1 && meshlet_vertices.size() + 3 <= max_vertices)
+			{
+				while (scan_position < num_triangles && emitted[scan_position])
+					scan_position++;
+				if (scan_position < num_triangles)
+				{
+					Vector3 delta = triangle_centers[scan_position] - center;
+					Vector3 extent = box_max - box_min;
+					if (delta.dot(delta) <= extent.dot(extent))
+						triangle = (int)scan_position;
+				}
+			}
+		}
+
+		//the growing order is not cache friendly, sort the triangles again inside the meshlet (with local indices to keep it cheap)
+		unsigned int* meshlet_indices = &result[meshlet.start * 3];
+		local_indices.resize(meshlet.length * 3);
+		for (size_t i = 0; i < local_indices.size(); ++i)
+			local_indices[i] = vertex_local[meshlet_indices[i]];
+		optimizeVertexCache(&local_indices[0], local_indices.size(), meshlet_vertices.size());
+		for (size_t i = 0; i < local_indices.size(); ++i)
+			meshlet_indices[i] = meshlet_vertices[local_indices[i]];
+
+		meshlets.push_back(meshlet);
+	}
+
+	memcpy(indices, &result[0], sizeof(unsigned int) * num_indices);
+
+	for (size_t i = first_meshlet; i < meshlets.size(); ++i)
+		computeMeshletBounds(meshlets[i], indices, positions, stride);
+	return meshlets.size() - first_meshlet;
+}
+
+struct sQuadric {
+	double a00, a11, a22, a01, a02, a12; //symmetric 3x3
+	double b0, b1, b2;
+	double c;
+	double weight; //sum of the weights, to get an average distance
+
+	void clear() { memset(this, 0, sizeof(sQuadric)); }
+
+	void addPlane(const Vector3& n, double d, double weight)
+	{
+		a00 += weight * n.x * n.x; a11 += weight * n.y * n.y; a22 += weight * n.z * n.z;
+		a01 += weight * n.x * n.y; a02 += weight * n.x * n.z; a12 += weight * n.y * n.z;
+		b0 += weight * n.x * d; b1 += weight * n.y * d; b2 += weight * n.z * d;
+		c += weight * d * d;
+		this->weight += weight;
+	}
+
+	void add(const sQuadric& q)
+	{
+		a00 += q.a00; a11 += q.a11; a22 += q.a22; a01 += q.a01; a02 += q.a02; a12 += q.a12;
+		b0 += q.b0; b1 += q.b1; b2 += q.b2;
+		c += q.c;
+		weight += q.weight;
+	}
+
+	//average squared distance to the planes
+	double error(const Vector3& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double e = a00 * x * x + a11 * y * y + a22 * z * z + 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z) + 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+		return e > 0 && weight > 0 ? e / weight : 0;
+	}
+};
+
+struct sCollapse {
+	unsigned int from;
+	unsigned int to;
+	double cost;
+};
+
+static size_t simplifyCompact(unsigned int* destination, const unsigned int* indices, size_t num_indices, const float* positions, size_t positions_stride, size_t num_vertices, size_t target_index_count, float* result_error)
+{
+	size_t stride = positions_stride / sizeof(float);
+	#define POSITION(i) Vector3(positions[(i) * stride], positions[(i) * stride + 1], positions[(i) * stride + 2])
+
+	std::vector<unsigned int> result(indices, indices + num_indices);
+	if (result_error)
+		*result_error = 0;
+	if (num_indices <= target_index_count || !num_vertices)
+	{
+		if (result.size())
+			memcpy(destination, &result[0], sizeof(unsigned int) * result.size());
+		return result.size();
+	}
+
+	//weld the vertices by position (the other attributes create seams)
+	std::vector<unsigned int> sorted(num_vertices);
+	for (size_t i = 0; i < num_vertices; ++i)
+		sorted[i] = (unsigned int)i;
+	std::sort(sorted.begin(), sorted.end(), [&](unsigned int a, unsigned int b) {
+		const float* pa = positions + a * stride;
+		const float* pb = positions + b * stride;
+		if (pa[0] != pb[0]) return pa[0] < pb[0];
+		if (pa[1] != pb[1]) return pa[1] < pb[1];
+		return pa[2] < pb[2];
+	});
+	std::vector<unsigned int> welded(num_vertices); //the first vertex with the same position
+	std::vector<bool> locked(num_vertices, false); //by welded vertex
+	for (size_t i = 0; i < num_vertices; ++i)
+	{
+		unsigned int v = sorted[i];
+		if (i > 0 && memcmp(positions + v * stride, positions + sorted[i - 1] * stride, sizeof(float) * 3) == 0)
+		{
+			welded[v] = welded[sorted[i - 1]];
+			locked[welded[v]] = true; //seam
+		}
+		else
+			welded[v] = v;
+	}
+
+	//open borders: edges without the opposite one
+	std::vector<unsigned long long> edges(num_indices);
+	for (size_t i = 0; i < num_indices; ++i)
+	{
+		unsigned int a = welded[indices[i]];
+		unsigned int b = welded[indices[i - i % 3 + (i + 1) % 3]];
+		edges[i] = ((unsigned long long)a << 32) | b;
+	}
+	std::sort(edges.begin(), edges.end());
+	for (size_t i = 0; i < edges.size(); ++i)
+	{
+		unsigned long long opposite = (edges[i] << 32) | (edges[i] >> 32);
+		if (!std::binary_search(edges.begin(), edges.end(), opposite))
+			locked[edges[i] >> 32] = locked[edges[i] & 0xFFFFFFFF] = true;
+	}
+
+	//quadric of the planes around every welded vertex (weighted by area) and the radius to normalize the error
+	std::vector<sQuadric> quadrics(num_vertices);
+	for (size_t i = 0; i < num_vertices; ++i)
+		quadrics[i].clear();
+	Vector3 min_pos = POSITION(indices[0]);
+	Vector3 max_pos = min_pos;
+	for (size_t i = 0; i < num_indices; i += 3)
+	{
+		Vector3 a = POSITION(indices[i]);
+		Vector3 b = POSITION(indices[i + 1]);
+		Vector3 c = POSITION(indices[i + 2]);
+		min_pos.setMin(a); min_pos.setMin(b); min_pos.setMin(c);
+		max_pos.setMax(a); max_pos.setMax(b); max_pos.setMax(c);
+		Vector3 n = (b - a).cross(c - a);
+		float area = (float)n.length();
+		if (area == 0.0f)
+			continue;
+		n = n * (1.0f / area);
+		double d = -n.dot(a);
+		for (int k = 0; k < 3; ++k)
+			quadrics[welded[indices[i + k]]].addPlane(n, d, area * 0.5);
+	}
+	float radius = (float)(max_pos - min_pos).length() * 0.5f;
+
+	std::vector<unsigned int> remap(num_vertices);
+	std::vector<bool> pass_locked(num_vertices);
+	std::vector<unsigned int> best_target(num_vertices);
+	std::vector<double> best_cost(num_vertices);
+	std::vector<unsigned int> adjacency_offset(num_vertices + 1);
+	std::vector<unsigned int> adjacency;
+	std::vector<sCollapse> collapses;
+	double max_error = 0;
+
+	//every pass collapses the cheapest edges that do not touch each other, until the target is reached
+	while (result.size() > target_index_count)
+	{
+		//triangles around every vertex
+		std::fill(adjacency_offset.begin(), adjacency_offset.end(), 0);
+		for (size_t i = 0; i < result.size(); ++i)
+			adjacency_offset[result[i] + 1]++;
+		for (size_t i = 0; i < num_vertices; ++i)
+			adjacency_offset[i + 1] += adjacency_offset[i];
+		adjacency.resize(result.size());
+		std::vector<unsigned int> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+		for (size_t i = 0; i < result.size(); ++i)
+			adjacency[fill[result[i]]++] = (unsigned int)(i / 3);
+
+		//cheapest edge of every vertex that can be removed
+		std::fill(best_cost.begin(), best_cost.end(), -1.0);
+		for (size_t i = 0; i < result.size(); ++i)
+		{
+			unsigned int from = result[i];
+			unsigned int to = result[i - i % 3 + (i + 1) % 3];
+			for (int k = 0; k < 2; ++k, std::swap(from, to))
+			{
+				if (locked[welded[from]] || welded[from] == welded[to])
+					continue;
+				sQuadric q = quadrics[welded[from]];
+				q.add(quadrics[welded[to]]);
+				double cost = q.error(POSITION(to));
+				if (best_cost[from] < 0 || cost < best_cost[from])
+				{
+					best_cost[from] = cost;
+					best_target[from] = to;
+				}
+			}
+		}
+
+		collapses.clear();
+		for (size_t i = 0; i < num_vertices; ++i)
+			if (best_cost[i] >= 0)
+			{
+				sCollapse collapse = { (unsigned int)i, best_target[i], best_cost[i] };
+				collapses.push_back(collapse);
+			}
+		if (collapses.empty())
+			break;
+		std::sort(collapses.begin(), collapses.end(), [](const sCollapse& a, const sCollapse& b) { return a.cost < b.cost; });
+
+		for (size_t i = 0; i < num_vertices; ++i)
+			remap[i] = (unsigned int)i;
+		std::fill(pass_locked.begin(), pass_locked.end(), false);
+
+		size_t triangles_left = result.size() / 3;
+		size_t target_triangles = target_index_count / 3;
+		size_t num_collapsed = 0;
+		for (size_t c = 0; c < collapses.size() && triangles_left > target_triangles; ++c)
+		{
+			const sCollapse& collapse = collapses[c];
+			if (pass_locked[collapse.from] || pass_locked[collapse.to])
+				continue;
+
+			//the triangles that stay must not flip
+			Vector3 new_position = POSITION(collapse.to);
+			bool flips = false;
+			int removed = 0;
+			for (unsigned int j = adjacency_offset[collapse.from]; j < adjacency_offset[collapse.from + 1] && !flips; ++j)
+			{
+				const unsigned int* tri = &result[adjacency[j] * 3];
+				if (welded[tri[0]] == welded[collapse.to] || welded[tri[1]] == welded[collapse.to] || welded[tri[2]] == welded[collapse.to])
+				{
+					removed++;
+					continue;
+				}
+				Vector3 p[3];
+				for (int k = 0; k < 3; ++k)
+					p[k] = POSITION(tri[k]);
+				Vector3 n0 = (p[1] - p[0]).cross(p[2] - p[0]);
+				for (int k = 0; k < 3; ++k)
+					if (tri[k] == collapse.from)
+						p[k] = new_position;
+				Vector3 n1 = (p[1] - p[0]).cross(p[2] - p[0]);
+				if (n0.dot(n1) <= 0)
+					flips = true;
+			}
+			if (flips)
+				continue;
+
+			remap[collapse.from] = collapse.to;
+			quadrics[welded[collapse.to]].add(quadrics[welded[collapse.from]]);
+			if (collapse.cost > max_error)
+				max_error = collapse.cost;
+			triangles_left -= removed;
+			num_collapsed++;
+
+			//the triangles around it changed, their vertices wait for the next pass
+			pass_locked[collapse.to] = true;
+			for (unsigned int j = adjacency_offset[collapse.from]; j < adjacency_offset[collapse.from + 1]; ++j)
+				for (int k = 0; k < 3; ++k)
+					pass_locked[result[adjacency[j] * 3 + k]] = true;
+		}
+		if (!num_collapsed)
+			break;
+
+		//apply and remove the degenerated triangles
+		size_t write = 0;
+		for (size_t i = 0; i < result.size(); i += 3)
+		{
+			unsigned int a = remap[result[i]];
+			unsigned int b = remap[result[i + 1]];
+			unsigned int c = remap[result[i + 2]];
+			if (welded[a] == welded[b] || welded[b] == welded[c] || welded[a] == welded[c])
+				continue;
+			result[write++] = a;
+			result[write++] = b;
+			result[write++] = c;
+		}
+		result.resize(write);
+	}
+	#undef POSITION
+
+	if (result_error)
+		*result_error = radius > 0 ? (float)(sqrt(max_error) / radius) : 0.0f;
+	if (result.size())
+		memcpy(destination, &result[0], sizeof(unsigned int) * result.size());
+	return result.size();
+}
+
+size_t simplifyMesh(unsigned int* destination, const unsigned int* indices, size_t num_indices, const float* positions, size_t positions_stride, size_t num_vertices, size_t target_index_count, float* result_error)
+{
+	//work only with the vertices used by these triangles, submeshes and LODs use a small part of the mesh
+	std::vector<unsigned int> local(num_vertices, 0xFFFFFFFF);
+	std::vector<unsigned int> used;
+	std::vector<unsigned int> local_indices(num_indices);
+	for (size_t i = 0; i < num_indices; ++i)
+	{
+		unsigned int v = indices[i];
+		if (local[v] == 0xFFFFFFFF)
+		{
+			local[v] = (unsigned int)used.size();
+			used.push_back(v);
+		}
+		local_indices[i] = local[v];
+	}
+	size_t stride = positions_stride / sizeof(float);
+	std::vector<float> local_positions(used.size() * 3);
+	for (size_t i = 0; i < used.size(); ++i)
+		memcpy(&local_positions[i * 3], positions + used[i] * stride, sizeof(float) * 3);
+
+	size_t count = simplifyCompact(destination, num_indices ? &local_indices[0] : NULL, num_indices, local_positions.size() ? &local_positions[0] : NULL, sizeof(float) * 3, used.size(), target_index_count, result_error);
+	for (size_t i = 0; i < count; ++i)
+		destination[i] = used[destination[i]];
+	return count;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+//index buffer optimizations, they work on triangle lists (3 indices per triangle)
+
+#define VERTEX_CACHE_SIZE 16 //FIFO size used to measure, close to what most GPUs do
+
+struct sVertexCacheStats {
+	float acmr; //average cache miss ratio: transformed vertices per triangle (0.5 is ideal, 3 is the worst)
+	float atvr; //average transformed vertex ratio: transformed vertices per referenced vertex (1 is ideal)
+};
+
+sVertexCacheStats computeVertexCacheStats(const unsigned int* indices, size_t num_indices, size_t num_vertices, int cache_size = VERTEX_CACHE_SIZE);
+
+//reorders the triangles so the vertices are reused while they are in the post-transform cache (Forsyth)
+void optimizeVertexCache(unsigned int* indices, size_t num_indices, size_t num_vertices);
+
+//reorders clusters of triangles (split where the cache restarts) so the ones facing outwards go first, keeps the order if the ACMR grows more than threshold
+void optimizeOverdraw(unsigned int* indices, size_t num_indices, const float* positions, size_t positions_stride, size_t num_vertices, float threshold = 1.05f);
+
+//renames the vertices in order of first use, fills remap with the new index of every old vertex (unused ones go at the end), returns the number of used vertices
+size_t optimizeVertexFetch(unsigned int* indices, size_t num_indices, size_t num_vertices, std::vector<unsigned int>& remap);
+
+//clusters of neighbouring triangles with the info needed to cull them before drawing
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+struct sMeshlet {
+	unsigned int start; //in triangles
+	unsigned int length;
+	float center[3]; //bounding sphere
+	float radius;
+	float cone_axis[3]; //average normal of the triangles
+	float cone_cutoff; //sin of the cone spread, 1 if the normals are too different to cull by orientation
+};
+
+//reorders the triangles so every meshlet is a contiguous range (growing from neighbour triangles), appends the meshlets (start is relative to indices) and returns how many were added
+size_t buildMeshlets(unsigned int* indices, size_t num_indices, const float* positions, size_t positions_stride, size_t num_vertices, std::vector<sMeshlet>& meshlets, size_t max_vertices = MESHLET_MAX_VERTICES, size_t max_triangles = MESHLET_MAX_TRIANGLES);
+
+//quadric error edge collapse (Garland-Heckbert), the vertices are not modified: the result is a new index buffer that uses part of them
+//vertices on open borders or on attribute seams (same position, other normal or uv) are never removed
+//returns the number of indices written in destination (it needs num_indices), result_error is the distance error relative to the mesh radius
+size_t simplifyMesh(unsigned int* destination, const unsigned int* indices, size_t num_indices, const float* positions, size_t positions_stride, size_t num_vertices, size_t target_index_count, float* result_error = NULL);
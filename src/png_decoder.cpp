@@ -0,0 +1,815 @@
+#include "png_decoder.h"
+#include "utils.h" //parallelFor
+
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define PNG_USE_SSE2
+	#include <emmintrin.h>
+#endif
+
+#define INFLATE_FAST_BITS 10
+#define PNG_MAX_SIZE 16384
+
+static unsigned int readBE32(const unsigned char* p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+// INFLATE ***********************************
+
+static const unsigned short length_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const unsigned char length_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const unsigned short dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const unsigned char dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+static unsigned int reverseBits(unsigned int v, int num_bits)
+{
+	v = ((v & 0xAAAA) >> 1) | ((v & 0x5555) << 1);
+	v = ((v & 0xCCCC) >> 2) | ((v & 0x3333) << 2);
+	v = ((v & 0xF0F0) >> 4) | ((v & 0x0F0F) << 4);
+	v = ((v & 0xFF00) >> 8) | ((v & 0x00FF) << 8);
+	return v >> (16 - num_bits);
+}
+
+//canonical huffman code: the short codes are solved with one lookup of the next INFLATE_FAST_BITS bits,
+//the longer ones comparing the bits (reversed) with the last code of every length
+struct sHuffmanTable
+{
+	unsigned short fast[1 << INFLATE_FAST_BITS]; //(code length << 9) | symbol, 0 if the code is longer
+	unsigned int max_code[17]; //first code after the ones of this length, shifted to 16 bits
+	unsigned short first_code[16];
+	unsigned short first_index[16];
+	unsigned char sizes[288]; //by index (symbols sorted by code)
+	unsigned short symbols[288];
+
+	bool build(const unsigned char* lengths, int num)
+	{
+		int counts[16] = { 0 };
+		int next_code[16];
+		memset(fast, 0, sizeof(fast));
+		for (int i = 0; i < num; ++i)
+			counts[lengths[i]]++;
+		counts[0] = 0;
+
+		int code = 0;
+		int index = 0;
+		for (int i = 1; i < 16; ++i)
+		{
+			next_code[i] = code;
+			first_code[i] = (unsigned short)code;
+			first_index[i] = (unsigned short)index;
+			code += counts[i];
+			if (counts[i] && code - 1 >= (1 << i))
+				return false; //over-subscribed
+			max_code[i] = code << (16 - i);
+			code <<= 1;
+			index += counts[i];
+		}
+		max_code[16] = 0x10000;
+
+		for (int i = 0; i < num; ++i)
+		{
+			int size = lengths[i];
+			if (!size)
+				continue;
+			int c = next_code[size] - first_code[size] + first_index[size];
+			sizes[c] = (unsigned char)size;
+			symbols[c] = (unsigned short)i;
+			if (size <= INFLATE_FAST_BITS)
+				for (int j = reverseBits(next_code[size], size); j < (1 << INFLATE_FAST_BITS); j += 1 << size)
+					fast[j] = (unsigned short)((size << 9) | i);
+			next_code[size]++;
+		}
+		return true;
+	}
+};
+
+struct sFixedTables
+{
+	sHuffmanTable litlen;
+	sHuffmanTable dist;
+	sFixedTables()
+	{
+		unsigned char lengths[288];
+		memset(lengths, 8, 144);
+		memset(lengths + 144, 9, 112);
+		memset(lengths + 256, 7, 24);
+		memset(lengths + 280, 8, 8);
+		litlen.build(lengths, 288);
+		memset(lengths, 5, 30);
+		dist.build(lengths, 30);
+	}
+};
+
+//raw deflate stream to memory, the bits are read 64 at a time (little endian)
+struct sInflater
+{
+	const unsigned char* in_begin;
+	const unsigned char* in;
+	const unsigned char* in_end;
+	size_t padding; //zero bytes read past the end
+	unsigned long long bits; //above num_bits it can hold part of the next bytes, they are loaded again at the same place
+	int num_bits;
+
+	unsigned char* out_begin; //back references cannot go before it
+	unsigned char* out;
+	unsigned char* out_end;
+	std::vector<unsigned char>* growable; //if not NULL the output is this vector and it grows when it is full
+	size_t max_output; //the growable output cannot be bigger
+
+	bool final_block;
+	bool ended_at_input_end;
+	sHuffmanTable litlen;
+	sHuffmanTable dist;
+
+	sInflater(const unsigned char* input, size_t input_size, unsigned char* output, size_t output_size, std::vector<unsigned char>* growable = NULL, size_t max_output = 0)
+	{
+		in_begin = in = input;
+		in_end = input + input_size;
+		padding = 0;
+		bits = 0;
+		num_bits = 0;
+		out_begin = out = output;
+		out_end = output + output_size;
+		this->growable = growable;
+		this->max_output = max_output;
+		final_block = false;
+		ended_at_input_end = false;
+	}
+
+	void refill()
+	{
+		if (in_end - in >= 8)
+		{
+			unsigned long long v;
+			memcpy(&v, in, 8);
+			bits |= v << num_bits;
+			in += (63 - num_bits) >> 3;
+			num_bits |= 56;
+			return;
+		}
+		while (num_bits <= 56)
+		{
+			if (in < in_end)
+				bits |= (unsigned long long)*in++ << num_bits;
+			else
+				padding++;
+			num_bits += 8;
+		}
+	}
+
+	unsigned int getBits(int n)
+	{
+		if (num_bits < n)
+			refill();
+		unsigned int v = (unsigned int)(bits & ((1ULL << n) - 1));
+		bits >>= n;
+		num_bits -= n;
+		return v;
+	}
+
+	size_t consumedBits() { return (size_t)(in - in_begin + padding) * 8 - num_bits; }
+	bool overrun() { return consumedBits() > (size_t)(in_end - in_begin) * 8; }
+
+	int decodeSymbol(const sHuffmanTable& table)
+	{
+		if (num_bits < 16)
+			refill();
+		int entry = table.fast[bits & ((1 << INFLATE_FAST_BITS) - 1)];
+		if (entry)
+		{
+			int size = entry >> 9;
+			bits >>= size;
+			num_bits -= size;
+			return entry & 511;
+		}
+
+		unsigned int k = reverseBits((unsigned int)(bits & 0xFFFF), 16);
+		int size = INFLATE_FAST_BITS + 1;
+		while (size < 16 && k >= table.max_code[size])
+			size++;
+		if (size == 16)
+			return -1; //invalid code
+		int index = (k >> (16 - size)) - table.first_code[size] + table.first_index[size];
+		if (index >= 288 || table.sizes[index] != size)
+			return -1;
+		bits >>= size;
+		num_bits -= size;
+		return table.symbols[index];
+	}
+
+	bool reserve(size_t size)
+	{
+		if ((size_t)(out_end - out) >= size)
+			return true;
+		size_t used = out - out_begin;
+		if (!growable || used + size > max_output || overrun())
+			return false; //a broken stream could go on with the zeros past the end
+		growable->resize(std::max(growable->size() * 2, used + size));
+		out_begin = &(*growable)[0];
+		out = out_begin + used;
+		out_end = out_begin + growable->size();
+		return true;
+	}
+
+	bool copyStored()
+	{
+		int skip = num_bits & 7;
+		bits >>= skip;
+		num_bits -= skip;
+		unsigned int length = getBits(16);
+		unsigned int nlength = getBits(16);
+		if ((length ^ 0xFFFF) != nlength || !reserve(length))
+			return false;
+
+		//the bytes already in the bit buffer go first
+		while (length && num_bits >= 8)
+		{
+			*out++ = (unsigned char)bits;
+			bits >>= 8;
+			num_bits -= 8;
+			length--;
+		}
+		if (length)
+		{
+			if (padding || (size_t)(in_end - in) < length)
+				return false;
+			memcpy(out, in, length);
+			out += length;
+			in += length;
+			bits = 0;
+		}
+		return true;
+	}
+
+	bool readDynamicTables()
+	{
+		static const unsigned char order[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+		int num_litlen = getBits(5) + 257;
+		int num_dist = getBits(5) + 1;
+		int num_code_lengths = getBits(4) + 4;
+		if (num_litlen > 286)
+			return false;
+
+		unsigned char code_length_sizes[19] = { 0 };
+		for (int i = 0; i < num_code_lengths; ++i)
+			code_length_sizes[order[i]] = (unsigned char)getBits(3);
+		sHuffmanTable code_lengths;
+		if (!code_lengths.build(code_length_sizes, 19))
+			return false;
+
+		unsigned char lengths[286 + 32];
+		int total = num_litlen + num_dist;
+		int n = 0;
+		while (n < total)
+		{
+			int symbol = decodeSymbol(code_lengths);
+			if (symbol < 0 || symbol > 18)
+				return false;
+			if (symbol < 16)
+			{
+				lengths[n++] = (unsigned char)symbol;
+				continue;
+			}
+			int repeat;
+			unsigned char value = 0;
+			if (symbol == 16)
+			{
+				if (n == 0)
+					return false;
+				value = lengths[n - 1];
+				repeat = 3 + getBits(2);
+			}
+			else if (symbol == 17)
+				repeat = 3 + getBits(3);
+			else
+				repeat = 11 + getBits(7);
+			if (n + repeat > total)
+				return false;
+			memset(lengths + n, value, repeat);
+			n += repeat;
+		}
+		if (lengths[256] == 0)
+			return false; //no end of block
+		return litlen.build(lengths, num_litlen) && dist.build(lengths + num_litlen, num_dist);
+	}
+
+	bool decodeBlock(const sHuffmanTable& litlen, const sHuffmanTable& dist)
+	{
+		while (true)
+		{
+			int symbol = decodeSymbol(litlen);
+			if (symbol < 256)
+			{
+				if (symbol < 0 || !reserve(1))
+					return false;
+				*out++ = (unsigned char)symbol;
+				continue;
+			}
+			if (symbol == 256)
+				return true;
+			symbol -= 257;
+			if (symbol >= 29)
+				return false;
+			size_t length = length_base[symbol] + getBits(length_extra[symbol]);
+			int dist_symbol = decodeSymbol(dist);
+			if (dist_symbol < 0 || dist_symbol >= 30)
+				return false;
+			size_t distance = dist_base[dist_symbol] + getBits(dist_extra[dist_symbol]);
+			if (distance > (size_t)(out - out_begin) || !reserve(length))
+				return false;
+
+			const unsigned char* src = out - distance;
+			if (distance >= 8 && (size_t)(out_end - out) >= length + 8)
+			{
+				//8 bytes at a time, it may write past the match but it is overwritten later
+				unsigned char* end = out + length;
+				do {
+					memcpy(out, src, 8);
+					out += 8;
+					src += 8;
+				} while (out < end);
+				out = end;
+			}
+			else if (distance == 1)
+			{
+				memset(out, *src, length);
+				out += length;
+			}
+			else
+				for (size_t i = 0; i < length; ++i)
+					*out++ = src[i];
+		}
+	}
+
+	//stop_at_input_end: returns after the block that ends exactly at the end of the input (a flush), for the split streams
+	bool run(bool stop_at_input_end = false)
+	{
+		static sFixedTables fixed_tables;
+		while (!final_block)
+		{
+			final_block = getBits(1) != 0;
+			int type = getBits(2);
+			bool valid = false;
+			if (type == 0)
+				valid = copyStored();
+			else if (type == 1)
+				valid = decodeBlock(fixed_tables.litlen, fixed_tables.dist);
+			else if (type == 2)
+				valid = readDynamicTables() && decodeBlock(litlen, dist);
+			if (!valid || overrun())
+				return false;
+			if (stop_at_input_end && !final_block && consumedBits() == (size_t)(in_end - in_begin) * 8)
+			{
+				ended_at_input_end = true;
+				return true;
+			}
+		}
+		return true;
+	}
+};
+
+static bool checkZlibHeader(const unsigned char* data, size_t size)
+{
+	//deflate, no preset dictionary
+	return size >= 2 && (data[0] & 15) == 8 && (data[0] >> 4) <= 7 && ((data[0] << 8) | data[1]) % 31 == 0 && !(data[1] & 32);
+}
+
+struct sPNGChunk {
+	const unsigned char* data;
+	size_t size;
+};
+
+//every IDAT inflated in its own thread, only valid if the encoder did a full flush at the end of every chunk
+static bool inflateChunksInParallel(const std::vector<sPNGChunk>& chunks, unsigned char* output, size_t output_size)
+{
+	int num_chunks = (int)chunks.size();
+	std::vector< std::vector<unsigned char> > outputs(num_chunks);
+	std::vector<char> valid(num_chunks, 0);
+	parallelFor(num_chunks, [&](int i) {
+		const unsigned char* data = chunks[i].data;
+		size_t size = chunks[i].size;
+		if (i == 0)
+		{
+			if (!checkZlibHeader(data, size))
+				return;
+			data += 2;
+			size -= 2;
+		}
+		std::vector<unsigned char>& result = outputs[i];
+		result.resize(std::max((size_t)4096, size * 4));
+		sInflater inflater(data, size, &result[0], result.size(), &result, output_size);
+		bool last = i == num_chunks - 1;
+		//no back references out of the chunk, so it did not depend on the previous ones
+		valid[i] = inflater.run(!last) && (last ? inflater.final_block : inflater.ended_at_input_end);
+		result.resize(inflater.out - inflater.out_begin);
+	});
+
+	size_t total = 0;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		if (!valid[i])
+			return false;
+		total += outputs[i].size();
+	}
+	if (total != output_size)
+		return false;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		if (outputs[i].size())
+			memcpy(output, &outputs[i][0], outputs[i].size());
+		output += outputs[i].size();
+	}
+	return true;
+}
+
+static bool inflateChunks(const std::vector<sPNGChunk>& chunks, unsigned char* output, size_t output_size)
+{
+	//a flush (empty stored block) at the end of every chunk but the last, the chunks may be independent
+	bool flushed = chunks.size() > 1 && getNumCores() > 1;
+	for (size_t i = 0; i + 1 < chunks.size() && flushed; ++i)
+		flushed = chunks[i].size >= 4 && memcmp(chunks[i].data + chunks[i].size - 4, "\x00\x00\xFF\xFF", 4) == 0;
+	if (flushed && inflateChunksInParallel(chunks, output, output_size))
+		return true;
+
+	//the zlib stream is split in chunks, join them unless there is only one
+	std::vector<unsigned char> joined;
+	const unsigned char* data = chunks[0].data;
+	size_t size = chunks[0].size;
+	if (chunks.size() > 1)
+	{
+		for (size_t i = 0; i < chunks.size(); ++i)
+			joined.insert(joined.end(), chunks[i].data, chunks[i].data + chunks[i].size);
+		data = &joined[0];
+		size = joined.size();
+	}
+	if (!checkZlibHeader(data, size))
+		return false;
+	//the adler32 at the end is not checked
+	sInflater inflater(data + 2, size - 2, output, output_size);
+	return inflater.run() && inflater.out == output + output_size;
+}
+
+// UNFILTER ***********************************
+
+static unsigned char paeth(int a, int b, int c)
+{
+	int pa = abs(b - c);
+	int pb = abs(a - c);
+	int pc = abs(a + b - 2 * c);
+	if (pa <= pb && pa <= pc)
+		return (unsigned char)a;
+	return (unsigned char)(pb <= pc ? b : c);
+}
+
+#ifdef PNG_USE_SSE2
+//one pixel (3 or 4 bytes) in the low lanes, the stores never write past the pixel
+//the 3 bytes ones are joined in registers, going through memory would stall every pixel
+template<int BPP> static inline __m128i loadPixel(const unsigned char* p);
+template<int BPP> static inline void storePixel(unsigned char* p, __m128i v);
+template<> inline __m128i loadPixel<4>(const unsigned char* p) { int v; memcpy(&v, p, 4); return _mm_cvtsi32_si128(v); }
+template<> inline void storePixel<4>(unsigned char* p, __m128i v) { int r = _mm_cvtsi128_si32(v); memcpy(p, &r, 4); }
+template<> inline __m128i loadPixel<3>(const unsigned char* p) { return _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16)); }
+template<> inline void storePixel<3>(unsigned char* p, __m128i v) { int r = _mm_cvtsi128_si32(v); p[0] = (unsigned char)r; p[1] = (unsigned char)(r >> 8); p[2] = (unsigned char)(r >> 16); }
+static inline __m128i abs16(__m128i v) { return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v)); }
+static inline __m128i select(__m128i mask, __m128i a, __m128i b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+
+//sub, avg and paeth depend on the previous pixel, so the lanes are the channels of one pixel
+template<int BPP>
+static bool unfilterRowSSE2(unsigned char* row, const unsigned char* prev, size_t row_bytes, int filter)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = zero;
+	if (filter == 1)
+		for (size_t i = 0; i < row_bytes; i += BPP)
+		{
+			a = _mm_add_epi8(loadPixel<BPP>(row + i), a);
+			storePixel<BPP>(row + i, a);
+		}
+	else if (filter == 3)
+	{
+		__m128i one = _mm_set1_epi8(1);
+		for (size_t i = 0; i < row_bytes; i += BPP)
+		{
+			__m128i b = loadPixel<BPP>(prev + i);
+			//avg_epu8 rounds up, the filter rounds down
+			__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+			a = _mm_add_epi8(loadPixel<BPP>(row + i), average);
+			storePixel<BPP>(row + i, a);
+		}
+	}
+	else if (filter == 4)
+	{
+		__m128i c = zero;
+		__m128i mask = _mm_set1_epi16(255);
+		for (size_t i = 0; i < row_bytes; i += BPP)
+		{
+			__m128i b = _mm_unpacklo_epi8(loadPixel<BPP>(prev + i), zero);
+			__m128i x = _mm_unpacklo_epi8(loadPixel<BPP>(row + i), zero);
+			__m128i pa = _mm_sub_epi16(b, c);
+			__m128i pb = _mm_sub_epi16(a, c);
+			__m128i pc = abs16(_mm_add_epi16(pa, pb));
+			pa = abs16(pa);
+			pb = abs16(pb);
+			__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+			__m128i nearest = select(_mm_cmpeq_epi16(smallest, pa), a, select(_mm_cmpeq_epi16(smallest, pb), b, c));
+			a = _mm_and_si128(_mm_add_epi16(x, nearest), mask);
+			storePixel<BPP>(row + i, _mm_packus_epi16(a, a));
+			c = b;
+		}
+	}
+	else
+		return false;
+	return true;
+}
+#endif
+
+//prev is the previous row already unfiltered (zeros for the first one), bpp the bytes per pixel (at least 1)
+static bool unfilterRow(unsigned char* row, const unsigned char* prev, size_t row_bytes, int bpp, int filter)
+{
+	switch (filter)
+	{
+	case 0:
+		return true;
+	case 1:
+#ifdef PNG_USE_SSE2
+		if (bpp == 3 || bpp == 4)
+			return bpp == 3 ? unfilterRowSSE2<3>(row, prev, row_bytes, filter) : unfilterRowSSE2<4>(row, prev, row_bytes, filter);
+#endif
+		for (size_t i = bpp; i < row_bytes; ++i)
+			row[i] += row[i - bpp];
+		return true;
+	case 2:
+	{
+		size_t i = 0;
+#ifdef PNG_USE_SSE2
+		for (; i + 16 <= row_bytes; i += 16)
+			_mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(row + i)), _mm_loadu_si128((const __m128i*)(prev + i))));
+#endif
+		for (; i < row_bytes; ++i)
+			row[i] += prev[i];
+		return true;
+	}
+	case 3:
+#ifdef PNG_USE_SSE2
+		if (bpp == 3 || bpp == 4)
+			return bpp == 3 ? unfilterRowSSE2<3>(row, prev, row_bytes, filter) : unfilterRowSSE2<4>(row, prev, row_bytes, filter);
+#endif
+		for (size_t i = 0; i < (size_t)bpp && i < row_bytes; ++i)
+			row[i] += prev[i] >> 1;
+		for (size_t i = bpp; i < row_bytes; ++i)
+			row[i] += (row[i - bpp] + prev[i]) >> 1;
+		return true;
+	case 4:
+#ifdef PNG_USE_SSE2
+		if (bpp == 3 || bpp == 4)
+			return bpp == 3 ? unfilterRowSSE2<3>(row, prev, row_bytes, filter) : unfilterRowSSE2<4>(row, prev, row_bytes, filter);
+#endif
+		for (size_t i = 0; i < (size_t)bpp && i < row_bytes; ++i)
+			row[i] += prev[i];
+		for (size_t i = bpp; i < row_bytes; ++i)
+			row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+		return true;
+	}
+	return false;
+}
+
+// DECODE ***********************************
+
+static int getPNGChannels(int color_type)
+{
+	switch (color_type)
+	{
+	case 0: return 1;
+	case 2: return 3;
+	case 3: return 1;
+	case 4: return 2;
+	case 6: return 4;
+	}
+	return 0;
+}
+
+static size_t getPNGRowBytes(const sPNGInfo& info)
+{
+	return ((size_t)info.width * getPNGChannels(info.color_type) * info.bit_depth + 7) / 8;
+}
+
+bool readPNGInfo(const unsigned char* png, size_t size, sPNGInfo& info)
+{
+	static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	if (size < 33 || memcmp(png, signature, 8) != 0 || memcmp(png + 12, "IHDR", 4) != 0)
+		return false;
+	info.width = readBE32(png + 16);
+	info.height = readBE32(png + 20);
+	info.bit_depth = png[24];
+	info.color_type = png[25];
+	info.interlace = png[28];
+	if (!info.width || !info.height || png[26] != 0 || png[27] != 0 || info.interlace > 1)
+		return false;
+
+	int depth = info.bit_depth;
+	switch (info.color_type)
+	{
+	case 0: return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+	case 3: return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+	case 2: case 4: case 6: return depth == 8 || depth == 16;
+	}
+	return false;
+}
+
+bool isPNGSupported(const sPNGInfo& info)
+{
+	return info.interlace == 0 && info.width <= PNG_MAX_SIZE && info.height <= PNG_MAX_SIZE;
+}
+
+size_t getPNGBufferSize(const sPNGInfo& info)
+{
+	size_t pixels = (size_t)info.width * info.height * 4;
+	size_t inflated = (getPNGRowBytes(info) + 1) * info.height; //every row starts with the filter type
+	return std::max(pixels, inflated);
+}
+
+//the colors of one unfiltered row to RGBA8
+struct sPNGColors
+{
+	sPNGInfo info;
+	unsigned char palette[256][4];
+	bool has_key; //tRNS of gray and RGB: that color is transparent
+	unsigned int key[3];
+
+	void expandRow(const unsigned char* src, unsigned char* dst)
+	{
+		unsigned int width = info.width;
+		int depth = info.bit_depth;
+		if (depth == 8)
+		{
+			switch (info.color_type)
+			{
+			case 0:
+				for (unsigned int x = 0; x < width; ++x, dst += 4)
+				{
+					dst[0] = dst[1] = dst[2] = src[x];
+					dst[3] = has_key && src[x] == key[0] ? 0 : 255;
+				}
+				return;
+			case 2:
+				for (unsigned int x = 0; x < width; ++x, dst += 4, src += 3)
+				{
+					dst[0] = src[0];
+					dst[1] = src[1];
+					dst[2] = src[2];
+					dst[3] = has_key && src[0] == key[0] && src[1] == key[1] && src[2] == key[2] ? 0 : 255;
+				}
+				return;
+			case 3:
+				for (unsigned int x = 0; x < width; ++x, dst += 4)
+					memcpy(dst, palette[src[x]], 4);
+				return;
+			case 4:
+				for (unsigned int x = 0; x < width; ++x, dst += 4, src += 2)
+				{
+					dst[0] = dst[1] = dst[2] = src[0];
+					dst[3] = src[1];
+				}
+				return;
+			case 6:
+				memcpy(dst, src, width * 4);
+				return;
+			}
+		}
+		else if (depth == 16)
+		{
+			//the high byte, the key compares the whole value
+			int channels = getPNGChannels(info.color_type);
+			for (unsigned int x = 0; x < width; ++x, dst += 4, src += channels * 2)
+			{
+				unsigned int v0 = (src[0] << 8) | src[1];
+				if (info.color_type == 0 || info.color_type == 4)
+				{
+					dst[0] = dst[1] = dst[2] = src[0];
+					dst[3] = info.color_type == 4 ? src[2] : (has_key && v0 == key[0] ? 0 : 255);
+				}
+				else
+				{
+					dst[0] = src[0];
+					dst[1] = src[2];
+					dst[2] = src[4];
+					if (info.color_type == 6)
+						dst[3] = src[6];
+					else
+						dst[3] = has_key && v0 == key[0] && ((unsigned int)(src[2] << 8) | src[3]) == key[1] && ((unsigned int)(src[4] << 8) | src[5]) == key[2] ? 0 : 255;
+				}
+			}
+		}
+		else
+		{
+			//1, 2 or 4 bits of gray or palette index, from the high bits of every byte
+			unsigned int mask = (1 << depth) - 1;
+			for (unsigned int x = 0; x < width; ++x, dst += 4)
+			{
+				unsigned int bit = x * depth;
+				unsigned int v = (src[bit >> 3] >> (8 - depth - (bit & 7))) & mask;
+				if (info.color_type == 3)
+					memcpy(dst, palette[v], 4);
+				else
+				{
+					dst[0] = dst[1] = dst[2] = (unsigned char)(v * 255 / mask);
+					dst[3] = has_key && v == key[0] ? 0 : 255;
+				}
+			}
+		}
+	}
+};
+
+bool decodePNGRGBA(const unsigned char* png, size_t size, const sPNGInfo& info, unsigned char* output)
+{
+	if (!isPNGSupported(info))
+		return false;
+
+	sPNGColors colors;
+	colors.info = info;
+	colors.has_key = false;
+	for (int i = 0; i < 256; ++i)
+	{
+		colors.palette[i][0] = colors.palette[i][1] = colors.palette[i][2] = 0;
+		colors.palette[i][3] = 255;
+	}
+
+	//chunks, the CRCs are not checked
+	std::vector<sPNGChunk> idats;
+	size_t pos = 8;
+	while (pos + 12 <= size)
+	{
+		size_t length = readBE32(png + pos);
+		const unsigned char* type = png + pos + 4;
+		const unsigned char* data = png + pos + 8;
+		if (length > size - pos - 12)
+			return false;
+		if (memcmp(type, "IDAT", 4) == 0)
+		{
+			sPNGChunk chunk = { data, length };
+			if (length)
+				idats.push_back(chunk);
+		}
+		else if (memcmp(type, "PLTE", 4) == 0)
+		{
+			for (size_t i = 0; i < length / 3 && i < 256; ++i)
+				memcpy(colors.palette[i], data + i * 3, 3);
+		}
+		else if (memcmp(type, "tRNS", 4) == 0)
+		{
+			if (info.color_type == 3)
+				for (size_t i = 0; i < length && i < 256; ++i)
+					colors.palette[i][3] = data[i];
+			else if ((info.color_type == 0 && length >= 2) || (info.color_type == 2 && length >= 6))
+			{
+				colors.has_key = true;
+				for (size_t i = 0; i < length / 2 && i < 3; ++i)
+					colors.key[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+			}
+		}
+		else if (memcmp(type, "IEND", 4) == 0)
+			break;
+		pos += length + 12;
+	}
+	if (idats.empty())
+		return false;
+
+	//the rows are inflated at the end of the output and converted to RGBA in place, from the first row
+	//the RGBA rows never get to the inflated rows that are still to be converted
+	size_t row_bytes = getPNGRowBytes(info);
+	size_t inflated_size = (row_bytes + 1) * info.height;
+	unsigned char* inflated = output + getPNGBufferSize(info) - inflated_size;
+	if (!inflateChunks(idats, inflated, inflated_size))
+		return false;
+
+	int bpp = std::max(1, getPNGChannels(info.color_type) * info.bit_depth / 8);
+	std::vector<unsigned char> zeros(row_bytes, 0);
+	std::vector<unsigned char> scratch(row_bytes);
+	const unsigned char* prev = &zeros[0];
+	size_t stride = (size_t)info.width * 4;
+	for (unsigned int y = 0; y <= info.height; ++y)
+	{
+		unsigned char* row = inflated + y * (row_bytes + 1);
+		if (y < info.height && !unfilterRow(row + 1, prev, row_bytes, bpp, row[0]))
+			return false;
+		//the previous row is converted once it is not needed to unfilter
+		if (y > 0)
+		{
+			unsigned char* dst = output + (y - 1) * stride;
+			if (info.color_type == 6 && info.bit_depth == 8)
+				memmove(dst, prev, stride);
+			else
+			{
+				memcpy(&scratch[0], prev, row_bytes); //it may overlap its RGBA row
+				colors.expandRow(&scratch[0], dst);
+			}
+		}
+		prev = row + 1;
+	}
+	return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+//PNG decoder used by Image::loadPNG: table driven inflate, unfiltering with SSE2 when the CPU has it, and the IDAT chunks
+//inflated in parallel when the encoder flushed the zlib stream between them. The output is always RGBA8.
+
+struct sPNGInfo {
+	unsigned int width;
+	unsigned int height;
+	int bit_depth;
+	int color_type; //0 gray, 2 RGB, 3 palette, 4 gray alpha, 6 RGBA
+	int interlace;
+};
+
+bool readPNGInfo(const unsigned char* png, size_t size, sPNGInfo& info); //false if it is not a valid PNG header
+bool isPNGSupported(const sPNGInfo& info); //interlaced images are not, use picopng for them
+
+//the output buffer is also used to inflate the rows, so it needs a bit more than width * height * 4 bytes
+size_t getPNGBufferSize(const sPNGInfo& info);
+bool decodePNGRGBA(const unsigned char* png, size_t size, const sPNGInfo& info, unsigned char* output); //output must have getPNGBufferSize bytes
@@ -12,9 +12,12 @@
 #include "framework.h"
 
 #include <iostream>
+#include <mutex>
 
 using namespace GTR;
 
+static std::mutex prefabs_mutex; //sPrefabsLoaded is used from the loading threads
+
 Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF)
 {
 
@@ -74,13 +77,19 @@ void Node::renderInMenu()
 	}
 }
 
+Prefab::Prefab()
+{
+	load_state = ASSET_READY;
+}
+
 Prefab::~Prefab()
 {
 	if (name.size())
 	{
+		std::lock_guard<std::mutex> lock(prefabs_mutex);
 		auto it = sPrefabsLoaded.find(name);
-		if (it != sPrefabsLoaded.end());
-		sPrefabsLoaded.erase(it);
+		if (it != sPrefabsLoaded.end() && it->second == this)
+			sPrefabsLoaded.erase(it);
 	}
 }
 
@@ -90,29 +99,79 @@ void Prefab::updateBounding()
 }
 
 std::map<std::string, Prefab*> Prefab::sPrefabsLoaded;
+bool Prefab::use_binary = true;
+
+//true while a texture used by the node or its children is not uploaded yet
+static bool hasTexturesLoading(Node* node)
+{
+	Material* material = node->material;
+	if (material)
+	{
+		Texture* textures[] = { material->color_texture, material->emissive_texture, material->metallic_roughness_texture, material->occlusion_texture, material->normal_texture };
+		for (int i = 0; i < 5; ++i)
+			if (textures[i] && textures[i]->load_state == ASSET_LOADING)
+				return true;
+	}
+	for (int i = 0; i < node->children.size(); ++i)
+		if (hasTexturesLoading(node->children[i]))
+			return true;
+	return false;
+}
 
 Prefab* Prefab::Get(const char* filename)
+{
+	//same path than the async version, but waiting for it and for its textures (the tree is only read once it is not loading)
+	Prefab* prefab = GetAsync(filename);
+	waitUntil([prefab]() { return prefab->load_state != ASSET_LOADING && !hasTexturesLoading(&prefab->root); });
+	return prefab->isReady() ? prefab : NULL;
+}
+
+Prefab* Prefab::GetAsync(const char* filename)
 {
 	assert(filename);
-	std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(filename);
-	if (it != sPrefabsLoaded.end())
-		return it->second;
+	std::string name = filename;
 
-	Prefab* prefab = loadGLTF(filename);
-	if (!prefab)
+	Prefab* prefab = NULL;
 	{
-		std::cout << "[ERROR]: Prefab not found" << std::endl;
-		return NULL;
+		std::lock_guard<std::mutex> lock(prefabs_mutex);
+		std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(name);
+		if (it != sPrefabsLoaded.end())
+			return it->second;
+
+		//registered now so the next calls get the same one while it loads
+		prefab = new Prefab();
+		prefab->load_state = ASSET_LOADING;
+		prefab->name = name;
+		sPrefabsLoaded[name] = prefab;
 	}
 
-	std::string name = filename;
-	prefab->registerPrefab(name);
-	prefab->updateBounding();
+	runAsync([prefab, name]() {
+		//the snapshot skips the glTF parsing, it is written after importing it
+		bool loaded = use_binary && prefab->readBin(name.c_str());
+		if (!loaded)
+		{
+			std::vector<std::string> sources;
+			loaded = loadGLTF(name.c_str(), prefab, use_binary ? &sources : NULL);
+			if (loaded && use_binary)
+				prefab->writeBin(name.c_str(), sources);
+		}
+		//queued after the uploads of its meshes, so they are in VRAM when it is ready
+		runInMainThread([prefab, loaded]() {
+			if (!loaded)
+			{
+				std::cout << "[ERROR]: Prefab not found" << std::endl;
+				prefab->load_state = ASSET_FAILED;
+				return;
+			}
+			prefab->load_state = ASSET_READY;
+		});
+	});
 	return prefab;
 }
 
 void Prefab::registerPrefab(std::string name)
 {
+	std::lock_guard<std::mutex> lock(prefabs_mutex);
 	this->name = name;
 	sPrefabsLoaded[name] = this;
 }
@@ -137,4 +196,349 @@ void Prefab::updateNodesByName()
 {
 	nodes_by_name.clear();
 	updateInDepth(nodes_by_name, &root);
-}
\ No newline at end of file
+}
+
+//PBIN: header, then the tables of sources, meshes (.mbin), textures (with their usage), materials and nodes (parents before children)
+//strings are stored as an int with the length followed by the chars
+struct sPrefabBinHeader
+{
+	int version;
+	int header_bytes;
+	unsigned long long source_hash; //of the source files and the import settings
+	int num_sources;
+	int num_meshes;
+	int num_textures;
+	int num_materials;
+	int num_nodes;
+};
+
+struct sPrefabBinMaterial
+{
+	int alpha_mode;
+	float alpha_cutoff;
+	int two_sided;
+	Vector4 color;
+	float roughness_factor;
+	float metallic_factor;
+	Vector3 emissive_factor;
+	int textures[5]; //color, emissive, metallic_roughness, occlusion and normal, -1 if there is none
+};
+
+struct sPrefabBinNode
+{
+	int parent; //-1 for the root
+	int visible;
+	int layers;
+	int mesh; //-1 if there is none
+	int material;
+	Matrix44 model;
+};
+
+//the source files and the settings that change the result of the import
+static bool hashPrefabSources(const char* filename, const std::vector<std::string>& sources, unsigned long long& hash)
+{
+	int settings[] = { PREFAB_BIN_VERSION, MESH_BIN_VERSION, Mesh::optimize_meshes, Mesh::build_meshlets, Mesh::lod_levels, load_textures };
+	hash = hashData(settings, sizeof(settings));
+	if (!hashFile(filename, hash))
+		return false;
+	for (size_t i = 0; i < sources.size(); ++i)
+		if (!hashFile(sources[i].c_str(), hash))
+			return false;
+	return true;
+}
+
+static void writeBinString(std::string& out, const std::string& str)
+{
+	int length = (int)str.size();
+	out.append((const char*)&length, sizeof(int));
+	out.append(str);
+}
+
+//reads in order from the mapped file, false if it goes past the end
+struct sPrefabBinReader
+{
+	const char* pos;
+	const char* end;
+
+	bool read(void* dst, size_t size)
+	{
+		if (size > (size_t)(end - pos))
+			return false;
+		memcpy(dst, pos, size);
+		pos += size;
+		return true;
+	}
+
+	bool readString(std::string& str)
+	{
+		int length = 0;
+		if (!read(&length, sizeof(int)) || length < 0 || length > end - pos)
+			return false;
+		str.assign(pos, length);
+		pos += length;
+		return true;
+	}
+};
+
+static void collectNodes(Node* node, int parent, std::vector<Node*>& nodes, std::vector<int>& parents)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(node);
+	parents.push_back(parent);
+	for (int i = 0; i < node->children.size(); ++i)
+		collectNodes(node->children[i], index, nodes, parents);
+}
+
+template<typename T>
+static int getBinIndex(std::map<T*, int>& indices, std::vector<T*>& list, T* item)
+{
+	if (!item)
+		return -1;
+	auto it = indices.find(item);
+	if (it != indices.end())
+		return it->second;
+	indices[item] = (int)list.size();
+	list.push_back(item);
+	return (int)list.size() - 1;
+}
+
+bool Prefab::writeBin(const char* filename, const std::vector<std::string>& sources)
+{
+	std::vector<Node*> nodes;
+	std::vector<int> parents;
+	collectNodes(&root, -1, nodes, parents);
+
+	std::map<Mesh*, int> mesh_indices;
+	std::map<Material*, int> material_indices;
+	std::map<Texture*, int> texture_indices;
+	std::vector<Mesh*> meshes;
+	std::vector<Material*> materials;
+	std::vector<Texture*> textures;
+
+	std::string nodes_data;
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		Node* node = nodes[i];
+		if (node->mesh && node->mesh->bin_filename.empty())
+		{
+			std::cout << "[WARN] cannot write prefab BIN, mesh without .mbin: " << node->mesh->name << std::endl;
+			return false;
+		}
+		sPrefabBinNode info = {};
+		info.parent = parents[i];
+		info.visible = node->visible;
+		info.layers = node->layers;
+		info.mesh = getBinIndex(mesh_indices, meshes, node->mesh);
+		info.material = getBinIndex(material_indices, materials, node->material);
+		info.model = node->model;
+		writeBinString(nodes_data, node->name);
+		nodes_data.append((const char*)&info, sizeof(info));
+	}
+
+	std::string materials_data;
+	for (size_t i = 0; i < materials.size(); ++i)
+	{
+		Material* material = materials[i];
+		sPrefabBinMaterial info = {};
+		info.alpha_mode = material->alpha_mode;
+		info.alpha_cutoff = material->alpha_cutoff;
+		info.two_sided = material->two_sided;
+		info.color = material->color;
+		info.roughness_factor = material->roughness_factor;
+		info.metallic_factor = material->metallic_factor;
+		info.emissive_factor = material->emissive_factor;
+		Texture* material_textures[] = { material->color_texture, material->emissive_texture, material->metallic_roughness_texture, material->occlusion_texture, material->normal_texture };
+		for (int j = 0; j < 5; ++j)
+			info.textures[j] = getBinIndex(texture_indices, textures, material_textures[j]);
+		writeBinString(materials_data, material->name);
+		materials_data.append((const char*)&info, sizeof(info));
+	}
+
+	sPrefabBinHeader header;
+	memset(&header, 0, sizeof(header));
+	header.version = PREFAB_BIN_VERSION;
+	header.header_bytes = sizeof(sPrefabBinHeader);
+	if (!hashPrefabSources(filename, sources, header.source_hash))
+		return false;
+	header.num_sources = (int)sources.size();
+	header.num_meshes = (int)meshes.size();
+	header.num_textures = (int)textures.size();
+	header.num_materials = (int)materials.size();
+	header.num_nodes = (int)nodes.size();
+
+	std::string data("PBIN");
+	data.append((const char*)&header, sizeof(header));
+	for (size_t i = 0; i < sources.size(); ++i)
+		writeBinString(data, sources[i]);
+	for (size_t i = 0; i < meshes.size(); ++i)
+		writeBinString(data, meshes[i]->bin_filename);
+	for (size_t i = 0; i < textures.size(); ++i)
+	{
+		writeBinString(data, textures[i]->filename);
+		data.append((const char*)&textures[i]->usage, sizeof(int));
+	}
+	data += materials_data;
+	data += nodes_data;
+
+	std::string binfilename = std::string(filename) + ".pbin";
+	FILE* f = fopen(binfilename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write prefab BIN: " << binfilename << std::endl;
+		return false;
+	}
+	fwrite(data.c_str(), data.size(), 1, f);
+	fclose(f);
+	return true;
+}
+
+bool Prefab::readBin(const char* filename)
+{
+	long time = getTime();
+	std::string binfilename = std::string(filename) + ".pbin";
+	MappedFile file;
+	if (!file.open(binfilename.c_str()))
+		return false;
+
+	sPrefabBinReader reader = { file.data, file.data + file.size };
+	sPrefabBinHeader header;
+	if (file.size < 4 + sizeof(header) || memcmp(file.data, "PBIN", 4) != 0)
+	{
+		std::cout << "[ERROR] loading PBIN: wrong file: " << binfilename << std::endl;
+		return false;
+	}
+	reader.pos += 4;
+	reader.read(&header, sizeof(header));
+	if (header.version != PREFAB_BIN_VERSION || header.header_bytes != sizeof(sPrefabBinHeader))
+	{
+		std::cout << "[WARN] loading PBIN: old version: " << binfilename << std::endl;
+		return false;
+	}
+
+	//every entry takes at least 4 bytes
+	int counts[] = { header.num_sources, header.num_meshes, header.num_textures, header.num_materials, header.num_nodes };
+	for (int i = 0; i < 5; ++i)
+		if (counts[i] < 0 || (size_t)counts[i] > file.size / 4)
+		{
+			std::cout << "[ERROR] loading PBIN: corrupted file: " << binfilename << std::endl;
+			return false;
+		}
+
+	//read and check everything before creating anything
+	bool valid = header.num_nodes > 0;
+	std::vector<std::string> sources(header.num_sources);
+	for (int i = 0; i < header.num_sources && valid; ++i)
+		valid = reader.readString(sources[i]);
+	std::vector<std::string> mesh_filenames(header.num_meshes);
+	for (int i = 0; i < header.num_meshes && valid; ++i)
+		valid = reader.readString(mesh_filenames[i]);
+	std::vector<std::string> texture_filenames(header.num_textures);
+	std::vector<int> texture_usages(header.num_textures);
+	for (int i = 0; i < header.num_textures && valid; ++i)
+		valid = reader.readString(texture_filenames[i]) && reader.read(&texture_usages[i], sizeof(int));
+	std::vector<std::string> material_names(header.num_materials);
+	std::vector<sPrefabBinMaterial> material_infos(header.num_materials);
+	for (int i = 0; i < header.num_materials && valid; ++i)
+	{
+		valid = reader.readString(material_names[i]) && reader.read(&material_infos[i], sizeof(sPrefabBinMaterial));
+		for (int j = 0; j < 5 && valid; ++j)
+			valid = material_infos[i].textures[j] >= -1 && material_infos[i].textures[j] < header.num_textures;
+	}
+	std::vector<std::string> node_names(header.num_nodes);
+	std::vector<sPrefabBinNode> node_infos(header.num_nodes);
+	for (int i = 0; i < header.num_nodes && valid; ++i)
+	{
+		sPrefabBinNode& info = node_infos[i];
+		valid = reader.readString(node_names[i]) && reader.read(&info, sizeof(sPrefabBinNode)) &&
+			(i == 0 ? info.parent == -1 : info.parent >= 0 && info.parent < i) &&
+			info.mesh >= -1 && info.mesh < header.num_meshes && info.material >= -1 && info.material < header.num_materials;
+	}
+	if (!valid)
+	{
+		std::cout << "[ERROR] loading PBIN: corrupted file: " << binfilename << std::endl;
+		return false;
+	}
+
+	//outdated if the sources changed or any mesh is missing
+	unsigned long long hash = 0;
+	bool outdated = !hashPrefabSources(filename, sources, hash) || hash != header.source_hash;
+	for (int i = 0; i < header.num_meshes && !outdated; ++i)
+	{
+		FILE* f = fopen(mesh_filenames[i].c_str(), "rb");
+		outdated = f == NULL;
+		if (f)
+			fclose(f);
+	}
+	if (outdated)
+	{
+		std::cout << " + Prefab BIN outdated: " << binfilename << std::endl;
+		return false;
+	}
+
+	//same assets than the import: the meshes and textures are shared by filename and the materials by name
+	std::vector<Mesh*> meshes(header.num_meshes);
+	for (int i = 0; i < header.num_meshes; ++i)
+		meshes[i] = Mesh::GetAsync(mesh_filenames[i].c_str());
+
+	std::vector<Texture*> textures(header.num_textures);
+	for (int i = 0; i < header.num_textures; ++i)
+		textures[i] = Texture::GetAsync(texture_filenames[i].c_str(), true, true, texture_usages[i]);
+
+	//with the lock of the glTF import, that shares them by name too, registered once they are filled so no loader gets one half done
+	std::vector<Material*> materials(header.num_materials);
+	{
+		std::lock_guard<std::mutex> lock(gltf_registry_mutex);
+		for (int i = 0; i < header.num_materials; ++i)
+		{
+			Material* material = material_names[i].size() ? Material::Get(material_names[i].c_str()) : NULL;
+			if (!material)
+			{
+				const sPrefabBinMaterial& info = material_infos[i];
+				material = new Material();
+				material->alpha_mode = (AlphaMode)info.alpha_mode;
+				material->alpha_cutoff = info.alpha_cutoff;
+				material->two_sided = info.two_sided != 0;
+				material->color = info.color;
+				material->roughness_factor = info.roughness_factor;
+				material->metallic_factor = info.metallic_factor;
+				material->emissive_factor = info.emissive_factor;
+				Texture** material_textures[] = { &material->color_texture, &material->emissive_texture, &material->metallic_roughness_texture, &material->occlusion_texture, &material->normal_texture };
+				for (int j = 0; j < 5; ++j)
+					*material_textures[j] = info.textures[j] != -1 ? textures[info.textures[j]] : NULL;
+				if (material_names[i].size())
+					material->registerMaterial(material_names[i].c_str());
+			}
+			materials[i] = material;
+		}
+	}
+
+	std::vector<Node*> nodes(header.num_nodes);
+	for (int i = 0; i < header.num_nodes; ++i)
+	{
+		const sPrefabBinNode& info = node_infos[i];
+		Node* node = i == 0 ? &root : new Node();
+		node->name = node_names[i];
+		node->visible = info.visible != 0;
+		node->layers = info.layers;
+		node->model = info.model;
+		node->mesh = info.mesh != -1 ? meshes[info.mesh] : NULL;
+		node->material = info.material != -1 ? materials[info.material] : NULL;
+		if (i > 0)
+			nodes[info.parent]->addChild(node);
+		nodes[i] = node;
+	}
+
+	//like after an import, the meshes are in VRAM when the prefab is ready (the bounding needs them too)
+	waitUntil([&meshes]() {
+		for (size_t i = 0; i < meshes.size(); ++i)
+			if (meshes[i] && meshes[i]->load_state == ASSET_LOADING)
+				return false;
+		return true;
+	});
+
+	updateNodesByName();
+	updateBounding();
+
+	std::cout << " + Prefab loading: " << filename << " ... [OK PBIN] Nodes: " << header.num_nodes << " Meshes: " << header.num_meshes << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	return true;
+}
@@ -6,6 +6,10 @@
 #include <string>
 
 #include "material.h"
+#include "utils.h" //eAssetState
+#include <atomic>
+
+#define PREFAB_BIN_VERSION 2 //this is used to regenerate the .pbin if the format changes
 
 //forward declaration
 class Mesh;
@@ -68,17 +72,29 @@ namespace GTR {
 		//root node which contains the tree
 		Node root;
 		BoundingBox bounding;
+		std::atomic<int> load_state; //eAssetState, the tree must not be used until it is ASSET_READY
+
+		//ctor
+		Prefab();
 
 		//dtor
 		virtual ~Prefab();
 
+		bool isReady() { return load_state == ASSET_READY; }
+
 		void updateBounding();
 		void updateNodesByName();
 		Node* getNodeByName(const char* name);
 
+		//snapshot of the imported tree (filename + ".pbin"), the meshes go in their own .mbin
+		static bool use_binary; //Get reads the .pbin when its source files did not change, or writes it after the import
+		bool readBin(const char* filename); //filename of the source, false if there is no .pbin or it is outdated
+		bool writeBin(const char* filename, const std::vector<std::string>& sources); //sources: the other files read by the import
+
 		//Manager to cache loaded prefabs
 		static std::map<std::string, Prefab*> sPrefabsLoaded;
-		static Prefab* Get(const char* filename);
+		static Prefab* Get(const char* filename); //waits until it is loaded (textures included), NULL if it failed
+		static Prefab* GetAsync(const char* filename); //returns an empty prefab at once, parsed by a worker, its meshes and textures are uploaded by the main thread (see processMainThreadTasks)
 		void registerPrefab(std::string name);
 	};
 
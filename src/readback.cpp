@@ -0,0 +1,194 @@
+#include "readback.h"
+
+#include "includes.h"
+#include "texture.h"
+#include "gl_state.h"
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+int GPUReadback::ring_size = 4;
+
+int GPUReadback::num_pending = 0;
+int GPUReadback::num_stalls = 0;
+
+struct sReadback {
+	GLuint pbo;
+	int capacity; //bytes allocated in the pbo
+	GLsync fence; //NULL if the buffer is free
+	bool mapped; //its callback is running
+	long order;
+	int width;
+	int height;
+	GPUReadback::tCallback callback;
+};
+
+static std::vector<sReadback> ring; //never resized once created, the callbacks can start new reads
+static long next_order = 0;
+
+int GPUReadback::getPixelSize(unsigned int format, unsigned int type)
+{
+	int channels = 4;
+	switch (format)
+	{
+		case GL_RED: case GL_DEPTH_COMPONENT: channels = 1; break;
+		case GL_RG: channels = 2; break;
+		case GL_RGB: case GL_BGR: channels = 3; break;
+	}
+	switch (type)
+	{
+		case GL_FLOAT: case GL_UNSIGNED_INT: case GL_INT: return channels * 4;
+		case GL_HALF_FLOAT: case GL_UNSIGNED_SHORT: case GL_SHORT: return channels * 2;
+	}
+	return channels;
+}
+
+//maps the buffer and calls the callback, the fence must be signaled
+static void complete(sReadback& readback)
+{
+	assert(readback.fence && !readback.mapped);
+	glDeleteSync(readback.fence);
+
+	readback.mapped = true;
+	GLState::bindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+	const void* data = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (data)
+		readback.callback(data, readback.width, readback.height);
+	else
+		std::cout << "[ERROR] GPUReadback: cannot map the pixel buffer of a " << readback.width << "x" << readback.height << " read" << std::endl;
+	GLState::bindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo); //the callback could have read something else
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	GLState::bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	readback.callback = GPUReadback::tCallback();
+	readback.fence = NULL;
+	readback.mapped = false;
+	GPUReadback::num_pending--;
+}
+
+static void wait(sReadback& readback)
+{
+	//flushes the commands, otherwise the fence could never reach the GPU
+	while (glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+}
+
+//the oldest read that is not in its callback
+static sReadback* getOldest()
+{
+	sReadback* oldest = NULL;
+	for (size_t i = 0; i < ring.size(); ++i)
+		if (ring[i].fence && !ring[i].mapped && (!oldest || ring[i].order < oldest->order))
+			oldest = &ring[i];
+	return oldest;
+}
+
+//a free buffer of this size bound to GL_PIXEL_PACK_BUFFER
+static sReadback* acquire(int bytes)
+{
+	if (ring.empty())
+	{
+		ring.resize(std::max(GPUReadback::ring_size, 2)); //one can be in its callback while another waits
+		for (size_t i = 0; i < ring.size(); ++i)
+		{
+			ring[i].pbo = 0;
+			ring[i].capacity = 0;
+			ring[i].fence = NULL;
+			ring[i].mapped = false;
+		}
+	}
+
+	sReadback* readback = NULL;
+	for (size_t i = 0; i < ring.size() && !readback; ++i)
+		if (!ring[i].fence)
+			readback = &ring[i];
+
+	if (!readback)
+	{
+		readback = getOldest();
+		assert(readback && "every buffer is in its callback");
+		GPUReadback::num_stalls++;
+		wait(*readback);
+		complete(*readback);
+	}
+
+	if (!readback->pbo)
+		glGenBuffers(1, &readback->pbo);
+	GLState::bindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+	if (readback->capacity < bytes)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+		readback->capacity = bytes;
+	}
+	return readback;
+}
+
+static void submit(sReadback* readback, int width, int height, const GPUReadback::tCallback& callback)
+{
+	readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	readback->order = next_order++;
+	readback->width = width;
+	readback->height = height;
+	readback->callback = callback;
+	GLState::bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	GPUReadback::num_pending++;
+}
+
+void GPUReadback::readTexture(Texture* texture, unsigned int format, unsigned int type, const tCallback& callback)
+{
+	assert(texture && texture->texture_type == GL_TEXTURE_2D);
+	sReadback* readback = acquire(texture->width * texture->height * getPixelSize(format, type));
+
+	GLState::bindTexture(GL_TEXTURE_2D, texture->texture_id);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glGetTexImage(GL_TEXTURE_2D, 0, format, type, 0); //to the offset 0 of the pbo
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	GLState::bindTexture(GL_TEXTURE_2D, 0);
+
+	submit(readback, texture->width, texture->height, callback);
+}
+
+void GPUReadback::readFramebuffer(int x, int y, int width, int height, unsigned int format, unsigned int type, const tCallback& callback)
+{
+	sReadback* readback = acquire(width * height * getPixelSize(format, type));
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, format, type, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+	submit(readback, width, height, callback);
+}
+
+int GPUReadback::update()
+{
+	//the GPU runs the commands in order, so the fences signal in the order of the reads
+	while (sReadback* oldest = getOldest())
+	{
+		GLenum status = glClientWaitSync(oldest->fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+		complete(*oldest);
+	}
+	return num_pending;
+}
+
+void GPUReadback::finish()
+{
+	while (sReadback* oldest = getOldest())
+	{
+		if (glClientWaitSync(oldest->fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		{
+			num_stalls++;
+			wait(*oldest);
+		}
+		complete(*oldest);
+	}
+}
+
+void GPUReadback::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Readbacks: %d pending in %d buffers, %d stalls", num_pending, (int)ring.size(), num_stalls);
+#endif
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "includes.h"
+#include <functional>
+
+class Texture;
+
+//asynchronous reads from the GPU: the pixels are copied into one of a ring of pixel buffer objects and a fence marks when the copy
+//is done, so the CPU keeps working instead of stalling until the GPU finishes all the commands issued before the read. update()
+//maps the finished ones and calls their callbacks in the order they were read, the data is only valid inside the callback.
+class GPUReadback
+{
+public:
+	typedef std::function<void(const void* data, int width, int height)> tCallback;
+
+	static int ring_size; //pixel buffers, read when the first one is created. A read with all of them busy waits for the oldest
+
+	//stats
+	static int num_pending;
+	static int num_stalls; //reads that had to wait for a buffer, or for the GPU in finish()
+
+	static void readTexture(Texture* texture, unsigned int format, unsigned int type, const tCallback& callback); //the first level, like glGetTexImage
+	static void readFramebuffer(int x, int y, int width, int height, unsigned int format, unsigned int type, const tCallback& callback); //from the bound framebuffer, like glReadPixels
+
+	static int update(); //main thread, calls the callbacks of the reads the GPU already finished, returns how many are still pending
+	static void finish(); //waits for all the reads and calls their callbacks
+
+	static int getPixelSize(unsigned int format, unsigned int type); //bytes
+	static void renderInMenu();
+};
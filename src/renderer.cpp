@@ -8,12 +8,42 @@
 #include "material.h"
 #include "utils.h"
 #include "application.h"
+#include "texture_streaming.h"
+#include "virtual_texture.h"
+#include "texture_array.h"
+#include "readback.h"
+#include "texture_upload.h"
+#include "uniform_blocks.h"
+#include "shader_permutations.h"
+#include "gl_state.h"
 #include "sphericalharmonics.h"
 #include "extra/hdre.h"
 
+#include <algorithm>
+#include <atomic>
+
 using namespace GTR;
 
 bool render_shadowmap = false;
+bool render_vt_feedback = false;
+
+//the uniforms set for every draw or light, the camera, light and material data goes in the UniformBlocks
+static UniformHandle u_model("u_model");
+static UniformHandle u_texture("u_texture");
+static UniformHandle u_iRes("u_iRes");
+static UniformHandle u_hasgamma("u_hasgamma");
+static UniformHandle u_hasmetal("u_hasmetal");
+static UniformHandle u_camera_near_far("u_camera_near_far");
+static UniformHandle u_metal_roughness("u_metal_roughness");
+static UniformHandle u_vt_color("u_vt_color");
+static UniformHandle u_vt_metal_roughness("u_vt_metal_roughness");
+static UniformHandle u_vt_color_id("u_vt_color_id");
+static UniformHandle u_vt_color_size("u_vt_color_size");
+static UniformHandle u_vt_metal_roughness_id("u_vt_metal_roughness_id");
+static UniformHandle u_vt_metal_roughness_size("u_vt_metal_roughness_size");
+static UniformHandle u_vt_page_size("u_vt_page_size");
+static UniformHandle u_vt_feedback_bias("u_vt_feedback_bias");
+static UniformHandle u_shadowmap("shadowmap");
 
 
 Renderer::Renderer()
@@ -66,18 +96,17 @@ void Renderer::renderProbe(Vector3 pos, float size, float* coeffs)
 	Shader* shader = Shader::Get("probe");
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj");
 
-	glEnable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
+	GLState::disable(GL_BLEND);
+	GLState::enable(GL_DEPTH_TEST);
 
 	Matrix44 model;
 	model.setTranslation(pos.x, pos.y, pos.z);
 	model.scale(size, size, size);
 
+	UniformBlocks::setCamera(camera);
 	shader->enable();
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
+	shader->setUniform(u_model, model);
 	shader->setUniform3Array("u_coeffs", coeffs, 9);
 
 	mesh->render(GL_TRIANGLES);
@@ -126,15 +155,24 @@ void GTR::Renderer::computeIrradiance()
 		irr_fbo->create(64, 64, 1, GL_RGB, GL_FLOAT);
 	}
 
-	FloatImage images[6]; //here we will store the six views
+	//the six views of every probe are read back asynchronously while the next ones render,
+	//and a worker computes the coefficients once the six of a probe arrived
+	struct sProbeViews {
+		FloatImage images[6];
+		int num_images;
+	};
+	sProbeViews* views = new sProbeViews[probes.size()];
+	std::atomic<int> num_computing(0);
 
 	//set the fov to 90 and the aspect to 1
 	Camera cam;
 	cam.setPerspective(90, 1, 0.1, 1000);
+	cam.lod_bias = probe_lod_bias; //the probes are tiny and blurred, coarse LODs are enough
 
 	for (int iP = 0; iP < probes.size(); ++iP)
 	{
 		sProbe& p = probes[iP];
+		views[iP].num_images = 0;
 
 		for (int i = 0; i < 6; ++i) //for every cubemap face
 		{
@@ -154,12 +192,27 @@ void GTR::Renderer::computeIrradiance()
 			irr_fbo->unbind();
 
 			//read the pixels back and store in a FloatImage
-			images[i].fromTexture(irr_fbo->color_textures[0]);
+			GPUReadback::readTexture(irr_fbo->color_textures[0], GL_RGB, GL_FLOAT, [&, iP, i](const void* data, int width, int height) {
+				FloatImage& image = views[iP].images[i];
+				image.resize(width, height, 3);
+				memcpy(image.data, data, width * height * 3 * sizeof(float));
+				if (++views[iP].num_images < 6)
+					return;
+				//compute the coefficients given the six images
+				num_computing++;
+				runAsync([&, iP]() {
+					probes[iP].sh = computeSH(views[iP].images);
+					num_computing--;
+				});
+			});
 		}
-		//compute the coefficients given the six images
-		p.sh = computeSH(images);
+		GPUReadback::update(); //the views of the previous probes
 	}
 
+	GPUReadback::finish();
+	waitUntil([&]() { return num_computing == 0; });
+	delete[] views;
+
 	// create the texture to store the probes(do this ONCE!!!)
 	if (!probes_texture)
 	{
@@ -241,15 +294,16 @@ void Renderer::renderDeferred(Camera* camera)
 	renderSkyBox(camera, 1);
 	//render everything 
 	std::vector<PrefabEntity*> prefab_vector = Scene::scene->getPrefabs();
-	for(int i=0;i<prefab_vector.size();i++)
-		renderPrefab(prefab_vector[i]->model, prefab_vector[i]->prefab, camera, true);
+	renderPrefabs(prefab_vector, camera, true);
 
 	//stop rendering to the gbuffers
 	gbuffers_fbo->unbind();
 
-	//send info to reconstruct the world position
-	Matrix44 inv_vp = camera->viewprojection_matrix;
-	inv_vp.inverse();
+	if (use_virtual_texturing)
+		renderVirtualTextureFeedback(prefab_vector, camera);
+
+	//the camera of all the passes, also the inverse to reconstruct the world position
+	UniformBlocks::setCamera(camera);
 
 	//Decals
 	if (decals)
@@ -261,9 +315,9 @@ void Renderer::renderDeferred(Camera* camera)
 
 		gbuffers_fbo->bind();
 
-		glEnable(GL_DEPTH_TEST);
-		glEnable(GL_CULL_FACE);
-		glEnable(GL_BLEND);
+		GLState::enable(GL_DEPTH_TEST);
+		GLState::enable(GL_CULL_FACE);
+		GLState::enable(GL_BLEND);
 
 		Matrix44 m;
 		m.setTranslation(-200, -3, 50);
@@ -274,10 +328,7 @@ void Renderer::renderDeferred(Camera* camera)
 
 		Shader* sh = Shader::Get("decal");
 		sh->enable();
-		sh->setUniform("u_camera_position", camera->eye);
 		sh->setUniform("u_texture", Texture::Get("data/textures/bulletholes.png"), 0);
-		sh->setUniform("u_inverse_viewprojection", inv_vp);
-		sh->setUniform("u_viewprojection", camera->viewprojection_matrix);
 		sh->setUniform("u_depth_texture", temp_depth_texture, 1);
 		sh->setUniform("u_model", m);
 		sh->setUniform("u_imodel", im);
@@ -310,7 +361,7 @@ void Renderer::renderDeferred(Camera* camera)
 	ssao_fbo->bind();
 
 
-	glDisable(GL_DEPTH_TEST);
+	GLState::disable(GL_DEPTH_TEST);
 
 	//get the shader for SSAO (remember to create it using the atlas)
 	Shader* shader = Shader::Get("ssao");
@@ -325,12 +376,10 @@ void Renderer::renderDeferred(Camera* camera)
 	gbuffers_fbo->depth_texture->unbind();
 
 	shader->setUniform("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
-	shader->setUniform("u_inverse_viewprojection", inv_vp);
 	shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 1);
 	//we need the pixel size so we can center the samples 
 	shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->depth_texture->width, 1.0 / (float)gbuffers_fbo->depth_texture->height));
-	//we will need the viewprojection to obtain the uv in the depthtexture of any random position of our world
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	//the viewprojection of the camera block gives the uv in the depthtexture of any random position of our world
 	shader->setUniform("u_bias", Scene::scene->ssao_bias);
 
 	//send random points so we can fetch around
@@ -339,8 +388,8 @@ void Renderer::renderDeferred(Camera* camera)
 	//render fullscreen quad
 	Mesh* ssao_quad = Mesh::getQuad();
 	ssao_quad->render(GL_TRIANGLES);
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS); //as default;
+	GLState::disable(GL_BLEND);
+	GLState::depthFunc(GL_LESS); //as default;
 	shader->disable();
 
 	//stop rendering to the texture
@@ -382,131 +431,77 @@ void Renderer::renderDeferred(Camera* camera)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	std::vector<Light*> light_vector = Scene::scene->getVisibleLights();
-	for (int i = 0; i < light_vector.size(); i++)
-	{
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_ONE, GL_ONE);
-		
-		if (light_vector[i]->l_type != light_type::POINT_L)
-		{
-			//we need a fullscreen quad
-			Mesh* quad = Mesh::getQuad();
+	UniformBlocks::setLights(light_vector);
 
-			//we need a shader specially for this task, lets call it "deferred"
-			Shader* sh = Shader::Get("deferred");
-			sh->enable();
+	//the uniforms that are the same for every light are set once per shader, the programs keep them between the lights
+	std::vector<Shader*> prepared_shaders;
+	auto setLightPassUniforms = [&](Shader* sh) {
+		//pass the gbuffers to the shader
+		sh->setUniform("u_color_texture", gbuffers_fbo->color_textures[0], 0);
+		sh->setUniform("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
+		sh->setUniform("u_extra_texture", gbuffers_fbo->color_textures[2], 2);
+		sh->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 3);
 
-			sh->setUniform("u_camera_position", camera->eye);
-
-			//pass the gbuffers to the shader
-			sh->setUniform("u_color_texture", gbuffers_fbo->color_textures[0], 0);
-			sh->setUniform("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
-			sh->setUniform("u_extra_texture", gbuffers_fbo->color_textures[2], 2);
-			sh->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 3);
-			
-			sh->setUniform("u_hasgamma", Scene::scene->has_gamma);
-			sh->setUniform("u_ssao", ssao_fbo->color_textures[0], 4);
-
-			//pass the inverse projection of the camera to reconstruct world pos.
-			inv_vp = camera->viewprojection_matrix;
-			inv_vp.inverse();
-			sh->setUniform("u_inverse_viewprojection", inv_vp);
-			//pass the inverse window resolution, this may be useful
-			sh->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-
-			//pass all the information about the light and ambient
-			sh->setUniform("u_ambient_light", Scene::scene->ambient);
-			sh->setUniform("u_light_num", i);
-
-			//Irradiance information to shader
-			if (irr_fbo)
-			{
-				shader->setUniform("u_irradiance", true);
-				shader->setUniform("u_probes_texture", irr_fbo->color_textures[0], 7);
-				shader->setUniform("u_irr_end", Vector3(180, 150, 80));
-				shader->setUniform("u_irr_start", Vector3(-55, 10, -170));
-				shader->setUniform("u_irr_normal_distance", normalDistance);
-				shader->setUniform("u_irr_delta", Vector3(180, 150, 80) - Vector3(-55, 10, -170));
-				shader->setUniform("u_irr_dims", Vector3(8, 6, 12));
-				shader->setUniform("u_num_probes", 576.0f);
-			}
-			else
-				shader->setUniform("u_irradiance", 0);
+		sh->setUniform("u_hasgamma", Scene::scene->has_gamma);
+		sh->setUniform("u_ssao", ssao_fbo->color_textures[0], 4);
 
-			light_vector[i]->setUniforms(sh);
-			if (light_vector[i]->has_shadow) {
-				//get the depth texture from the FBO
-				Texture* shadowmap = light_vector[i]->shadow_fbo->depth_texture;
+		//pass the inverse window resolution, this may be useful
+		sh->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
 
-				//first time we create the FBO
-				sh->setTexture("shadowmap", shadowmap, 8);
+		//pass the ambient, the camera and the lights are in the uniform blocks
+		sh->setUniform("u_ambient_light", Scene::scene->ambient);
 
-				//also get the viewprojection from the light
-				Matrix44 shadow_proj = light_vector[i]->light_camera->viewprojection_matrix;
+		//Irradiance information to shader
+		if (irr_fbo)
+		{
+			sh->setUniform("u_irradiance", true);
+			sh->setUniform("u_probes_texture", irr_fbo->color_textures[0], 7);
+			sh->setUniform("u_irr_end", Vector3(180, 150, 80));
+			sh->setUniform("u_irr_start", Vector3(-55, 10, -170));
+			sh->setUniform("u_irr_normal_distance", normalDistance);
+			sh->setUniform("u_irr_delta", Vector3(180, 150, 80) - Vector3(-55, 10, -170));
+			sh->setUniform("u_irr_dims", Vector3(8, 6, 12));
+			sh->setUniform("u_num_probes", 576.0f);
+		}
+		else
+			sh->setUniform("u_irradiance", false);
+	};
 
-				//pass it to the shader
-				sh->setUniform("u_shadow_viewproj", shadow_proj);
+	//the permutation of each light, the shadows are the only feature that changes between them
+	unsigned int pass_features = (irr_fbo ? FEATURE_IRRADIANCE : 0) | (Scene::scene->has_gamma ? FEATURE_GAMMA : 0);
 
-				//we will also need the shadow bias
-				sh->setUniform("u_shadow_bias", light_vector[i]->shadow_bias);
+	GLState::enable(GL_BLEND);
+	GLState::blendFunc(GL_ONE, GL_ONE);
+	GLState::disable(GL_DEPTH_TEST);
 
-			}
+	for (int i = 0; i < light_vector.size(); i++)
+	{
+		//we need a shader specially for this task, lets call it "deferred", the deferred_ws shader uses the basic.vs instead of quad.vs
+		unsigned int features = pass_features | ShaderPermutations::getLightFeatures(light_vector[i]);
+		Shader* sh = ShaderPermutations::get(light_vector[i]->l_type != light_type::POINT_L ? "deferred" : "deferred_ws", features);
+		if (!sh)
+			continue;
+		sh->enable();
+		if (std::find(prepared_shaders.begin(), prepared_shaders.end(), sh) == prepared_shaders.end())
+		{
+			setLightPassUniforms(sh);
+			prepared_shaders.push_back(sh);
+		}
 
-			glDisable(GL_DEPTH_TEST);
+		//the range of this light in the light block
+		UniformBlocks::bindLight(i);
+		if (light_vector[i]->has_shadow)
+			sh->setUniform(u_shadowmap, light_vector[i]->shadow_fbo->depth_texture, 8);
 
+		if (light_vector[i]->l_type != light_type::POINT_L)
+		{
 			//render a fullscreen quad
-			quad->render(GL_TRIANGLES);
-
-			sh->disable();
+			Mesh::getQuad()->render(GL_TRIANGLES);
 		}
 		else
 		{
 			//we can use a sphere mesh for point lights
 			Mesh* sphere = Mesh::Get("data/meshes/sphere.obj");
-			
-			//this deferred_ws shader uses the basic.vs instead of quad.vs
-			Shader* sh = Shader::Get("deferred_ws");
-			sh->enable();
-
-			//remember to upload all the uniforms for gbuffers, ivp, etc...
-			sh->setUniform("u_camera_position", camera->eye);
-
-			//pass the gbuffers to the shader
-			sh->setUniform("u_color_texture", gbuffers_fbo->color_textures[0], 0);
-			sh->setUniform("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
-			sh->setUniform("u_extra_texture", gbuffers_fbo->color_textures[2], 2);
-			sh->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 3);
-			sh->setUniform("u_hasgamma", Scene::scene->has_gamma);
-			sh->setUniform("u_ssao", ssao_fbo->color_textures[0], 4);
-
-			//pass the inverse projection of the camera to reconstruct world pos.
-			Matrix44 inv_vp = camera->viewprojection_matrix;
-			inv_vp.inverse();
-			sh->setUniform("u_inverse_viewprojection", inv_vp);
-			//pass the inverse window resolution, this may be useful
-			sh->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-
-			//pass all the information about the light and ambient
-			sh->setUniform("u_ambient_light", Scene::scene->ambient);
-			sh->setUniform("u_light_num", i);
-
-			//Irradiance information to shader
-			if (irr_fbo)
-			{
-				shader->setUniform("u_irradiance", true);
-				shader->setUniform("u_probes_texture", irr_fbo->color_textures[0], 7);
-				shader->setUniform("u_irr_end", Vector3(180, 150, 80));
-				shader->setUniform("u_irr_start", Vector3(-55, 10, -170));
-				shader->setUniform("u_irr_normal_distance", normalDistance);
-				shader->setUniform("u_irr_delta", Vector3(180, 150, 80) - Vector3(-55, 10, -170));
-				shader->setUniform("u_irr_dims", Vector3(8, 6, 12));
-				shader->setUniform("u_num_probes", 576.0f);
-			}
-			else
-				shader->setUniform("u_irradiance", 0);
-
-			//basic.vs will need the model and the viewproj of the camera
-			sh->setUniform("u_viewprojection", camera->viewprojection_matrix);
 
 			//we must translate the model to the center of the light
 			Matrix44 m;
@@ -514,32 +509,25 @@ void Renderer::renderDeferred(Camera* camera)
 			//and scale it according to the max_distance of the light
 			m.scale(light_vector[i]->maxDist, light_vector[i]->maxDist, light_vector[i]->maxDist);
 			//pass the model to the shader to render the sphere
-			sh->setUniform("u_model", m);
-
-			//pass all the info about this light
-			light_vector[i]->setUniforms(sh);
+			sh->setUniform(u_model, m);
 
 			//render only the backfacing triangles of the sphere
-			glFrontFace(GL_CW);
-
-			glDisable(GL_DEPTH_TEST);
-
-			glEnable(GL_CULL_FACE);
+			GLState::frontFace(GL_CW);
+			GLState::enable(GL_CULL_FACE);
 			//and render the sphere
 			sphere->render(GL_TRIANGLES);
-			glDisable(GL_CULL_FACE);
-
-			glFrontFace(GL_CCW);
-
-			sh->disable();
+			GLState::disable(GL_CULL_FACE);
+			GLState::frontFace(GL_CCW);
 		}
 	}
+	if (Shader::current)
+		Shader::current->disable();
 
 	//stop rendering to the fbo, render to screen
 	illumination_fbo->unbind();
 
 	//be sure blending is not active
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
 
 	illumination_fbo->color_textures[0]->toViewport();
 
@@ -583,7 +571,7 @@ void Renderer::renderDeferred(Camera* camera)
 
 		if (Scene::scene->sun && Scene::scene->sun->has_shadow && volumetric) //VOLUMETRIC
 		{
-			glDisable(GL_BLEND);
+			GLState::disable(GL_BLEND);
 
 			Texture* noise = Texture::Get("data/textures/noise.png");
 			noise->bind();
@@ -598,11 +586,8 @@ void Renderer::renderDeferred(Camera* camera)
 
 			shader->enable();
 
-			shader->setUniform("u_inverse_viewprojection", inv_vp);
-			shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 			shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 0);
 			shader->setUniform("u_iRes", Vector2(1.0 / volumetric_fbo->width, 1.0 / volumetric_fbo->height));
-			shader->setUniform("u_camera_position", camera->eye);
 
 			shader->setUniform("u_ambient_light", Scene::scene->ambient);
 
@@ -622,30 +607,27 @@ void Renderer::renderDeferred(Camera* camera)
 			shader->disable();
 			volumetric_fbo->unbind();
 
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 			volumetric_fbo->color_textures[0]->bind();
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 			volumetric_fbo->color_textures[0]->unbind();
 			volumetric_fbo->color_textures[0]->toViewport();
-			glDisable(GL_BLEND);
+			GLState::disable(GL_BLEND);
 
 		}
 		if (Scene::scene->show_reflections&&environment&&reflections_fbo) {
 
 			Mesh* quad = Mesh::getQuad();
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 			Shader *shader = Shader::Get("deferred_reflections");
 			shader->enable();
-			shader->setUniform("u_inverse_viewprojection", inv_vp);
-			shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 			shader->setTexture("u_color_texture", gbuffers_fbo->color_textures[0], 0);
 			shader->setTexture("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
 			shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 2);
 			shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->depth_texture->width, 1.0 / (float)gbuffers_fbo->depth_texture->height));
-			shader->setUniform("u_camera_position", camera->eye);
 
 			Texture * nearest_cubemap = environment;
 			for (int i = 0;i < reflection_probes.size();++i) {
@@ -683,25 +665,70 @@ void GTR::Renderer::renderScene(Camera * camera, bool deferred)
 	if(!deferred)
 		renderSkyBox(camera, 0);
 
-	for (int i = 0; i < prefab_vector.size();i++) {
-		renderPrefab(prefab_vector[i]->model, prefab_vector[i]->prefab, camera, deferred);
-	}
+	renderPrefabs(prefab_vector, camera, deferred);
+}
+
+//renders all the prefabs together so the nodes repeated among them can be instanced
+void Renderer::renderPrefabs(std::vector<PrefabEntity*>& prefab_vector, Camera* camera, bool deferred)
+{
+	for (int i = 0; i < prefab_vector.size(); i++)
+		if (prefab_vector[i]->prefab->isReady()) //still loading in the background
+		{
+			if (use_texture_arrays)
+				TextureArray::request(prefab_vector[i]->prefab);
+			collectRenderCalls(prefab_vector[i]->model, &prefab_vector[i]->prefab->root, camera);
+		}
+
+	renderCalls(camera, deferred);
 }
 
 //renders all the prefab
 void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, bool deferred)
 {
+	//still loading in the background
+	if (!prefab->isReady())
+		return;
+
 	//assign the model to the root node
-	if(deferred)
-		renderNodeDeferred(model, &prefab->root, camera);
-	else 
-		renderNodeForward(model, &prefab->root, camera);
+	collectRenderCalls(model, &prefab->root, camera);
+	renderCalls(camera, deferred);
+}
 
-	
+void Renderer::renderVirtualTextureFeedback(std::vector<PrefabEntity*>& prefab_vector, Camera* camera)
+{
+	if (!VirtualTexture::beginFeedback(Application::instance->window_width, Application::instance->window_height))
+		return;
+	render_vt_feedback = true;
+	renderPrefabs(prefab_vector, camera, true);
+	render_vt_feedback = false;
+	VirtualTexture::endFeedback();
 }
 
-//renders a node of the prefab and its children
-void Renderer::renderNodeForward(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+//the virtual texture used instead of the texture, NULL if it has none or it is still being tiled
+static VirtualTexture* getVirtualTexture(Texture* texture, bool enabled)
+{
+	VirtualTexture* vt = enabled ? VirtualTexture::Get(texture) : NULL;
+	return vt && vt->isReady() ? vt : NULL;
+}
+
+//the finest mip every texture of the material needs, from the texels of the first level per pixel where the node is closest to the camera
+static void requestTextureDetail(Mesh* mesh, GTR::Material* material, Matrix44& model, const BoundingBox& world_bounding, Camera* camera, bool virtual_texturing)
+{
+	float radius = world_bounding.halfsize.length();
+	float pixels_per_unit = TextureStreaming::getPixelsPerUnit(camera, world_bounding.center, radius, (float)Application::instance->window_height);
+
+	//UV units per world unit, without the UV density of the mesh assume the UVs cover it once
+	float scale = std::max(model.rightVector().length(), std::max(model.topVector().length(), model.frontVector().length()));
+	float uv_per_unit = mesh->uv_density ? mesh->uv_density / scale : 0.5f / std::max(radius, 0.0001f);
+
+	Texture* textures[] = { material->color_texture, material->emissive_texture, material->metallic_roughness_texture, material->occlusion_texture, material->normal_texture };
+	for (int i = 0; i < 5; ++i)
+		if (textures[i] && textures[i]->streamed && !getVirtualTexture(textures[i], virtual_texturing) && !TextureArray::sSlots.count(textures[i])) //the virtual and packed ones keep only their small mips
+			TextureStreaming::request(textures[i], std::max(textures[i]->width, textures[i]->height) * uv_per_unit / pixels_per_unit);
+}
+
+//stores the visible meshes of a node of the prefab and its children
+void Renderer::collectRenderCalls(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
 {
 	if (!node->visible)
 		return;
@@ -709,7 +736,7 @@ void Renderer::renderNodeForward(const Matrix44& prefab_model, GTR::Node* node,
 	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
 
 	//does this node have a mesh? then we must render it
-	if (node->mesh && node->material)
+	if (node->mesh && node->material && node->mesh->isReady())
 	{
 		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
 		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
@@ -717,42 +744,117 @@ void Renderer::renderNodeForward(const Matrix44& prefab_model, GTR::Node* node,
 		//if bounding box is inside the camera frustum then the object is probably visible
 		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
 		{
-			//render node mesh
-			renderMeshWithLight(node_model, node->mesh, node->material, camera);
+			//pick the detail from the size on screen
+			sRenderCall rc;
+			rc.mesh = node->mesh;
+			rc.material = node->material;
+			rc.packed = use_texture_arrays ? TextureArray::getPacked(node->material) : NULL;
+			rc.model = node_model;
+			rc.lod = node->mesh->getLOD(camera->getProjectedScale(world_bounding.center, world_bounding.halfsize.length()), camera->lod_bias);
+			render_calls.push_back(rc);
+
+			if (camera == streaming_camera)
+				requestTextureDetail(node->mesh, node->material, node_model, world_bounding, camera, use_virtual_texturing);
 		}
 	}
 
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i)
-		renderNodeForward(prefab_model, node->children[i], camera);
+		collectRenderCalls(prefab_model, node->children[i], camera);
 }
 
-void Renderer::renderNodeDeferred(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+//the G-buffer draws packed materials that use the same arrays together, they read their factors from the material table
+static bool sameBatch(const sRenderCall& a, const sRenderCall& b, bool deferred)
 {
-	if (!node->visible)
-		return;
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	if (a.mesh != b.mesh || a.lod != b.lod)
+		return false;
+	return a.material == b.material || (deferred && a.packed && b.packed && TextureArray::canShareDraw(a.material, b.material));
+}
 
-	//does this node have a mesh? then we must render it
-	if (node->mesh && node->material)
+static bool sortRenderCalls(const sRenderCall& a, const sRenderCall& b)
+{
+	if (a.mesh != b.mesh)
+		return a.mesh < b.mesh;
+	if (a.lod != b.lod)
+		return a.lod < b.lod;
+	if ((a.packed != NULL) != (b.packed != NULL))
+		return a.packed != NULL;
+	if (a.packed)
 	{
-		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
+		if (a.packed->color_array != b.packed->color_array)
+			return a.packed->color_array < b.packed->color_array;
+		if (a.packed->metal_roughness_array != b.packed->metal_roughness_array)
+			return a.packed->metal_roughness_array < b.packed->metal_roughness_array;
+		if (a.material->alpha_mode != b.material->alpha_mode)
+			return a.material->alpha_mode < b.material->alpha_mode;
+		if (a.material->two_sided != b.material->two_sided)
+			return a.material->two_sided < b.material->two_sided;
+	}
+	return a.material < b.material;
+}
 
-		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
+void Renderer::renderCalls(Camera* camera, bool deferred)
+{
+	//the order only matters for blended materials, the stable sort keeps it inside every batch
+	if (use_instancing)
+		std::stable_sort(render_calls.begin(), render_calls.end(), sortRenderCalls);
+
+	//the camera and the materials of all the calls are uploaded at once, the draws only bind their range
+	UniformBlocks::setCamera(camera ? camera : Camera::current);
+	static std::vector<GTR::Material*> materials;
+	materials.resize(render_calls.size());
+	for (size_t i = 0; i < render_calls.size(); ++i)
+		materials[i] = render_calls[i].material;
+	UniformBlocks::setMaterials(materials);
+
+	for (int i = 0; i < (int)render_calls.size(); )
+	{
+		sRenderCall& rc = render_calls[i];
+		int num = 1;
+		if (use_instancing)
+			while (i + num < (int)render_calls.size() && sameBatch(rc, render_calls[i + num], deferred))
+				num++;
+
+		//planar reflections need the shader with the uniform model
+		if (num >= min_instances && !rc.material->planarReflection)
 		{
-			renderMeshDeferred(node_model, node->mesh, node->material, camera);
+			instance_models.resize(num);
+			for (int j = 0; j < num; ++j)
+				instance_models[j] = render_calls[i + j].model;
+
+			if (deferred && rc.packed)
+			{
+				instance_material_ids.resize(num);
+				for (int j = 0; j < num; ++j)
+					instance_material_ids[j] = (float)(render_calls[i + j].packed->row + 1);
+				renderMeshDeferred(rc.model, rc.mesh, rc.material, camera, rc.lod, &instance_models[0], num, &instance_material_ids[0]);
+			}
+			else if (deferred)
+				renderMeshDeferred(rc.model, rc.mesh, rc.material, camera, rc.lod, &instance_models[0], num);
+			else
+				renderMeshWithLight(rc.model, rc.mesh, rc.material, camera, rc.lod, &instance_models[0], num);
 		}
+		else
+			for (int j = i; j < i + num; ++j)
+			{
+				sRenderCall& call = render_calls[j];
+				if (deferred)
+					renderMeshDeferred(call.model, call.mesh, call.material, camera, call.lod);
+				else
+					renderMeshWithLight(call.model, call.mesh, call.material, camera, call.lod);
+			}
+
+		i += num;
 	}
 
-	//iterate recursively with children
-	for (int i = 0; i < node->children.size(); ++i)
-		renderNodeDeferred(prefab_model, node->children[i], camera);
+	//the draws leave their shader enabled, the next one is often the same program
+	if (Shader::current)
+		Shader::current->disable();
+
+	render_calls.clear();
 }
 
-void Renderer::renderMeshWithLight(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::renderMeshWithLight(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, int lod, const Matrix44* instances, int num_instances)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -761,7 +863,7 @@ void Renderer::renderMeshWithLight(const Matrix44 model, Mesh* mesh, GTR::Materi
 	//define locals to simplify coding
 	Shader* shader = NULL;
 	Shader* shader_shadow = NULL;
-	shader_shadow = Shader::Get("shadow");
+	shader_shadow = Shader::Get(instances ? "shadow_instanced" : "shadow");
 	Texture* texture = NULL;
 	Texture* texture_emissive = NULL;
 	if (camera == NULL)
@@ -770,34 +872,39 @@ void Renderer::renderMeshWithLight(const Matrix44 model, Mesh* mesh, GTR::Materi
 
 	if (render_shadowmap) { //if we are rendering shadowmap
 
+		UniformBlocks::setCamera(camera);
 		shader_shadow->enable();
 
 		//upload uniforms
-		shader_shadow->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader_shadow->setUniform("u_camera_position", camera->eye);
-		shader_shadow->setUniform("u_model", model);
-
-		mesh->render(GL_TRIANGLES);
-		shader_shadow->disable();
+		if (instances)
+			mesh->renderInstanced(GL_TRIANGLES, instances, num_instances, -1, lod);
+		else
+		{
+			shader_shadow->setUniform(u_model, model);
+			mesh->renderCulled(GL_TRIANGLES, model, camera, !material->two_sided, -1, lod);
+		}
 	}
 	else {
 
 		texture = material->color_texture;
 		texture_emissive = material->emissive_texture;
 		//allow to render pixels that have the same depth as the one in the depth buffer
-		glDepthFunc(GL_LEQUAL);
+		GLState::depthFunc(GL_LEQUAL);
 		//select if render both sides of the triangles
 		if (material->two_sided)
-			glDisable(GL_CULL_FACE);
+			GLState::disable(GL_CULL_FACE);
 		else
-			glEnable(GL_CULL_FACE);
-
-		//chose a shader
+			GLState::enable(GL_CULL_FACE);
 
+		//chose a shader, the permutation of texture depends on the shadows of each light
+		const char* shader_name = NULL;
 		if (material->planarReflection == true)
 			shader = Shader::Get("planar_reflection");
 		else
-			shader = Shader::Get("texture");
+		{
+			shader_name = instances ? "texture_instanced" : "texture";
+			shader = Shader::Get(shader_name);
+		}
 
 
 		//no shader? then nothing to render
@@ -807,75 +914,64 @@ void Renderer::renderMeshWithLight(const Matrix44 model, Mesh* mesh, GTR::Materi
 
 		//set blending mode to additive
 		//this will collide with materials with blend...
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-
-		shader->enable();
-		shader->setUniform("u_iRes", Vector2(1.0 / (float)Application::instance->window_width, 1.0 / (float)Application::instance->window_height));
-
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 
-		//upload uniforms
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader->setUniform("u_camera_position", camera->eye);
-		shader->setUniform("u_model", model);
-		//shader->setUniform("u_ambient_light", Scene::scene->ambient);
-
-		shader->setUniform("u_color", material->color);
-		if (texture)
-			shader->setUniform("u_texture", texture, 0);
+		UniformBlocks::setCamera(camera);
+		UniformBlocks::setLights(light_vector);
 
-		/*if(texture_emissive)
-			shader->setUniform("u_emissive_texture", texture_emissive, 0);*/
+		//the color, emissive and alpha threshold (to cut polygons according to texture alpha) are in the material block
+		UniformBlocks::bindMaterial(material);
 
-		shader->setUniform("u_emissive_factor", material->emissive_factor);
-		//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-		shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0);
+		//upload uniforms, again when the light uses another permutation
+		auto enableShader = [&](Shader* sh) {
+			sh->enable();
+			sh->setUniform(u_iRes, Vector2(1.0 / (float)Application::instance->window_width, 1.0 / (float)Application::instance->window_height));
+			sh->setUniform(u_model, model);
+			//sh->setUniform("u_ambient_light", Scene::scene->ambient);
+			if (texture)
+				sh->setUniform(u_texture, texture, 0);
+			/*if(texture_emissive)
+				sh->setUniform("u_emissive_texture", texture_emissive, 0);*/
+		};
 
 		//light
+		Shader* enabled_shader = NULL;
 		for (int i = 0;i < light_vector.size();i++) {
+			if (shader_name)
+				shader = ShaderPermutations::get(shader_name, ShaderPermutations::getLightFeatures(light_vector[i]));
+			if (shader != enabled_shader)
+			{
+				enableShader(shader);
+				enabled_shader = shader;
+			}
 
 			//first pass doesn't use blending
 			if (i == 0) {
 				if (material->alpha_mode == GTR::AlphaMode::BLEND)
 				{
-					glEnable(GL_BLEND);
+					GLState::enable(GL_BLEND);
 				}
 				else
-					glDisable(GL_BLEND);
+					GLState::disable(GL_BLEND);
 			}
 			else {
-				glEnable(GL_BLEND);
+				GLState::enable(GL_BLEND);
 			}
+			//the depth texture from the FBO, its viewprojection and bias are in the light block
 			if (light_vector[i]->has_shadow)
-			{
-
-				//get the depth texture from the FBO
-				Texture* shadowmap = light_vector[i]->shadow_fbo->depth_texture;
-
-				//first time we create the FBO
-				shader->setTexture("shadowmap", shadowmap, 8);
-
-				//also get the viewprojection from the light
-				Matrix44 shadow_proj = light_vector[i]->light_camera->viewprojection_matrix;
-
-				//pass it to the shader
-				shader->setUniform("u_shadow_viewproj", shadow_proj);
-
-				//we will also need the shadow bias
-				shader->setUniform("u_shadow_bias", light_vector[i]->shadow_bias);
-
-			}
+				shader->setUniform(u_shadowmap, light_vector[i]->shadow_fbo->depth_texture, 8);
 
 			//pass the light data to the shader
-			light_vector[i]->setUniforms(shader);
-			mesh->render(GL_TRIANGLES);
+			UniformBlocks::bindLight(i);
+			if (instances)
+				mesh->renderInstanced(GL_TRIANGLES, instances, num_instances, -1, lod);
+			else
+				mesh->renderCulled(GL_TRIANGLES, model, camera, !material->two_sided, -1, lod);
 		}
 
-		//disable shader
-		shader->disable();
-
 		//set the render state as it was before to avoid problems with future renders
-		glDisable(GL_BLEND);
-		glDepthFunc(GL_LESS); //as default*/
+		GLState::disable(GL_BLEND);
+		GLState::depthFunc(GL_LESS); //as default*/
 	}
 
 }
@@ -898,6 +994,7 @@ void GTR::Renderer::renderShadowmap()
 				cam->setPerspective(acos(light_vector[i]->spotCutOff)*RAD2DEG, 1.0, 1.0f, light_vector[i]->maxDist);
 			}
 
+			cam->lod_bias = shadow_lod_bias;
 			light_vector[i]->light_camera = cam;
 
 
@@ -919,9 +1016,9 @@ void GTR::Renderer::renderShadowmap()
 			//set the camera as default (used by some functions in the framework)
 
 			//set default flags
-			glDisable(GL_BLEND);
-			glEnable(GL_DEPTH_TEST);
-			glEnable(GL_CULL_FACE);
+			GLState::disable(GL_BLEND);
+			GLState::enable(GL_DEPTH_TEST);
+			GLState::enable(GL_CULL_FACE);
 
 			light_vector[i]->light_camera->enable();
 
@@ -930,8 +1027,8 @@ void GTR::Renderer::renderShadowmap()
 
 			//disable it to render back to the screen
 			light_vector[i]->shadow_fbo->unbind();
-			glDisable(GL_CULL_FACE);
-			glDisable(GL_DEPTH_TEST);
+			GLState::disable(GL_CULL_FACE);
+			GLState::disable(GL_DEPTH_TEST);
 
 			glColorMask(true, true, true, true);
 
@@ -942,7 +1039,7 @@ void GTR::Renderer::renderShadowmap()
 	render_shadowmap = false;
 }
 
-void Renderer::renderMeshDeferred(const Matrix44 model, Mesh * mesh, GTR::Material * material, Camera * camera)
+void Renderer::renderMeshDeferred(const Matrix44 model, Mesh * mesh, GTR::Material * material, Camera * camera, int lod, const Matrix44* instances, int num_instances, const float* instance_material_ids)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -962,77 +1059,125 @@ void Renderer::renderMeshDeferred(const Matrix44 model, Mesh * mesh, GTR::Materi
 	//texture = material->normal_texture;
 	//texture = material->occlusion_texture;
 	Shader* shader_shadow = NULL;
-	shader_shadow = Shader::Get("shadow");
+	shader_shadow = Shader::Get(instances ? "shadow_instanced" : "shadow");
 
 	if (render_shadowmap) { //if we are rendering shadowmap
 
+		UniformBlocks::setCamera(camera);
 		shader_shadow->enable();
 
 		//upload uniforms
-		shader_shadow->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader_shadow->setUniform("u_camera_position", camera->eye);
-		shader_shadow->setUniform("u_model", model);
+		if (instances)
+			mesh->renderInstanced(GL_TRIANGLES, instances, num_instances, -1, lod);
+		else
+		{
+			shader_shadow->setUniform(u_model, model);
+			mesh->renderCulled(GL_TRIANGLES, model, camera, !material->two_sided, -1, lod);
+		}
+	}
+	else if (render_vt_feedback) { //the pages of the virtual textures, the rest write id 0 to occlude them
+		VirtualTexture* vt_color = getVirtualTexture(texture, use_virtual_texturing);
+		VirtualTexture* vt_met_rough = getVirtualTexture(texture_met_rough, use_virtual_texturing);
+		shader = Shader::Get(instances ? "vt_feedback_instanced" : "vt_feedback");
+		if (!shader)
+			return;
+		shader->enable();
 
-		mesh->render(GL_TRIANGLES);
-		shader_shadow->disable();
+		GLState::disable(GL_BLEND);
+		if (material->two_sided)
+			GLState::disable(GL_CULL_FACE);
+		else
+			GLState::enable(GL_CULL_FACE);
+
+		UniformBlocks::setCamera(camera);
+		shader->setUniform(u_model, model);
+		shader->setUniform(u_vt_color_id, vt_color ? vt_color->id : 0);
+		if (vt_color)
+			shader->setUniform(u_vt_color_size, Vector3((float)vt_color->width, (float)vt_color->height, (float)vt_color->num_levels));
+		shader->setUniform(u_vt_metal_roughness_id, vt_met_rough ? vt_met_rough->id : 0);
+		if (vt_met_rough)
+			shader->setUniform(u_vt_metal_roughness_size, Vector3((float)vt_met_rough->width, (float)vt_met_rough->height, (float)vt_met_rough->num_levels));
+		shader->setUniform(u_vt_page_size, (float)VirtualTexture::page_size);
+		shader->setUniform(u_vt_feedback_bias, log2f((float)VirtualTexture::feedback_divisor));
+
+		if (instances)
+			mesh->renderInstanced(GL_TRIANGLES, instances, num_instances, -1, lod);
+		else
+			mesh->renderCulled(GL_TRIANGLES, model, camera, !material->two_sided, -1, lod);
 	}
 	else {
 		//select the blending
 		if (material->alpha_mode == GTR::AlphaMode::BLEND)
 		{
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		}
 		else
-			glDisable(GL_BLEND);
+			GLState::disable(GL_BLEND);
 
 		//select if render both sides of the triangles
 		if (material->two_sided)
-			glDisable(GL_CULL_FACE);
+			GLState::disable(GL_CULL_FACE);
 		else
-			glEnable(GL_CULL_FACE);
+			GLState::enable(GL_CULL_FACE);
 
-		shader = Shader::Get("multi");
+		//the packed materials read the textures and factors from the arrays and their row of the material table
+		bool packed = use_texture_arrays && TextureArray::getPacked(material);
+		shader = ShaderPermutations::get(instances ? "multi_instanced" : "multi", ShaderPermutations::getMaterialFeatures(material, packed));
 
 		//no shader? then nothing to render
 		if (!shader)
 			return;
+		UniformBlocks::setCamera(camera);
 		shader->enable();
 
 		//upload uniforms
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader->setUniform("u_camera_position", camera->eye);
-		shader->setUniform("u_model", model);
-		shader->setUniform("u_camera_near_far", Vector2(camera->near_plane, camera->far_plane));
-		shader->setUniform("u_hasgamma", Scene::scene->has_gamma);
-
-		shader->setUniform("u_color", material->color);
-		if (texture)
-			shader->setUniform("u_texture", texture, 0);
+		shader->setUniform(u_model, model);
+		shader->setUniform(u_camera_near_far, Vector2(camera->near_plane, camera->far_plane));
+		shader->setUniform(u_hasgamma, Scene::scene->has_gamma);
+
+		//the color, metalness, roughness, emissive and alpha threshold are in the material block
+		UniformBlocks::bindMaterial(material);
+		TextureArray::setUniforms(shader, packed ? material : NULL);
+
+		VirtualTexture* vt_color = packed ? NULL : getVirtualTexture(texture, use_virtual_texturing);
+		VirtualTexture* vt_met_rough = NULL;
+		if (vt_color)
+			vt_color->setUniforms(shader, "u_vt_color", 2);
+		else
+		{
+			shader->setUniform(u_vt_color, false);
+			if (texture && !packed)
+				shader->setUniform(u_texture, texture, 0);
+		}
 
-		if (texture_met_rough)
+		if (packed)
+			shader->setUniform(u_hasmetal, false); //from the table
+		else if (texture_met_rough && texture_met_rough->isReady()) //a white placeholder would be full metal
 		{
-			shader->setUniform("u_metal_roughness", texture_met_rough, 1);
-			shader->setUniform("u_hasmetal", true);
+			vt_met_rough = getVirtualTexture(texture_met_rough, use_virtual_texturing);
+			if (vt_met_rough)
+				vt_met_rough->setUniforms(shader, "u_vt_metal_roughness", 3);
+			else
+			{
+				shader->setUniform(u_vt_metal_roughness, false);
+				shader->setUniform(u_metal_roughness, texture_met_rough, 1);
+			}
+			shader->setUniform(u_hasmetal, true);
 		}
 		else
-			shader->setUniform("u_hasmetal", false);
-
-		shader->setUniform("u_metalness", material->metallic_factor);
-		shader->setUniform("u_roughness", material->roughness_factor);
-		shader->setUniform("u_emissive_factor", material->emissive_factor);
-
-		//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-		shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0);
+			shader->setUniform(u_hasmetal, false);
+		if (vt_color || vt_met_rough)
+			VirtualTexture::setCacheUniforms(shader, 4);
 
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
-
-		//disable shader
-		shader->disable();
+		if (instances)
+			mesh->renderInstanced(GL_TRIANGLES, instances, num_instances, -1, lod, instance_material_ids);
+		else
+			mesh->renderCulled(GL_TRIANGLES, model, camera, !material->two_sided, -1, lod);
 
 		//set the render state as it was before to avoid problems with future renders
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 	}
 
 }
@@ -1046,19 +1191,18 @@ void GTR::Renderer::renderSkyBox(Camera* camera, bool flag)
 		
 
 	Shader* shader = Shader::Get("skybox");
-	glDisable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
-	glDisable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
+	GLState::disable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
 	Matrix44 model;
 	model.setTranslation(camera->eye.x, camera->eye.y, camera->eye.z);
+	UniformBlocks::setCamera(camera);
 	shader->enable();
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
+	shader->setUniform(u_model, model);
 	shader->setUniform("u_texture", environment, 0);
 
 	Mesh::Get("data/meshes/box.ASE")->render(GL_TRIANGLES);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_DEPTH_TEST);
 	shader->disable();
 }
 
@@ -1091,6 +1235,7 @@ void GTR::Renderer::computeReflection()
 		//sReflectionProbe *p = reflection_probes[iP];
 		Camera cam;
 		cam.setPerspective(90, 1, 0.1, 1000);
+		cam.lod_bias = probe_lod_bias;
 
 		//render the view from every side
 		for (int i = 0; i < 6; ++i)
@@ -1111,9 +1256,9 @@ void GTR::Renderer::computeReflection()
 			glClearColor(0.0, 0.0, 0.0, 1.0);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-			glDisable(GL_BLEND);
-			glEnable(GL_DEPTH_TEST);
-			glEnable(GL_CULL_FACE);
+			GLState::disable(GL_BLEND);
+			GLState::enable(GL_DEPTH_TEST);
+			GLState::enable(GL_CULL_FACE);
 
 			renderScene(&cam, false);
 
@@ -1134,18 +1279,17 @@ void GTR::Renderer::renderReflectionProbe(Vector3 pos, float size, Texture *cube
 	Shader* shader = Shader::Get("ref_probes");
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj");
 
-	glEnable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
+	GLState::disable(GL_BLEND);
+	GLState::enable(GL_DEPTH_TEST);
 
 	Matrix44 model;
 	model.setTranslation(pos.x, pos.y, pos.z);
 	model.scale(size, size, size);
 
+	UniformBlocks::setCamera(camera);
 	shader->enable();
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
+	shader->setUniform(u_model, model);
 	cubemap->bind();
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -1166,9 +1310,21 @@ Texture* Renderer::CubemapFromHDRE(const char* filename)
 		return NULL;
 	}
 
+	//the faces are staged (see TextureUpload), the file is kept until they are uploaded
 	Texture* texture = new Texture();
-	texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFaces(0), hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT);
-	for (int i = 1; i < 6; ++i)
+	texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFaces(0), hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT, false);
+	for (int i = 1; i < N_LEVELS; ++i)
 		texture->uploadCubemap(texture->format, texture->type, false, (Uint8**)hdre->getFaces(i), GL_RGBA32F, i);
+	TextureUpload::whenDone(texture, [hdre]() { delete hdre; });
+
+	//the levels of the file are the prefiltered chain the shaders sample, no glGenerateMipmap
+	texture->mipmaps = true;
+	GLState::bindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id); //bind() would use the placeholder while it loads
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, N_LEVELS - 1);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, texture->wrapS);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, texture->wrapT);
+	GLState::bindTexture(GL_TEXTURE_CUBE_MAP, 0);
 	return texture;
 }
\ No newline at end of file
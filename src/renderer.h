@@ -7,6 +7,7 @@
 
 //forward declarations
 class Camera;
+struct sPackedMaterial;
 
 namespace GTR {
 
@@ -25,6 +26,16 @@ namespace GTR {
 		Texture* cubemap = NULL;
 	};
 
+	//a visible mesh of a prefab node, they are gathered first so the ones that share mesh, material and lod can be drawn instanced
+	//(in the G-buffer also the ones with different packed materials that use the same arrays, see TextureArray)
+	struct sRenderCall {
+		Mesh* mesh;
+		Material* material;
+		sPackedMaterial* packed; //NULL if it binds its own textures
+		Matrix44 model;
+		int lod;
+	};
+
 	
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
@@ -66,23 +77,49 @@ namespace GTR {
 
 		bool ssao_blurring = false;
 
+		//LOD bias of the cameras used to render shadowmaps and probes (see Camera::lod_bias)
+		float shadow_lod_bias = 1.0f;
+		float probe_lod_bias = 2.0f;
+
+		//nodes with the same mesh, material and lod are drawn in one instanced call when there are at least min_instances
+		bool use_instancing = true;
+		int min_instances = 2;
+		std::vector<sRenderCall> render_calls;
+		std::vector<Matrix44> instance_models;
+		std::vector<float> instance_material_ids;
+
+		//the material textures of the prefabs are packed in texture arrays once loaded, and the G-buffer uses them
+		bool use_texture_arrays = true;
+
+		//the render calls of this camera request the detail of their material textures (see TextureStreaming)
+		Camera* streaming_camera = NULL;
+
+		//the big color and metal-roughness textures are sampled through VirtualTexture in the G-buffer
+		bool use_virtual_texturing = true;
+
 		Renderer();
 
 		std::vector<Vector3> generateSpherePoints(int num, float radius, bool hemi);
 
 		void renderDeferred(Camera * camera);
 
+		void renderVirtualTextureFeedback(std::vector<PrefabEntity*>& prefab_vector, Camera * camera); //requests the pages of the virtual textures seen
+
 		void renderScene(Camera * camera, bool deferred);
 
+		void renderPrefabs(std::vector<PrefabEntity*>& prefab_vector, Camera * camera, bool deferred);
+
 		void renderPrefab(const Matrix44 & model, GTR::Prefab * prefab, Camera * camera, bool deferred);
 
-		void renderNodeForward(const Matrix44 & prefab_model, GTR::Node * node, Camera * camera);
+		void collectRenderCalls(const Matrix44 & prefab_model, GTR::Node * node, Camera * camera);
 
-		void renderNodeDeferred(const Matrix44 & prefab_model, GTR::Node * node, Camera * camera);
+		void renderCalls(Camera * camera, bool deferred); //draws and clears render_calls
 
-		void renderMeshWithLight(const Matrix44 model, Mesh * mesh, GTR::Material * material, Camera * camera);//forward
+		//with instances the model is ignored and the mesh is drawn once per instance matrix (no meshlet culling)
+		void renderMeshWithLight(const Matrix44 model, Mesh * mesh, GTR::Material * material, Camera * camera, int lod = 0, const Matrix44* instances = NULL, int num_instances = 0);//forward
 
-		void renderMeshDeferred(const Matrix44 model, Mesh * mesh, GTR::Material * material, Camera * camera);
+		//instance_material_ids: row + 1 in the material table of every instance, when the batch mixes packed materials
+		void renderMeshDeferred(const Matrix44 model, Mesh * mesh, GTR::Material * material, Camera * camera, int lod = 0, const Matrix44* instances = NULL, int num_instances = 0, const float* instance_material_ids = NULL);
 
 		void renderShadowmap();
 
@@ -6,8 +6,11 @@
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <set>
+#include <cstring>
 
 #include "texture.h"
+#include "gl_state.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
@@ -57,16 +60,209 @@ std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
 
+bool Shader::use_binary_cache = true;
+int Shader::num_from_cache = 0;
+int Shader::num_compiled = 0;
+
+#define SHADER_BIN_VERSION 1
+#define SHADER_CACHE_FILENAME "data/shaders.sbin"
+
+//header of every program in the .sbin, followed by its name and its binary
+struct sProgramBinHeader {
+	unsigned long long hash; //sources with the macros, driver and version
+	unsigned int format;
+	unsigned int bytes;
+	unsigned int name_length;
+};
+
+struct sProgramBinary {
+	unsigned long long hash;
+	GLenum format;
+	std::vector<char> data;
+};
+
+static std::map<std::string, sProgramBinary> s_binaries; //by the name of the shader, one per program so the outdated ones are replaced
+static bool s_binaries_dirty = false;
+
+static bool s_compiling = false; //atlas shaders not finished yet
+static long s_compile_start = 0;
+
+#ifndef GL_COMPLETION_STATUS_KHR
+	#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (APIENTRY * glMaxShaderCompilerThreadsKHR_func)(GLuint count);
+
+static bool supportsParallelCompile()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		supported = SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile") == SDL_TRUE;
+		glMaxShaderCompilerThreadsKHR_func max_threads = supported ? (glMaxShaderCompilerThreadsKHR_func)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR") : NULL;
+		if (max_threads)
+			max_threads(0xFFFFFFFF); //as many as the driver wants
+		std::cout << " * Parallel shader compile: " << (supported ? "yes" : "no") << std::endl;
+	}
+	return supported == 1;
+}
+
+static bool supportsProgramBinary()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		GLint num_formats = 0;
+		if (SDL_GL_ExtensionSupported("GL_ARB_get_program_binary") == SDL_TRUE)
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+		supported = num_formats > 0;
+	}
+	return supported == 1;
+}
+
+//the binaries only work in the same driver
+static unsigned long long hashProgramSource(const std::string& vsm, const std::string& psm)
+{
+	static unsigned long long driver_hash = 0;
+	if (!driver_hash)
+	{
+		int version = SHADER_BIN_VERSION;
+		driver_hash = hashData(&version, sizeof(version));
+		const GLenum strings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		for (int i = 0; i < 3; ++i)
+		{
+			const char* str = (const char*)glGetString(strings[i]);
+			if (str)
+				driver_hash = hashData(str, strlen(str), driver_hash);
+		}
+	}
+	unsigned long long hash = hashData(vsm.data(), vsm.size(), driver_hash);
+	hash = hashData("\0", 1, hash); //so moving code from one to the other changes it
+	return hashData(psm.data(), psm.size(), hash);
+}
+
+static std::map<std::string, sProgramBinary>& getBinaries()
+{
+	static bool read = false;
+	if (read)
+		return s_binaries;
+	read = true;
+
+	MappedFile file;
+	if (!file.open(SHADER_CACHE_FILENAME))
+		return s_binaries;
+	const char* pos = file.data;
+	const char* end = file.data + file.size;
+	int version = 0;
+	if (file.size < 8 || memcmp(pos, "SBIN", 4) != 0 || (memcpy(&version, pos + 4, 4), version != SHADER_BIN_VERSION))
+	{
+		std::cout << "[WARN] Shader cache outdated: " << SHADER_CACHE_FILENAME << std::endl;
+		return s_binaries;
+	}
+	pos += 8;
+	while (pos + sizeof(sProgramBinHeader) <= end)
+	{
+		sProgramBinHeader header;
+		memcpy(&header, pos, sizeof(header));
+		pos += sizeof(header);
+		if (pos + header.name_length + header.bytes > end)
+			break; //truncated
+		sProgramBinary& binary = s_binaries[std::string(pos, header.name_length)];
+		pos += header.name_length;
+		binary.hash = header.hash;
+		binary.format = header.format;
+		binary.data.assign(pos, pos + header.bytes);
+		pos += header.bytes;
+	}
+	return s_binaries;
+}
+
+void Shader::saveBinaryCache()
+{
+	if (!s_binaries_dirty)
+		return;
+	s_binaries_dirty = false;
+
+	FILE* f = fopen(SHADER_CACHE_FILENAME, "wb");
+	if (!f)
+	{
+		std::cout << "[WARN] cannot write the shader cache: " << SHADER_CACHE_FILENAME << std::endl;
+		return;
+	}
+	int version = SHADER_BIN_VERSION;
+	fwrite("SBIN", 1, 4, f);
+	fwrite(&version, sizeof(version), 1, f);
+	for (auto it = s_binaries.begin(); it != s_binaries.end(); ++it)
+	{
+		sProgramBinHeader header;
+		header.hash = it->second.hash;
+		header.format = it->second.format;
+		header.bytes = (unsigned int)it->second.data.size();
+		header.name_length = (unsigned int)it->first.size();
+		fwrite(&header, sizeof(header), 1, f);
+		fwrite(it->first.data(), 1, header.name_length, f);
+		fwrite(&it->second.data[0], 1, header.bytes, f);
+	}
+	fclose(f);
+}
+
+bool Shader::loadBinary(unsigned long long hash)
+{
+	if (!use_binary_cache || name.empty() || !supportsProgramBinary())
+		return false;
+	std::map<std::string, sProgramBinary>& binaries = getBinaries();
+	auto it = binaries.find(name);
+	if (it == binaries.end() || it->second.hash != hash)
+		return false;
+
+	compiling_program = glCreateProgram();
+	glProgramBinary(compiling_program, it->second.format, &it->second.data[0], (GLsizei)it->second.data.size());
+	GLint linked = 0;
+	glGetProgramiv(compiling_program, GL_LINK_STATUS, &linked);
+	glGetError(); //an unknown format is an error, not a failure
+	if (!linked)
+	{
+		//an updated driver can reject the binaries of the old one, it is compiled from the sources
+		glDeleteProgram(compiling_program);
+		compiling_program = 0;
+		binaries.erase(it);
+		s_binaries_dirty = true;
+		return false;
+	}
+	return true;
+}
+
+void Shader::storeBinary(unsigned long long hash)
+{
+	if (!use_binary_cache || name.empty() || !supportsProgramBinary())
+		return;
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	sProgramBinary& binary = getBinaries()[name];
+	binary.hash = hash;
+	binary.data.resize(length);
+	glGetProgramBinary(program, length, NULL, &binary.format, &binary.data[0]);
+	assert(glGetError() == GL_NO_ERROR);
+	s_binaries_dirty = true;
+}
+
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
 	compiled = false;
 	from_atlas = false;
+	vs = fs = program = 0;
+	compiling_vs = compiling_fs = compiling_program = 0;
+	compile_state = COMPILE_NONE;
+	compile_from_cache = false;
+	compile_hash = 0;
 }
 
 Shader::~Shader()
 {
+	deleteCompiling();
 	release();
 }
 
@@ -119,12 +315,18 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 		name = vsf;
 	std::map<std::string,Shader*>::iterator it = s_Shaders.find(name);
 	if (it != s_Shaders.end())
-		return it->second;
+	{
+		Shader* shader = it->second;
+		if (shader->isCompiling() && !shader->finishCompile()) //from the atlas, the first time it is used
+			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
+		return shader->compiled ? shader : NULL;
+	}
 
 	if (!psf)
 		return NULL;
 
 	Shader* sh = new Shader();
+	sh->name = name;
 	if (!sh->load( vsf,psf, macros ))
 		return NULL;
 	s_Shaders[name] = sh;
@@ -153,6 +355,26 @@ static inline std::string trim(std::string str) {
 	return str;
 }
 
+//the macros of the atlas are names separated by spaces, defined after the #version line that must be the first one
+static std::string addMacros(const std::string& code, const std::string& macros)
+{
+	std::vector<std::string> names = tokenize(macros, " \t");
+	std::string defines;
+	for (size_t i = 0; i < names.size(); ++i)
+		if (!trim(names[i]).empty())
+			defines += "#define " + trim(names[i]) + "\n";
+	if (defines.empty())
+		return code;
+
+	size_t pos = code.find("#version");
+	if (pos == std::string::npos)
+		return defines + code;
+	pos = code.find('\n', pos);
+	if (pos == std::string::npos)
+		return code + "\n" + defines;
+	return code.substr(0, pos + 1) + defines + code.substr(pos + 1);
+}
+
 void Shader::setMacros(const char* macros)
 {
 	this->macros = macros;
@@ -168,6 +390,10 @@ bool Shader::LoadAtlas(const char* filename)
 		return false;
 	}
 
+	s_compile_start = getTime();
+	num_from_cache = 0;
+	num_compiled = 0;
+
 	//separate subfiles
 	s_shader_atlas_filename = filename;
 	std::vector<std::string> lines = tokenize(content, "\n");
@@ -238,8 +464,8 @@ bool Shader::LoadAtlas(const char* filename)
 			continue;
 		}
 
-		vs_code = macros + "\n" + vs_code;
-		fs_code = macros + "\n" + fs_code;
+		vs_code = addMacros(vs_code, macros);
+		fs_code = addMacros(fs_code, macros);
 
 		Shader* shader = NULL;
 		auto it = s_Shaders.find( name );
@@ -250,24 +476,89 @@ bool Shader::LoadAtlas(const char* filename)
 		}
 		else
 			shader = it->second;
-	
-		if (!shader->compileFromMemory(vs_code,fs_code))
-		{
-			delete shader;
-			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
-            return false; //stop here
-			continue;
-		}
-
+		shader->name = name;
 		shader->vs_filename = vs_filename;
 		shader->ps_filename = fs_filename;
+		shader->macros = macros;
 		shader->from_atlas = true;
-		std::cout << " + Shader from atlas: " << name << std::endl;
+
+		//the driver compiles them in its threads, the first Shader::Get of each one waits for it (see update)
+		shader->queueCompile(vs_code, fs_code);
+		if (supportsParallelCompile())
+			shader->beginCompile();
+		s_compiling = true;
 	}
 
+	//the variants are built again from the new sources
+	for (auto it = s_Shaders.begin(); it != s_Shaders.end(); ++it)
+		if (!it->second->variant_of.empty())
+			CreateVariant(it->second->variant_of.c_str(), it->first, it->second->variant_macros);
+
 	return true;
 }
 
+Shader* Shader::CreateVariant(const char* name, const std::string& variant_name, const std::string& macros)
+{
+	auto it = s_Shaders.find(name);
+	if (it == s_Shaders.end() || !it->second->from_atlas)
+	{
+		std::cout << "[ERROR] Shader: cannot make the variant " << variant_name << ", " << name << " is not in the atlas" << std::endl;
+		return NULL;
+	}
+	Shader* base = it->second;
+
+	Shader*& shader = s_Shaders[variant_name];
+	if (!shader)
+		shader = new Shader();
+	shader->name = variant_name;
+	shader->vs_filename = base->vs_filename;
+	shader->ps_filename = base->ps_filename;
+	shader->macros = base->macros + " " + macros;
+	shader->variant_of = name;
+	shader->variant_macros = macros;
+	shader->from_atlas = true;
+
+	//like the ones of the atlas, the first Shader::Get waits for it
+	shader->queueCompile(addMacros(s_shaders_atlas[base->vs_filename], shader->macros), addMacros(s_shaders_atlas[base->ps_filename], shader->macros));
+	if (supportsParallelCompile())
+		shader->beginCompile();
+	if (!s_compiling)
+		s_compile_start = getTime();
+	s_compiling = true;
+	return shader;
+}
+
+void Shader::update()
+{
+	if (!s_compiling)
+		return;
+
+	//without KHR_parallel_shader_compile the link blocks, only one per frame
+	bool parallel = supportsParallelCompile();
+	bool waited = false;
+	int num_pending = 0;
+	for (auto it = s_Shaders.begin(); it != s_Shaders.end(); ++it)
+	{
+		Shader* shader = it->second;
+		if (!shader->isCompiling())
+			continue;
+		if (parallel ? shader->isCompileDone() : !waited)
+		{
+			waited = true;
+			if (!shader->finishCompile())
+				std::cout << " * Compilation error in shader at atlas: " << it->first << std::endl;
+		}
+		else
+			num_pending++;
+	}
+	if (num_pending)
+		return;
+
+	s_compiling = false;
+	std::cout << " * Shaders: " << num_from_cache << " from the binary cache, " << num_compiled << " compiled. Time: " << (getTime() - s_compile_start) * 0.001 << "sec" << std::endl;
+	saveBinaryCache();
+}
+
 bool Shader::compile()
 {
 	assert(!compiled && "Shader already compiled" );
@@ -296,40 +587,93 @@ bool Shader::hasInfoLog() const
 
 bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 {
+	queueCompile(vsm, psm);
+	beginCompile();
+	return finishCompile();
+}
+
+void Shader::queueCompile(const std::string& vsm, const std::string& psm)
+{
+	if (compile_state == COMPILE_RUNNING) //the sources changed while it was compiling
+		deleteCompiling();
+	queued_vs = vsm;
+	queued_fs = psm;
+	compile_state = COMPILE_QUEUED;
+}
+
+void Shader::beginCompile()
+{
+	assert(compile_state == COMPILE_QUEUED);
 	if (glCreateProgram == 0)
 	{
 		std::cout << "Error: your graphics cards dont support shaders. Sorry." << std::endl;
 		exit(0);
 	}
+	compile_state = COMPILE_RUNNING;
 
-	program = glCreateProgram();
-	assert (glGetError() == GL_NO_ERROR);
+	//the same sources already linked in a previous run
+	compile_hash = hashProgramSource(queued_vs, queued_fs);
+	compile_from_cache = loadBinary(compile_hash);
+	if (compile_from_cache)
+		return;
 
-	if (!createVertexShaderObject(vsm))
-	{
-		printf("Vertex shader compilation failed\n");
-		return false;
-	}
+	//nothing here waits for the driver, the status is only queried in finishCompile
+	compiling_program = glCreateProgram();
+	compiling_vs = createShaderObject(GL_VERTEX_SHADER, queued_vs);
+	compiling_fs = createShaderObject(GL_FRAGMENT_SHADER, queued_fs);
+	if (use_binary_cache && !name.empty() && supportsProgramBinary())
+		glProgramParameteri(compiling_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(compiling_program);
+	assert (glGetError() == GL_NO_ERROR);
+}
 
-	if (!createFragmentShaderObject(psm))
-	{
-		printf("Fragment shader compilation failed\n");
-		return false;
-	}
+bool Shader::isCompileDone()
+{
+	if (compile_state != COMPILE_RUNNING || !supportsParallelCompile())
+		return compile_state == COMPILE_NONE;
+	GLint done = 0;
+	glGetProgramiv(compiling_program, GL_COMPLETION_STATUS_KHR, &done);
+	return done == GL_TRUE;
+}
 
-	glLinkProgram(program);
-	assert (glGetError() == GL_NO_ERROR);
+bool Shader::finishCompile()
+{
+	if (compile_state == COMPILE_NONE)
+		return compiled;
+	if (compile_state == COMPILE_QUEUED)
+		beginCompile();
 
 	GLint linked=0;
-    
-	glGetProgramiv(program,GL_LINK_STATUS,&linked);
+	glGetProgramiv(compiling_program,GL_LINK_STATUS,&linked);
 	assert(glGetError() == GL_NO_ERROR);
 
 	if (!linked)
 	{
-		saveProgramInfoLog(program);
-		release();
-		return false;
+		//the log of the step that failed
+		if (checkShaderObject(compiling_vs, queued_vs) && checkShaderObject(compiling_fs, queued_fs))
+			saveProgramInfoLog(compiling_program);
+		deleteCompiling();
+		return false; //a shader compiled again keeps the old program
+	}
+
+	//replaces the old program, if it was compiled again
+	GLuint new_program = compiling_program, new_vs = compiling_vs, new_fs = compiling_fs;
+	compiling_program = compiling_vs = compiling_fs = 0;
+	deleteCompiling();
+	release();
+	if (current == this) //so the next enable binds the new one
+		current = NULL;
+	program = new_program;
+	vs = new_vs;
+	fs = new_fs;
+
+	setupProgram();
+	if (compile_from_cache)
+		num_from_cache++;
+	else
+	{
+		storeBinary(compile_hash);
+		num_compiled++;
 	}
 
 #ifdef _DEBUG
@@ -341,6 +685,36 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	return true;
 }
 
+void Shader::deleteCompiling()
+{
+	if (compiling_vs)
+		glDeleteShader(compiling_vs);
+	if (compiling_fs)
+		glDeleteShader(compiling_fs);
+	if (compiling_program)
+		glDeleteProgram(compiling_program);
+	compiling_program = compiling_vs = compiling_fs = 0;
+	std::string().swap(queued_vs);
+	std::string().swap(queued_fs);
+	compile_state = COMPILE_NONE;
+}
+
+void Shader::setupProgram()
+{
+	//GLSL 330 has no binding qualifier for the blocks, every program points them to the same binding points
+	static const char* block_names[NUM_UNIFORM_BLOCKS] = { "u_camera_block", "u_light_block", "u_material_block" };
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS; ++i)
+	{
+		GLuint index = glGetUniformBlockIndex(program, block_names[i]);
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, index, i);
+	}
+	assert(glGetError() == GL_NO_ERROR);
+	locations.clear(); //the atlas reload compiles again the same shaders
+	handle_locations.clear();
+	resolveHandles();
+}
+
 bool Shader::validate()
 {
 	glValidateProgram(program);
@@ -360,31 +734,22 @@ bool Shader::validate()
 	return true;
 }
 
-bool Shader::createVertexShaderObject(const std::string& shader)
-{
-	return createShaderObject(GL_VERTEX_SHADER,vs,shader);
-}
-
-bool Shader::createFragmentShaderObject(const std::string& shader)
+GLuint Shader::createShaderObject(unsigned int type, const std::string& code)
 {
-	return createShaderObject(GL_FRAGMENT_SHADER,fs,shader);
-}
-
-bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code)
-{
-	handle = glCreateShader(type);
+	GLuint handle = glCreateShader(type);
 	assert( glGetError() == GL_NO_ERROR );
-    
-	std::string prefix = "";//"#define DESKTOP\n";
 
-    std::string fullcode = prefix + code;
-	const char* ptr = fullcode.c_str();
+	const char* ptr = code.c_str();
 	glShaderSource(handle, 1, &ptr, NULL);
-	assert( glGetError() == GL_NO_ERROR );
-	
 	glCompileShader(handle);
+	glAttachShader(compiling_program,handle);
 	assert( glGetError() == GL_NO_ERROR );
 
+	return handle;
+}
+
+bool Shader::checkShaderObject(GLuint handle, const std::string& code)
+{
 	GLint compile=0;
 	glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
 	assert( glGetError() == GL_NO_ERROR );
@@ -394,16 +759,13 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	{
 		saveShaderInfoLog(handle);
         std::cout << "Shader code:\n " << std::endl;
-		std::vector<std::string> lines = split( fullcode, '\n' );
+		std::vector<std::string> lines = split( code, '\n' );
 		for( size_t i = 0; i < lines.size(); ++i)
 			std::cout << i << "  " << lines[i] << std::endl;
 
 		return false;
 	}
 
-	glAttachShader(program,handle);
-	assert( glGetError() == GL_NO_ERROR );
-
 	return true;
 }
 
@@ -432,6 +794,7 @@ void Shader::release()
 	}
 
 	locations.clear();
+	handle_locations.clear();
 
 	compiled = false;
 }
@@ -444,7 +807,7 @@ void Shader::enable()
 
 	current = this;
 
-	glUseProgram(program);
+	GLState::useProgram(program);
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -456,14 +819,14 @@ void Shader::disable()
 {
 	current = NULL;
 
-	glUseProgram(0);
+	GLState::useProgram(0);
 	//glActiveTexture(GL_TEXTURE0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
-	glUseProgram(0);
+	GLState::useProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
@@ -523,13 +886,11 @@ GLint Shader::getLocation(const char* varname,loctable* table)
 	if(cur == locs->end()) //not found in the locations table
 	{
 		loc = glGetUniformLocation(program, varname);
-		if (loc == -1)
-		{
-			return -1;
-		}
 
-		//insert the new value
-		locs->insert(loctable::value_type(varname,loc));
+		//insert the new value, also if the program does not have it. The key is a copy, varname could be a temporary
+		static std::set<std::string> names;
+		const char* name = names.insert(varname).first->c_str();
+		locs->insert(loctable::value_type(name,loc));
 	}
 	else //found in the table
 	{
@@ -561,12 +922,50 @@ int Shader::getUniformLocation(const char* varname)
 	return loc;
 }
 
+static std::vector<const char*>& getHandleNames()
+{
+	static std::vector<const char*> names; //not a global, the handles are statics of other files
+	return names;
+}
+
+int Shader::registerUniform(const char* name)
+{
+	std::vector<const char*>& names = getHandleNames();
+	names.push_back(name);
+	return (int)names.size() - 1;
+}
+
+UniformHandle::UniformHandle(const char* name)
+{
+	this->name = name;
+	this->id = Shader::registerUniform(name);
+}
+
+void Shader::resolveHandles()
+{
+	std::vector<const char*>& names = getHandleNames();
+	for (size_t i = handle_locations.size(); i < names.size(); ++i)
+		handle_locations.push_back(program ? glGetUniformLocation(program, names[i]) : -1);
+}
+
+void Shader::setUniform(const UniformHandle& handle, Texture* texture, int slot)
+{
+	assert(current == this);
+	GLint loc = getLocation(handle);
+	if (loc == -1)
+		return;
+	if (!texture->isReady()) //still loading in the background
+		texture = Texture::getWhiteTexture();
+	GLState::bindTexture(slot, texture->texture_type, texture->texture_id);
+	glUniform1i(loc, slot);
+}
+
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	if (!tex->isReady()) //still loading in the background
+		tex = Texture::getWhiteTexture();
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
 /*
@@ -8,6 +8,7 @@
 #include "includes.h"
 #include <string>
 #include <map>
+#include <vector>
 #include "framework.h"
 #include <cassert>
 
@@ -20,6 +21,20 @@
 
 class Texture;
 
+//binding points of the std140 uniform blocks shared by all the programs (see UniformBlocks)
+enum eUniformBlock { BLOCK_CAMERA, BLOCK_LIGHT, BLOCK_MATERIAL, NUM_UNIFORM_BLOCKS };
+
+//a uniform name registered once, every shader keeps the location of each handle so setting it is an index instead of a string lookup.
+//Declare them as statics next to the code that sets them
+class UniformHandle
+{
+public:
+	int id;
+	const char* name;
+
+	UniformHandle(const char* name);
+};
+
 class Shader
 {
 	int last_slot;
@@ -39,7 +54,15 @@ public:
 	virtual bool load(const std::string& vsf, const std::string& psf, const char* macros);
 
 	//internal functions
-	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm);
+	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm); //the steps below at once
+
+	//compilation in steps, so the driver can compile many programs at the same time and none waits until it is used
+	void queueCompile(const std::string& vsm, const std::string& psm); //keeps the sources
+	void beginCompile(); //issues the compile and the link of the queued sources, without waiting
+	bool isCompiling() { return compile_state != COMPILE_NONE; }
+	bool isCompileDone(); //without waiting, always false until finishCompile if the driver lacks KHR_parallel_shader_compile
+	bool finishCompile(); //waits for the link, false if it failed (the shader keeps its previous program, if any)
+
 	virtual void release();
 	virtual void enable();
 	virtual void disable();
@@ -64,6 +87,16 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//with handles, no lookup and no glGetError per call
+	void setUniform(const UniformHandle& handle, bool input) { assert(current == this); GLint loc = getLocation(handle); if (loc != -1) glUniform1i(loc, input); }
+	void setUniform(const UniformHandle& handle, int input) { assert(current == this); GLint loc = getLocation(handle); if (loc != -1) glUniform1i(loc, input); }
+	void setUniform(const UniformHandle& handle, float input) { assert(current == this); GLint loc = getLocation(handle); if (loc != -1) glUniform1f(loc, input); }
+	void setUniform(const UniformHandle& handle, const Vector2& input) { assert(current == this); GLint loc = getLocation(handle); if (loc != -1) glUniform2f(loc, input.x, input.y); }
+	void setUniform(const UniformHandle& handle, const Vector3& input) { assert(current == this); GLint loc = getLocation(handle); if (loc != -1) glUniform3f(loc, input.x, input.y, input.z); }
+	void setUniform(const UniformHandle& handle, const Vector4& input) { assert(current == this); GLint loc = getLocation(handle); if (loc != -1) glUniform4f(loc, input.x, input.y, input.z, input.w); }
+	void setUniform(const UniformHandle& handle, const Matrix44& input) { assert(current == this); GLint loc = getLocation(handle); if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, input.m); }
+	void setUniform(const UniformHandle& handle, Texture* texture, int slot);
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -118,29 +151,58 @@ public:
 	static std::string s_shader_atlas_filename;
 	static std::map<std::string, std::string> s_shaders_atlas; //stores strings, no shaders
 
+	//a program of the atlas compiled again with more macros (names separated by spaces), kept in s_Shaders as variant_name and
+	//built again by LoadAtlas. It is queued like the atlas ones, Get(variant_name) returns it once it is linked
+	static Shader* CreateVariant(const char* name, const std::string& variant_name, const std::string& macros);
+
 	static Shader* getDefaultShader(std::string name);
 
+	//binaries of the linked programs, a warm start loads them with glProgramBinary instead of compiling the sources again
+	static bool use_binary_cache;
+	static int num_from_cache; //programs since the last LoadAtlas
+	static int num_compiled;
+	static void saveBinaryCache(); //if any binary changed since it was read
+
+	static void update(); //main thread, once per frame: finishes the atlas shaders the driver compiled, saves the cache when all are done
+
 protected:
 
+	std::string name; //key in s_Shaders, the ones without it are not cached
 	std::string info_log;
 	std::string vs_filename;
 	std::string ps_filename;
 	std::string macros;
 	bool from_atlas;
+	std::string variant_of; //the atlas program of a CreateVariant
+	std::string variant_macros;
 
-	bool createVertexShaderObject(const std::string& shader);
-	bool createFragmentShaderObject(const std::string& shader);
-	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
+	GLuint createShaderObject(unsigned int type, const std::string& code); //attached to compiling_program, the status is not checked
+	bool checkShaderObject(GLuint handle, const std::string& code); //prints the log if it did not compile
+	void deleteCompiling();
 	void saveShaderInfoLog(GLuint obj);
 	void saveProgramInfoLog(GLuint obj);
 
 	bool validate();
+	void setupProgram(); //after linking or loading the binary
+	bool loadBinary(unsigned long long hash);
+	void storeBinary(unsigned long long hash);
 
 	GLuint vs;
 	GLuint fs;
 	GLuint program;
 	std::string log;
 
+	//the program being compiled, it replaces the one above when it is linked
+	enum eCompileState { COMPILE_NONE, COMPILE_QUEUED, COMPILE_RUNNING };
+	eCompileState compile_state;
+	std::string queued_vs;
+	std::string queued_fs;
+	GLuint compiling_vs;
+	GLuint compiling_fs;
+	GLuint compiling_program;
+	unsigned long long compile_hash;
+	bool compile_from_cache;
+
 //this is a hack to speed up shader usage (save info locally)
 private: 
 
@@ -153,9 +215,16 @@ private:
 	};	
 	typedef std::map<const char*, int, ltstr> loctable;
 
+	std::vector<GLint> handle_locations; //by UniformHandle::id, -1 if the program does not use it
+
+	void resolveHandles(); //the handles registered since the last call
+
 public:
 	GLint getLocation( const char* varname, loctable* table );
+	GLint getLocation(const UniformHandle& handle) { if (handle.id >= (int)handle_locations.size()) resolveHandles(); return handle_locations[handle.id]; }
 	loctable locations;	
+
+	static int registerUniform(const char* name); //by UniformHandle
 };
 
 #endif
\ No newline at end of file
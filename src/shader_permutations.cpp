@@ -0,0 +1,131 @@
+#include "shader_permutations.h"
+
+#include "includes.h"
+#include "shader.h"
+#include "BaseEntity.h"
+#include "material.h"
+#include "texture.h"
+#include "utils.h"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+bool ShaderPermutations::enabled = true;
+
+static const char* feature_macros[NUM_SHADER_FEATURES] = { "USE_METAL_ROUGHNESS", "USE_SHADOWS", "USE_IRRADIANCE", "USE_GAMMA" };
+
+//by the pointer of the name, so a draw does not build the name of the variant
+static std::map<std::pair<const char*, unsigned int>, Shader*> variants;
+static std::set<std::pair<std::string, unsigned int>> used;
+static int num_listed = 0; //queued from the file
+
+unsigned int ShaderPermutations::getMaterialFeatures(GTR::Material* material, bool packed)
+{
+	unsigned int features = 0;
+	//a white placeholder would be full metal
+	if (!packed && material->metallic_roughness_texture && material->metallic_roughness_texture->isReady())
+		features |= FEATURE_METAL_ROUGHNESS;
+	return features;
+}
+
+unsigned int ShaderPermutations::getLightFeatures(Light* light)
+{
+	unsigned int features = 0;
+	if (light->has_shadow && light->shadow_fbo)
+		features |= FEATURE_SHADOWS;
+	return features;
+}
+
+std::string ShaderPermutations::getMacros(unsigned int features)
+{
+	std::string macros = "PERMUTATION";
+	for (int i = 0; i < NUM_SHADER_FEATURES; ++i)
+		if (features & (1 << i))
+			macros += std::string(" ") + feature_macros[i];
+	return macros;
+}
+
+static std::string getVariantName(const std::string& name, unsigned int features)
+{
+	return name + "@" + std::to_string(features);
+}
+
+Shader* ShaderPermutations::get(const char* name, unsigned int features)
+{
+	if (!enabled)
+		return Shader::Get(name);
+
+	auto it = variants.find(std::make_pair(name, features));
+	if (it != variants.end())
+		return it->second;
+
+	used.insert(std::make_pair(std::string(name), features));
+	std::string variant_name = getVariantName(name, features);
+	if (Shader::s_Shaders.find(variant_name) == Shader::s_Shaders.end())
+	{
+		std::cout << " + Shader permutation: " << name << " " << getMacros(features) << std::endl;
+		if (!Shader::CreateVariant(name, variant_name, getMacros(features)))
+			return Shader::Get(name);
+	}
+
+	Shader* shader = Shader::Get(variant_name.c_str());
+	if (!shader) //the error is in the console, it is asked again in case the atlas is fixed and reloaded
+		return Shader::Get(name);
+	variants[std::make_pair(name, features)] = shader;
+	return shader;
+}
+
+bool ShaderPermutations::load(const char* filename)
+{
+	std::string content;
+	if (!readFile(filename, content))
+		return false;
+
+	std::vector<std::string> lines = tokenize(content, "\r\n");
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		std::vector<std::string> tokens = tokenize(lines[i], " \t");
+		if (tokens.size() < 2 || tokens[0].substr(0, 2) == "//")
+			continue;
+		unsigned int features = (unsigned int)atoi(tokens[1].c_str());
+		std::string variant_name = getVariantName(tokens[0], features);
+		if (Shader::s_Shaders.find(variant_name) != Shader::s_Shaders.end())
+			continue;
+		if (Shader::CreateVariant(tokens[0].c_str(), variant_name, getMacros(features)))
+			num_listed++;
+	}
+	std::cout << " * Shader permutations: " << num_listed << " queued from " << filename << std::endl;
+	return true;
+}
+
+bool ShaderPermutations::save(const char* filename)
+{
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] ShaderPermutations: cannot write " << filename << std::endl;
+		return false;
+	}
+	fprintf(f, "//permutations used by the scene, queued at load (see ShaderPermutations)\n");
+	for (auto it = used.begin(); it != used.end(); ++it)
+		fprintf(f, "%s %u //%s\n", it->first.c_str(), it->second, ShaderPermutations::getMacros(it->second).c_str());
+	fclose(f);
+	std::cout << " * Shader permutations: " << used.size() << " saved to " << filename << std::endl;
+	return true;
+}
+
+void ShaderPermutations::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Permutations", &enabled);
+	ImGui::Text("Used: %d, queued from the list: %d", (int)used.size(), num_listed);
+	for (auto it = used.begin(); it != used.end(); ++it)
+		ImGui::BulletText("%s %s", it->first.c_str(), getMacros(it->second).c_str());
+	if (ImGui::Button("Save list"))
+		save(SHADER_PERMUTATIONS_FILENAME);
+#endif
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+
+#define SHADER_PERMUTATIONS_FILENAME "data/shader_permutations.txt"
+
+class Shader;
+class Light;
+namespace GTR { class Material; }
+
+//the state that selects a permutation, every bit is a macro of permutations.glsl in the atlas
+enum eShaderFeature {
+	FEATURE_METAL_ROUGHNESS = 1 << 0, //USE_METAL_ROUGHNESS
+	FEATURE_SHADOWS = 1 << 1, //USE_SHADOWS
+	FEATURE_IRRADIANCE = 1 << 2, //USE_IRRADIANCE
+	FEATURE_GAMMA = 1 << 3, //USE_GAMMA
+	NUM_SHADER_FEATURES = 4
+};
+
+//variants of the atlas programs with the features of the material and the light compiled in as constants, instead of branching on
+//uniforms in every pixel. Each variant is made the first time it is asked (see Shader::CreateVariant), the ones listed in the file
+//saved from the menu are queued at load so only the permutations the scene uses are built.
+class ShaderPermutations
+{
+public:
+	static bool enabled; //false uses the programs of the atlas with the uniforms
+
+	static unsigned int getMaterialFeatures(GTR::Material* material, bool packed); //packed materials read the table (see TextureArray)
+	static unsigned int getLightFeatures(Light* light);
+	static std::string getMacros(unsigned int features);
+
+	//the variant of the atlas program, or the program itself if permutations are disabled or the variant failed to compile.
+	//The name must be a literal, the variants are found by its pointer
+	static Shader* get(const char* name, unsigned int features);
+
+	//the list of permutations used since the start, one "program features" per line
+	static bool load(const char* filename); //after Shader::LoadAtlas, queues the variants of the list
+	static bool save(const char* filename);
+	static void renderInMenu();
+};
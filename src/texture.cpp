@@ -8,7 +8,17 @@
 #include "mesh.h"
 #include "shader.h"
 #include "extra/picopng.h"
+#include "texture_compression.h"
+#include "png_decoder.h"
+#include "texture_upload.h"
+#include "readback.h"
+#include "texture_streaming.h"
+#include "gl_state.h"
 #include <cassert>
+#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 
 //bilinear interpolation
 Color Image::getPixelInterpolated(float x, float y, bool repeat) {
@@ -41,9 +51,40 @@ Vector4 Image::getPixelInterpolatedHigh(float x, float y, bool repeat) {
 
 
 std::map<std::string, Texture*> Texture::sTexturesLoaded;
+static std::mutex textures_mutex; //sTexturesLoaded is used from the loading threads
 int Texture::default_mag_filter = GL_LINEAR;
 int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 FBO* Texture::global_fbo = NULL;
+bool Texture::bake_textures = true;
+bool Texture::compress_textures = true;
+bool Texture::supports_s3tc = false;
+bool Texture::supports_bptc = false;
+
+//not in every GL header
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+	#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+	#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+
+#define TEXTURE_BIN_VERSION 1
+
+//header of the .tbin, followed by the bytes of every level from the biggest one
+struct sTextureBinHeader {
+	int version;
+	int header_bytes;
+	unsigned long long source_hash; //image file, usage, baking settings and version
+	int usage;
+	int block_format; //-1 for RGBA8
+	int width;
+	int height;
+	int num_levels;
+	unsigned int level_bytes[16];
+};
 
 Texture::Texture()
 {
@@ -55,29 +96,57 @@ Texture::Texture()
 	format = 0;
 	type = 0;
 	texture_type = GL_TEXTURE_2D;
+	load_state = ASSET_READY;
+	usage = TEXTURE_GENERIC;
+	block_format = -1;
+	baked_file = NULL;
+	baked_levels = NULL;
+	streamed = false;
+	resident_level = wanted_level = 0;
+	last_used = -1;
 }
 
 Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
 	texture_id = 0;
+	load_state = ASSET_READY;
+	usage = TEXTURE_GENERIC;
+	block_format = -1;
+	baked_file = NULL;
+	baked_levels = NULL;
+	streamed = false;
+	resident_level = wanted_level = 0;
+	last_used = -1;
 	create(width, height, format, type, mipmaps, data, internal_format);
 }
 
 Texture::Texture(Image* img)
 {
 	texture_id = 0;
+	load_state = ASSET_READY;
+	usage = TEXTURE_GENERIC;
+	block_format = -1;
+	baked_file = NULL;
+	baked_levels = NULL;
+	streamed = false;
+	resident_level = wanted_level = 0;
+	last_used = -1;
 	create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
 }
 
 Texture::~Texture()
 {
+	if (streamed)
+		TextureStreaming::remove(this);
+	freeBaked();
 	clear();
 }
 
 void Texture::clear()
 {
+	GLState::deleteTexture(texture_id);
 	glDeleteTextures(1, &texture_id);
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	texture_id = 0;
 }
 
@@ -161,76 +230,552 @@ void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** dat
 	if (texture_id == 0)
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 	uploadCubemap(format, type, mipmaps, data, internal_format);
 }
 
-Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
+Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap, int usage)
+{
+	//same path than the async version, but waiting for it
+	Texture* texture = GetAsync(filename, mipmaps, wrap, usage);
+	waitUntil([texture]() { return texture->load_state != ASSET_LOADING; });
+	return texture->isReady() ? texture : NULL;
+}
+
+Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap, int usage)
+{
+	bool created = false;
+	Texture* texture = Register(filename, created);
+	if (!created)
+		return texture;
+	texture->usage = usage;
+	runAsync([texture, mipmaps, wrap]() {
+		long time = getTime();
+		bool found = texture->loadImage(texture->filename.c_str());
+		texture->queueUpload(found, mipmaps, wrap, time);
+	});
+	return texture;
+}
+
+static const char* getBlockFormatName(int block_format)
+{
+	const char* names[] = { "BC1", "BC3", "BC4", "BC5", "BC7" };
+	return block_format >= 0 && block_format <= BLOCK_BC7 ? names[block_format] : "";
+}
+
+Texture* Texture::Register(const char* filename, bool& created)
 {
 	assert(filename);
+	std::string name = filename;
+	std::lock_guard<std::mutex> lock(textures_mutex);
 
 	//check if loaded
-	auto it = sTexturesLoaded.find(filename);
+	created = false;
+	auto it = sTexturesLoaded.find(name);
 	if (it != sTexturesLoaded.end())
 		return it->second;
 
-	//load it
+	//registered now so the next calls get the same one while it loads
 	Texture* texture = new Texture();
-	if (!texture->load(filename, mipmaps, wrap))
-	{
-		delete texture;
-		return NULL;
-	}
-
+	texture->load_state = ASSET_LOADING;
+	texture->filename = name;
+	sTexturesLoaded[name] = texture;
+	created = true;
 	return texture;
 }
 
+void Texture::queueUpload(bool decoded, bool mipmaps, bool wrap, long start_time)
+{
+	runInMainThread([this, decoded, mipmaps, wrap, start_time]() {
+		std::cout << " + Texture loading: " << filename << " ... ";
+		if (!decoded)
+		{
+			std::cout << "[ERROR]: Texture not found or unsupported format" << std::endl;
+			load_state = ASSET_FAILED;
+			return;
+		}
+		uploadImage(mipmaps, wrap);
+		TextureUpload::whenDone(this, [this, start_time]() {
+			std::cout << "[OK] Size: " << width << "x" << height;
+			if (block_format != -1)
+				std::cout << " " << getBlockFormatName(block_format);
+			std::cout << " Time: " << (getTime() - start_time) * 0.001 << "sec" << std::endl;
+			load_state = ASSET_READY;
+		});
+	});
+}
+
+void Texture::setName(const char* name)
+{
+	std::lock_guard<std::mutex> lock(textures_mutex);
+	sTexturesLoaded[name] = this;
+}
+
 bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type)
 {
-	std::string str = filename;
-	std::string ext = str.substr(str.size() - 4, 4);
-	Image* image = NULL;
 	long time = getTime();
 
 	std::cout << " + Texture loading: " << filename << " ... ";
 
-	image = new Image();
-	bool found = false;
+	if (!loadImage(filename, type == GL_UNSIGNED_BYTE))
+	{
+		std::cout << "[ERROR]: Texture not found or unsupported format" << std::endl;
+		return false;
+	}
 
+	this->filename = filename;
+	load_state = ASSET_LOADING; //until the staged levels are uploaded
+	uploadImage(mipmaps, wrap, type);
+	TextureUpload::whenDone(this, [this]() { load_state = ASSET_READY; });
+
+	std::cout << "[OK] Size: " << width << "x" << height;
+	if (block_format != -1)
+		std::cout << " " << getBlockFormatName(block_format);
+	std::cout << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	setName(filename);
+	return true;
+}
+
+bool Texture::loadImage(const char* filename, bool bake)
+{
+	bake = bake && bake_textures;
+	if (bake && readBaked(filename))
+		return true;
+
+	std::string str = filename;
+	std::string ext = str.size() > 4 ? str.substr(str.size() - 4, 4) : "";
+
+	bool loaded = false;
 	if (ext == ".tga" || ext == ".TGA")
-		found = image->loadTGA(filename);
+		loaded = image.loadTGA(filename);
 	else if (ext == ".png" || ext == ".PNG")
-		found = image->loadPNG(filename);
+		loaded = image.loadPNG(filename);
 	else
-	{
-		std::cout << "[ERROR]: unsupported format" << std::endl;
 		return false; //unsupported file type
+
+	if (loaded && bake)
+		bakeImage(filename);
+	return loaded;
+}
+
+static unsigned int getBlockFormatGL(int block_format)
+{
+	switch (block_format)
+	{
+		case BLOCK_BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		case BLOCK_BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		case BLOCK_BC4: return GL_COMPRESSED_RED_RGTC1;
+		case BLOCK_BC5: return GL_COMPRESSED_RG_RGTC2;
+		case BLOCK_BC7: return GL_COMPRESSED_RGBA_BPTC_UNORM;
+	}
+	return 0;
+}
+
+static bool isBlockFormatSupported(int block_format)
+{
+	if (block_format == -1)
+		return true; //RGBA8
+	if (block_format == BLOCK_BC1 || block_format == BLOCK_BC3)
+		return Texture::supports_s3tc;
+	if (block_format == BLOCK_BC7)
+		return Texture::supports_bptc;
+	return block_format == BLOCK_BC4 || block_format == BLOCK_BC5;
+}
+
+static size_t getBakedLevelSize(int block_format, int width, int height)
+{
+	return block_format == -1 ? (size_t)width * height * 4 : getBlockCompressedSize(block_format, width, height);
+}
+
+//the .tbin must be baked again if the image, the usage or the formats it can use change
+static bool hashTextureSource(const char* filename, int usage, unsigned long long& hash)
+{
+	int settings[5] = { TEXTURE_BIN_VERSION, usage, Texture::compress_textures, Texture::supports_s3tc, Texture::supports_bptc };
+	hash = hashData(settings, sizeof(settings));
+	return hashFile(filename, hash);
+}
+
+void Texture::detectCompressedFormats()
+{
+	supports_s3tc = SDL_GL_ExtensionSupported("GL_EXT_texture_compression_s3tc") == SDL_TRUE;
+	supports_bptc = SDL_GL_ExtensionSupported("GL_ARB_texture_compression_bptc") == SDL_TRUE;
+	std::cout << " * Texture compression: S3TC " << (supports_s3tc ? "yes" : "no") << ", BPTC " << (supports_bptc ? "yes" : "no") << std::endl;
+}
+
+bool Texture::readBaked(const char* filename)
+{
+	std::string bin_filename = std::string(filename) + ".tbin";
+	MappedFile* file = new MappedFile();
+	if (!file->open(bin_filename.c_str()))
+	{
+		delete file;
+		return false;
+	}
+
+	sTextureBinHeader header;
+	bool valid = file->size >= 4 + sizeof(header) && memcmp(file->data, "TBIN", 4) == 0;
+	if (valid)
+	{
+		memcpy(&header, file->data + 4, sizeof(header));
+		valid = header.version == TEXTURE_BIN_VERSION && header.header_bytes == sizeof(header) && header.usage == usage &&
+			isBlockFormatSupported(header.block_format) && header.num_levels >= 1 && header.num_levels <= 16 && header.width > 0 && header.height > 0;
 	}
 
-	if (!found) //file not found
+	unsigned long long hash = 0;
+	valid = valid && hashTextureSource(filename, usage, hash) && hash == header.source_hash; //outdated if not
+
+	size_t total = 0;
+	for (int i = 0; valid && i < header.num_levels; ++i)
+	{
+		int w = std::max(1, header.width >> i);
+		int h = std::max(1, header.height >> i);
+		valid = header.level_bytes[i] == getBakedLevelSize(header.block_format, w, h);
+		total += header.level_bytes[i];
+	}
+	if (!valid || file->size != 4 + sizeof(header) + total)
 	{
-		std::cout << " [ERROR]: Texture not found " << std::endl;
+		delete file;
 		return false;
 	}
 
-	this->filename = filename;
+	//the levels stay in the mapping, the driver reads them from there
+	baked_file = file;
+	baked_levels = (const Uint8*)file->data + 4 + sizeof(header);
+	baked_level_bytes.assign(header.level_bytes, header.level_bytes + header.num_levels);
+	block_format = header.block_format;
+	width = (float)header.width;
+	height = (float)header.height;
+	return true;
+}
+
+//BCn format for the usage that the GPU supports, -1 to keep RGBA8
+static int chooseBlockFormat(int usage, const Uint8* rgba, int num_pixels, int* channels)
+{
+	if (usage == TEXTURE_COLOR)
+	{
+		bool alpha = false;
+		for (int i = 0; i < num_pixels && !alpha; ++i)
+			alpha = rgba[i * 4 + 3] != 255;
+		if (alpha)
+			return Texture::supports_bptc ? BLOCK_BC7 : (Texture::supports_s3tc ? BLOCK_BC3 : -1);
+		return Texture::supports_s3tc ? BLOCK_BC1 : (Texture::supports_bptc ? BLOCK_BC7 : -1);
+	}
+	if (usage == TEXTURE_NORMAL)
+		return BLOCK_BC5;
+	if (usage == TEXTURE_METAL_ROUGHNESS)
+	{
+		channels[0] = 1; //roughness
+		channels[1] = 2; //metalness
+		return BLOCK_BC5;
+	}
+	if (usage == TEXTURE_MASK)
+		return BLOCK_BC4;
+	return -1;
+}
+
+bool Texture::bakeImage(const char* filename)
+{
+	assert(image.data && "call loadImage first");
+	int w = image.width;
+	int h = image.height;
+
+	//the encoder and the uploads read RGBA
+	std::vector<Uint8> level;
+	if (image.num_channels == 4)
+		level.assign(image.data, image.data + w * h * 4);
+	else
+	{
+		level.resize(w * h * 4);
+		for (int i = 0; i < w * h; ++i)
+		{
+			memcpy(&level[i * 4], image.data + i * image.num_channels, 3);
+			level[i * 4 + 3] = 255;
+		}
+	}
+
+	int channels[2] = { 0, 1 };
+	int format = compress_textures ? chooseBlockFormat(usage, &level[0], w * h, channels) : -1;
+
+	//all the mips down to 1x1, like glGenerateMipmap does (only power of two sizes use them)
+	//color is averaged in linear space, the rest of usages store data and are averaged as they are
+	bool mips = isPowerOfTwo(w) && isPowerOfTwo(h);
+	std::vector<Uint8> next;
+	baked_data.clear();
+	baked_level_bytes.clear();
+	while (true)
+	{
+		size_t bytes = getBakedLevelSize(format, w, h);
+		size_t offset = baked_data.size();
+		baked_data.resize(offset + bytes);
+		if (format == -1)
+			memcpy(&baked_data[offset], &level[0], bytes);
+		else
+			compressBlocks(format, &level[0], w, h, &baked_data[offset], channels);
+		baked_level_bytes.push_back((unsigned int)bytes);
+		if (!mips || (w == 1 && h == 1) || baked_level_bytes.size() == 16)
+			break;
+		next.resize(std::max(1, w / 2) * std::max(1, h / 2) * 4);
+		downsampleRGBA(&level[0], w, h, &next[0], usage == TEXTURE_COLOR);
+		level.swap(next);
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+	}
+	baked_levels = &baked_data[0];
+	block_format = format;
+	width = (float)image.width;
+	height = (float)image.height;
+
+	sTextureBinHeader header;
+	memset(&header, 0, sizeof(header));
+	header.version = TEXTURE_BIN_VERSION;
+	header.header_bytes = sizeof(header);
+	header.usage = usage;
+	header.block_format = format;
+	header.width = image.width;
+	header.height = image.height;
+	header.num_levels = (int)baked_level_bytes.size();
+	for (size_t i = 0; i < baked_level_bytes.size(); ++i)
+		header.level_bytes[i] = baked_level_bytes[i];
+	image.clear();
+
+	//if it cannot be written it is baked again next time
+	if (!hashTextureSource(filename, usage, header.source_hash))
+		return true;
+	std::string bin_filename = std::string(filename) + ".tbin";
+	FILE* f = fopen(bin_filename.c_str(), "wb");
+	if (!f)
+	{
+		std::cout << "[WARN] cannot write baked texture: " << bin_filename << std::endl;
+		return true;
+	}
+	fwrite("TBIN", 1, 4, f);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(&baked_data[0], 1, baked_data.size(), f);
+	fclose(f);
+
+	//streamed textures keep their levels until they are dropped, better in the mapped file than in RAM
+	if (TextureStreaming::enabled && usage != TEXTURE_GENERIC && header.num_levels > 1)
+	{
+		MappedFile* file = new MappedFile();
+		if (file->open(bin_filename.c_str()) && file->size == 4 + sizeof(header) + baked_data.size())
+		{
+			baked_file = file;
+			baked_levels = (const Uint8*)file->data + 4 + sizeof(header);
+			std::vector<Uint8>().swap(baked_data);
+		}
+		else
+			delete file;
+	}
+	return true;
+}
+
+void Texture::uploadBaked(bool mipmaps, bool wrap)
+{
+	assert(baked_levels && "call loadImage first");
+
+	this->depth = 0;
+	this->format = GL_RGBA;
+	this->type = GL_UNSIGNED_BYTE;
+	this->internal_format = block_format == -1 ? GL_RGBA : getBlockFormatGL(block_format);
+	this->mipmaps = mipmaps && baked_level_bytes.size() > 1;
+	this->wrapS = this->wrapT = this->mipmaps && wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+
+	if (this->texture_id != 0)
+		clear();
+
+	//the material textures (the ones with a usage) start with the small mips, the renderer requests the rest
+	streamed = this->mipmaps && usage != TEXTURE_GENERIC && TextureStreaming::enabled;
+	createBakedTexture(streamed ? TextureStreaming::getFloorLevel(this) : 0, true);
+
+	//the staging copies read the baked levels until the last one is uploaded
+	TextureUpload::whenDone(this, [this]() {
+		if (streamed)
+			TextureStreaming::add(this);
+		else
+			freeBaked();
+	});
+}
+
+size_t Texture::getBakedBytes(int first_level)
+{
+	size_t bytes = 0;
+	int last_level = this->mipmaps ? (int)baked_level_bytes.size() - 1 : 0;
+	for (int i = first_level; i <= last_level; ++i)
+		bytes += baked_level_bytes[i];
+	return bytes;
+}
+
+void Texture::uploadBakedLevel(int level, const Uint8* data)
+{
+	int w = std::max(1, (int)width >> level);
+	int h = std::max(1, (int)height >> level);
+	if (block_format == -1)
+		glTexImage2D(this->texture_type, level, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	else
+		glCompressedTexImage2D(this->texture_type, level, internal_format, w, h, 0, baked_level_bytes[level], data);
+}
+
+//the shaders read roughness from .g and metalness from .b, but BC5 stores them in R and G
+static void setBakedSwizzle(unsigned int texture_type, int usage, int block_format)
+{
+	if (usage != TEXTURE_METAL_ROUGHNESS || block_format != BLOCK_BC5)
+		return;
+	glTexParameteri(texture_type, GL_TEXTURE_SWIZZLE_R, GL_ONE);
+	glTexParameteri(texture_type, GL_TEXTURE_SWIZZLE_G, GL_RED);
+	glTexParameteri(texture_type, GL_TEXTURE_SWIZZLE_B, GL_GREEN);
+	glTexParameteri(texture_type, GL_TEXTURE_SWIZZLE_A, GL_ONE);
+}
+
+void Texture::createBakedTexture(int first_level, bool staged)
+{
+	GLuint previous = texture_id;
+	this->texture_type = GL_TEXTURE_2D;
+	glGenTextures(1, &texture_id);
+	GLState::bindTexture(this->texture_type, texture_id);
+
+	//every level as it is, no glGenerateMipmap
+	int last_level = this->mipmaps ? (int)baked_level_bytes.size() - 1 : 0;
+	const Uint8* level = baked_levels;
+	for (int i = 0; i <= last_level; ++i)
+	{
+		if (i >= first_level)
+			uploadBakedLevel(i, staged ? NULL : level);
+		level += baked_level_bytes[i];
+	}
+	glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, first_level);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, last_level);
+
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, wrapT);
+	setBakedSwizzle(this->texture_type, usage, block_format);
+
+	GLState::bindTexture(this->texture_type, 0);
+	if (previous)
+	{
+		GLState::deleteTexture(previous);
+		glDeleteTextures(1, &previous);
+	}
+	resident_level = first_level;
+	assert(checkGLErrors() && "Error uploading baked texture");
+
+	//the levels are only allocated, their data goes through the staging buffers
+	if (!staged)
+		return;
+	level = baked_levels;
+	for (int i = 0; i <= last_level; ++i)
+	{
+		if (i >= first_level)
+			TextureUpload::uploadLevel(this, this->texture_type, i, level, baked_level_bytes[i]);
+		level += baked_level_bytes[i];
+	}
+}
+
+void Texture::uploadBakedLevels(int first_level)
+{
+	assert(baked_levels && first_level <= resident_level);
+	GLState::bindTexture(this->texture_type, texture_id);
+	const Uint8* level = baked_levels;
+	for (int i = 0; i < resident_level; ++i)
+	{
+		if (i >= first_level)
+			uploadBakedLevel(i, level);
+		level += baked_level_bytes[i];
+	}
+	glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, first_level);
+	GLState::bindTexture(this->texture_type, 0);
+	resident_level = first_level;
+	assert(checkGLErrors() && "Error uploading baked texture");
+}
+
+void Texture::createBakedArray(const std::vector<Texture*>& layers)
+{
+	Texture* first = layers[0];
+	assert(first->baked_levels && "the layers need their baked levels");
+	int num_layers = (int)layers.size();
+
+	this->width = first->width;
+	this->height = first->height;
+	this->depth = (float)num_layers;
+	this->format = GL_RGBA;
+	this->type = GL_UNSIGNED_BYTE;
+	this->usage = first->usage;
+	this->block_format = first->block_format;
+	this->internal_format = block_format == -1 ? GL_RGBA : getBlockFormatGL(block_format);
+	this->mipmaps = first->baked_level_bytes.size() > 1;
+	this->wrapS = this->wrapT = GL_REPEAT;
+
+	if (this->texture_id != 0)
+		clear();
+	this->texture_type = GL_TEXTURE_2D_ARRAY;
+	glGenTextures(1, &texture_id);
+	GLState::bindTexture(this->texture_type, texture_id);
+
+	//every level with all the layers in one call
+	std::vector<Uint8> data;
+	size_t offset = 0;
+	int num_levels = (int)first->baked_level_bytes.size();
+	for (int i = 0; i < num_levels; ++i)
+	{
+		int w = std::max(1, (int)width >> i);
+		int h = std::max(1, (int)height >> i);
+		size_t bytes = first->baked_level_bytes[i];
+		data.resize(bytes * num_layers);
+		for (int j = 0; j < num_layers; ++j)
+			memcpy(&data[bytes * j], layers[j]->baked_levels + offset, bytes);
+		if (block_format == -1)
+			glTexImage3D(this->texture_type, i, GL_RGBA, w, h, num_layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, &data[0]);
+		else
+			glCompressedTexImage3D(this->texture_type, i, internal_format, w, h, num_layers, 0, (GLsizei)data.size(), &data[0]);
+		offset += bytes;
+	}
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, wrapT);
+	setBakedSwizzle(this->texture_type, usage, block_format);
+
+	GLState::bindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading baked texture array");
+}
+
+void Texture::freeBaked()
+{
+	std::vector<Uint8>().swap(baked_data);
+	baked_level_bytes.clear();
+	baked_levels = NULL;
+	delete baked_file; //unmaps it
+	baked_file = NULL;
+}
+
+void Texture::uploadImage(bool mipmaps, bool wrap, unsigned int type)
+{
+	if (baked_levels)
+	{
+		uploadBaked(mipmaps, wrap);
+		return;
+	}
+	assert(image.data && "call loadImage first");
 
 	unsigned int internal_format = 0;
 	if (type == GL_FLOAT)
-		internal_format = (image->num_channels == 3 ? GL_RGB32F : GL_RGBA32F);
+		internal_format = (image.num_channels == 3 ? GL_RGB32F : GL_RGBA32F);
 
-	//upload to VRAM
-	create(image->width, image->height, (image->num_channels == 3 ? GL_RGB : GL_RGBA), type, mipmaps, image->data, 0);
+	//upload to VRAM: allocated here, the pixels go through the staging buffers
+	create(image.width, image.height, (image.num_channels == 3 ? GL_RGB : GL_RGBA), type, mipmaps, NULL, 0);
+	TextureUpload::uploadLevel(this, this->texture_type, 0, image.data, image.width * image.height * GPUReadback::getPixelSize(this->format, type));
 
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, this->mipmaps && wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, this->mipmaps && wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
-	if (mipmaps)
-		generateMipmaps();
 
-	this->image.clear();
-	std::cout << "[OK] Size: " << width << "x" << height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-	setName(filename);
-	return true;
+	TextureUpload::whenDone(this, [this, mipmaps]() {
+		if (mipmaps)
+			generateMipmaps();
+		this->image.clear();
+	});
 }
 
 void Texture::upload(Image* img)
@@ -251,7 +796,7 @@ void Texture::upload(unsigned int format, unsigned int type, bool mipmaps, Uint8
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_2D && "Texture type does not match.");
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	if (internal_format == 0)
 	{
@@ -272,7 +817,7 @@ void Texture::upload(unsigned int format, unsigned int type, bool mipmaps, Uint8
 	if (data && this->mipmaps)
 		generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
@@ -280,7 +825,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
 
@@ -293,7 +838,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	if (data && this->mipmaps)
 		generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
@@ -302,7 +847,7 @@ void Texture::uploadCubemap(unsigned int format, unsigned int type, bool mipmaps
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_CUBE_MAP && "Texture type does not match.");
 
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 	int width = ((int)this->width) >> level;
 	int height = ((int)this->height) >> level;
@@ -316,8 +861,9 @@ void Texture::uploadCubemap(unsigned int format, unsigned int type, bool mipmaps
 		this->internal_format = internal_format;
 	}
 
+	//allocated here, the faces go through the staging buffers
 	for (int i = 0; i < 6; i++)
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, level, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data ? data[i] : NULL);
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, level, internal_format == 0 ? format : internal_format, width, height, 0, format, type, NULL);
 
 	if (level == 0 && mipmaps)
 	{
@@ -325,13 +871,23 @@ void Texture::uploadCubemap(unsigned int format, unsigned int type, bool mipmaps
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);   //set the mag filter
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, this->wrapS);
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, this->wrapT);
-
-		if (data && this->mipmaps)
-			generateMipmaps();
 	}
 
-	glBindTexture(this->texture_type, 0);
+	GLState::bindTexture(this->texture_type, 0);
 	assert(glGetError() == GL_NO_ERROR && "Error creating texture");
+	if (!data)
+		return;
+
+	//data must stay valid until the texture is ready
+	load_state = ASSET_LOADING;
+	for (int i = 0; i < 6; i++)
+		TextureUpload::uploadLevel(this, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, level, data[i], width * height * GPUReadback::getPixelSize(format, type));
+	bool generate = level == 0 && mipmaps && this->mipmaps;
+	TextureUpload::whenDone(this, [this, generate]() {
+		if (generate)
+			generateMipmaps();
+		load_state = ASSET_READY;
+	});
 }
 
 //special function to upload texture arrays, a special type of texture that has layers
@@ -387,7 +943,7 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 	assert(glGetError() == GL_NO_ERROR);
 	if (texture_id == 0)
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
-	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 	glTexImage3D(this->texture_type, 0, format, width, height, num_textures, 0, dataFormat, type, data);
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -408,13 +964,18 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 void Texture::bind()
 {
 	//glEnable(this->texture_type); //enable the textures 
-	glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+	if (load_state != ASSET_READY) //placeholder until it is uploaded
+	{
+		getWhiteTexture()->bind();
+		return;
+	}
+	GLState::bindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 }
 
 void Texture::unbind()
 {
 	//glDisable(this->texture_type); //disable the textures 
-	glBindTexture(this->texture_type, 0);	//disable the id of the texture we are going to use
+	GLState::bindTexture(this->texture_type, 0);	//disable the id of the texture we are going to use
 }
 
 void Texture::UnbindAll()
@@ -422,9 +983,9 @@ void Texture::UnbindAll()
 	glDisable(GL_TEXTURE_CUBE_MAP);
 	glDisable(GL_TEXTURE_2D);
 	glDisable(GL_TEXTURE_3D);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-	glBindTexture(GL_TEXTURE_3D, 0);
+	GLState::bindTexture(GL_TEXTURE_2D, 0);
+	GLState::bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	GLState::bindTexture(GL_TEXTURE_3D, 0);
 }
 
 void Texture::generateMipmaps()
@@ -432,7 +993,7 @@ void Texture::generateMipmaps()
 	if (!glGenerateMipmapEXT)
 		return;
 
-	glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+	GLState::bindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter); //set the mag filter
 	glGenerateMipmapEXT(this->texture_type);
 }
@@ -481,29 +1042,29 @@ void Texture::copyTo(Texture* destination, Shader* shader)
 {
 	if (!destination)
 	{
-		glDepthFunc(GL_ALWAYS);
-		glEnable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_ALWAYS);
+		GLState::enable(GL_DEPTH_TEST);
 		shader = Shader::getDefaultShader("screen_depth");
 		toViewport(shader);
-		glDisable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LESS);
+		GLState::disable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_LESS);
 		return;
 	}
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_BLEND);
 	FBO* fbo = getGlobalFBO(destination);
 	fbo->bind();
 	if (!shader && format == GL_DEPTH_COMPONENT)
 	{
 		shader = Shader::getDefaultShader("screen_depth");
-		glDepthFunc(GL_ALWAYS);
-		glEnable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_ALWAYS);
+		GLState::enable(GL_DEPTH_TEST);
 	}
 	toViewport(shader);
 	fbo->unbind();
-	glDisable(GL_DEPTH_TEST);
-	glDepthFunc(GL_LESS);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::depthFunc(GL_LESS);
 }
 
 void Image::fromScreen(int width, int height)
@@ -621,34 +1182,37 @@ bool Image::loadTGA(const char* filename)
 
 bool Image::loadPNG(const char* filename, bool flip_y)
 {
-	std::ifstream file(filename, std::ios::in | std::ios::binary | std::ios::ate);
-
-	//get filesize
-	std::streamsize size = 0;
-	if (file.seekg(0, std::ios::end).good()) size = file.tellg();
-	if (file.seekg(0, std::ios::beg).good()) size -= file.tellg();
-
-	if (!size)
+	MappedFile file;
+	if (!file.open(filename))
 		return false;
+	const unsigned char* png = (const unsigned char*)file.data;
 
-	std::vector<unsigned char> buffer;
+	sPNGInfo info;
+	if (!readPNGInfo(png, file.size, info))
+		return false;
 
-	//read contents of the file into the vector
-	if (size > 0)
+	clear();
+	if (isPNGSupported(info))
 	{
-		buffer.resize((size_t)size);
-		file.read((char*)(&buffer[0]), size);
+		//decoded straight into data, the buffer is a bit bigger than the pixels because it also holds the inflated rows
+		data = new Uint8[getPNGBufferSize(info)];
+		if (!decodePNGRGBA(png, file.size, info, data))
+		{
+			clear();
+			return false;
+		}
+		width = info.width;
+		height = info.height;
 	}
 	else
-		buffer.clear();
-
-	std::vector<unsigned char> out_image;
-
-	if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
-		return false;
-
-	data = new Uint8[out_image.size()];
-	memcpy(data, &out_image[0], out_image.size());
+	{
+		//interlaced
+		std::vector<unsigned char> out_image;
+		if (decodePNG(out_image, width, height, png, file.size, true) != 0)
+			return false;
+		data = new Uint8[out_image.size()];
+		memcpy(data, &out_image[0], out_image.size());
+	}
 	num_channels = 4;
 
 	//flip pixels in Y
@@ -658,6 +1222,47 @@ bool Image::loadPNG(const char* filename, bool flip_y)
 	return true;
 }
 
+//decodes every PNG of the folder (and subfolders) with picopng and with loadPNG, prints the times and checks they match
+//(picopng gets wrong the 1, 2 and 4 bits images)
+void Image::benchmarkPNG(const char* folder)
+{
+	std::vector<std::string> files;
+	listFiles(folder, ".png", files);
+
+	long total_picopng = 0, total_fast = 0;
+	size_t total_bytes = 0;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		const char* filename = files[i].c_str();
+
+		//the old path: the file read to a vector, decoded to another one and copied
+		long time = getTime();
+		std::string content;
+		std::vector<unsigned char> reference;
+		unsigned int w = 0, h = 0;
+		bool decoded = readFile(filename, content) && decodePNG(reference, w, h, (const unsigned char*)content.c_str(), content.size(), true) == 0;
+		Uint8* copy = decoded ? new Uint8[reference.size()] : NULL;
+		if (copy)
+			memcpy(copy, &reference[0], reference.size());
+		delete[] copy;
+		long picopng_time = getTime() - time;
+
+		time = getTime();
+		Image image;
+		bool loaded = image.loadPNG(filename);
+		long fast_time = getTime() - time;
+
+		bool match = decoded && loaded && image.width == w && image.height == h && memcmp(image.data, &reference[0], reference.size()) == 0;
+		std::cout << " + PNG benchmark: " << filename << " " << w << "x" << h << " picopng: " << picopng_time * 0.001 << "sec loadPNG: " << fast_time * 0.001 << "sec"
+			<< (match ? "" : " [WARN] pixels differ from picopng") << std::endl;
+		total_picopng += picopng_time;
+		total_fast += fast_time;
+		total_bytes += content.size();
+	}
+	std::cout << " + PNG benchmark: " << files.size() << " files (" << total_bytes / (1024 * 1024) << "MB) picopng: " << total_picopng * 0.001 << "sec loadPNG: " << total_fast * 0.001
+		<< "sec (x" << (total_fast ? (float)total_picopng / total_fast : 0.0f) << ")" << std::endl;
+}
+
 // Saves the image to a TGA file
 bool Image::saveTGA(const char* filename, bool flip_y)
 {
@@ -6,14 +6,26 @@
 
 #include "includes.h"
 #include "framework.h"
+#include "utils.h" //eAssetState
 #include <map>
 #include <string>
 #include <cassert>
+#include <atomic>
+#include <vector>
 
 class Shader;
 class FBO;
 class Texture;
 
+//what the texture is used for, it decides the block compression (see texture_compression.h) when Texture::compress_textures is on
+enum eTextureUsage {
+	TEXTURE_GENERIC = 0,		//never compressed
+	TEXTURE_COLOR,				//BC1, or BC7 (BC3 if not supported) when it has alpha
+	TEXTURE_NORMAL,				//BC5 with X and Y, Z must be rebuilt in the shader
+	TEXTURE_METAL_ROUGHNESS,	//BC5 with G (roughness) and B (metalness), swizzled back to .g and .b
+	TEXTURE_MASK				//BC4 with R (occlusion)
+};
+
 //Simple class to handle images (stores RGBA always)
 template <typename T> class tImage
 {
@@ -50,11 +62,12 @@ public:
 	Color getPixelInterpolated(float x, float y, bool repeat = false);
 	Vector4 getPixelInterpolatedHigh(float x, float y, bool repeat = false); //returns a Vector4 (floats)
 
-	void fromTexture(Texture* texture);
+	void fromTexture(Texture* texture); //these two wait for the GPU, GPUReadback reads without stalling
 	void fromScreen(int width, int height);
 
 	bool loadTGA(const char* filename);
 	bool loadPNG(const char* filename, bool flip_y = false);
+	static void benchmarkPNG(const char* folder); //decodes every PNG in it with picopng and loadPNG, the results go to the console
 	bool saveTGA(const char* filename, bool flip_y = true);
 };
 
@@ -75,7 +88,7 @@ public:
 		if (num_channels == 4)
 			data[pos + 3] = v.w;
 	};
-	void fromTexture(Texture* texture);
+	void fromTexture(Texture* texture); //waits for the GPU, see GPUReadback
 	bool loadIBIN(const char* filename);
 	bool saveIBIN(const char* filename);
 };
@@ -112,6 +125,27 @@ public:
 	//original data info
 	Image image;
 
+	//baked mip chain, written next to the image file (filename + ".tbin") the first time it is decoded
+	//the next loads map it and upload the levels as they are, without decoding or glGenerateMipmap
+	static bool bake_textures;
+	static bool compress_textures; //bake block compressed levels when the usage allows it, RGBA8 otherwise
+	static bool supports_s3tc; //BC1 and BC3 (BC4 and BC5 are core in GL 3.0)
+	static bool supports_bptc; //BC7
+	int usage; //eTextureUsage, set before loading the image
+	int block_format; //eBlockFormat of the baked levels, -1 if they are RGBA8
+	std::vector<Uint8> baked_data; //levels just baked, one after the other
+	MappedFile* baked_file; //or the .tbin, mapped until the upload
+	const Uint8* baked_levels; //first level, inside baked_data or baked_file
+	std::vector<unsigned int> baked_level_bytes; //bytes of every level
+
+	//mip streaming (see TextureStreaming): the baked levels stay mapped and only the ones needed are in VRAM
+	bool streamed;
+	int resident_level; //finest level in VRAM
+	int wanted_level; //finest level requested in the frame of last_used
+	long last_used; //TextureStreaming::frame of the last request
+
+	std::atomic<int> load_state; //eAssetState, while it is loading in the background the white texture is bound instead
+
 	Texture();
 	Texture(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	Texture(Image* img);
@@ -127,7 +161,7 @@ public:
 	void upload(FloatImage* img);
 	void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
+	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0); //staged (see TextureUpload), the faces must stay valid until it is ready
 	void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
 	void bind();
@@ -141,10 +175,28 @@ public:
 
 	//load without using the manager
 	bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
+	bool loadImage(const char* filename, bool bake = true); //decodes the file to image (or reads the baked levels), it can be called from any thread
+	void uploadImage(bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE); //creates the texture from image and frees it once TextureUpload is done with it
+
+	static void detectCompressedFormats(); //needs the GL context, call it before loading textures
+	bool bakeImage(const char* filename); //builds the levels of image for usage, frees it and writes the .tbin, any thread
+	bool readBaked(const char* filename); //maps the .tbin if it is up to date, any thread
+	void uploadBaked(bool mipmaps = true, bool wrap = true); //creates the texture from the baked levels and frees them
+	void freeBaked();
+	size_t getBakedBytes(int first_level); //VRAM used by the baked levels from first_level to the last one
+	void createBakedTexture(int first_level, bool staged = false); //a new GL texture with the baked levels from first_level, main thread. Staged goes through TextureUpload
+	void uploadBakedLevels(int first_level); //adds the finer levels down to first_level to the texture, main thread
+	void createBakedArray(const std::vector<Texture*>& layers); //a GL_TEXTURE_2D_ARRAY with the baked levels of textures of the same size, usage and format (see TextureArray), main thread
 
 	//load using the manager (caching loaded ones to avoid reloading them)
-	static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true);
-	void setName(const char* name) { sTexturesLoaded[name] = this; }
+	static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true, int usage = TEXTURE_GENERIC); //waits until it is loaded, NULL if it failed
+	static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true, int usage = TEXTURE_GENERIC); //returns at once, decoded by a worker and uploaded by the main thread (see processMainThreadTasks)
+	void setName(const char* name);
+
+	//for loaders that decode in their own threads: Register returns the existing texture or a new empty one (created), filled with loadImage and then queueUpload
+	static Texture* Register(const char* filename, bool& created);
+	void queueUpload(bool decoded, bool mipmaps = true, bool wrap = true, long start_time = 0); //any thread, the upload waits for processMainThreadTasks
+	bool isReady() { return load_state == ASSET_READY; }
 
 	void generateMipmaps();
 
@@ -156,6 +208,9 @@ public:
 	static FBO* getGlobalFBO(Texture* texture);
 	static Texture* getBlackTexture();
 	static Texture* getWhiteTexture();
+
+private:
+	void uploadBakedLevel(int level, const Uint8* data);
 };
 
 bool isPowerOfTwo(int n);
@@ -0,0 +1,346 @@
+#include "texture_array.h"
+
+#include "texture.h"
+#include "shader.h"
+#include "prefab.h"
+#include "material.h"
+#include "utils.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+
+//imgui keeps its copy static, this file has its own
+#define STBRP_STATIC
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "extra/imgui/imstb_rectpack.h"
+
+using namespace GTR;
+
+bool TextureArray::enabled = true;
+int TextureArray::max_size = 1024;
+int TextureArray::atlas_size = 2048;
+int TextureArray::atlas_padding = 8;
+
+std::vector<Texture*> TextureArray::arrays;
+std::map<Texture*, sArraySlot> TextureArray::sSlots;
+std::map<Material*, sPackedMaterial> TextureArray::sMaterials;
+std::vector<Material*> TextureArray::table_materials;
+Texture* TextureArray::material_table = NULL;
+
+int TextureArray::num_packing = 0;
+
+#define MAX_ARRAY_LAYERS 256 //the minimum GL_MAX_ARRAY_TEXTURE_LAYERS of GL 3.3
+
+static std::set<Prefab*> requested_prefabs;
+static std::set<Texture*> pending_textures; //in a job
+static std::set<Texture*> atlases;
+
+//the materials and textures of a prefab, read by the main thread, the rest is filled by a worker
+struct sPackJob {
+	std::vector<Material*> materials;
+	std::vector<Texture*> textures;
+
+	std::vector<std::vector<Texture*> > groups; //textures with the same size, usage and format
+	std::vector<std::vector<Texture*> > group_levels; //temporary textures with the baked levels of every group
+	Texture* atlas; //its image has all the layers, one under the other
+	std::vector<std::pair<Texture*, sArraySlot> > atlas_slots; //the array is set when it is uploaded
+};
+
+static void collectMaterials(Node* node, std::vector<Material*>& materials)
+{
+	if (node->material && std::find(materials.begin(), materials.end(), node->material) == materials.end())
+		materials.push_back(node->material);
+	for (size_t i = 0; i < node->children.size(); ++i)
+		collectMaterials(node->children[i], materials);
+}
+
+//worker: baked levels for the power of two sizes, decoded images in atlases for the rest
+static void packTextures(sPackJob* job)
+{
+	std::map<std::tuple<int, int, int, int>, int> group_index;
+	std::vector<Texture*> odd; //with the decoded image
+	int padding = TextureArray::atlas_padding;
+	for (size_t i = 0; i < job->textures.size(); ++i)
+	{
+		Texture* texture = job->textures[i];
+		Texture* source = new Texture();
+		source->usage = texture->usage;
+		if (isPowerOfTwo((int)texture->width) && isPowerOfTwo((int)texture->height) && source->readBaked(texture->filename.c_str()))
+		{
+			std::tuple<int, int, int, int> key((int)source->width, (int)source->height, source->block_format, source->usage);
+			auto it = group_index.find(key);
+			if (it == group_index.end() || job->groups[it->second].size() == MAX_ARRAY_LAYERS)
+			{
+				group_index[key] = (int)job->groups.size();
+				job->groups.push_back(std::vector<Texture*>());
+				job->group_levels.push_back(std::vector<Texture*>());
+				it = group_index.find(key);
+			}
+			job->groups[it->second].push_back(texture);
+			job->group_levels[it->second].push_back(source);
+		}
+		else if (source->loadImage(texture->filename.c_str(), false) && (int)source->image.width + padding * 2 <= TextureArray::atlas_size &&
+			(int)source->image.height + padding * 2 <= TextureArray::atlas_size)
+		{
+			source->filename = texture->filename;
+			odd.push_back(source);
+			job->atlas_slots.push_back(std::make_pair(texture, sArraySlot()));
+		}
+		else
+			delete source;
+	}
+
+	job->atlas = NULL;
+	if (odd.empty())
+		return;
+
+	//every layer takes all the rects it can, the rest go to the next one
+	int size = TextureArray::atlas_size;
+	std::vector<stbrp_rect> rects(odd.size());
+	for (size_t i = 0; i < odd.size(); ++i)
+	{
+		rects[i].id = (int)i;
+		rects[i].w = (stbrp_coord)(odd[i]->image.width + padding * 2);
+		rects[i].h = (stbrp_coord)(odd[i]->image.height + padding * 2);
+	}
+	std::vector<stbrp_node> nodes(size);
+	std::vector<int> layers(odd.size());
+	std::vector<stbrp_rect> placed(odd.size());
+	int num_layers = 0;
+	while (!rects.empty())
+	{
+		stbrp_context context;
+		stbrp_init_target(&context, size, size, &nodes[0], (int)nodes.size());
+		stbrp_pack_rects(&context, &rects[0], (int)rects.size());
+		std::vector<stbrp_rect> next;
+		for (size_t i = 0; i < rects.size(); ++i)
+			if (rects[i].was_packed)
+			{
+				placed[rects[i].id] = rects[i];
+				layers[rects[i].id] = num_layers;
+			}
+			else
+				next.push_back(rects[i]);
+		rects.swap(next);
+		num_layers++;
+	}
+
+	//the padding repeats the texture like GL_REPEAT, so the bilinear filter wraps at its borders
+	job->atlas = new Texture();
+	Image& atlas = job->atlas->image;
+	atlas.resize(size, size * num_layers, 4);
+	for (size_t i = 0; i < odd.size(); ++i)
+	{
+		Image& image = odd[i]->image;
+		int w = image.width;
+		int h = image.height;
+		int channels = image.num_channels;
+		const stbrp_rect& rect = placed[i];
+		for (int y = 0; y < rect.h; ++y)
+		{
+			int sy = ((y - padding) % h + h) % h;
+			Uint8* out = atlas.data + ((size_t)(layers[i] * size + rect.y + y) * size + rect.x) * 4;
+			for (int x = 0; x < rect.w; ++x)
+			{
+				const Uint8* pixel = image.data + ((size_t)sy * w + ((x - padding) % w + w) % w) * channels;
+				out[x * 4] = pixel[0];
+				out[x * 4 + 1] = pixel[1];
+				out[x * 4 + 2] = pixel[2];
+				out[x * 4 + 3] = channels == 4 ? pixel[3] : 255;
+			}
+		}
+		sArraySlot& slot = job->atlas_slots[i].second;
+		slot.array = NULL;
+		slot.layer = layers[i];
+		slot.rect.set((rect.x + padding) / (float)size, (rect.y + padding) / (float)size, w / (float)size, h / (float)size);
+		delete odd[i];
+	}
+}
+
+//main thread: uploads the arrays and packs the materials that have all their textures in them
+static void finishPacking(sPackJob* job)
+{
+	for (size_t i = 0; i < job->groups.size(); ++i)
+	{
+		Texture* array = new Texture();
+		array->createBakedArray(job->group_levels[i]);
+		TextureArray::arrays.push_back(array);
+		for (size_t j = 0; j < job->groups[i].size(); ++j)
+		{
+			sArraySlot slot = { array, (int)j, Vector4(0, 0, 1, 1) };
+			TextureArray::sSlots[job->groups[i][j]] = slot;
+			delete job->group_levels[i][j];
+		}
+	}
+
+	if (job->atlas)
+	{
+		//the mips stop when the padding is one texel
+		Texture* atlas = job->atlas;
+		atlas->depth = (float)(atlas->image.height / TextureArray::atlas_size);
+		atlas->uploadAsArray(TextureArray::atlas_size, true);
+		atlas->bind();
+		glTexParameteri(atlas->texture_type, GL_TEXTURE_MAX_LEVEL, std::max(0, (int)floor(log2f((float)TextureArray::atlas_padding))));
+		atlas->unbind();
+		atlas->image.clear();
+		TextureArray::arrays.push_back(atlas);
+		atlases.insert(atlas);
+		for (size_t i = 0; i < job->atlas_slots.size(); ++i)
+		{
+			job->atlas_slots[i].second.array = atlas;
+			TextureArray::sSlots[job->atlas_slots[i].first] = job->atlas_slots[i].second;
+		}
+	}
+
+	for (size_t i = 0; i < job->textures.size(); ++i)
+		pending_textures.erase(job->textures[i]);
+
+	for (size_t i = 0; i < job->materials.size(); ++i)
+	{
+		Material* material = job->materials[i];
+		Texture* textures[2] = { material->color_texture, material->metallic_roughness_texture };
+		Texture* material_arrays[2] = { NULL, NULL };
+		bool packed = TextureArray::sMaterials.find(material) == TextureArray::sMaterials.end();
+		for (int j = 0; j < 2 && packed; ++j)
+		{
+			if (!textures[j])
+				continue;
+			auto it = TextureArray::sSlots.find(textures[j]);
+			packed = it != TextureArray::sSlots.end();
+			if (packed)
+				material_arrays[j] = it->second.array;
+		}
+		if (!packed)
+			continue;
+		sPackedMaterial packed_material = { (int)TextureArray::table_materials.size(), material_arrays[0], material_arrays[1] };
+		TextureArray::sMaterials[material] = packed_material;
+		TextureArray::table_materials.push_back(material);
+	}
+
+	TextureArray::update(); //the table has the new rows before they are drawn
+}
+
+void TextureArray::request(Prefab* prefab)
+{
+	if (!enabled || !prefab->isReady() || requested_prefabs.count(prefab))
+		return;
+
+	sPackJob* job = new sPackJob();
+	collectMaterials(&prefab->root, job->materials);
+	for (size_t i = 0; i < job->materials.size(); ++i)
+	{
+		Texture* textures[2] = { job->materials[i]->color_texture, job->materials[i]->metallic_roughness_texture };
+		for (int j = 0; j < 2; ++j)
+		{
+			Texture* texture = textures[j];
+			if (!texture)
+				continue;
+			if (texture->load_state == ASSET_LOADING)
+			{
+				delete job; //next frame
+				return;
+			}
+			if (!texture->isReady() || texture->filename.empty() || texture->width > max_size || texture->height > max_size ||
+				sSlots.count(texture) || pending_textures.count(texture) || std::find(job->textures.begin(), job->textures.end(), texture) != job->textures.end())
+				continue;
+			job->textures.push_back(texture);
+		}
+	}
+	requested_prefabs.insert(prefab);
+	pending_textures.insert(job->textures.begin(), job->textures.end());
+
+	num_packing++;
+	runAsync([job]() {
+		packTextures(job);
+		runInMainThread([job]() {
+			finishPacking(job);
+			delete job;
+			num_packing--;
+		});
+	});
+}
+
+sPackedMaterial* TextureArray::getPacked(Material* material)
+{
+	auto it = sMaterials.find(material);
+	return it != sMaterials.end() ? &it->second : NULL;
+}
+
+bool TextureArray::canShareDraw(Material* a, Material* b)
+{
+	sPackedMaterial* packed_a = getPacked(a);
+	sPackedMaterial* packed_b = getPacked(b);
+	return packed_a && packed_b && packed_a->color_array == packed_b->color_array && packed_a->metal_roughness_array == packed_b->metal_roughness_array &&
+		a->alpha_mode == b->alpha_mode && a->two_sided == b->two_sided && !a->planarReflection && !b->planarReflection;
+}
+
+void TextureArray::setUniforms(Shader* shader, Material* material)
+{
+	//the array samplers always need their own slots, two types of samplers cannot share one
+	sPackedMaterial* packed = material ? getPacked(material) : NULL;
+	if (packed && packed->color_array)
+		shader->setUniform("u_color_array", packed->color_array, 5);
+	else
+		shader->setUniform("u_color_array", 5);
+	if (packed && packed->metal_roughness_array)
+		shader->setUniform("u_metal_roughness_array", packed->metal_roughness_array, 6);
+	else
+		shader->setUniform("u_metal_roughness_array", 6);
+	if (packed && material_table)
+		shader->setUniform("u_material_table", material_table, 7);
+	shader->setUniform("u_material_id", packed && material_table ? packed->row + 1 : 0);
+}
+
+void TextureArray::update()
+{
+	int num_rows = (int)table_materials.size();
+	if (!num_rows)
+		return;
+
+	//the materials can be edited, the table is small enough to upload it every frame
+	std::vector<Vector4> data(num_rows * 4);
+	for (int i = 0; i < num_rows; ++i)
+	{
+		Material* material = table_materials[i];
+		Vector4* row = &data[i * 4];
+		Texture* textures[2] = { material->color_texture, material->metallic_roughness_texture };
+		sArraySlot* slots[2] = { NULL, NULL };
+		for (int j = 0; j < 2; ++j)
+			if (textures[j])
+				slots[j] = &sSlots[textures[j]];
+		row[0] = material->color;
+		row[1].set(material->metallic_factor, material->roughness_factor, slots[0] ? (float)slots[0]->layer : -1.0f, slots[1] ? (float)slots[1]->layer : -1.0f);
+		row[2] = slots[0] ? slots[0]->rect : Vector4(0, 0, 1, 1);
+		row[3] = slots[1] ? slots[1]->rect : Vector4(0, 0, 1, 1);
+	}
+
+	if (!material_table || (int)material_table->height != num_rows)
+	{
+		delete material_table;
+		material_table = new Texture(4, num_rows, GL_RGBA, GL_FLOAT, false, (Uint8*)&data[0], GL_RGBA32F);
+		material_table->bind();
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		material_table->unbind();
+		return;
+	}
+	material_table->bind();
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 4, num_rows, GL_RGBA, GL_FLOAT, &data[0]);
+	material_table->unbind();
+}
+
+void TextureArray::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Pack new prefabs", &enabled);
+	ImGui::Text("Arrays: %d with %d textures, %d materials packed, %d prefabs packing", (int)arrays.size(), (int)sSlots.size(), (int)table_materials.size(), num_packing);
+	for (size_t i = 0; i < arrays.size(); ++i)
+	{
+		Texture* array = arrays[i];
+		ImGui::Text("%dx%d, %d layers, %s", (int)array->width, (int)array->height, (int)array->depth,
+			atlases.count(array) ? "RGBA8 atlas" : (array->block_format != -1 ? "compressed" : "RGBA8"));
+	}
+#endif
+}
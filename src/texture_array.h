@@ -0,0 +1,56 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+#include <vector>
+#include <map>
+#include <set>
+
+class Texture;
+class Shader;
+namespace GTR { class Material; class Prefab; class Node; }
+
+//the color and metal-roughness textures of the materials of a prefab are packed in GL_TEXTURE_2D_ARRAYs once it is loaded, so the
+//G-buffer draws only change layers. The ones with the same power of two size, usage and format share an array with their baked mips,
+//the odd sizes are packed with imstb_rectpack in the layers of RGBA8 atlases. The factors and layers of every packed material are a
+//row of the material table, so one instanced draw of a mesh can mix materials that use the same arrays (see Renderer::renderCalls).
+
+//where a texture is inside an array
+struct sArraySlot {
+	Texture* array;
+	int layer;
+	Vector4 rect; //offset and scale of the uvs in the layer, the atlases use only a part of it
+};
+
+//a material that samples the arrays
+struct sPackedMaterial {
+	int row; //in the material table
+	Texture* color_array; //NULL if it has no texture
+	Texture* metal_roughness_array;
+};
+
+class TextureArray
+{
+public:
+	static bool enabled; //for the prefabs loaded after changing it
+	static int max_size; //bigger textures keep their own texture (they can be virtual)
+	static int atlas_size; //of the layers of the atlases
+	static int atlas_padding; //texels repeated around every texture of an atlas, its mips stop before they mix
+
+	static std::vector<Texture*> arrays;
+	static std::map<Texture*, sArraySlot> sSlots;
+	static std::map<GTR::Material*, sPackedMaterial> sMaterials;
+	static std::vector<GTR::Material*> table_materials; //by row
+	static Texture* material_table; //RGBA32F, a row of 4 texels per material: color, (metalness, roughness, color layer, metal-roughness layer), color rect, metal-roughness rect
+
+	static int num_packing; //prefabs being packed by the workers
+
+	static void request(GTR::Prefab* prefab); //by the renderer every frame, the first time its textures are ready it is packed in the background
+	static sPackedMaterial* getPacked(GTR::Material* material); //NULL if it must bind its own textures
+	static bool canShareDraw(GTR::Material* a, GTR::Material* b); //both packed, with the same arrays and render state
+
+	//binds the arrays (slots 5 and 6) and the table (7), sets u_material_id to its row + 1 for the draws without instances
+	static void setUniforms(Shader* shader, GTR::Material* material);
+	static void update(); //main thread, once per frame: uploads the material table
+	static void renderInMenu();
+};
@@ -0,0 +1,473 @@
+#include "texture_compression.h"
+
+#include "utils.h" //parallelFor
+
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
+
+size_t getBlockSize(int format)
+{
+	return (format == BLOCK_BC1 || format == BLOCK_BC4) ? 8 : 16;
+}
+
+size_t getBlockCompressedSize(int format, int width, int height)
+{
+	return (size_t)((width + 3) / 4) * ((height + 3) / 4) * getBlockSize(format);
+}
+
+//4x4 pixels, RGBA
+static void fetchBlock(const unsigned char* rgba, int width, int height, int bx, int by, unsigned char* block)
+{
+	for (int y = 0; y < 4; ++y)
+	{
+		int sy = std::min(by * 4 + y, height - 1);
+		for (int x = 0; x < 4; ++x)
+		{
+			int sx = std::min(bx * 4 + x, width - 1);
+			memcpy(block + (y * 4 + x) * 4, rgba + ((size_t)sy * width + sx) * 4, 4);
+		}
+	}
+}
+
+//mean and direction of maximum variance of the first num_channels (power iteration on the covariance)
+static void computePrincipalAxis(const unsigned char* block, int num_channels, float* mean, float* axis)
+{
+	float cov[4][4];
+	memset(cov, 0, sizeof(cov));
+	for (int c = 0; c < num_channels; ++c)
+	{
+		mean[c] = 0;
+		for (int i = 0; i < 16; ++i)
+			mean[c] += block[i * 4 + c];
+		mean[c] /= 16.0f;
+	}
+	for (int i = 0; i < 16; ++i)
+	{
+		float d[4];
+		for (int c = 0; c < num_channels; ++c)
+			d[c] = block[i * 4 + c] - mean[c];
+		for (int a = 0; a < num_channels; ++a)
+			for (int b = 0; b < num_channels; ++b)
+				cov[a][b] += d[a] * d[b];
+	}
+
+	//start from the channel with more variance, so it is never orthogonal to the solution
+	int start = 0;
+	for (int c = 1; c < num_channels; ++c)
+		if (cov[c][c] > cov[start][start])
+			start = c;
+	for (int c = 0; c < num_channels; ++c)
+		axis[c] = cov[start][c];
+
+	for (int iteration = 0; iteration < 8; ++iteration)
+	{
+		float v[4];
+		float max_value = 0;
+		for (int a = 0; a < num_channels; ++a)
+		{
+			v[a] = 0;
+			for (int b = 0; b < num_channels; ++b)
+				v[a] += cov[a][b] * axis[b];
+			max_value = std::max(max_value, fabsf(v[a]));
+		}
+		if (max_value == 0)
+			break;
+		for (int c = 0; c < num_channels; ++c)
+			axis[c] = v[c] / max_value;
+	}
+
+	float length = 0;
+	for (int c = 0; c < num_channels; ++c)
+		length += axis[c] * axis[c];
+	length = sqrtf(length);
+	for (int c = 0; c < num_channels; ++c)
+		axis[c] = length > 0 ? axis[c] / length : 0;
+}
+
+//endpoints along the axis that cover all the pixels
+static void computeAxisEndpoints(const unsigned char* block, int num_channels, float* e0, float* e1)
+{
+	float mean[4], axis[4];
+	computePrincipalAxis(block, num_channels, mean, axis);
+	float tmin = FLT_MAX, tmax = -FLT_MAX;
+	for (int i = 0; i < 16; ++i)
+	{
+		float t = 0;
+		for (int c = 0; c < num_channels; ++c)
+			t += (block[i * 4 + c] - mean[c]) * axis[c];
+		tmin = std::min(tmin, t);
+		tmax = std::max(tmax, t);
+	}
+	for (int c = 0; c < num_channels; ++c)
+	{
+		e0[c] = std::min(255.0f, std::max(0.0f, mean[c] + axis[c] * tmin));
+		e1[c] = std::min(255.0f, std::max(0.0f, mean[c] + axis[c] * tmax));
+	}
+}
+
+//least squares endpoints for the chosen weights (0 is e0, 1 is e1), false if the weights are all the same
+static bool fitEndpoints(const unsigned char* block, int num_channels, const float* weights, float* e0, float* e1)
+{
+	float aa = 0, bb = 0, ab = 0;
+	float ax[4] = { 0, 0, 0, 0 };
+	float bx[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < 16; ++i)
+	{
+		float a = 1.0f - weights[i];
+		float b = weights[i];
+		aa += a * a;
+		bb += b * b;
+		ab += a * b;
+		for (int c = 0; c < num_channels; ++c)
+		{
+			ax[c] += a * block[i * 4 + c];
+			bx[c] += b * block[i * 4 + c];
+		}
+	}
+	float det = aa * bb - ab * ab;
+	if (fabsf(det) < 1e-6f)
+		return false;
+	for (int c = 0; c < num_channels; ++c)
+	{
+		e0[c] = std::min(255.0f, std::max(0.0f, (ax[c] * bb - bx[c] * ab) / det));
+		e1[c] = std::min(255.0f, std::max(0.0f, (bx[c] * aa - ax[c] * ab) / det));
+	}
+	return true;
+}
+
+//BC1 *************************************
+
+static unsigned short packRGB565(const float* c)
+{
+	int r = std::min(31, std::max(0, (int)(c[0] * (31.0f / 255.0f) + 0.5f)));
+	int g = std::min(63, std::max(0, (int)(c[1] * (63.0f / 255.0f) + 0.5f)));
+	int b = std::min(31, std::max(0, (int)(c[2] * (31.0f / 255.0f) + 0.5f)));
+	return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+static void unpackRGB565(unsigned short v, int* c)
+{
+	int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+	c[0] = (r << 3) | (r >> 2);
+	c[1] = (g << 2) | (g >> 4);
+	c[2] = (b << 3) | (b >> 2);
+}
+
+//best index of every pixel in the four color mode (c0 > c1), returns the squared error
+static int evaluateBC1(const unsigned char* block, unsigned short c0, unsigned short c1, unsigned int& indices)
+{
+	int palette[4][3];
+	unpackRGB565(c0, palette[0]);
+	unpackRGB565(c1, palette[1]);
+	for (int c = 0; c < 3; ++c)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+
+	int error = 0;
+	indices = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		const unsigned char* pixel = block + i * 4;
+		int best = 0, best_error = INT_MAX;
+		for (int j = 0; j < 4; ++j)
+		{
+			int dr = pixel[0] - palette[j][0], dg = pixel[1] - palette[j][1], db = pixel[2] - palette[j][2];
+			int e = dr * dr + dg * dg + db * db;
+			if (e < best_error)
+			{
+				best_error = e;
+				best = j;
+			}
+		}
+		indices |= best << (2 * i);
+		error += best_error;
+	}
+	return error;
+}
+
+static void encodeBC1(const unsigned char* block, unsigned char* output)
+{
+	static const float bc1_weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+	float e0[4], e1[4];
+	computeAxisEndpoints(block, 3, e0, e1);
+	unsigned short c0 = packRGB565(e1);
+	unsigned short c1 = packRGB565(e0);
+	if (c0 < c1)
+		std::swap(c0, c1);
+
+	//with c0 == c1 the decoder uses the three color mode, index 0 is still the color
+	unsigned int indices = 0;
+	if (c0 != c1)
+	{
+		int error = evaluateBC1(block, c0, c1, indices);
+
+		//refine the endpoints for the chosen indices
+		float weights[16];
+		for (int i = 0; i < 16; ++i)
+			weights[i] = bc1_weights[(indices >> (2 * i)) & 3];
+		if (fitEndpoints(block, 3, weights, e0, e1))
+		{
+			unsigned short n0 = packRGB565(e0);
+			unsigned short n1 = packRGB565(e1);
+			if (n0 < n1)
+				std::swap(n0, n1);
+			unsigned int new_indices = 0;
+			if (n0 != n1 && evaluateBC1(block, n0, n1, new_indices) < error)
+			{
+				c0 = n0;
+				c1 = n1;
+				indices = new_indices;
+			}
+		}
+	}
+
+	output[0] = c0 & 0xFF;
+	output[1] = c0 >> 8;
+	output[2] = c1 & 0xFF;
+	output[3] = c1 >> 8;
+	for (int i = 0; i < 4; ++i)
+		output[4 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+//BC4 *************************************
+
+//one channel of the block (values[i * 4]), eight values mode
+static void encodeBC4(const unsigned char* values, unsigned char* output)
+{
+	int vmin = 255, vmax = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		vmin = std::min(vmin, (int)values[i * 4]);
+		vmax = std::max(vmax, (int)values[i * 4]);
+	}
+	output[0] = vmax;
+	output[1] = vmin;
+	memset(output + 2, 0, 6);
+	if (vmax == vmin)
+		return;
+
+	int palette[8];
+	palette[0] = vmax;
+	palette[1] = vmin;
+	for (int i = 2; i < 8; ++i)
+		palette[i] = ((8 - i) * vmax + (i - 1) * vmin + 3) / 7;
+
+	unsigned long long bits = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		int best = 0, best_error = INT_MAX;
+		for (int j = 0; j < 8; ++j)
+		{
+			int e = abs(values[i * 4] - palette[j]);
+			if (e < best_error)
+			{
+				best_error = e;
+				best = j;
+			}
+		}
+		bits |= (unsigned long long)best << (3 * i);
+	}
+	for (int i = 0; i < 6; ++i)
+		output[2 + i] = (bits >> (8 * i)) & 0xFF;
+}
+
+//BC7 *************************************
+
+static const int bc7_weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+//mode 6 endpoints have 7 bits per channel and a shared lowest bit (p-bit), the one with less error is used
+static void quantizeBC7Endpoint(const float* e, int* q, int& p)
+{
+	float best_error = FLT_MAX;
+	for (int pbit = 0; pbit < 2; ++pbit)
+	{
+		int v[4];
+		float error = 0;
+		for (int c = 0; c < 4; ++c)
+		{
+			v[c] = std::min(127, std::max(0, (int)((e[c] - pbit) * 0.5f + 0.5f)));
+			float d = ((v[c] << 1) | pbit) - e[c];
+			error += d * d;
+		}
+		if (error < best_error)
+		{
+			best_error = error;
+			p = pbit;
+			memcpy(q, v, sizeof(v));
+		}
+	}
+}
+
+static int evaluateBC7(const unsigned char* block, const int* q0, int p0, const int* q1, int p1, unsigned char* indices)
+{
+	int palette[16][4];
+	for (int i = 0; i < 16; ++i)
+		for (int c = 0; c < 4; ++c)
+			palette[i][c] = ((64 - bc7_weights4[i]) * ((q0[c] << 1) | p0) + bc7_weights4[i] * ((q1[c] << 1) | p1) + 32) >> 6;
+
+	int error = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		const unsigned char* pixel = block + i * 4;
+		int best = 0, best_error = INT_MAX;
+		for (int j = 0; j < 16; ++j)
+		{
+			int e = 0;
+			for (int c = 0; c < 4; ++c)
+				e += (pixel[c] - palette[j][c]) * (pixel[c] - palette[j][c]);
+			if (e < best_error)
+			{
+				best_error = e;
+				best = j;
+			}
+		}
+		indices[i] = best;
+		error += best_error;
+	}
+	return error;
+}
+
+struct sBitWriter {
+	unsigned char* data;
+	int pos;
+	void write(unsigned int value, int bits) {
+		for (int i = 0; i < bits; ++i, ++pos)
+			if ((value >> i) & 1)
+				data[pos >> 3] |= 1 << (pos & 7);
+	}
+};
+
+static void encodeBC7(const unsigned char* block, unsigned char* output)
+{
+	float e0[4], e1[4];
+	computeAxisEndpoints(block, 4, e0, e1);
+
+	int q0[4], q1[4], p0, p1;
+	unsigned char indices[16];
+	quantizeBC7Endpoint(e0, q0, p0);
+	quantizeBC7Endpoint(e1, q1, p1);
+	int error = evaluateBC7(block, q0, p0, q1, p1, indices);
+
+	//refine the endpoints for the chosen indices
+	float weights[16];
+	for (int i = 0; i < 16; ++i)
+		weights[i] = bc7_weights4[indices[i]] / 64.0f;
+	if (fitEndpoints(block, 4, weights, e0, e1))
+	{
+		int n0[4], n1[4], np0, np1;
+		unsigned char new_indices[16];
+		quantizeBC7Endpoint(e0, n0, np0);
+		quantizeBC7Endpoint(e1, n1, np1);
+		if (evaluateBC7(block, n0, np0, n1, np1, new_indices) < error)
+		{
+			memcpy(q0, n0, sizeof(q0));
+			memcpy(q1, n1, sizeof(q1));
+			p0 = np0;
+			p1 = np1;
+			memcpy(indices, new_indices, sizeof(indices));
+		}
+	}
+
+	//the highest bit of the first index is implicit (0)
+	if (indices[0] & 8)
+	{
+		for (int c = 0; c < 4; ++c)
+			std::swap(q0[c], q1[c]);
+		std::swap(p0, p1);
+		for (int i = 0; i < 16; ++i)
+			indices[i] = 15 - indices[i];
+	}
+
+	memset(output, 0, 16);
+	sBitWriter writer = { output, 0 };
+	writer.write(1 << 6, 7); //mode 6
+	for (int c = 0; c < 4; ++c)
+	{
+		writer.write(q0[c], 7);
+		writer.write(q1[c], 7);
+	}
+	writer.write(p0, 1);
+	writer.write(p1, 1);
+	for (int i = 0; i < 16; ++i)
+		writer.write(indices[i], i == 0 ? 3 : 4);
+}
+
+void compressBlocks(int format, const unsigned char* rgba, int width, int height, unsigned char* output, const int* channels)
+{
+	int blocks_x = (width + 3) / 4;
+	int blocks_y = (height + 3) / 4;
+	size_t block_size = getBlockSize(format);
+	int channel0 = channels ? channels[0] : 0;
+	int channel1 = channels ? channels[1] : 1;
+
+	parallelFor(blocks_y, [&](int by) {
+		unsigned char block[64];
+		unsigned char* out = output + (size_t)by * blocks_x * block_size;
+		for (int bx = 0; bx < blocks_x; ++bx, out += block_size)
+		{
+			fetchBlock(rgba, width, height, bx, by, block);
+			switch (format)
+			{
+			case BLOCK_BC1: encodeBC1(block, out); break;
+			case BLOCK_BC3: encodeBC4(block + 3, out); encodeBC1(block, out + 8); break;
+			case BLOCK_BC4: encodeBC4(block + channel0, out); break;
+			case BLOCK_BC5: encodeBC4(block + channel0, out); encodeBC4(block + channel1, out + 8); break;
+			case BLOCK_BC7: encodeBC7(block, out); break;
+			}
+		}
+	}, 16);
+}
+
+//sRGB encoded bytes to linear light and back, the color textures are averaged in linear space so the mips do not get darker
+struct sSRGBTables {
+	float to_linear[256];
+	unsigned char to_srgb[4096]; //linear quantized to 12 bits
+	sSRGBTables() {
+		for (int i = 0; i < 256; ++i)
+		{
+			float c = i / 255.0f;
+			to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+		}
+		for (int i = 0; i < 4096; ++i)
+		{
+			float c = i / 4095.0f;
+			float s = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+			to_srgb[i] = (unsigned char)std::min(255.0f, s * 255.0f + 0.5f);
+		}
+	}
+};
+
+void downsampleRGBA(const unsigned char* rgba, int width, int height, unsigned char* output, bool srgb)
+{
+	static const sSRGBTables tables;
+	int w = std::max(1, width / 2);
+	int h = std::max(1, height / 2);
+	parallelFor(h, [&](int y) {
+		const unsigned char* row0 = rgba + (size_t)std::min(y * 2, height - 1) * width * 4;
+		const unsigned char* row1 = rgba + (size_t)std::min(y * 2 + 1, height - 1) * width * 4;
+		for (int x = 0; x < w; ++x)
+		{
+			int x0 = std::min(x * 2, width - 1) * 4;
+			int x1 = std::min(x * 2 + 1, width - 1) * 4;
+			unsigned char* out = output + ((size_t)y * w + x) * 4;
+			int first = 0;
+			if (srgb)
+			{
+				for (int c = 0; c < 3; ++c)
+				{
+					float sum = tables.to_linear[row0[x0 + c]] + tables.to_linear[row0[x1 + c]] + tables.to_linear[row1[x0 + c]] + tables.to_linear[row1[x1 + c]];
+					out[c] = tables.to_srgb[(int)(sum * (4095.0f / 4.0f) + 0.5f)];
+				}
+				first = 3; //alpha is linear
+			}
+			for (int c = first; c < 4; ++c)
+				out[c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4;
+		}
+	}, 64);
+}
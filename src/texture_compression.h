@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+//block compression of RGBA8 images: every 4x4 pixels go to one block, blocks are stored in rows from the first row of the image
+//the blocks of the borders repeat the last pixels when the size is not a multiple of 4
+
+enum eBlockFormat {
+	BLOCK_BC1 = 0,	//RGB, 8 bytes per block (S3TC DXT1)
+	BLOCK_BC3 = 1,	//RGBA, 16 bytes, BC1 color and BC4 alpha (S3TC DXT5)
+	BLOCK_BC4 = 2,	//one channel, 8 bytes (RGTC1)
+	BLOCK_BC5 = 3,	//two channels, 16 bytes, two BC4 blocks (RGTC2)
+	BLOCK_BC7 = 4	//RGBA, 16 bytes, only mode 6 (BPTC)
+};
+
+size_t getBlockSize(int format); //bytes per block
+size_t getBlockCompressedSize(int format, int width, int height);
+
+//channels: the ones of the source read by BC4 (the first) and BC5 (the first two), NULL is red and green
+//the rows of blocks are compressed in all the cores
+void compressBlocks(int format, const unsigned char* rgba, int width, int height, unsigned char* output, const int* channels = NULL);
+
+//half the size (at least 1), averaging every 2x2 pixels, the rows in all the cores
+//srgb: the color channels are averaged in linear space (alpha never is)
+void downsampleRGBA(const unsigned char* rgba, int width, int height, unsigned char* output, bool srgb = false);
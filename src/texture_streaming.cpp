@@ -0,0 +1,193 @@
+#include "texture_streaming.h"
+
+#include "includes.h"
+#include "texture.h"
+#include "camera.h"
+
+#include <cmath>
+#include <algorithm>
+
+bool TextureStreaming::enabled = true;
+int TextureStreaming::budget_mb = 256;
+int TextureStreaming::min_size = 64;
+int TextureStreaming::max_uploads = 4;
+float TextureStreaming::bias = 0.0f;
+
+std::vector<Texture*> TextureStreaming::textures;
+long TextureStreaming::frame = 0;
+
+size_t TextureStreaming::resident_bytes = 0;
+size_t TextureStreaming::full_bytes = 0;
+int TextureStreaming::num_uploaded = 0;
+int TextureStreaming::num_dropped = 0;
+int TextureStreaming::num_blurry = 0;
+
+void TextureStreaming::add(Texture* texture)
+{
+	textures.push_back(texture);
+}
+
+void TextureStreaming::remove(Texture* texture)
+{
+	auto it = std::find(textures.begin(), textures.end(), texture);
+	if (it != textures.end())
+		textures.erase(it);
+}
+
+int TextureStreaming::getFloorLevel(Texture* texture)
+{
+	int last = (int)texture->baked_level_bytes.size() - 1;
+	for (int i = 0; i < last; ++i)
+		if (std::max((int)texture->width >> i, (int)texture->height >> i) <= min_size)
+			return i;
+	return std::max(last, 0);
+}
+
+float TextureStreaming::getPixelsPerUnit(Camera* camera, const Vector3& center, float radius, float viewport_height)
+{
+	if (camera->type == Camera::ORTHOGRAPHIC)
+		return viewport_height / fabs(camera->top - camera->bottom);
+	//inside the sphere it could be as close as the near plane
+	float dist = std::max(camera->eye.distance(center) - radius, camera->near_plane);
+	return viewport_height / (2.0f * dist * (float)tan(camera->fov * 0.5f * DEG2RAD));
+}
+
+void TextureStreaming::request(Texture* texture, float texels_per_pixel)
+{
+	//one texel per pixel: every level halves the texels
+	int floor_level = getFloorLevel(texture);
+	int level = texels_per_pixel > 0 ? (int)floorf(log2f(texels_per_pixel) + bias) : floor_level;
+	level = std::max(0, std::min(level, floor_level));
+	if (texture->last_used != frame || level < texture->wanted_level)
+		texture->wanted_level = level;
+	texture->last_used = frame;
+}
+
+//the level the texture needs now, the floor if it was not requested this frame
+static int getWantedLevel(Texture* texture, int floor_level)
+{
+	return texture->last_used == TextureStreaming::frame ? std::min(texture->wanted_level, floor_level) : floor_level;
+}
+
+//the texture that loses its finest level to make room: the least recently used, and among the visible the ones with more
+//detail than they need. force also takes the visible ones that need all their levels.
+static int findVictim(const std::vector<int>& target, int exclude, bool force)
+{
+	int victim = -1;
+	long victim_used = 0;
+	int victim_surplus = 0;
+	for (size_t i = 0; i < target.size(); ++i)
+	{
+		Texture* texture = TextureStreaming::textures[i];
+		int floor_level = TextureStreaming::getFloorLevel(texture);
+		if ((int)i == exclude || target[i] >= floor_level)
+			continue;
+		int surplus = getWantedLevel(texture, floor_level) - target[i];
+		if (texture->last_used == TextureStreaming::frame && surplus <= 0 && !force)
+			continue;
+		if (victim == -1 || texture->last_used < victim_used || (texture->last_used == victim_used && surplus > victim_surplus))
+		{
+			victim = (int)i;
+			victim_used = texture->last_used;
+			victim_surplus = surplus;
+		}
+	}
+	return victim;
+}
+
+void TextureStreaming::update()
+{
+	size_t budget = (size_t)std::max(budget_mb, 0) * 1024 * 1024;
+	std::vector<int> target(textures.size());
+	std::vector<int> upgrades;
+	resident_bytes = 0;
+	full_bytes = 0;
+	for (size_t i = 0; i < textures.size(); ++i)
+	{
+		Texture* texture = textures[i];
+		target[i] = texture->resident_level;
+		resident_bytes += texture->getBakedBytes(texture->resident_level);
+		full_bytes += texture->getBakedBytes(0);
+		if (getWantedLevel(texture, getFloorLevel(texture)) < texture->resident_level)
+			upgrades.push_back((int)i);
+	}
+
+	//one level per texture and frame, the ones missing more levels first
+	std::stable_sort(upgrades.begin(), upgrades.end(), [&target](int a, int b) {
+		return target[a] - getWantedLevel(textures[a], getFloorLevel(textures[a])) > target[b] - getWantedLevel(textures[b], getFloorLevel(textures[b]));
+	});
+	size_t total = resident_bytes;
+	num_uploaded = 0;
+	for (size_t j = 0; j < upgrades.size() && num_uploaded < max_uploads; ++j)
+	{
+		int i = upgrades[j];
+		int level = target[i] - 1;
+		size_t bytes = textures[i]->baked_level_bytes[level];
+		while (total + bytes > budget)
+		{
+			int victim = findVictim(target, i, false);
+			if (victim == -1)
+				break;
+			total -= textures[victim]->baked_level_bytes[target[victim]];
+			target[victim]++;
+		}
+		if (total + bytes > budget)
+			continue; //a smaller one may fit
+		target[i] = level;
+		total += bytes;
+		num_uploaded++;
+	}
+
+	//the budget was lowered: even the visible ones lose detail
+	while (total > budget)
+	{
+		int victim = findVictim(target, -1, true);
+		if (victim == -1)
+			break;
+		total -= textures[victim]->baked_level_bytes[target[victim]];
+		target[victim]++;
+	}
+
+	num_dropped = 0;
+	num_blurry = 0;
+	for (size_t i = 0; i < textures.size(); ++i)
+	{
+		Texture* texture = textures[i];
+		if (target[i] < texture->resident_level)
+			texture->uploadBakedLevels(target[i]);
+		else if (target[i] > texture->resident_level)
+		{
+			texture->createBakedTexture(target[i]); //GL cannot free single levels, the texture is created again without them
+			num_dropped++;
+		}
+		if (texture->last_used == frame && texture->resident_level > texture->wanted_level)
+			num_blurry++;
+	}
+	resident_bytes = total;
+	frame++;
+}
+
+void TextureStreaming::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Stream new textures", &enabled);
+	ImGui::DragInt("Budget (MB)", &budget_mb, 1.0f, 16, 8192);
+	ImGui::DragInt("Min size", &min_size, 1.0f, 1, 1024);
+	ImGui::DragInt("Uploads per frame", &max_uploads, 0.1f, 1, 64);
+	ImGui::DragFloat("Bias", &bias, 0.05f, -2.0f, 4.0f);
+	ImGui::Text("Textures: %d, resident %.1f MB of %.1f MB", (int)textures.size(), resident_bytes / (1024.0f * 1024.0f), full_bytes / (1024.0f * 1024.0f));
+	ImGui::Text("Last frame: %d levels uploaded, %d textures dropped levels, %d blurry", num_uploaded, num_dropped, num_blurry);
+	if (ImGui::TreeNode("Residency"))
+	{
+		for (size_t i = 0; i < textures.size(); ++i)
+		{
+			Texture* texture = textures[i];
+			int level = texture->resident_level;
+			ImGui::Text("%s: %dx%d (level %d of %d, wanted %d) %.2f MB, used %ld frames ago", texture->filename.c_str(),
+				std::max(1, (int)texture->width >> level), std::max(1, (int)texture->height >> level), level, (int)texture->baked_level_bytes.size(),
+				getWantedLevel(texture, getFloorLevel(texture)), texture->getBakedBytes(level) / (1024.0f * 1024.0f), frame - texture->last_used);
+		}
+		ImGui::TreePop();
+	}
+#endif
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+class Texture;
+class Camera;
+
+//mip streaming of the baked material textures (the ones loaded with a usage, see Texture::bake_textures): a texture starts with only its small mips in VRAM,
+//the renderer requests every frame the detail it needs from its size on screen and update() uploads the finer mips
+//from the mapped .tbin. When the streamed textures need more than the budget the least recently used lose their big mips.
+class TextureStreaming
+{
+public:
+	static bool enabled; //for the textures uploaded after changing it
+	static int budget_mb; //VRAM for all the streamed textures
+	static int min_size; //levels of this size or smaller are uploaded with the texture and never dropped
+	static int max_uploads; //levels uploaded per frame
+	static float bias; //added to the requested levels, positive values use less VRAM
+
+	static std::vector<Texture*> textures; //the ones streamed, in upload order
+	static long frame; //increased by update
+
+	//stats of the last update
+	static size_t resident_bytes;
+	static size_t full_bytes; //if all the levels were resident
+	static int num_uploaded; //levels
+	static int num_dropped; //textures that lost levels
+	static int num_blurry; //requested this frame but with less detail than they need
+
+	static void add(Texture* texture); //by Texture::uploadBaked
+	static void remove(Texture* texture);
+
+	static int getFloorLevel(Texture* texture); //the finest level not bigger than min_size, always resident
+	static float getPixelsPerUnit(Camera* camera, const Vector3& center, float radius, float viewport_height); //screen pixels per world unit at the nearest point of the sphere
+	static void request(Texture* texture, float texels_per_pixel); //texels of the first level per screen pixel, any number of times per frame
+
+	static void update(); //main thread, once per frame after rendering
+	static void renderInMenu();
+};
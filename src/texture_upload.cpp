@@ -0,0 +1,236 @@
+#include "texture_upload.h"
+
+#include "includes.h"
+#include "texture.h"
+#include "utils.h"
+#include "gl_state.h"
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+bool TextureUpload::enabled = true;
+int TextureUpload::ring_size = 4;
+
+int TextureUpload::num_queued = 0;
+int TextureUpload::num_orphaned = 0;
+size_t TextureUpload::uploaded_bytes = 0;
+
+struct sStagedLevel {
+	Texture* texture;
+	unsigned int target;
+	int level;
+	const void* data;
+	int bytes;
+};
+
+struct sStagingBuffer {
+	GLuint pbo;
+	int capacity;
+	GLsync fence; //of the last upload from it, NULL once the GPU finished it
+	bool copying; //mapped, a worker is filling it
+};
+
+//the textures with levels queued or copying, and what to do when they are done
+struct sPendingTexture {
+	int num_levels;
+	std::vector<std::function<void()>> callbacks;
+};
+
+static std::vector<sStagingBuffer> buffers;
+static std::deque<sStagedLevel> queue;
+static std::map<Texture*, sPendingTexture> pending;
+
+static void pump();
+
+static void retireFences()
+{
+	for (size_t i = 0; i < buffers.size(); ++i)
+	{
+		sStagingBuffer& buffer = buffers[i];
+		if (buffer.fence && glClientWaitSync(buffer.fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+		{
+			glDeleteSync(buffer.fence);
+			buffer.fence = NULL;
+		}
+	}
+}
+
+//data is a pointer in client memory, or an offset in the bound GL_PIXEL_UNPACK_BUFFER
+static void uploadSubImage(Texture* texture, unsigned int target, int level, const void* data, int bytes)
+{
+	int width = std::max(1, (int)texture->width >> level);
+	int height = std::max(1, (int)texture->height >> level);
+	GLState::bindTexture(texture->texture_type, texture->texture_id);
+	if (texture->block_format != -1)
+		glCompressedTexSubImage2D(target, level, 0, 0, width, height, texture->internal_format, bytes, data);
+	else
+		glTexSubImage2D(target, level, 0, 0, width, height, texture->format, texture->type, data);
+	GLState::bindTexture(texture->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading a texture level");
+	TextureUpload::uploaded_bytes += bytes;
+}
+
+//the draws issued after the upload already see the level, the fences only guard the buffers
+static void finishLevel(Texture* texture)
+{
+	sPendingTexture& state = pending[texture];
+	if (--state.num_levels > 0)
+		return;
+	std::vector<std::function<void()>> callbacks;
+	callbacks.swap(state.callbacks);
+	pending.erase(texture);
+	for (size_t i = 0; i < callbacks.size(); ++i)
+		callbacks[i]();
+}
+
+//main thread, the copy of the worker is done
+static void submit(int index, sStagedLevel staged)
+{
+	sStagingBuffer& buffer = buffers[index];
+	GLState::bindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.pbo);
+	bool valid = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+	buffer.copying = false;
+
+	if (valid)
+	{
+		//from the offset 0 of the buffer, the call returns before the GPU reads it
+		uploadSubImage(staged.texture, staged.target, staged.level, 0, staged.bytes);
+		buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		GLState::bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	else
+	{
+		//the buffer was lost while it was mapped (it can happen when the display mode changes)
+		GLState::bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		uploadSubImage(staged.texture, staged.target, staged.level, staged.data, staged.bytes);
+	}
+
+	finishLevel(staged.texture);
+	pump();
+}
+
+//maps the staging buffer and gives it to a worker
+static void stage(int index, const sStagedLevel& staged)
+{
+	sStagingBuffer& buffer = buffers[index];
+	if (!buffer.pbo)
+		glGenBuffers(1, &buffer.pbo);
+	GLState::bindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.pbo);
+
+	//the GPU is still reading the last upload: new storage for the buffer, the driver frees the old one when it is done
+	if (buffer.fence)
+	{
+		glDeleteSync(buffer.fence);
+		buffer.fence = NULL;
+		TextureUpload::num_orphaned++;
+		buffer.capacity = std::max(buffer.capacity, staged.bytes);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer.capacity, NULL, GL_STREAM_DRAW);
+	}
+	else if (buffer.capacity < staged.bytes)
+	{
+		buffer.capacity = staged.bytes;
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer.capacity, NULL, GL_STREAM_DRAW);
+	}
+
+	void* ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, staged.bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	GLState::bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!ptr)
+	{
+		std::cout << "[ERROR] TextureUpload: cannot map a staging buffer of " << staged.bytes << " bytes" << std::endl;
+		uploadSubImage(staged.texture, staged.target, staged.level, staged.data, staged.bytes);
+		finishLevel(staged.texture);
+		return;
+	}
+
+	buffer.copying = true;
+	runAsync([index, staged, ptr]() {
+		memcpy(ptr, staged.data, staged.bytes);
+		runInMainThread([index, staged]() { submit(index, staged); });
+	});
+}
+
+//starts the queued levels while there are buffers not being filled
+static void pump()
+{
+	if (queue.empty())
+		return;
+	retireFences();
+
+	for (size_t i = 0; i < buffers.size() && !queue.empty(); ++i)
+	{
+		if (buffers[i].copying)
+			continue;
+		sStagedLevel staged = queue.front();
+		queue.pop_front();
+		TextureUpload::num_queued--;
+		stage((int)i, staged);
+	}
+}
+
+void TextureUpload::uploadLevel(Texture* texture, unsigned int target, int level, const void* data, int bytes)
+{
+	assert(texture && texture->texture_id && data);
+
+	if (!enabled)
+	{
+		uploadSubImage(texture, target, level, data, bytes);
+		return;
+	}
+
+	if (buffers.empty())
+	{
+		buffers.resize(std::max(ring_size, 1));
+		for (size_t i = 0; i < buffers.size(); ++i)
+		{
+			buffers[i].pbo = 0;
+			buffers[i].capacity = 0;
+			buffers[i].fence = NULL;
+			buffers[i].copying = false;
+		}
+	}
+
+	sStagedLevel staged;
+	staged.texture = texture;
+	staged.target = target;
+	staged.level = level;
+	staged.data = data;
+	staged.bytes = bytes;
+	queue.push_back(staged);
+	num_queued++;
+	pending[texture].num_levels++;
+	pump();
+}
+
+void TextureUpload::whenDone(Texture* texture, const std::function<void()>& callback)
+{
+	auto it = pending.find(texture);
+	if (it == pending.end())
+		callback();
+	else
+		it->second.callbacks.push_back(callback);
+}
+
+bool TextureUpload::isPending(Texture* texture)
+{
+	return pending.find(texture) != pending.end();
+}
+
+void TextureUpload::update()
+{
+	retireFences();
+	pump();
+}
+
+void TextureUpload::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Staged uploads", &enabled);
+	ImGui::Text("Textures uploading: %d, levels waiting for a buffer: %d", (int)pending.size(), num_queued);
+	ImGui::Text("Uploaded %.1f MB, %d buffers orphaned", uploaded_bytes / (1024.0f * 1024.0f), num_orphaned);
+#endif
+}
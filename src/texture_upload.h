@@ -0,0 +1,32 @@
+#pragma once
+
+#include "includes.h"
+#include <functional>
+
+class Texture;
+
+//staged texture uploads: instead of glTexImage2D from client memory (the driver copies it all inside the call, so a 4k texture
+//is a hitch), the texture is created empty and every level goes through a pixel buffer object of a ring. The main thread maps a
+//buffer, a worker copies the level into it and a later main thread task unmaps it and starts the DMA with glTexSubImage2D, so
+//every level is a separate task inside the upload budget of processMainThreadTasks. A fence tells when the GPU no longer reads a
+//buffer, the ones still busy are orphaned instead of waiting.
+class TextureUpload
+{
+public:
+	static bool enabled; //false uploads from client memory in the call, like before
+	static int ring_size; //staging buffers, read when the first level is queued, it is also the number of copies in flight
+
+	//stats
+	static int num_queued; //levels waiting for a buffer
+	static int num_orphaned;
+	static size_t uploaded_bytes;
+
+	//main thread: the level of target (a cubemap face or GL_TEXTURE_2D) must be already allocated and data must stay valid until
+	//the texture is done, compressed levels use the internal_format of the texture
+	static void uploadLevel(Texture* texture, unsigned int target, int level, const void* data, int bytes);
+	static void whenDone(Texture* texture, const std::function<void()>& callback); //main thread, once all its queued levels are uploaded, at once if there are none
+	static bool isPending(Texture* texture);
+
+	static void update(); //main thread, once per frame: recycles the buffers the GPU finished with
+	static void renderInMenu();
+};
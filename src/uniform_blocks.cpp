@@ -0,0 +1,168 @@
+#include "uniform_blocks.h"
+
+#include "includes.h"
+#include "shader.h"
+#include "camera.h"
+#include "BaseEntity.h"
+#include "material.h"
+#include "gl_state.h"
+
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+
+int UniformBlocks::num_uploads = 0;
+int UniformBlocks::num_skipped = 0;
+size_t UniformBlocks::uploaded_bytes = 0;
+
+static_assert(sizeof(sCameraBlock) == 144, "sCameraBlock must match the std140 layout of u_camera_block");
+static_assert(sizeof(sLightBlock) == 144, "sLightBlock must match the std140 layout of u_light_block");
+static_assert(sizeof(sMaterialBlock) == 48, "sMaterialBlock must match the std140 layout of u_material_block");
+
+struct sUniformBuffer {
+	GLuint ubo = 0;
+	int stride = 0; //bytes between the elements, a multiple of the offset alignment for glBindBufferRange
+	std::vector<char> data; //the content of the buffer
+};
+
+static sUniformBuffer camera_buffer;
+static sUniformBuffer light_buffer;
+static sUniformBuffer material_buffer;
+static int num_lights = 0;
+static std::map<GTR::Material*, int> material_slots;
+
+static int getStride(int size)
+{
+	static GLint alignment = 0;
+	if (!alignment)
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	return ((size + alignment - 1) / alignment) * alignment;
+}
+
+//uploads the data unless the buffer already has it
+static void upload(sUniformBuffer& buffer, const std::vector<char>& data)
+{
+	if (buffer.ubo && buffer.data == data)
+	{
+		UniformBlocks::num_skipped++;
+		return;
+	}
+
+	if (!buffer.ubo)
+		glGenBuffers(1, &buffer.ubo);
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, buffer.ubo);
+	glBufferData(GL_UNIFORM_BUFFER, data.size(), &data[0], GL_DYNAMIC_DRAW); //new storage, the draws already issued keep the old one
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+	buffer.data = data;
+
+	UniformBlocks::num_uploads++;
+	UniformBlocks::uploaded_bytes += data.size();
+}
+
+void UniformBlocks::setCamera(Camera* camera)
+{
+	assert(camera);
+	//the inverse is only computed when the camera moved
+	if (camera_buffer.ubo)
+	{
+		const sCameraBlock& last = *(const sCameraBlock*)&camera_buffer.data[0];
+		if (memcmp(last.viewprojection.m, camera->viewprojection_matrix.m, sizeof(Matrix44)) == 0 && memcmp(last.camera_position.v, camera->eye.v, sizeof(Vector3)) == 0)
+		{
+			num_skipped++;
+			return;
+		}
+	}
+
+	std::vector<char> data(sizeof(sCameraBlock), 0);
+	sCameraBlock& block = *(sCameraBlock*)&data[0];
+	block.viewprojection = camera->viewprojection_matrix;
+	block.inverse_viewprojection = camera->viewprojection_matrix;
+	block.inverse_viewprojection.inverse();
+	block.camera_position = camera->eye;
+
+	bool created = camera_buffer.ubo == 0;
+	upload(camera_buffer, data);
+	if (created) //nothing else uses its binding point
+		GLState::bindBufferBase(GL_UNIFORM_BUFFER, BLOCK_CAMERA, camera_buffer.ubo);
+}
+
+void UniformBlocks::setLights(const std::vector<Light*>& lights)
+{
+	light_buffer.stride = getStride(sizeof(sLightBlock));
+	std::vector<char> data(std::max((int)lights.size(), 1) * light_buffer.stride, 0);
+	for (int i = 0; i < (int)lights.size(); ++i)
+	{
+		sLightBlock& block = *(sLightBlock*)&data[i * light_buffer.stride];
+		lights[i]->fillUniformBlock(block);
+		block.light_num = i;
+	}
+	num_lights = (int)lights.size();
+	upload(light_buffer, data);
+}
+
+void UniformBlocks::bindLight(int index)
+{
+	assert(index >= 0 && index < num_lights && "the light was not in setLights");
+	GLState::bindBufferRange(GL_UNIFORM_BUFFER, BLOCK_LIGHT, light_buffer.ubo, index * light_buffer.stride, sizeof(sLightBlock));
+}
+
+static void fillMaterialBlock(GTR::Material* material, sMaterialBlock& block)
+{
+	block.color = material->color;
+	block.emissive_factor = material->emissive_factor;
+	//the alpha threshold to discard pixels, only for masked materials
+	block.alpha_cutoff = material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0;
+	block.metalness = material->metallic_factor;
+	block.roughness = material->roughness_factor;
+}
+
+void UniformBlocks::setMaterials(const std::vector<GTR::Material*>& materials)
+{
+	material_buffer.stride = getStride(sizeof(sMaterialBlock));
+	material_slots.clear();
+	std::vector<char> data;
+	for (size_t i = 0; i < materials.size(); ++i)
+	{
+		if (material_slots.find(materials[i]) != material_slots.end())
+			continue;
+		int slot = (int)material_slots.size();
+		material_slots[materials[i]] = slot;
+		data.resize((slot + 1) * material_buffer.stride, 0);
+		fillMaterialBlock(materials[i], *(sMaterialBlock*)&data[slot * material_buffer.stride]);
+	}
+	if (!data.empty())
+		upload(material_buffer, data);
+}
+
+void UniformBlocks::bindMaterial(GTR::Material* material)
+{
+	auto it = material_slots.find(material);
+	if (it == material_slots.end())
+	{
+		//drawn without setMaterials, it is added at the end of the buffer
+		material_buffer.stride = getStride(sizeof(sMaterialBlock));
+		int slot = (int)material_slots.size();
+		std::vector<char> data = material_buffer.data;
+		data.resize((slot + 1) * material_buffer.stride, 0);
+		fillMaterialBlock(material, *(sMaterialBlock*)&data[slot * material_buffer.stride]);
+		upload(material_buffer, data);
+		it = material_slots.insert(std::make_pair(material, slot)).first;
+	}
+	GLState::bindBufferRange(GL_UNIFORM_BUFFER, BLOCK_MATERIAL, material_buffer.ubo, it->second * material_buffer.stride, sizeof(sMaterialBlock));
+}
+
+void UniformBlocks::beginFrame()
+{
+	num_uploads = 0;
+	num_skipped = 0;
+	uploaded_bytes = 0;
+}
+
+void UniformBlocks::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Uniform blocks: %d uploads (%.1f KB), %d skipped", num_uploads, uploaded_bytes / 1024.0f, num_skipped);
+	ImGui::Text("Lights: %d, materials: %d", num_lights, (int)material_slots.size());
+#endif
+}
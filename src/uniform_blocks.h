@@ -0,0 +1,51 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+class Camera;
+class Light;
+namespace GTR { class Material; }
+
+//the std140 layouts of the blocks in camera_block.glsl, light_block.glsl and material_block.glsl of the atlas, vec3s are padded to 16 bytes
+struct sCameraBlock {
+	Matrix44 viewprojection;
+	Matrix44 inverse_viewprojection;
+	Vector3 camera_position; float pad0;
+};
+
+struct sLightBlock {
+	Matrix44 shadow_viewproj;
+	Vector3 light_vector; float spot_cutoff;
+	Vector3 light_position; float exponent;
+	Vector3 light_color; float max_dist;
+	int light_type; float intensity; float shadow_bias; int shadows; //a GLSL bool is 4 bytes
+	int light_num; float pad0[3];
+};
+
+struct sMaterialBlock {
+	Vector4 color;
+	Vector3 emissive_factor; float alpha_cutoff;
+	float metalness; float roughness; float pad0[2];
+};
+
+//uniform buffers with the data shared by many draws: the camera, the lights of the frame and the materials of the render calls. The data is
+//uploaded when it changes instead of once per draw and every draw only binds its range, the programs get the binding points of eUniformBlock
+//when they are linked (see Shader::setupProgram).
+class UniformBlocks
+{
+public:
+	//stats of the current frame
+	static int num_uploads; //buffer updates
+	static int num_skipped; //updates with the same data already in the buffer
+	static size_t uploaded_bytes;
+
+	static void setCamera(Camera* camera); //any number of times, only uploads if it changed
+	static void setLights(const std::vector<Light*>& lights); //all the lights of the pass, u_light_num is their index
+	static void bindLight(int index); //in the lights of setLights
+	static void setMaterials(const std::vector<GTR::Material*>& materials); //the ones that will be drawn, before the draws
+	static void bindMaterial(GTR::Material* material); //adds it if it was not in setMaterials
+
+	static void beginFrame(); //main thread, resets the stats
+	static void renderInMenu();
+};
@@ -4,6 +4,11 @@
 	#include <windows.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <dirent.h>
 #endif
 
 #include "includes.h"
@@ -12,9 +17,19 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
+#include "readback.h"
+#include "gl_state.h"
 
 #include "extra/stb_easy_font.h"
 
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <memory>
+
 long getTime()
 {
 	#ifdef WIN32
@@ -27,6 +42,14 @@ long getTime()
 }
 
 float * snapshot()
+{
+	float* result = NULL;
+	snapshot([&](float* data, int width, int height) { result = data; });
+	GPUReadback::finish();
+	return result;
+}
+
+void snapshot(const std::function<void(float* data, int width, int height)>& callback)
 {
 	GLint viewport[4];
 	glGetIntegerv(GL_VIEWPORT, viewport);
@@ -36,15 +59,11 @@ float * snapshot()
 	int width = viewport[2];
 	int height = viewport[3];
 
-	float * data = new float[width * height * 4]; // (R, G, B, A)
-
-	if (!data)
-		return 0;
-
-	// glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glReadPixels(x, y, width, height, GL_RGBA, GL_FLOAT, data);
-
-	return data;
+	GPUReadback::readFramebuffer(x, y, width, height, GL_RGBA, GL_FLOAT, [callback](const void* pixels, int width, int height) {
+		float* data = new float[width * height * 4]; // (R, G, B, A)
+		memcpy(data, pixels, width * height * 4 * sizeof(float));
+		callback(data, width, height);
+	});
 }
 
 //this function is used to access OpenGL Extensions (special features not supported by all cards)
@@ -121,6 +140,159 @@ bool readFile(const std::string& filename, std::string& content)
 	return true;
 }
 
+static bool hasExtension(const std::string& name, const char* extension)
+{
+	size_t length = strlen(extension);
+	if (name.size() < length)
+		return false;
+	for (size_t i = 0; i < length; ++i)
+		if (tolower(name[name.size() - length + i]) != tolower(extension[i]))
+			return false;
+	return true;
+}
+
+void listFiles(const std::string& folder, const char* extension, std::vector<std::string>& files)
+{
+#ifdef WIN32
+	WIN32_FIND_DATAA entry;
+	HANDLE handle = FindFirstFileA((folder + "/*").c_str(), &entry);
+	if (handle == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		std::string name = entry.cFileName;
+		if (name == "." || name == "..")
+			continue;
+		if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			listFiles(folder + "/" + name, extension, files);
+		else if (hasExtension(name, extension))
+			files.push_back(folder + "/" + name);
+	} while (FindNextFileA(handle, &entry));
+	FindClose(handle);
+#else
+	DIR* dir = opendir(folder.c_str());
+	if (!dir)
+		return;
+	while (dirent* entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if (name == "." || name == "..")
+			continue;
+		std::string path = folder + "/" + name;
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+			continue;
+		if (S_ISDIR(info.st_mode))
+			listFiles(path, extension, files);
+		else if (hasExtension(name, extension))
+			files.push_back(path);
+	}
+	closedir(dir);
+#endif
+}
+
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+#ifdef WIN32
+	file_handle = mapping_handle = NULL;
+#else
+	fd = -1;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	HANDLE mapping = file_size.QuadPart ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	mapping_handle = mapping;
+	size = (size_t)file_size.QuadPart;
+#else
+	fd = ::open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat stbuffer;
+	if (fstat(fd, &stbuffer) != 0 || stbuffer.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	void* ptr = mmap(NULL, (size_t)stbuffer.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+	madvise(ptr, (size_t)stbuffer.st_size, MADV_SEQUENTIAL);
+	data = (const char*)ptr;
+	size = (size_t)stbuffer.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifdef WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+	file_handle = mapping_handle = NULL;
+#else
+	if (data)
+		munmap((void*)data, size);
+	if (fd != -1)
+		::close(fd);
+	fd = -1;
+#endif
+	data = NULL;
+	size = 0;
+}
+
+unsigned long long hashData(const void* data, size_t size, unsigned long long hash)
+{
+	//FNV-1a
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
+
+bool hashFile(const char* filename, unsigned long long& hash)
+{
+	MappedFile file;
+	if (!file.open(filename))
+		return false;
+	hash = hashData(file.data, file.size, hash);
+	return true;
+}
+
 bool checkGLErrors()
 {
 	#ifndef _DEBUG
@@ -191,8 +363,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	Matrix44 projection_matrix;
 	projection_matrix.ortho(0, Application::instance->window_width / scale, Application::instance->window_height / scale, 0, -1, 1);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
 
 	glMatrixMode(GL_MODELVIEW);
 	glPushMatrix();
@@ -211,8 +383,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	glMatrixMode(GL_MODELVIEW);
 	glPopMatrix();
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 
 	return true;
 }
@@ -285,8 +457,11 @@ std::string getGPUStats()
 	}
 
 	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB-nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+	str += "\nMeshlets: " + std::to_string(Mesh::num_meshlets_rendered) + " / " + std::to_string(Mesh::num_meshlets_rendered + Mesh::num_meshlets_culled);
 	Mesh::num_meshes_rendered = 0;
 	Mesh::num_triangles_rendered = 0;
+	Mesh::num_meshlets_rendered = 0;
+	Mesh::num_meshlets_culled = 0;
 	return str;
 }
 
@@ -301,9 +476,9 @@ void drawGrid()
 	}
 
 	glLineWidth(1);
-	glEnable(GL_BLEND);
-	glDepthMask(false);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	GLState::enable(GL_BLEND);
+	GLState::depthMask(false);
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	Shader* grid_shader = Shader::getDefaultShader("grid");
 	grid_shader->enable();
 	Matrix44 m;
@@ -313,8 +488,8 @@ void drawGrid()
 	grid_shader->setUniform("u_camera_position", Camera::current->eye);
 	grid_shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
 	grid->render(GL_LINES); //background grid
-	glDisable(GL_BLEND);
-	glDepthMask(true);
+	GLState::disable(GL_BLEND);
+	GLState::depthMask(true);
 	grid_shader->disable();
 }
 
@@ -334,6 +509,234 @@ void ImGuiMatrix44(Matrix44& matrix, const char* text)
 	#endif
 }
 
+int getNumCores()
+{
+	int num = (int)std::thread::hardware_concurrency();
+	return num > 0 ? num : 1;
+}
+
+//the queues are never destroyed so the workers can outlive the static destructors at exit
+struct sJobQueues {
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::deque< std::function<void()> > jobs; //for the workers
+	std::deque< std::function<void()> > main_thread_tasks;
+	std::vector<std::thread> workers;
+};
+
+static std::thread::id main_thread_id = std::this_thread::get_id(); //static initialization happens in the main thread
+
+static sJobQueues& getJobQueues()
+{
+	static sJobQueues* queues = new sJobQueues();
+	return *queues;
+}
+
+static bool popJob(sJobQueues& queues, std::function<void()>& job)
+{
+	std::lock_guard<std::mutex> lock(queues.mutex);
+	if (queues.jobs.empty())
+		return false;
+	job = queues.jobs.front();
+	queues.jobs.pop_front();
+	return true;
+}
+
+static void workerLoop()
+{
+	sJobQueues& queues = getJobQueues();
+	while (true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(queues.mutex);
+			queues.wakeup.wait(lock, [&]() { return !queues.jobs.empty(); });
+			job = queues.jobs.front();
+			queues.jobs.pop_front();
+		}
+		job();
+	}
+}
+
+bool isMainThread()
+{
+	return std::this_thread::get_id() == main_thread_id;
+}
+
+void runAsync(const std::function<void()>& task)
+{
+	sJobQueues& queues = getJobQueues();
+	{
+		std::lock_guard<std::mutex> lock(queues.mutex);
+		//one core is left for the main thread
+		if (queues.workers.empty())
+			for (int i = 0; i < std::max(1, getNumCores() - 1); ++i)
+				queues.workers.push_back(std::thread(workerLoop));
+		queues.jobs.push_back(task);
+	}
+	queues.wakeup.notify_one();
+}
+
+void runInMainThread(const std::function<void()>& task)
+{
+	sJobQueues& queues = getJobQueues();
+	std::lock_guard<std::mutex> lock(queues.mutex);
+	queues.main_thread_tasks.push_back(task);
+}
+
+int processMainThreadTasks(float budget_ms)
+{
+	assert(isMainThread());
+	sJobQueues& queues = getJobQueues();
+	auto start = std::chrono::high_resolution_clock::now();
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::lock_guard<std::mutex> lock(queues.mutex);
+			if (queues.main_thread_tasks.empty())
+				return 0;
+			task = queues.main_thread_tasks.front();
+			queues.main_thread_tasks.pop_front();
+		}
+		task(); //at least one per call, so big uploads still make progress
+
+		std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		if (budget_ms > 0 && elapsed.count() >= budget_ms)
+		{
+			std::lock_guard<std::mutex> lock(queues.mutex);
+			return (int)queues.main_thread_tasks.size();
+		}
+	}
+}
+
+void waitUntil(const std::function<bool()>& done)
+{
+	sJobQueues& queues = getJobQueues();
+	bool main_thread = isMainThread();
+	while (!done())
+	{
+		if (main_thread)
+		{
+			processMainThreadTasks();
+			if (done())
+				break;
+		}
+		std::function<void()> job;
+		if (popJob(queues, job)) //help instead of waiting, it also avoids deadlocks when a job waits for another one
+			job();
+		else
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+void parallelFor(int count, const std::function<void(int)>& task, int min_count)
+{
+	//the pool has a worker less than the cores, this thread is the other one
+	int num_jobs = std::min(getNumCores() - 1, count - 1);
+	if (count < min_count || num_jobs <= 0)
+	{
+		for (int i = 0; i < count; ++i)
+			task(i);
+		return;
+	}
+
+	//the jobs and this thread take the next pending index until there are no more. A job that starts when all are taken does
+	//nothing, but it can start after this returns, so what it reads is not on this stack
+	struct sParallelFor {
+		std::atomic<int> next;
+		std::atomic<int> done;
+		const std::function<void(int)>* task;
+	};
+	std::shared_ptr<sParallelFor> state = std::make_shared<sParallelFor>();
+	state->next = 0;
+	state->done = 0;
+	state->task = &task;
+	auto work = [state, count]() {
+		for (int i = state->next++; i < count; i = state->next++)
+		{
+			(*state->task)(i);
+			state->done++;
+		}
+	};
+	for (int i = 0; i < num_jobs; ++i)
+		runAsync(work);
+	work();
+
+	//the last ones can still be running in the workers
+	while (state->done < count)
+		std::this_thread::yield();
+}
+
+static const double powers_of_ten[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+const char* parseFloat(const char* pos, float& v)
+{
+	bool negative = false;
+	if (*pos == '-') { negative = true; pos++; }
+	else if (*pos == '+') pos++;
+
+	unsigned long long mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	while (*pos >= '0' && *pos <= '9')
+	{
+		if (digits < 19) { mantissa = mantissa * 10 + (*pos - '0'); if (mantissa) digits++; }
+		else exponent++;
+		pos++;
+	}
+	if (*pos == '.')
+	{
+		pos++;
+		while (*pos >= '0' && *pos <= '9')
+		{
+			if (digits < 19) { mantissa = mantissa * 10 + (*pos - '0'); exponent--; if (mantissa) digits++; }
+			pos++;
+		}
+	}
+	if (*pos == 'e' || *pos == 'E')
+	{
+		int e = 0;
+		const char* epos = pos + 1;
+		bool negative_e = false;
+		if (*epos == '-') { negative_e = true; epos++; }
+		else if (*epos == '+') epos++;
+		if (*epos >= '0' && *epos <= '9')
+		{
+			while (*epos >= '0' && *epos <= '9') { if (e < 10000) e = e * 10 + (*epos - '0'); epos++; }
+			exponent += negative_e ? -e : e;
+			pos = epos;
+		}
+	}
+
+	double d = (double)mantissa;
+	while (exponent > 22) { d *= 1e22; exponent -= 22; }
+	while (exponent < -22) { d /= 1e22; exponent += 22; }
+	if (exponent > 0) d *= powers_of_ten[exponent];
+	else if (exponent < 0) d /= powers_of_ten[-exponent];
+	v = (float)(negative ? -d : d);
+	return pos;
+}
+
+const char* parseInt(const char* pos, int& v)
+{
+	bool negative = false;
+	if (*pos == '-') { negative = true; pos++; }
+	else if (*pos == '+') pos++;
+	int r = 0;
+	while (*pos >= '0' && *pos <= '9')
+		r = r * 10 + (*pos++ - '0');
+	v = negative ? -r : r;
+	return pos;
+}
+
+const char* skipSpaces(const char* pos)
+{
+	while (*pos == ' ' || *pos == '\t')
+		pos++;
+	return pos;
+}
+
 char* fetchWord(char* data, char* word)
 {
 	int pos = 0;
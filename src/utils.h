@@ -7,14 +7,58 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <functional>
 
 #include "includes.h"
 #include "framework.h"
 
 //General functions **************
 long getTime();
-float * snapshot();
+float * snapshot(); //RGBA floats of the viewport, waits for the GPU
+void snapshot(const std::function<void(float* data, int width, int height)>& callback); //asynchronous, the callback owns the data (see GPUReadback)
 bool readFile(const std::string& filename, std::string& content);
+void listFiles(const std::string& folder, const char* extension, std::vector<std::string>& files); //adds the files of the folder and its subfolders with that extension
+
+//read-only view of a whole file mapped in memory (no copy), used to load binary assets
+class MappedFile
+{
+public:
+	const char* data;
+	size_t size;
+
+	MappedFile();
+	~MappedFile();
+
+	bool open(const char* filename);
+	void close();
+
+private:
+#ifdef WIN32
+	void* file_handle;
+	void* mapping_handle;
+#else
+	int fd;
+#endif
+};
+
+//FNV-1a, to know if the source of a cached file changed
+unsigned long long hashData(const void* data, size_t size, unsigned long long hash = 14695981039346656037ULL);
+bool hashFile(const char* filename, unsigned long long& hash); //adds the content of the file to the hash, false if it cannot be read
+
+//multithreading
+int getNumCores();
+//runs task(i) for every i in [0,count) in the worker pool and this thread, returns when all are done. Below min_count they run in this
+//thread, for items too cheap to be worth the jobs
+void parallelFor(int count, const std::function<void(int)>& task, int min_count = 2);
+
+//background jobs: the loading runs in a pool of worker threads, the tasks that need the GL context are queued for the main thread
+enum eAssetState { ASSET_READY = 0, ASSET_LOADING = 1, ASSET_FAILED = 2 };
+
+bool isMainThread();
+void runAsync(const std::function<void()>& task); //runs the task in one of the worker threads
+void runInMainThread(const std::function<void()>& task); //queued until processMainThreadTasks is called from the main thread
+int processMainThreadTasks(float budget_ms = 0); //runs queued tasks until budget_ms is spent (0 runs all of them), returns how many are still queued
+void waitUntil(const std::function<bool()>& done); //blocks until done() is true, meanwhile it runs queued jobs (and main thread tasks if called from it)
 
 //generic purposes fuctions
 void drawGrid();
@@ -37,6 +81,11 @@ void ImGuiMatrix44(Matrix44& matrix, const char* text);
 std::string getGPUStats();
 void drawGrid();
 
+//allocation free number parsers (they stop at the first char that is not part of the number), used in the OBJ and ASE parsers
+const char* parseFloat(const char* pos, float& v);
+const char* parseInt(const char* pos, int& v);
+const char* skipSpaces(const char* pos); //skips spaces and tabs, not line breaks
+
 //Used in the MESH and ANIM parsers
 char* fetchWord(char* data, char* word);
 char* fetchFloat(char* data, float& f);
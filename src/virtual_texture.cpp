@@ -0,0 +1,518 @@
+#include "virtual_texture.h"
+
+#include "texture.h"
+#include "texture_compression.h" //downsampleRGBA
+#include "shader.h"
+#include "fbo.h"
+#include "readback.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cassert>
+
+std::map<Texture*, VirtualTexture*> VirtualTexture::sVirtualTextures;
+std::vector<VirtualTexture*> VirtualTexture::sById;
+
+int VirtualTexture::page_size = 128;
+int VirtualTexture::page_border = 4;
+int VirtualTexture::cache_pages = 16;
+int VirtualTexture::min_size = 2048;
+int VirtualTexture::max_page_loads = 8;
+int VirtualTexture::feedback_divisor = 8;
+
+int VirtualTexture::num_resident = 0;
+int VirtualTexture::num_requested = 0;
+int VirtualTexture::num_loading = 0;
+int VirtualTexture::num_evicted = 0;
+
+//header of the .vtex, followed by the tiles of every level (RGBA8, rows of pages from the first row of the image)
+struct sVirtualTextureHeader {
+	int version;
+	int header_bytes;
+	unsigned long long source_hash; //image file, usage, page size and version
+	int usage;
+	int width;
+	int height;
+	int page_size;
+	int page_border;
+	int num_levels;
+};
+
+//a tile of the cache atlas and the page it holds
+struct sCacheTile {
+	VirtualTexture* owner; //NULL if it is free
+	int page;
+	long last_used; //feedback frame
+	bool loading;
+	bool locked; //the coarsest page of every texture, the fallback of all the others
+};
+
+static std::vector<sCacheTile> cache_tiles;
+static Texture* cache = NULL;
+static FBO* feedback_fbo = NULL;
+static bool feedback_pending = false; //a read of the feedback the GPU has not finished, the next ones are skipped until then
+static long feedback_frame = 0;
+
+static int getTileSize()
+{
+	return VirtualTexture::page_size + VirtualTexture::page_border * 2;
+}
+
+static void createCache()
+{
+	int size = VirtualTexture::cache_pages * getTileSize();
+	cache = new Texture(size, size, GL_RGBA, GL_UNSIGNED_BYTE, false);
+	cache->bind();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	cache->unbind();
+	sCacheTile free_tile = { NULL, -1, -1, false, false };
+	cache_tiles.assign(VirtualTexture::cache_pages * VirtualTexture::cache_pages, free_tile);
+}
+
+//a free tile or the least recently used that was not seen in the last feedback, -1 if all are in use
+static int allocateTile()
+{
+	int best = -1;
+	for (size_t i = 0; i < cache_tiles.size(); ++i)
+	{
+		sCacheTile& tile = cache_tiles[i];
+		if (!tile.owner)
+			return (int)i;
+		if (tile.loading || tile.locked || tile.last_used >= feedback_frame)
+			continue;
+		if (best == -1 || tile.last_used < cache_tiles[best].last_used)
+			best = (int)i;
+	}
+	if (best == -1)
+		return -1;
+
+	sCacheTile& tile = cache_tiles[best];
+	tile.owner->page_tiles[tile.page] = -1;
+	tile.owner->table_dirty = true;
+	tile.owner = NULL;
+	VirtualTexture::num_resident--;
+	VirtualTexture::num_evicted++;
+	return best;
+}
+
+VirtualTexture::VirtualTexture()
+{
+	source = NULL;
+	usage = TEXTURE_GENERIC;
+	id = 0;
+	width = height = num_levels = 0;
+	load_state = ASSET_LOADING;
+	page_table = NULL;
+	table_dirty = false;
+	tiles_offset = 0;
+}
+
+VirtualTexture* VirtualTexture::Get(Texture* texture)
+{
+	if (!texture || !texture->isReady() || texture->filename.empty())
+		return NULL;
+	auto it = sVirtualTextures.find(texture);
+	if (it != sVirtualTextures.end())
+		return it->second;
+
+	//power of two so every level splits in whole pages, and the page coordinates of the feedback need to fit in a byte
+	int w = (int)texture->width;
+	int h = (int)texture->height;
+	VirtualTexture* vt = NULL;
+	if (isPowerOfTwo(w) && isPowerOfTwo(h) && std::max(w, h) >= min_size && std::max(w, h) / page_size <= 256 && sById.size() < 255)
+	{
+		vt = new VirtualTexture();
+		vt->source = texture;
+		vt->filename = texture->filename;
+		vt->usage = texture->usage;
+		vt->width = w;
+		vt->height = h;
+		vt->setupLevels();
+		sById.push_back(vt);
+		vt->id = (int)sById.size();
+		runAsync([vt]() {
+			bool built = vt->build();
+			runInMainThread([vt, built]() {
+				if (!built)
+				{
+					std::cout << "[WARN] cannot tile virtual texture: " << vt->filename << std::endl;
+					vt->load_state = ASSET_FAILED;
+					return;
+				}
+				vt->createPageTable(); //ready when its coarsest page is in the cache
+			});
+		});
+	}
+	sVirtualTextures[texture] = vt;
+	return vt;
+}
+
+void VirtualTexture::setupLevels()
+{
+	level_pages_x.clear();
+	level_pages_y.clear();
+	level_first_page.clear();
+	int num_pages = 0;
+	for (int level = 0; ; ++level)
+	{
+		int w = std::max(1, width >> level);
+		int h = std::max(1, height >> level);
+		level_pages_x.push_back(std::max(1, w / page_size));
+		level_pages_y.push_back(std::max(1, h / page_size));
+		level_first_page.push_back(num_pages);
+		num_pages += level_pages_x.back() * level_pages_y.back();
+		if (w <= page_size && h <= page_size)
+			break;
+	}
+	num_levels = (int)level_pages_x.size();
+	page_tiles.assign(num_pages, -1);
+	table_data.assign(num_pages * 4, 0);
+}
+
+//the tiles must be built again if the image, the usage or the page layout change
+static bool hashVirtualSource(const char* filename, int usage, unsigned long long& hash)
+{
+	int settings[4] = { VTEX_VERSION, usage, VirtualTexture::page_size, VirtualTexture::page_border };
+	hash = hashData(settings, sizeof(settings));
+	return hashFile(filename, hash);
+}
+
+bool VirtualTexture::build()
+{
+	std::string vtex_filename = filename + ".vtex";
+	if (readTiles(vtex_filename.c_str()))
+		return true;
+	return writeTiles(vtex_filename.c_str()) && readTiles(vtex_filename.c_str());
+}
+
+bool VirtualTexture::readTiles(const char* vtex_filename)
+{
+	if (!file.open(vtex_filename))
+		return false;
+
+	sVirtualTextureHeader header;
+	bool valid = file.size >= 4 + sizeof(header) && memcmp(file.data, "VTEX", 4) == 0;
+	if (valid)
+	{
+		memcpy(&header, file.data + 4, sizeof(header));
+		valid = header.version == VTEX_VERSION && header.header_bytes == sizeof(header) && header.usage == usage && header.width == width &&
+			header.height == height && header.page_size == page_size && header.page_border == page_border && header.num_levels == num_levels;
+	}
+	unsigned long long hash = 0;
+	valid = valid && hashVirtualSource(filename.c_str(), usage, hash) && hash == header.source_hash; //outdated if not
+
+	size_t tile_bytes = (size_t)getTileSize() * getTileSize() * 4;
+	if (!valid || file.size != 4 + sizeof(header) + page_tiles.size() * tile_bytes)
+	{
+		file.close();
+		return false;
+	}
+	tiles_offset = 4 + sizeof(header);
+	return true;
+}
+
+bool VirtualTexture::writeTiles(const char* vtex_filename)
+{
+	Image image;
+	std::string ext = filename.size() > 4 ? filename.substr(filename.size() - 4, 4) : "";
+	bool loaded = false;
+	if (ext == ".tga" || ext == ".TGA")
+		loaded = image.loadTGA(filename.c_str());
+	else if (ext == ".png" || ext == ".PNG")
+		loaded = image.loadPNG(filename.c_str());
+	if (!loaded || (int)image.width != width || (int)image.height != height)
+		return false;
+
+	std::vector<Uint8> level(width * height * 4);
+	for (int i = 0; i < width * height; ++i)
+	{
+		memcpy(&level[i * 4], image.data + i * image.num_channels, image.num_channels == 4 ? 4 : 3);
+		if (image.num_channels != 4)
+			level[i * 4 + 3] = 255;
+	}
+	image.clear();
+
+	sVirtualTextureHeader header;
+	memset(&header, 0, sizeof(header));
+	header.version = VTEX_VERSION;
+	header.header_bytes = sizeof(header);
+	header.usage = usage;
+	header.width = width;
+	header.height = height;
+	header.page_size = page_size;
+	header.page_border = page_border;
+	header.num_levels = num_levels;
+	if (!hashVirtualSource(filename.c_str(), usage, header.source_hash))
+		return false;
+
+	FILE* f = fopen(vtex_filename, "wb");
+	if (!f)
+		return false;
+	fwrite("VTEX", 1, 4, f);
+	fwrite(&header, sizeof(header), 1, f);
+
+	//every tile repeats the texels around its page, wrapping at the borders of the image like GL_REPEAT
+	int tile_size = getTileSize();
+	std::vector<Uint8> tiles;
+	std::vector<Uint8> next;
+	int w = width;
+	int h = height;
+	for (int l = 0; l < num_levels; ++l)
+	{
+		int pages_x = level_pages_x[l];
+		tiles.resize((size_t)pages_x * level_pages_y[l] * tile_size * tile_size * 4);
+		parallelFor(level_pages_y[l] * tile_size, [&](int row) {
+			int py = row / tile_size;
+			int ty = row % tile_size;
+			int sy = ((py * page_size + ty - page_border) % h + h) % h;
+			for (int px = 0; px < pages_x; ++px)
+			{
+				Uint8* out = &tiles[(((size_t)(py * pages_x + px) * tile_size + ty) * tile_size) * 4];
+				for (int tx = 0; tx < tile_size; ++tx)
+				{
+					int sx = ((px * page_size + tx - page_border) % w + w) % w;
+					memcpy(out + tx * 4, &level[((size_t)sy * w + sx) * 4], 4);
+				}
+			}
+		}, 64);
+		fwrite(&tiles[0], 1, tiles.size(), f);
+
+		if (l + 1 < num_levels)
+		{
+			next.resize(std::max(1, w / 2) * std::max(1, h / 2) * 4);
+			downsampleRGBA(&level[0], w, h, &next[0], usage == TEXTURE_COLOR);
+			level.swap(next);
+			w = std::max(1, w / 2);
+			h = std::max(1, h / 2);
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+void VirtualTexture::createPageTable()
+{
+	if (!cache)
+		createCache();
+
+	//a mip chain of one texel per page, sampled without filtering
+	page_table = new Texture(level_pages_x[0], level_pages_y[0], GL_RGBA, GL_UNSIGNED_BYTE, false);
+	page_table->bind();
+	for (int l = 1; l < num_levels; ++l)
+		glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA, level_pages_x[l], level_pages_y[l], 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	page_table->unbind();
+
+	//the coarsest page is always there, if the cache is full it keeps the texture of the source
+	int tile = allocateTile();
+	if (tile == -1)
+	{
+		std::cout << "[WARN] virtual texture cache full: " << filename << std::endl;
+		load_state = ASSET_FAILED;
+		return;
+	}
+	cache_tiles[tile].locked = true;
+	loadPage(getPageIndex(num_levels - 1, 0, 0), tile);
+}
+
+void VirtualTexture::loadPage(int page, int tile)
+{
+	page_tiles[page] = -2;
+	sCacheTile& cache_tile = cache_tiles[tile];
+	cache_tile.owner = this;
+	cache_tile.page = page;
+	cache_tile.loading = true;
+	num_loading++;
+
+	//the worker reads the tile from the mapped file, so the main thread does not wait for the disk
+	VirtualTexture* vt = this;
+	runAsync([vt, page, tile]() {
+		int tile_size = getTileSize();
+		size_t tile_bytes = (size_t)tile_size * tile_size * 4;
+		Uint8* data = new Uint8[tile_bytes];
+		memcpy(data, vt->file.data + vt->tiles_offset + page * tile_bytes, tile_bytes);
+		runInMainThread([vt, page, tile, data, tile_size]() {
+			cache->bind();
+			glTexSubImage2D(GL_TEXTURE_2D, 0, (tile % cache_pages) * tile_size, (tile / cache_pages) * tile_size, tile_size, tile_size, GL_RGBA, GL_UNSIGNED_BYTE, data);
+			cache->unbind();
+			delete[] data;
+			vt->page_tiles[page] = tile;
+			vt->table_dirty = true;
+			if (cache_tiles[tile].locked && vt->load_state == ASSET_LOADING) //the coarsest page, every texel has a page to sample now
+				vt->load_state = ASSET_READY;
+			cache_tiles[tile].loading = false;
+			cache_tiles[tile].last_used = feedback_frame;
+			num_loading--;
+			num_resident++;
+		});
+	});
+}
+
+void VirtualTexture::updatePageTable()
+{
+	//from the coarsest level, the pages that are not resident use the entry of their parent
+	for (int l = num_levels - 1; l >= 0; --l)
+		for (int y = 0; y < level_pages_y[l]; ++y)
+			for (int x = 0; x < level_pages_x[l]; ++x)
+			{
+				int page = getPageIndex(l, x, y);
+				Uint8* entry = &table_data[page * 4];
+				int tile = page_tiles[page];
+				if (tile >= 0)
+				{
+					entry[0] = (Uint8)(tile % cache_pages);
+					entry[1] = (Uint8)(tile / cache_pages);
+					entry[2] = (Uint8)l;
+					entry[3] = 255;
+				}
+				else if (l + 1 < num_levels)
+					memcpy(entry, &table_data[getPageIndex(l + 1, x / 2, y / 2) * 4], 4);
+			}
+
+	page_table->bind();
+	for (int l = 0; l < num_levels; ++l)
+		glTexSubImage2D(GL_TEXTURE_2D, l, 0, 0, level_pages_x[l], level_pages_y[l], GL_RGBA, GL_UNSIGNED_BYTE, &table_data[level_first_page[l] * 4]);
+	page_table->unbind();
+	table_dirty = false;
+}
+
+void VirtualTexture::setUniforms(Shader* shader, const char* prefix, int slot)
+{
+	if (table_dirty)
+		updatePageTable();
+	std::string name = prefix;
+	shader->setUniform(prefix, true);
+	shader->setUniform((name + "_table").c_str(), page_table, slot);
+	shader->setUniform((name + "_size").c_str(), Vector3((float)width, (float)height, (float)num_levels));
+	shader->setUniform((name + "_id").c_str(), id);
+}
+
+void VirtualTexture::setCacheUniforms(Shader* shader, int slot)
+{
+	shader->setUniform("u_vt_cache", cache, slot);
+	shader->setUniform("u_vt_cache_info", Vector4((float)page_size, (float)page_border, (float)getTileSize(), cache->width));
+}
+
+bool VirtualTexture::beginFeedback(int width, int height)
+{
+	if (!cache)
+		return false; //no virtual texture is ready yet
+
+	int w = std::max(1, width / feedback_divisor);
+	int h = std::max(1, height / feedback_divisor);
+	if (!feedback_fbo || feedback_fbo->width != w || feedback_fbo->height != h)
+	{
+		delete feedback_fbo;
+		feedback_fbo = new FBO();
+		feedback_fbo->create(w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, true);
+	}
+	feedback_fbo->bind();
+	glClearColor(0.0, 0.0, 0.0, 0.0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	return true;
+}
+
+//requested page, with the number of pixels that wanted it
+struct sPageRequest {
+	VirtualTexture* vt;
+	int level;
+	int page;
+	int count;
+};
+
+//in the callback of the read, a frame or two after the feedback was rendered
+void VirtualTexture::processFeedback(const unsigned char* pixels, int w, int h)
+{
+	feedback_pending = false;
+	feedback_frame++;
+
+	//every pixel: id, level and page; the ones not resident are requested with their parent, the resident ones (or the
+	//coarser page they fall back to) are marked as used so they are not evicted
+	std::map<unsigned int, int> missing;
+	for (int i = 0; i < w * h; ++i)
+	{
+		const unsigned char* pixel = &pixels[i * 4];
+		if (!pixel[0] || (size_t)pixel[0] > sById.size())
+			continue;
+		VirtualTexture* vt = sById[pixel[0] - 1];
+		int level = pixel[1];
+		int x = pixel[2];
+		int y = pixel[3];
+		if (!vt->isReady() || level >= vt->num_levels || x >= vt->level_pages_x[level] || y >= vt->level_pages_y[level])
+			continue;
+		for (int requested = 0; level < vt->num_levels; ++level, x /= 2, y /= 2)
+		{
+			int page = vt->getPageIndex(level, x, y);
+			int tile = vt->page_tiles[page];
+			if (tile >= 0)
+			{
+				cache_tiles[tile].last_used = feedback_frame;
+				break;
+			}
+			if (tile == -1 && requested++ < 2)
+				missing[((unsigned int)vt->id << 24) | page]++;
+		}
+	}
+
+	//the coarse pages first, everything gets some detail before the close ones get all of it
+	std::vector<sPageRequest> requests;
+	for (auto it = missing.begin(); it != missing.end(); ++it)
+	{
+		sPageRequest request;
+		request.vt = sById[(it->first >> 24) - 1];
+		request.page = it->first & 0xFFFFFF;
+		request.level = 0;
+		while (request.level + 1 < request.vt->num_levels && request.vt->level_first_page[request.level + 1] <= request.page)
+			request.level++;
+		request.count = it->second;
+		requests.push_back(request);
+	}
+	std::sort(requests.begin(), requests.end(), [](const sPageRequest& a, const sPageRequest& b) {
+		return a.level != b.level ? a.level > b.level : a.count > b.count;
+	});
+
+	num_requested = (int)requests.size();
+	num_evicted = 0;
+	for (size_t i = 0; i < requests.size() && num_loading < max_page_loads; ++i)
+	{
+		int tile = allocateTile();
+		if (tile == -1)
+			break;
+		requests[i].vt->loadPage(requests[i].page, tile);
+	}
+}
+
+void VirtualTexture::endFeedback()
+{
+	//without waiting for the GPU, the pages are requested when GPUReadback::update gets the pixels
+	if (!feedback_pending)
+	{
+		feedback_pending = true;
+		GPUReadback::readFramebuffer(0, 0, feedback_fbo->width, feedback_fbo->height, GL_RGBA, GL_UNSIGNED_BYTE, [](const void* data, int width, int height) {
+			processFeedback((const unsigned char*)data, width, height);
+		});
+	}
+	feedback_fbo->unbind();
+}
+
+void VirtualTexture::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	int num_tiles = (int)cache_tiles.size();
+	ImGui::Text("Virtual textures: %d, pages %d/%d resident, %d loading", (int)sById.size(), num_resident, num_tiles, num_loading);
+	ImGui::Text("Last feedback: %d pages missing, %d evicted", num_requested, num_evicted);
+	ImGui::DragInt("Page loads", &max_page_loads, 0.1f, 1, 256);
+	ImGui::DragInt("Feedback divisor", &feedback_divisor, 0.1f, 1, 32);
+	if (cache)
+		ImGui::Image((void*)(intptr_t)cache->texture_id, ImVec2(256, 256), ImVec2(0, 1), ImVec2(1, 0));
+#endif
+}
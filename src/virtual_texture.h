@@ -0,0 +1,90 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+#include "utils.h" //MappedFile, eAssetState
+#include <vector>
+#include <map>
+#include <string>
+#include <atomic>
+
+class Texture;
+class Shader;
+class FBO;
+
+//sparse virtual texturing of the big material textures in the G-buffer (see multi.fs): every mip is split in pages, pre-tiled once
+//with a border in a .vtex next to the image, and only the pages the camera sees are in VRAM, inside one cache atlas shared by all
+//the virtual textures. The page table of every texture (a texel per page and mip) points to the tile of the page in the cache, or
+//to the tile of the closest coarser page that is resident. The pages seen come from a low resolution feedback pass rendered after
+//the G-buffer, the missing ones are read by the workers and uploaded by the main thread.
+
+#define VTEX_VERSION 1 //this is used to tile the images again if the format changes
+
+class VirtualTexture
+{
+public:
+	static std::map<Texture*, VirtualTexture*> sVirtualTextures; //NULL for the textures that cannot be virtual
+	static std::vector<VirtualTexture*> sById; //the id in the feedback is the index + 1
+
+	//read when the first virtual texture is created
+	static int page_size; //texels of a page without the border
+	static int page_border; //texels repeated from the neighbour pages, so the bilinear filter does not need them
+	static int cache_pages; //tiles per side of the cache atlas
+
+	static int min_size; //smaller textures are not virtual
+	static int max_page_loads; //pages loading at the same time
+	static int feedback_divisor; //the feedback pass is this times smaller than the screen
+
+	//stats
+	static int num_resident;
+	static int num_requested; //missing pages seen in the last feedback
+	static int num_loading;
+	static int num_evicted; //in the last feedback
+
+	Texture* source;
+	std::string filename;
+	int usage; //eTextureUsage of the source
+	int id;
+	int width;
+	int height;
+	int num_levels; //down to the one that fits in a page
+	std::vector<int> level_pages_x;
+	std::vector<int> level_pages_y;
+	std::vector<int> level_first_page; //index of the first page of every level, in page_tiles and in the .vtex
+	std::vector<int> page_tiles; //tile in the cache of every page, -1 if it is not resident and -2 while it loads
+	std::atomic<int> load_state; //eAssetState, loading while it is tiled
+
+	Texture* page_table; //RGBA8 with mips: tile x, tile y and level of the page to sample
+	std::vector<Uint8> table_data; //all the levels of page_table
+	bool table_dirty;
+
+	MappedFile file; //.vtex
+	size_t tiles_offset;
+
+	VirtualTexture();
+
+	static VirtualTexture* Get(Texture* texture); //NULL if it cannot be virtual, the first time it starts tiling it in a worker
+	bool isReady() { return load_state == ASSET_READY; }
+
+	//prefix_table, prefix_size (width, height, levels) and prefix_id, the prefix is set to true
+	void setUniforms(Shader* shader, const char* prefix, int slot);
+	static void setCacheUniforms(Shader* shader, int slot);
+
+	//the feedback pass: renders to a small FBO with vt_feedback, endFeedback reads it without waiting and the missing pages are requested
+	//when GPUReadback::update gets the pixels
+	static bool beginFeedback(int width, int height); //false if there are no virtual textures
+	static void endFeedback();
+
+	static void renderInMenu();
+
+private:
+	int getPageIndex(int level, int x, int y) { return level_first_page[level] + y * level_pages_x[level] + x; }
+	void setupLevels();
+	bool build(); //worker: maps the .vtex, tiling the image first if it is missing or outdated
+	bool readTiles(const char* vtex_filename);
+	bool writeTiles(const char* vtex_filename);
+	void createPageTable(); //main thread, also loads the coarsest page and keeps it resident, the texture is ready once it is uploaded
+	void updatePageTable();
+	void loadPage(int page, int tile); //reads it in a worker and uploads it in the main thread
+	static void processFeedback(const unsigned char* pixels, int width, int height);
+};